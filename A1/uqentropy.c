@@ -5,6 +5,19 @@
 #include <math.h>
 #include <ctype.h>
 #include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// SSE2 is always available on x86-64, AVX2 is detected at runtime
+#if defined(__x86_64__) && defined(__GNUC__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
 
 // Base Character set sizes
 #define NUMERIC_SET_SIZE 10
@@ -38,9 +51,57 @@
 // digit append i.e. count = 10^1+...+10^n
 #define DIG_APPEND_COUNT_BASE 10
 
+// Number of bytes classified at a time by the SSE2 and AVX2 kernels
+#define SSE2_BLOCK_SIZE 16
+#define AVX2_BLOCK_SIZE 32
+
+// Range of printable ASCII characters (as tested by isprint())
+#define PRINTABLE_FIRST ' '
+#define PRINTABLE_LAST '~'
+
 // Number of different search options (excluding EXACT since it is default)
 #define SEARCH_OPT_COUNT 4
 
+// Maximum number of worker threads that can be given with --threads
+#define BATCH_MAX_THREADS 256
+
+// Number of candidates read and evaluated at a time in batch mode
+#define BATCH_CHUNK_SIZE 4096
+
+// Initial number of passwords allocated for in a PasswordList (doubled each
+// time it fills up)
+#define LIST_INITIAL_CAPACITY 64
+
+// Size of reads used when a password file can't be memory mapped
+#define FILE_READ_SIZE 65536
+
+// Compiled dictionary (.uqd) file format. The magic number contains
+// non-printable characters so can never start a valid plain password file.
+// DICT_VERSION must be incremented whenever the layout changes.
+#define DICT_MAGIC "\211UQD\r\n\032\n"
+#define DICT_MAGIC_LENGTH 8
+#define DICT_VERSION 1
+#define DICT_BYTE_ORDER 0x01020304u
+// Every section of a compiled dictionary starts on a multiple of this
+#define DICT_ALIGNMENT 8
+
+// Value stored in an unused PasswordIndex slot
+#define EMPTY_SLOT (-1)
+
+// Minimum number of slots in a PasswordIndex. The index is always sized to at
+// least twice the number of passwords so that probe sequences stay short.
+#define INDEX_MIN_SLOTS 16
+#define INDEX_LOAD_FACTOR 2
+
+// FNV-1a hash parameters used when hashing passwords into a PasswordIndex
+#define FNV_OFFSET_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+// Position of the root node in a PasswordTrie's node array
+#define TRIE_ROOT 0
+// Value used for a TrieNode link that doesn't point to another node
+#define TRIE_NONE (-1)
+
 /*
  * Different types of character sets
  * EMPTY_SET - Set used when a password contains non printable characters
@@ -57,6 +118,30 @@ typedef enum {
     ASCII_OTHER = 8
 } CharacterSet;
 
+/* CharacterCounts
+ *
+ * Number of characters of each class in a string, as produced by
+ * count_characters(). The classes lower, upper, digit and other are mutually
+ * exclusive and match those used by get_sets().
+ *
+ * lower: Number of lower case alphabetic characters
+ * upper: Number of upper case alphabetic characters
+ * digit: Number of numeric characters
+ * other: Number of other printable characters (including spaces)
+ * space: Number of spaces
+ * newline: Number of newline characters
+ * nonPrintable: Number of non-printable characters (including newlines)
+ */
+typedef struct {
+    size_t lower;
+    size_t upper;
+    size_t digit;
+    size_t other;
+    size_t space;
+    size_t newline;
+    size_t nonPrintable;
+} CharacterCounts;
+
 /*
  * Different options to use when searching for a password match
  * Note that EXACT is used when we wish to search for an exact match
@@ -71,11 +156,14 @@ typedef enum { EXACT, CASE_CHECK, LEET, DOUBLEUP, DIG_APPEND } SearchOption;
  * optCount: Number of search options
  * appendCount: Used to store the number of digits to append if options
  *              contains DIG_APPEND
+ * appendGuesses: Guesses added by DIG_APPEND for each password that doesn't
+ *                end in a digit (10^1 + ... + 10^appendCount)
  */
 typedef struct {
     SearchOption* options;
     int optCount;
     int appendCount;
+    unsigned long appendGuesses;
 } SearchDescriptor;
 
 /* Password
@@ -83,6 +171,8 @@ typedef struct {
  * Stores information about a given password string.
  *
  * password: Password string itself
+ * length: Length of password string
+ * trailingDigits: Number of consecutive digits at the end of password
  * guessCount: Current number of guesses made for this password
  *             when searching password list files
  * mathced: true if the password was matched in a given list file with
@@ -90,25 +180,187 @@ typedef struct {
  */
 typedef struct {
     char* password;
+    int length;
+    int trailingDigits;
     unsigned long guessCount;
     bool matched;
 } Password;
 
-/* PasswordList
+/* BatchDescriptor
+ *
+ * Stores how to evaluate candidates when running in batch mode (--batch).
+ *
+ * inputName: Name of file to read candidates from ("-" for stdin)
+ * threadCount: Number of worker threads to evaluate candidates with
+ */
+typedef struct {
+    char* inputName;
+    int threadCount;
+} BatchDescriptor;
+
+/* PasswordIndex
+ *
+ * Open-addressing (linear probing) hash table mapping password strings to the
+ * position in a PasswordList at which they first appear.
+ *
+ * slots: Array of list positions, EMPTY_SLOT if slot is unused
+ * mask: Number of slots minus one (number of slots is a power of two)
+ * foldCase: true if passwords are hashed and compared case insensitively
+ */
+typedef struct {
+    int* slots;
+    unsigned int mask;
+    bool foldCase;
+} PasswordIndex;
+
+/* TrieNode
+ *
+ * A single node of a PasswordTrie. Children of a node are stored as a singly
+ * linked list of siblings.
+ *
+ * label: Character on the edge from this node's parent to this node
+ * firstChild: Node index of first child, TRIE_NONE if there are no children
+ * nextSibling: Node index of next sibling, TRIE_NONE if this is the last
+ * position: Position in the PasswordList of the first password ending at
+ *           this node, EMPTY_SLOT if no password ends here
+ */
+typedef struct {
+    char label;
+    int firstChild;
+    int nextSibling;
+    int position;
+} TrieNode;
+
+/* PasswordTrie
  *
- * Stores a data read from a given password list file.
+ * Prefix trie over the passwords in a PasswordList. Used to enumerate every
+ * password which is a prefix of a candidate in O(length of candidate).
  *
- * passwords: Array of passwords strings
+ * nodes: Array of nodes (nodes[TRIE_ROOT] is the root)
+ * nodeCount: Number of nodes in use
+ * capacity: Number of nodes allocated
+ */
+typedef struct {
+    TrieNode* nodes;
+    int nodeCount;
+    int capacity;
+} PasswordTrie;
+
+/*
+ * Sections of a compiled dictionary file. Each section other than
+ * DICT_PASSWORDS is an exact copy of the corresponding PasswordList array so
+ * that it can be used directly from a memory mapping of the file.
+ */
+typedef enum {
+    DICT_PASSWORDS,
+    DICT_OFFSETS,
+    DICT_LENGTHS,
+    DICT_ALPHA_COUNTS,
+    DICT_ONE_SUB_COUNTS,
+    DICT_TWO_SUB_COUNTS,
+    DICT_CASE_GUESSES,
+    DICT_LEET_GUESSES,
+    DICT_CASE_PREFIX,
+    DICT_LEET_PREFIX,
+    DICT_APPENDABLE_PREFIX,
+    DICT_EXACT_INDEX,
+    DICT_CASE_INDEX,
+    DICT_TRIE,
+    DICT_SECTION_COUNT
+} DictSection;
+
+/* DictHeader
+ *
+ * Header at the start of a compiled dictionary (.uqd) file. Arrays are
+ * stored in the native layout of the machine that compiled them, so the
+ * byte order and type sizes are recorded and checked on load.
+ *
+ * magic: DICT_MAGIC
+ * version: DICT_VERSION
+ * byteOrder: DICT_BYTE_ORDER as written by the compiling machine
+ * longSize: sizeof(unsigned long)
+ * sizeSize: sizeof(size_t)
+ * nodeSize: sizeof(TrieNode)
+ * passCount: Number of passwords
+ * indexSlots: Number of slots in each of the exact and case folded indexes
+ * trieNodes: Number of nodes in the trie
+ * sectionOffsets: Offset from start of file of each DictSection
+ * sectionSizes: Size in bytes of each DictSection
+ */
+typedef struct {
+    char magic[DICT_MAGIC_LENGTH];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t longSize;
+    uint32_t sizeSize;
+    uint32_t nodeSize;
+    uint32_t passCount;
+    uint32_t indexSlots;
+    uint32_t trieNodes;
+    uint64_t sectionOffsets[DICT_SECTION_COUNT];
+    uint64_t sectionSizes[DICT_SECTION_COUNT];
+} DictHeader;
+
+/* PasswordList
+ *
+ * Stores a data read from a given password list file. The file contents are
+ * kept as is (memory mapped where possible) and each password is referred to
+ * by its offset and length within them, so passwords are NOT null
+ * terminated. Per password metadata is stored in arrays parallel to offsets
+ * (element i of each describes password i) so that it is only calculated
+ * once when the file is loaded.
+ *
+ * data: Contents of the password file
+ * dataSize: Size of data in bytes
+ * mapped: true if data is a memory mapping, false if it is heap allocated
+ * compiled: true if the file is a compiled dictionary, in which case all of
+ *           the arrays below point into data and must not be freed
+ * offsets: Offset into data of each password
+ * capacity: Number of elements allocated for offsets and lengths
  * sourceFile: Name of file from which data was read
  * count: Number of password strings
  * contentValid: true if file contains all valid passwords and is
  *               non-empty, false otherwise.
+ * lengths: Length of each password
+ * alphaCounts: Number of alphabetic characters in each password
+ * oneSubCounts: Number of characters with one LeetSpeak substitute
+ * twoSubCounts: Number of characters with two LeetSpeak substitutes
+ * caseGuesses: Guesses added by CASE_CHECK for each password (2^a - 1)
+ * leetGuesses: Guesses added by LEET for each password (2^a * 3^b - 1)
+ * casePrefix: casePrefix[i] is the sum of caseGuesses[0] to caseGuesses[i - 1]
+ *             (passCount + 1 elements, so the last element is the total)
+ * leetPrefix: leetPrefix[i] is the sum of leetGuesses[0] to leetGuesses[i - 1]
+ *             (passCount + 1 elements)
+ * appendablePrefix: appendablePrefix[i] is the number of passwords before
+ *                   position i that don't end in a digit (passCount + 1
+ *                   elements)
+ * exactIndex: Index used for EXACT lookups (NULL if not built)
+ * caseIndex: Case folded index used for CASE_CHECK lookups (NULL if not
+ *            built)
+ * trie: Prefix trie used for DOUBLEUP lookups (NULL if not built)
  */
 typedef struct {
-    char** passwords;
+    char* data;
+    size_t dataSize;
+    bool mapped;
+    bool compiled;
+    size_t* offsets;
+    int capacity;
     char* sourceFile;
     int passCount;
     bool contentValid;
+    int* lengths;
+    int* alphaCounts;
+    int* oneSubCounts;
+    int* twoSubCounts;
+    unsigned long* caseGuesses;
+    unsigned long* leetGuesses;
+    unsigned long* casePrefix;
+    unsigned long* leetPrefix;
+    int* appendablePrefix;
+    PasswordIndex* exactIndex;
+    PasswordIndex* caseIndex;
+    PasswordTrie* trie;
 } PasswordList;
 
 /* PasswordSet
@@ -123,26 +375,220 @@ typedef struct {
     int listCount;
 } PasswordSet;
 
+/* BatchJob
+ *
+ * Work shared between the worker threads evaluating one chunk of batch
+ * candidates. Workers claim candidates by incrementing next.
+ *
+ * candidates: Array of candidates to evaluate
+ * entropies: Entropy of each candidate (set by workers)
+ * count: Number of candidates
+ * next: Index of next candidate to be claimed by a worker
+ * lock: Lock protecting next
+ * set: PasswordSet to search (NULL if no password files were given)
+ * descriptor: SearchDescriptor search options to use
+ */
+typedef struct {
+    Password** candidates;
+    float* entropies;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+    PasswordSet* set;
+    SearchDescriptor* descriptor;
+} BatchJob;
+
+/* count_characters_scalar()
+ * ---------------------------
+ * Add the number of characters of each class in string to counts one byte
+ * at a time. Used when SIMD kernels are unavailable and for the bytes left
+ * over at the end of a string by the SIMD kernels.
+ *
+ * string: String to classify
+ * len: Length of string
+ * counts: CharacterCounts to add to
+ */
+void count_characters_scalar(
+        const char* string, size_t len, CharacterCounts* counts)
+{
+    for (size_t i = 0; i < len; i++) {
+        unsigned char next = (unsigned char)string[i];
+
+        if (isdigit(next)) {
+            counts->digit++;
+        } else if (islower(next)) {
+            counts->lower++;
+        } else if (isupper(next)) {
+            counts->upper++;
+        } else if (isprint(next)) {
+            counts->other++;
+        } else {
+            counts->nonPrintable++;
+        }
+        if (next == ' ') {
+            counts->space++;
+        } else if (next == '\n') {
+            counts->newline++;
+        }
+    }
+}
+
+#ifdef SIMD_X86
+/* count_characters_sse2()
+ * -----------------------
+ * Add the number of characters of each class in string to counts, 16 bytes
+ * at a time. Bytes are compared as signed values, so bytes above 0x7f are
+ * negative and never fall within any of the (ASCII) ranges tested.
+ *
+ * string: String to classify
+ * len: Length of string
+ * counts: CharacterCounts to add to
+ */
+void count_characters_sse2(
+        const char* string, size_t len, CharacterCounts* counts)
+{
+    const __m128i lowerFirst = _mm_set1_epi8('a' - 1);
+    const __m128i lowerLast = _mm_set1_epi8('z' + 1);
+    const __m128i upperFirst = _mm_set1_epi8('A' - 1);
+    const __m128i upperLast = _mm_set1_epi8('Z' + 1);
+    const __m128i digitFirst = _mm_set1_epi8('0' - 1);
+    const __m128i digitLast = _mm_set1_epi8('9' + 1);
+    const __m128i printFirst = _mm_set1_epi8(PRINTABLE_FIRST - 1);
+    const __m128i printLast = _mm_set1_epi8(PRINTABLE_LAST + 1);
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + SSE2_BLOCK_SIZE <= len; i += SSE2_BLOCK_SIZE) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(string + i));
+        int lower = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpgt_epi8(block, lowerFirst),
+                _mm_cmplt_epi8(block, lowerLast)));
+        int upper = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpgt_epi8(block, upperFirst),
+                _mm_cmplt_epi8(block, upperLast)));
+        int digit = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpgt_epi8(block, digitFirst),
+                _mm_cmplt_epi8(block, digitLast)));
+        int print = _mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpgt_epi8(block, printFirst),
+                _mm_cmplt_epi8(block, printLast)));
+        int printCount = __builtin_popcount(print);
+        int alnumCount = __builtin_popcount(lower) + __builtin_popcount(upper)
+                + __builtin_popcount(digit);
+
+        counts->lower += __builtin_popcount(lower);
+        counts->upper += __builtin_popcount(upper);
+        counts->digit += __builtin_popcount(digit);
+        counts->other += printCount - alnumCount;
+        counts->nonPrintable += SSE2_BLOCK_SIZE - printCount;
+        counts->space += __builtin_popcount(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(block, space)));
+        counts->newline += __builtin_popcount(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+    }
+    count_characters_scalar(string + i, len - i, counts);
+}
+
+/* count_characters_avx2()
+ * -----------------------
+ * Add the number of characters of each class in string to counts, 32 bytes
+ * at a time. Must only be called if the CPU supports AVX2. See
+ * count_characters_sse2().
+ *
+ * string: String to classify
+ * len: Length of string
+ * counts: CharacterCounts to add to
+ */
+__attribute__((target("avx2"))) void count_characters_avx2(
+        const char* string, size_t len, CharacterCounts* counts)
+{
+    const __m256i lowerFirst = _mm256_set1_epi8('a' - 1);
+    const __m256i lowerLast = _mm256_set1_epi8('z' + 1);
+    const __m256i upperFirst = _mm256_set1_epi8('A' - 1);
+    const __m256i upperLast = _mm256_set1_epi8('Z' + 1);
+    const __m256i digitFirst = _mm256_set1_epi8('0' - 1);
+    const __m256i digitLast = _mm256_set1_epi8('9' + 1);
+    const __m256i printFirst = _mm256_set1_epi8(PRINTABLE_FIRST - 1);
+    const __m256i printLast = _mm256_set1_epi8(PRINTABLE_LAST + 1);
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + AVX2_BLOCK_SIZE <= len; i += AVX2_BLOCK_SIZE) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(string + i));
+        // AVX2 has no cmplt so compare with operands swapped
+        unsigned int lower = _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpgt_epi8(block, lowerFirst),
+                _mm256_cmpgt_epi8(lowerLast, block)));
+        unsigned int upper = _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpgt_epi8(block, upperFirst),
+                _mm256_cmpgt_epi8(upperLast, block)));
+        unsigned int digit = _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpgt_epi8(block, digitFirst),
+                _mm256_cmpgt_epi8(digitLast, block)));
+        unsigned int print = _mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpgt_epi8(block, printFirst),
+                _mm256_cmpgt_epi8(printLast, block)));
+        int printCount = __builtin_popcount(print);
+        int alnumCount = __builtin_popcount(lower) + __builtin_popcount(upper)
+                + __builtin_popcount(digit);
+
+        counts->lower += __builtin_popcount(lower);
+        counts->upper += __builtin_popcount(upper);
+        counts->digit += __builtin_popcount(digit);
+        counts->other += printCount - alnumCount;
+        counts->nonPrintable += AVX2_BLOCK_SIZE - printCount;
+        counts->space += __builtin_popcount(
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, space)));
+        counts->newline += __builtin_popcount(
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+    }
+    count_characters_scalar(string + i, len - i, counts);
+}
+#endif
+
+/* count_characters()
+ * ------------------
+ * Count the number of characters of each class in string, using the widest
+ * SIMD kernel supported by the CPU.
+ *
+ * string: String to classify
+ * len: Length of string
+ * counts: CharacterCounts to store result in
+ */
+void count_characters(const char* string, size_t len, CharacterCounts* counts)
+{
+    memset(counts, 0, sizeof(CharacterCounts));
+#ifdef SIMD_X86
+    if (len >= AVX2_BLOCK_SIZE && __builtin_cpu_supports("avx2")) {
+        count_characters_avx2(string, len, counts);
+        return;
+    }
+    if (len >= SSE2_BLOCK_SIZE) {
+        count_characters_sse2(string, len, counts);
+        return;
+    }
+#endif
+    count_characters_scalar(string, len, counts);
+}
+
 /* contains_whitespace()
  * ---------------------
  * Check if a string contains whitespace.
  *
  * string: String to check
+ * len: Length of string
  *
  * Returns: True if string contains one or more whitespace characters,
  *          false otherwise.
  */
-bool contains_whitespace(char* string)
+bool contains_whitespace(const char* string, int len)
 {
-    int len = strlen(string);
-
-    for (int i = 0; i < len; i++) {
-        if (string[i] == ' ') {
-            return true;
-        }
-    }
+    CharacterCounts counts;
 
-    return false;
+    count_characters(string, len, &counts);
+    return counts.space > 0;
 }
 
 /* contains_non_printable()
@@ -150,20 +596,17 @@ bool contains_whitespace(char* string)
  * Check if string contains a non-printable ASCII character.
  *
  * string: String to check
+ * len: Length of string
  *
  * Returns: True if string contains one or more non-printable ASCII
  *          characters, false otherwise.
  */
-bool contains_non_printable(char* string)
+bool contains_non_printable(const char* string, int len)
 {
-    int len = strlen(string);
+    CharacterCounts counts;
 
-    for (int i = 0; i < len; i++) {
-        if (!isprint(string[i])) {
-            return true;
-        }
-    }
-    return false;
+    count_characters(string, len, &counts);
+    return counts.nonPrintable > 0;
 }
 
 /* alpha_count()
@@ -171,23 +614,126 @@ bool contains_non_printable(char* string)
  * Find the number of alphabetic characters in word.
  *
  * word: String we want alphabetic character count of
+ * len: Length of word
  *
  * Returns: Number of alphabetic characters in word.
  */
-int alpha_count(char* word)
+int alpha_count(const char* word, int len)
+{
+    CharacterCounts counts;
+
+    count_characters(word, len, &counts);
+    return counts.lower + counts.upper;
+}
+
+/* swap_char_leet()
+ * ----------------
+ * Swap a character according to LeetSpeak. Will return an array
+ * of size two. The second element may be the null character '\0' if
+ * swap only had one possible substitute character.
+ *
+ * swap: Character to find LeetSpeak swap characters for
+ *
+ * Returns: Pointer to (static) array of size 2 containing zero, one or two
+ *          swap characters depending on if swap has 0, 1 or 2 substitutes
+ *          according to LeetSpeak. Must not be freed.
+ */
+const char* swap_char_leet(char swap)
+{
+    switch (tolower(swap)) {
+    case 'a':
+        return "@4";
+    case 'b':
+        return "68";
+    case 'e':
+        return "3";
+    case 'g':
+        return "69";
+    case 'i':
+        return "1!";
+    case 'l':
+        return "1";
+    case 'o':
+        return "0";
+    case 's':
+        return "5$";
+    case 't':
+        return "7+";
+    case 'x':
+        return "%";
+    case 'z':
+        return "2";
+    default:
+        return "\0";
+    }
+}
+
+/* leet_sub_count()
+ * ----------------
+ * Get the number of letters in word which have a LeetSpeak substitution
+ * count of subCount.
+ *
+ * word: Word to get count of
+ * len: Length of word
+ * subCount: The number of LeetSpeak substitution characters the characters
+ *            of word we wish to count.
+ *
+ * Returns: The number of characters in word which have subCount different
+ *          substitutions according to LeetSpeak.
+ *
+ * Errors: If an invalid is given for subCount (i.e. not 1 or 2), then NULL
+ *         is returned and should be ignored.
+ */
+int leet_sub_count(const char* word, int len, int subCount)
 {
     int count = 0;
-    int len = strlen(word);
 
     for (int i = 0; i < len; i++) {
-        if (isalpha(word[i])) {
+        const char* subs = swap_char_leet(word[i]);
+
+        // both elements of subs are not null and we're looking for sub count
+        // of two
+        if ((subs[0] != '\0') && (subs[1] != '\0') && (subCount == 2)) {
+            count++;
+        } else if ((subs[0] != '\0') && (subs[1] == '\0') && (subCount == 1)) {
+            // subs only has one valid element and we're looking for sub count
+            // of one
             count++;
         }
     }
-
     return count;
 }
 
+/* free_password_index()
+ * ---------------------
+ * Free a PasswordIndex type
+ *
+ * index: PasswordIndex to free (may be NULL)
+ */
+void free_password_index(PasswordIndex* index)
+{
+    if (index == NULL) {
+        return;
+    }
+    free(index->slots);
+    free(index);
+}
+
+/* free_password_trie()
+ * --------------------
+ * Free a PasswordTrie type
+ *
+ * trie: PasswordTrie to free (may be NULL)
+ */
+void free_password_trie(PasswordTrie* trie)
+{
+    if (trie == NULL) {
+        return;
+    }
+    free(trie->nodes);
+    free(trie);
+}
+
 /* free_password_list()
  * --------------------
  * Free a PasswordList type
@@ -196,10 +742,31 @@ int alpha_count(char* word)
  */
 void free_password_list(PasswordList* list)
 {
-    for (int i = 0; i < list->passCount; i++) {
-        free(list->passwords[i]);
+    if (list->compiled) {
+        // Only the wrapper structs are allocated, their arrays are in data
+        free(list->exactIndex);
+        free(list->caseIndex);
+        free(list->trie);
+    } else {
+        free(list->offsets);
+        free(list->lengths);
+        free(list->alphaCounts);
+        free(list->oneSubCounts);
+        free(list->twoSubCounts);
+        free(list->caseGuesses);
+        free(list->leetGuesses);
+        free(list->casePrefix);
+        free(list->leetPrefix);
+        free(list->appendablePrefix);
+        free_password_index(list->exactIndex);
+        free_password_index(list->caseIndex);
+        free_password_trie(list->trie);
+    }
+    if (list->mapped) {
+        munmap(list->data, list->dataSize);
+    } else {
+        free(list->data);
     }
-    free(list->passwords);
     free(list->sourceFile);
     free(list);
 }
@@ -250,19 +817,21 @@ void free_string_array(char** array, int count)
  */
 CharacterSet get_sets(char* password)
 {
-    int len = strlen(password);
+    CharacterCounts counts;
     CharacterSet result = EMPTY_SET;
 
-    for (int i = 0; i < len; i++) {
-        if (isdigit(password[i])) {
-            result |= NUMERIC;
-        } else if (islower(password[i])) {
-            result |= ALPHA_LOWER;
-        } else if (isupper(password[i])) {
-            result |= ALPHA_UPPER;
-        } else if (isprint(password[i])) {
-            result |= ASCII_OTHER;
-        }
+    count_characters(password, strlen(password), &counts);
+    if (counts.digit > 0) {
+        result |= NUMERIC;
+    }
+    if (counts.lower > 0) {
+        result |= ALPHA_LOWER;
+    }
+    if (counts.upper > 0) {
+        result |= ALPHA_UPPER;
+    }
+    if (counts.other > 0) {
+        result |= ASCII_OTHER;
     }
 
     return result;
@@ -343,6 +912,27 @@ float calc_entropy(Password* toCalc)
     return (floor(entropy * ROUND_FACTOR) / ROUND_FACTOR);
 }
 
+/* password_strength()
+ * -------------------
+ * Get the strength rating of a password with the given entropy
+ *
+ * entropy: Entropy of password
+ *
+ * Returns: Strength rating string ("very weak", "weak", "strong" or
+ *          "very strong").
+ */
+const char* password_strength(float entropy)
+{
+    if (entropy < ENTROPY_WEAK) {
+        return "very weak";
+    } else if ((ENTROPY_WEAK <= entropy) && (entropy < ENTROPY_STRONG)) {
+        return "weak";
+    } else if ((ENTROPY_STRONG <= entropy) && (entropy < ENTROPY_VERY_STRONG)) {
+        return "strong";
+    }
+    return "very strong";
+}
+
 /* print_password_strength()
  * -------------------------
  * Print the strength rating of a given password
@@ -352,18 +942,7 @@ float calc_entropy(Password* toCalc)
  */
 void print_password_strength(float entropy)
 {
-    printf("Password strength rating: ");
-
-    if (entropy < ENTROPY_WEAK) {
-        printf("very weak");
-    } else if ((ENTROPY_WEAK <= entropy) && (entropy < ENTROPY_STRONG)) {
-        printf("weak");
-    } else if ((ENTROPY_STRONG <= entropy) && (entropy < ENTROPY_VERY_STRONG)) {
-        printf("strong");
-    } else if (ENTROPY_VERY_STRONG <= entropy) {
-        printf("very strong");
-    }
-    printf("\n");
+    printf("Password strength rating: %s\n", password_strength(entropy));
 }
 
 /* read_line()
@@ -411,24 +990,46 @@ char* read_line(FILE* file)
     return result;
 }
 
-/* get_password_from_user()
- * ------------------------
- * Get a password from the user. Creates a Password type with string from user
- * and corresponding entropy
+/* trailing_digit_count()
+ * ----------------------
+ * Count the number of consecutive digits at the end of string.
  *
- * Returns: Pointer to Password type containing user's input string and entropy
- *          of string
+ * string: String to check
+ * len: Length of string
  *
- * Errors: If a valid password was not read i.e. empty input or contained
- *         whitespace or non-printable characters, then NULL is returned.
+ * Returns: Length of the run of digits that string ends with (0 if string
+ *          doesn't end in a digit).
+ */
+int trailing_digit_count(const char* string, int len)
+{
+    int count = 0;
+
+    while ((count < len) && isdigit((unsigned char)string[len - count - 1])) {
+        count++;
+    }
+    return count;
+}
+
+/* read_password()
+ * ---------------
+ * Read a password from input. Creates a Password type with the next valid
+ * line of input. Invalid lines are reported and skipped.
+ *
+ * input: Stream to read password from
+ *
+ * Returns: Pointer to Password type containing the input string
+ *
+ * Errors: If a valid password was not read before the end of input i.e.
+ *         every remaining line was empty or contained whitespace or
+ *         non-printable characters, then NULL is returned.
  *
  */
-Password* get_password_from_user(void)
+Password* read_password(FILE* input)
 {
     Password* userPass = (Password*)malloc(sizeof(Password));
     userPass->matched = false;
     userPass->guessCount = 0;
-    char* line = read_line(stdin);
+    char* line = read_line(input);
 
     // stdin was closed by user using Crtl-D
     if (line == NULL) {
@@ -438,11 +1039,12 @@ Password* get_password_from_user(void)
 
     // Asks for new password while given password contains whitespace,
     // non-printable or is empty
-    while (contains_whitespace(line) || contains_non_printable(line)
+    while (contains_whitespace(line, strlen(line))
+            || contains_non_printable(line, strlen(line))
             || (strlen(line) == 0)) {
         free(line);
         fprintf(stderr, "Password is not valid\n");
-        line = read_line(stdin);
+        line = read_line(input);
         if (line == NULL) {
             free(userPass);
             return NULL;
@@ -450,23 +1052,76 @@ Password* get_password_from_user(void)
     }
 
     userPass->password = line;
+    userPass->length = strlen(line);
+    userPass->trailingDigits = trailing_digit_count(line, userPass->length);
     return userPass;
 }
 
+/* get_password_from_user()
+ * ------------------------
+ * Get a password from the user. Creates a Password type with string from user
+ *
+ * Returns: Pointer to Password type containing user's input string
+ *
+ * Errors: If a valid password was not read i.e. empty input or contained
+ *         whitespace or non-printable characters, then NULL is returned.
+ *
+ */
+Password* get_password_from_user(void)
+{
+    return read_password(stdin);
+}
+
+/* arg_takes_value()
+ * -----------------
+ * Check if a command line argument is one of the options which are always
+ * followed by a value (other than --digit-append). These are not search
+ * options.
+ *
+ * arg: Argument to check
+ *
+ * Returns: True if arg is "--batch", "--threads" or "--compile-dict", false
+ *          otherwise.
+ */
+bool arg_takes_value(char* arg)
+{
+    return (strcmp(arg, "--batch") == 0) || (strcmp(arg, "--threads") == 0)
+            || (strcmp(arg, "--compile-dict") == 0);
+}
+
+/* arg_is_value()
+ * --------------
+ * Check if a command line argument is the value given to an option for which
+ * arg_takes_value() is true.
+ *
+ * argv: Array of command line arguments
+ * index: Index of argv to check
+ *
+ * Returns: True if argv[index] follows "--batch", "--threads" or
+ *          "--compile-dict", false otherwise.
+ */
+bool arg_is_value(char** argv, int index)
+{
+    return (index > 1) && arg_takes_value(argv[index - 1]);
+}
+
 /* arg_is_option()
  * --------------
  * Check if a command line argument is an option.
  *
  * arg: Argument to check
  *
- * Returns: True if arg is one of "--leet", "--casecheck", "--doubleup" or
- *          "--digit-append", false otherwise.
+ * Returns: True if arg is one of "--leet", "--casecheck", "--doubleup",
+ *          "--digit-append", "--batch", "--threads" or "--compile-dict",
+ *          false otherwise.
  */
 bool arg_is_option(char* arg)
 {
     bool result = false;
 
-    if (strcmp(arg, "--leet") == 0) {
+    if (arg_takes_value(arg)) {
+        result = true;
+    } else if (strcmp(arg, "--leet") == 0) {
         result = true;
     } else if (strcmp(arg, "--digit-append") == 0) {
         result = true;
@@ -498,6 +1153,9 @@ int cmdline_file_start(int argc, char** argv)
     int start = 0;
 
     for (int i = 1; i < argc; i++) {
+        if (arg_is_value(argv, i)) {
+            continue;
+        }
         if (!((argv[i][0] == '-') && (argv[i][1] == '-'))) {
             // Find a digit, check if it's part of --digit-append or
             // a file name
@@ -544,7 +1202,8 @@ int cmdline_file_count(int argc, char** argv)
  * argv: Array of command line arguments
  *
  * Returns: True if the second element in argv is a valid uqentropy option,
- *          false otherwise.
+ *          false otherwise. Batch mode and --compile-dict options are not
+ *          search options so are ignored.
  */
 bool cmdline_options_present(int argc, int fileStart, char** argv)
 {
@@ -552,14 +1211,19 @@ bool cmdline_options_present(int argc, int fileStart, char** argv)
         return false;
     }
     int endIndex = argc - fileStart - 1;
+    bool found = false;
 
     for (int i = 1; i <= endIndex; i++) {
+        if (arg_takes_value(argv[i]) || arg_is_value(argv, i)) {
+            continue;
+        }
         if (!arg_is_option(argv[i])) {
             return false;
         }
+        found = true;
     }
 
-    return true;
+    return found;
 }
 
 /* arg_duplicated()
@@ -578,6 +1242,10 @@ bool arg_duplicated(int fileStart, char** argv)
     int numArgsChecked = 0;
 
     for (int i = 1; i < fileStart; i++) {
+        // Option values may legitimately repeat other arguments
+        if (arg_is_value(argv, i)) {
+            continue;
+        }
         for (int j = 0; j < numArgsChecked; j++) {
             // argv[i] has already appeared once meaning argv[i] is duplicated
             if (strcmp(argv[i], argsChecked[j]) == 0) {
@@ -627,11 +1295,34 @@ bool verify_cmdline_args(int argc, char** argv)
         }
     }
     bool result = true;
+    bool batch = false;
+    bool threads = false;
+    bool compile = false;
 
     for (int i = 1; i < argc - fileCount; i++) {
+        if (arg_is_value(argv, i)) {
+            continue;
+        }
         if (!arg_is_option(argv[i])) {
             return false;
         }
+        if (arg_takes_value(argv[i])) {
+            if ((i == argc - 1) || (strncmp(argv[i + 1], "--", 2) == 0)) {
+                // These options must be followed by a value
+                return false;
+            }
+            if (strcmp(argv[i], "--batch") == 0) {
+                batch = true;
+            } else if (strcmp(argv[i], "--compile-dict") == 0) {
+                compile = true;
+            } else {
+                threads = true;
+                int threadCount = atoi(argv[i + 1]);
+                if ((threadCount < 1) || (threadCount > BATCH_MAX_THREADS)) {
+                    result = false;
+                }
+            }
+        }
         // Check that --digit-append is followed by a digit that
         // is between 1 and 6 inclusive
         if (strcmp(argv[i], "--digit-append") == 0) {
@@ -644,6 +1335,15 @@ bool verify_cmdline_args(int argc, char** argv)
         }
     }
 
+    // --threads only makes sense in batch mode
+    if (threads && !batch) {
+        result = false;
+    }
+    // --compile-dict must be the only option and be given one password file
+    if (compile && ((argc - fileCount != 3) || (fileCount != 1))) {
+        result = false;
+    }
+
     // Check for any empty strings in all arguments
     for (int i = 0; i < argc; i++) {
         if (strcmp(argv[i], "") == 0) {
@@ -678,69 +1378,447 @@ char** parse_cmdline_files(int argc, char** argv)
     return fileNames;
 }
 
+/* get_password()
+ * --------------
+ * Get a pointer to a password in list. Note that the password is NOT null
+ * terminated, its length is list->lengths[position].
+ *
+ * list: PasswordList containing password
+ * position: Position of password in list
+ *
+ * Returns: Pointer to the first character of the password.
+ */
+const char* get_password(PasswordList* list, int position)
+{
+    return list->data + list->offsets[position];
+}
+
+/* add_password()
+ * --------------
+ * Add a password to list, growing the offset and length arrays
+ * geometrically as required.
+ *
+ * list: PasswordList to add password to
+ * offset: Offset of password within list->data
+ * len: Length of password
+ */
+void add_password(PasswordList* list, size_t offset, int len)
+{
+    if (list->passCount == list->capacity) {
+        list->capacity *= 2;
+        list->offsets = (size_t*)realloc(
+                list->offsets, list->capacity * sizeof(size_t));
+        list->lengths
+                = (int*)realloc(list->lengths, list->capacity * sizeof(int));
+    }
+    list->offsets[list->passCount] = offset;
+    list->lengths[list->passCount] = len;
+    list->passCount++;
+}
+
 /* split_line()
  * ------------
- * Split line into tokens based on split string. Used when parsing passwords
- * from a file.
+ * Split line into tokens separated by one or more spaces. Used when parsing
+ * passwords from a file.
  *
  * list: PasswordList to store resulting tokens in
- * line: Line from file to split
- * split: String to split line on
+ * start: Offset of line within list->data
+ * len: Length of line (excluding newline)
  */
-void split_line(PasswordList* list, char* line, char* split)
+void split_line(PasswordList* list, size_t start, int len)
 {
-    // split line on string split
-    char* token = strtok(line, split);
+    const char* line = list->data + start;
+    int i = 0;
 
-    while (token != NULL) {
-        // Add token to list's passwords array
-        list->passwords = (char**)realloc(
-                list->passwords, (list->passCount + 1) * sizeof(char*));
-        list->passwords[list->passCount] = strdup(token);
-        list->passCount++;
-        token = strtok(NULL, split);
+    while (i < len) {
+        // skip over spaces before token
+        while ((i < len) && (line[i] == ' ')) {
+            i++;
+        }
+        int tokenStart = i;
+        while ((i < len) && (line[i] != ' ')) {
+            i++;
+        }
+        if (i > tokenStart) {
+            // Add token to list's passwords
+            add_password(list, start + tokenStart, i - tokenStart);
+        }
     }
 }
 
 /* read_passwords_from_file()
  * --------------------------
- * Read all passwords from pass_file into list.
+ * Split the contents of list->data into passwords in place. The contents
+ * are split into lines, and lines are split on spaces. Empty lines are
+ * skipped, and any line containing non-printable characters marks the list
+ * as invalid.
  *
- * list: pointer to PasswordList to store read passwords
- * passFile: file to read passwords from
+ * list: pointer to PasswordList to store read passwords (with data loaded)
  *
  */
-void read_passwords_from_file(PasswordList* list, FILE* passFile)
+void read_passwords_from_file(PasswordList* list)
 {
-    char* line = read_line(passFile);
+    CharacterCounts counts;
+    size_t start = 0;
+
+    // Validate the whole file in one pass rather than line by line. Lines
+    // contain a non-printable character exactly when the file contains a
+    // non-printable character other than a newline.
+    count_characters(list->data, list->dataSize, &counts);
+    if (counts.nonPrintable > counts.newline) {
+        list->contentValid = false;
+    }
 
-    while (line != NULL) {
-        // empty line so just skip over
-        if (strcmp(line, "") == 0) {
-            free(line);
-            line = read_line(passFile);
-            continue;
-        }
-        if (contains_non_printable(line)) {
-            list->contentValid = false;
-        }
-        if (contains_whitespace(line)) {
-            split_line(list, line, " ");
-        } else {
-            // Password is valid so we add it to the lists array
-            list->passwords = (char**)realloc(
-                    list->passwords, (list->passCount + 1) * sizeof(char*));
-            list->passwords[list->passCount] = strdup(line);
-            list->passCount++;
-        }
-        free(line);
-        line = read_line(passFile);
+    while (start < list->dataSize) {
+        const char* line = list->data + start;
+        const char* end = memchr(line, '\n', list->dataSize - start);
+        size_t len = (end == NULL) ? list->dataSize - start
+                                   : (size_t)(end - line);
+
+        // empty lines produce no tokens so are skipped over
+        split_line(list, start, len);
+        start += len + 1;
     }
 }
 
-/* parse_passwords()
+/* load_file_data()
+ * ----------------
+ * Load the contents of a password file into list->data. Regular files are
+ * memory mapped, anything else (e.g. a pipe) is read into a heap buffer.
+ *
+ * list: PasswordList to load data into
+ * fd: File descriptor of open password file
+ */
+void load_file_data(PasswordList* list, int fd)
+{
+    struct stat info;
+
+    list->data = NULL;
+    list->dataSize = 0;
+    list->mapped = false;
+
+    if ((fstat(fd, &info) == 0) && S_ISREG(info.st_mode)
+            && (info.st_size > 0)) {
+        void* mapping
+                = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            list->data = (char*)mapping;
+            list->dataSize = info.st_size;
+            list->mapped = true;
+            return;
+        }
+    }
+    size_t capacity = FILE_READ_SIZE;
+    list->data = (char*)malloc(capacity);
+
+    while (true) {
+        if (list->dataSize == capacity) {
+            capacity *= 2;
+            list->data = (char*)realloc(list->data, capacity);
+        }
+        ssize_t got = read(
+                fd, list->data + list->dataSize, capacity - list->dataSize);
+        if (got <= 0) {
+            break;
+        }
+        list->dataSize += got;
+    }
+}
+
+/* compute_password_metadata()
+ * ---------------------------
+ * Calculate the per password metadata arrays of list (lengths, alphabetic
+ * counts, LeetSpeak substitution counts, resulting guess counts and their
+ * prefix sums).
+ *
+ * list: PasswordList to calculate metadata of
+ */
+void compute_password_metadata(PasswordList* list)
+{
+    int count = list->passCount;
+
+    list->alphaCounts = (int*)malloc(count * sizeof(int));
+    list->oneSubCounts = (int*)malloc(count * sizeof(int));
+    list->twoSubCounts = (int*)malloc(count * sizeof(int));
+    list->caseGuesses = (unsigned long*)malloc(count * sizeof(unsigned long));
+    list->leetGuesses = (unsigned long*)malloc(count * sizeof(unsigned long));
+    list->casePrefix
+            = (unsigned long*)malloc((count + 1) * sizeof(unsigned long));
+    list->leetPrefix
+            = (unsigned long*)malloc((count + 1) * sizeof(unsigned long));
+    list->appendablePrefix = (int*)malloc((count + 1) * sizeof(int));
+    list->casePrefix[0] = 0;
+    list->leetPrefix[0] = 0;
+    list->appendablePrefix[0] = 0;
+
+    for (int i = 0; i < count; i++) {
+        const char* password = get_password(list, i);
+        int len = list->lengths[i];
+        int oneSub = leet_sub_count(password, len, 1);
+        int twoSub = leet_sub_count(password, len, 2);
+
+        list->alphaCounts[i] = alpha_count(password, len);
+        list->oneSubCounts[i] = oneSub;
+        list->twoSubCounts[i] = twoSub;
+        list->caseGuesses[i]
+                = (unsigned long)(pow(2, list->alphaCounts[i]) - 1);
+        list->leetGuesses[i]
+                = (unsigned long)(pow(LEET_COUNT_FIRST_BASE, oneSub)
+                                  * pow(LEET_COUNT_SECOND_BASE, twoSub))
+                - 1;
+        list->casePrefix[i + 1] = list->casePrefix[i] + list->caseGuesses[i];
+        list->leetPrefix[i + 1] = list->leetPrefix[i] + list->leetGuesses[i];
+        list->appendablePrefix[i + 1] = list->appendablePrefix[i]
+                + (isdigit(password[len - 1]) ? 0 : 1);
+    }
+}
+
+/* dig_append_guesses()
+ * --------------------
+ * Calculate the number of guesses needed to try appending every number of
+ * at most digitCount digits to a password i.e. 10^1 + ... + 10^digitCount
+ *
+ * digitCount: Maximum number of digits to append
+ *
+ * Returns: Number of guesses as described above.
+ */
+unsigned long dig_append_guesses(int digitCount)
+{
+    // guesses[n] = 10^1 + ... + 10^n
+    static const unsigned long guesses[DIG_APPEND_MAX + 1]
+            = {0, 10, 110, 1110, 11110, 111110, 1111110};
+
+    return guesses[digitCount];
+}
+
+/* dict_section_sizes()
+ * --------------------
+ * Calculate the expected size of each section of a compiled dictionary
+ * (other than DICT_PASSWORDS, which is set to 0).
+ *
+ * passCount: Number of passwords in dictionary
+ * indexSlots: Number of slots in each index
+ * trieNodes: Number of nodes in trie
+ * sizes: Array of DICT_SECTION_COUNT elements to store sizes in
+ */
+void dict_section_sizes(
+        size_t passCount, size_t indexSlots, size_t trieNodes, size_t* sizes)
+{
+    sizes[DICT_PASSWORDS] = 0;
+    sizes[DICT_OFFSETS] = passCount * sizeof(size_t);
+    sizes[DICT_LENGTHS] = passCount * sizeof(int);
+    sizes[DICT_ALPHA_COUNTS] = passCount * sizeof(int);
+    sizes[DICT_ONE_SUB_COUNTS] = passCount * sizeof(int);
+    sizes[DICT_TWO_SUB_COUNTS] = passCount * sizeof(int);
+    sizes[DICT_CASE_GUESSES] = passCount * sizeof(unsigned long);
+    sizes[DICT_LEET_GUESSES] = passCount * sizeof(unsigned long);
+    sizes[DICT_CASE_PREFIX] = (passCount + 1) * sizeof(unsigned long);
+    sizes[DICT_LEET_PREFIX] = (passCount + 1) * sizeof(unsigned long);
+    sizes[DICT_APPENDABLE_PREFIX] = (passCount + 1) * sizeof(int);
+    sizes[DICT_EXACT_INDEX] = indexSlots * sizeof(int);
+    sizes[DICT_CASE_INDEX] = indexSlots * sizeof(int);
+    sizes[DICT_TRIE] = trieNodes * sizeof(TrieNode);
+}
+
+/* is_compiled_dict()
+ * ------------------
+ * Check if the data loaded into list is a compiled dictionary.
+ *
+ * list: PasswordList with data loaded
+ *
+ * Returns: true if data starts with DICT_MAGIC, false otherwise.
+ */
+bool is_compiled_dict(PasswordList* list)
+{
+    return (list->dataSize >= DICT_MAGIC_LENGTH)
+            && (memcmp(list->data, DICT_MAGIC, DICT_MAGIC_LENGTH) == 0);
+}
+
+/* dict_header_valid()
+ * -------------------
+ * Check that a compiled dictionary header matches this program's version and
+ * data layout, and that every section it describes lies within the file.
+ *
+ * header: Header to check
+ * fileSize: Size of the whole dictionary file
+ *
+ * Returns: true if header is valid, false otherwise.
+ */
+bool dict_header_valid(DictHeader* header, size_t fileSize)
+{
+    size_t sizes[DICT_SECTION_COUNT];
+
+    if ((header->version != DICT_VERSION)
+            || (header->byteOrder != DICT_BYTE_ORDER)
+            || (header->longSize != sizeof(unsigned long))
+            || (header->sizeSize != sizeof(size_t))
+            || (header->nodeSize != sizeof(TrieNode))
+            || (header->passCount == 0) || (header->passCount > INT_MAX)
+            || (header->trieNodes == 0) || (header->trieNodes > INT_MAX)
+            || (header->indexSlots == 0)
+            || ((header->indexSlots & (header->indexSlots - 1)) != 0)) {
+        return false;
+    }
+    dict_section_sizes(
+            header->passCount, header->indexSlots, header->trieNodes, sizes);
+
+    for (int i = 0; i < DICT_SECTION_COUNT; i++) {
+        uint64_t offset = header->sectionOffsets[i];
+        uint64_t size = header->sectionSizes[i];
+
+        if (((i != DICT_PASSWORDS) && (size != sizes[i]))
+                || (offset % DICT_ALIGNMENT != 0) || (offset > fileSize)
+                || (size > fileSize - offset)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* dict_index_valid()
+ * ------------------
+ * Check that every slot of a compiled dictionary index is unused or refers to
+ * a password, and that at least one slot is unused (so every probe sequence
+ * ends).
+ *
+ * slots: Slots of the index
+ * slotCount: Number of slots
+ * passCount: Number of passwords in dictionary
+ *
+ * Returns: true if the index is valid, false otherwise.
+ */
+bool dict_index_valid(const int* slots, size_t slotCount, int passCount)
+{
+    bool hasEmpty = false;
+
+    for (size_t i = 0; i < slotCount; i++) {
+        if (slots[i] == EMPTY_SLOT) {
+            hasEmpty = true;
+        } else if ((slots[i] < 0) || (slots[i] >= passCount)) {
+            return false;
+        }
+    }
+    return hasEmpty;
+}
+
+/* dict_contents_valid()
+ * ---------------------
+ * Check that every reference within a compiled dictionary (whose header is
+ * valid) stays within the file: each password lies within DICT_PASSWORDS,
+ * each index slot refers to a password and each trie link refers to a node.
+ * Trie child links must point forwards and sibling links backwards, as they
+ * do in a trie built by create_password_trie(), so no corrupted file can make
+ * a lookup loop forever.
+ *
+ * header: Header of dictionary
+ * sections: Start of each DictSection
+ *
+ * Returns: true if the contents are valid, false otherwise.
+ */
+bool dict_contents_valid(DictHeader* header, char** sections)
+{
+    size_t* offsets = (size_t*)sections[DICT_OFFSETS];
+    int* lengths = (int*)sections[DICT_LENGTHS];
+    uint64_t passStart = header->sectionOffsets[DICT_PASSWORDS];
+    uint64_t passEnd = passStart + header->sectionSizes[DICT_PASSWORDS];
+    int passCount = header->passCount;
+
+    for (int i = 0; i < passCount; i++) {
+        if ((offsets[i] < passStart) || (offsets[i] > passEnd)
+                || (lengths[i] < 0)
+                || ((uint64_t)lengths[i] > passEnd - offsets[i])) {
+            return false;
+        }
+    }
+    if (!dict_index_valid((int*)sections[DICT_EXACT_INDEX],
+                header->indexSlots, passCount)
+            || !dict_index_valid((int*)sections[DICT_CASE_INDEX],
+                    header->indexSlots, passCount)) {
+        return false;
+    }
+    TrieNode* nodes = (TrieNode*)sections[DICT_TRIE];
+    int nodeCount = header->trieNodes;
+
+    for (int i = 0; i < nodeCount; i++) {
+        if (((nodes[i].firstChild != TRIE_NONE)
+                    && ((nodes[i].firstChild <= i)
+                            || (nodes[i].firstChild >= nodeCount)))
+                || ((nodes[i].nextSibling != TRIE_NONE)
+                        && ((nodes[i].nextSibling < 0)
+                                || (nodes[i].nextSibling >= i)))
+                || ((nodes[i].position != EMPTY_SLOT)
+                        && ((nodes[i].position < 0)
+                                || (nodes[i].position >= passCount)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* load_compiled_dict()
+ * --------------------
+ * Set up list from the compiled dictionary loaded into list->data. The
+ * lists's arrays, indexes and trie are pointed directly into data so no
+ * copying or indexing is done, but every reference they contain is checked
+ * first.
+ *
+ * list: PasswordList with compiled dictionary data loaded
+ *
+ * Returns: true if the dictionary was valid, false otherwise.
+ */
+bool load_compiled_dict(PasswordList* list)
+{
+    DictHeader* header = (DictHeader*)list->data;
+
+    if ((list->dataSize < sizeof(DictHeader))
+            || !dict_header_valid(header, list->dataSize)) {
+        return false;
+    }
+    char* sections[DICT_SECTION_COUNT];
+    for (int i = 0; i < DICT_SECTION_COUNT; i++) {
+        sections[i] = list->data + header->sectionOffsets[i];
+    }
+    if (!dict_contents_valid(header, sections)) {
+        return false;
+    }
+
+    // Replace the arrays allocated by parse_passwords()
+    free(list->offsets);
+    free(list->lengths);
+    list->compiled = true;
+    list->passCount = header->passCount;
+    list->capacity = header->passCount;
+    list->offsets = (size_t*)sections[DICT_OFFSETS];
+    list->lengths = (int*)sections[DICT_LENGTHS];
+    list->alphaCounts = (int*)sections[DICT_ALPHA_COUNTS];
+    list->oneSubCounts = (int*)sections[DICT_ONE_SUB_COUNTS];
+    list->twoSubCounts = (int*)sections[DICT_TWO_SUB_COUNTS];
+    list->caseGuesses = (unsigned long*)sections[DICT_CASE_GUESSES];
+    list->leetGuesses = (unsigned long*)sections[DICT_LEET_GUESSES];
+    list->casePrefix = (unsigned long*)sections[DICT_CASE_PREFIX];
+    list->leetPrefix = (unsigned long*)sections[DICT_LEET_PREFIX];
+    list->appendablePrefix = (int*)sections[DICT_APPENDABLE_PREFIX];
+
+    list->exactIndex = (PasswordIndex*)malloc(sizeof(PasswordIndex));
+    list->exactIndex->slots = (int*)sections[DICT_EXACT_INDEX];
+    list->exactIndex->mask = header->indexSlots - 1;
+    list->exactIndex->foldCase = false;
+    list->caseIndex = (PasswordIndex*)malloc(sizeof(PasswordIndex));
+    list->caseIndex->slots = (int*)sections[DICT_CASE_INDEX];
+    list->caseIndex->mask = header->indexSlots - 1;
+    list->caseIndex->foldCase = true;
+
+    list->trie = (PasswordTrie*)malloc(sizeof(PasswordTrie));
+    list->trie->nodes = (TrieNode*)sections[DICT_TRIE];
+    list->trie->nodeCount = header->trieNodes;
+    list->trie->capacity = header->trieNodes;
+    return true;
+}
+
+/* parse_passwords()
  * -----------------
- * Parse passwords from file into PasswordList object.
+ * Parse passwords from file into PasswordList object. The file may be either
+ * a plain password file or a compiled dictionary (see compile_dict()).
  *
  * fileName: Name of file to parse passwords from
  *
@@ -750,24 +1828,48 @@ void read_passwords_from_file(PasswordList* list, FILE* passFile)
  */
 PasswordList* parse_passwords(char* fileName)
 {
-    PasswordList* list = (PasswordList*)malloc(sizeof(PasswordList));
-    list->passwords = (char**)malloc(sizeof(char*));
-    FILE* passFile = fopen(fileName, "r");
+    int passFile = open(fileName, O_RDONLY);
 
-    if (passFile == NULL) {
+    if (passFile == -1) {
         fprintf(stderr, "uqentropy: unable to read from password file \"%s\"\n",
                 fileName);
-        free(list->passwords);
-        free(list);
         return NULL;
     }
+    PasswordList* list = (PasswordList*)malloc(sizeof(PasswordList));
 
     list->sourceFile = strdup(fileName);
     list->passCount = 0;
+    list->capacity = LIST_INITIAL_CAPACITY;
+    list->offsets = (size_t*)malloc(list->capacity * sizeof(size_t));
+    list->lengths = (int*)malloc(list->capacity * sizeof(int));
     list->contentValid = true;
+    list->compiled = false;
+    list->alphaCounts = NULL;
+    list->oneSubCounts = NULL;
+    list->twoSubCounts = NULL;
+    list->caseGuesses = NULL;
+    list->leetGuesses = NULL;
+    list->casePrefix = NULL;
+    list->leetPrefix = NULL;
+    list->appendablePrefix = NULL;
+    list->exactIndex = NULL;
+    list->caseIndex = NULL;
+    list->trie = NULL;
 
     // read all passwords from pass_file
-    read_passwords_from_file(list, passFile);
+    load_file_data(list, passFile);
+    close(passFile);
+
+    if (is_compiled_dict(list)) {
+        if (!load_compiled_dict(list)) {
+            fprintf(stderr,
+                    "uqentropy: \"%s\" is not a valid compiled dictionary\n",
+                    fileName);
+            list->contentValid = false;
+        }
+        return list;
+    }
+    read_passwords_from_file(list);
 
     if ((list->passCount == 0)) {
         // we didn't read any passwords (empty file)
@@ -779,9 +1881,10 @@ PasswordList* parse_passwords(char* fileName)
         fprintf(stderr,
                 "uqentropy: \"%s\" contains invalid password character\n",
                 fileName);
+    } else {
+        compute_password_metadata(list);
     }
 
-    fclose(passFile);
     return list;
 }
 
@@ -808,6 +1911,8 @@ SearchDescriptor* parse_options(char** argv, int fileStart)
     // for exact match
     result->options[0] = EXACT;
     result->optCount = 1;
+    result->appendCount = 0;
+    result->appendGuesses = 0;
     // order in which options should be parsed
     SearchOption order[] = {CASE_CHECK, DIG_APPEND, DOUBLEUP, LEET};
 
@@ -823,6 +1928,7 @@ SearchDescriptor* parse_options(char** argv, int fileStart)
             if (strcmp(argv[i], "--digit-append") == 0) {
                 toAdd = DIG_APPEND;
                 result->appendCount = atoi(argv[i + 1]);
+                result->appendGuesses = dig_append_guesses(result->appendCount);
             }
             if (strcmp(argv[i], "--doubleup") == 0) {
                 toAdd = DOUBLEUP;
@@ -843,6 +1949,40 @@ SearchDescriptor* parse_options(char** argv, int fileStart)
     return result;
 }
 
+/* parse_batch_options()
+ * ---------------------
+ * Parse the batch mode options (--batch and --threads) given through command
+ * line into a BatchDescriptor type.
+ *
+ * argv: Array of command line arguments
+ * fileStart: Index of argv where the first file name is
+ *
+ * Returns: A pointer to a BatchDescriptor type, or NULL if --batch was not
+ *          given. If --threads was not given, one thread per online
+ *          processor is used.
+ */
+BatchDescriptor* parse_batch_options(char** argv, int fileStart)
+{
+    BatchDescriptor* result = NULL;
+    int threadCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    if ((threadCount < 1) || (threadCount > BATCH_MAX_THREADS)) {
+        threadCount = 1;
+    }
+    for (int i = 1; i < fileStart - 1; i++) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            threadCount = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            result = (BatchDescriptor*)malloc(sizeof(BatchDescriptor));
+            result->inputName = argv[i + 1];
+        }
+    }
+    if (result != NULL) {
+        result->threadCount = threadCount;
+    }
+    return result;
+}
+
 /* read_in_passwords()
  * -------------------
  * Read in passwords from files given in command line to create PasswordSet.
@@ -887,129 +2027,387 @@ PasswordSet* read_in_passwords(char** fileNames, int fileCount)
     return set;
 }
 
-/* swap_char_leet()
- * ----------------
- * Swap a character according to LeetSpeak. Will return an array
- * of size two. The second element may be the null character '\0' if
- * swap only had one possible substitute character.
+/* hash_password()
+ * ---------------
+ * Hash a password string using the FNV-1a hash function.
  *
- * swap: Character to find LeetSpeak swap characters for
+ * password: Password to hash
+ * len: Length of password
+ * foldCase: true if password should be hashed as if it were all lower case
  *
- * Returns: Pointer to array of size 2 containing one or two swap characters
- *          depending on if swap has 1 or 2 substitutes according to
- *          LeetSpeak.
+ * Returns: 32 bit hash of password.
  */
-char* swap_char_leet(char swap)
+unsigned int hash_password(const char* password, int len, bool foldCase)
 {
-    char* result = (char*)calloc(2, sizeof(char));
+    unsigned int hash = FNV_OFFSET_BASIS;
 
-    if ((swap == 'a') || (swap == 'A')) {
-        result[0] = '@';
-        result[1] = '4';
-    }
-    if ((swap == 'b') || (swap == 'B')) {
-        result[0] = '6';
-        result[1] = '8';
-    }
-    if ((swap == 'e') || (swap == 'E')) {
-        result[0] = '3';
-    }
-    if ((swap == 'g') || (swap == 'G')) {
-        result[0] = '6';
-        result[1] = '9';
-    }
-    if ((swap == 'i') || (swap == 'I')) {
-        result[0] = '1';
-        result[1] = '!';
+    for (int i = 0; i < len; i++) {
+        unsigned char next = (unsigned char)password[i];
+        if (foldCase) {
+            next = (unsigned char)tolower(next);
+        }
+        hash = (hash ^ next) * FNV_PRIME;
     }
-    if ((swap == 'l') || (swap == 'L')) {
-        result[0] = '1';
+    return hash;
+}
+
+/* passwords_equal()
+ * -----------------
+ * Compare two password strings for equality.
+ *
+ * first: First password to compare
+ * firstLen: Length of first
+ * second: Second password to compare
+ * secondLen: Length of second
+ * foldCase: true if comparison should be case insensitive
+ *
+ * Returns: true if first and second are equal, false otherwise.
+ */
+bool passwords_equal(const char* first, int firstLen, const char* second,
+        int secondLen, bool foldCase)
+{
+    if (firstLen != secondLen) {
+        return false;
     }
-    if ((swap == 'o') || (swap == 'O')) {
-        result[0] = '0';
+    if (foldCase) {
+        return strncasecmp(first, second, firstLen) == 0;
     }
-    if ((swap == 's') || (swap == 'S')) {
-        result[0] = '5';
-        result[1] = '$';
+    return memcmp(first, second, firstLen) == 0;
+}
+
+/* create_password_index()
+ * -----------------------
+ * Build a PasswordIndex over all passwords in list. Only the first position
+ * of each distinct password is stored so that lookups report the same
+ * position a linear search of the list would.
+ *
+ * list: PasswordList to index
+ * foldCase: true if index should be case insensitive
+ *
+ * Returns: Pointer to newly allocated PasswordIndex.
+ */
+PasswordIndex* create_password_index(PasswordList* list, bool foldCase)
+{
+    PasswordIndex* index = (PasswordIndex*)malloc(sizeof(PasswordIndex));
+    unsigned int slotCount = INDEX_MIN_SLOTS;
+
+    while (slotCount < (unsigned int)list->passCount * INDEX_LOAD_FACTOR) {
+        slotCount *= 2;
     }
-    if ((swap == 't') || (swap == 'T')) {
-        result[0] = '7';
-        result[1] = '+';
+    index->slots = (int*)malloc(slotCount * sizeof(int));
+    index->mask = slotCount - 1;
+    index->foldCase = foldCase;
+
+    for (unsigned int i = 0; i < slotCount; i++) {
+        index->slots[i] = EMPTY_SLOT;
     }
-    if ((swap == 'x') || (swap == 'X')) {
-        result[0] = '%';
+
+    for (int j = 0; j < list->passCount; j++) {
+        const char* password = get_password(list, j);
+        int len = list->lengths[j];
+        unsigned int slot
+                = hash_password(password, len, foldCase) & index->mask;
+
+        // Probe until we find an empty slot or an earlier occurrence of the
+        // same password (in which case we keep the earlier position)
+        while (index->slots[slot] != EMPTY_SLOT) {
+            int other = index->slots[slot];
+            if (passwords_equal(get_password(list, other), list->lengths[other],
+                        password, len, foldCase)) {
+                break;
+            }
+            slot = (slot + 1) & index->mask;
+        }
+        if (index->slots[slot] == EMPTY_SLOT) {
+            index->slots[slot] = j;
+        }
     }
-    if ((swap == 'z') || (swap == 'Z')) {
-        result[0] = '2';
+    return index;
+}
+
+/* index_lookup()
+ * --------------
+ * Find the first position of password within the list that index was built
+ * from.
+ *
+ * index: PasswordIndex to search
+ * list: PasswordList that index was built from
+ * password: Password to look up
+ * len: Length of password
+ *
+ * Returns: Position of the first occurrence of password in list, or
+ *          EMPTY_SLOT if password is not present in list.
+ */
+int index_lookup(PasswordIndex* index, PasswordList* list,
+        const char* password, int len)
+{
+    unsigned int slot
+            = hash_password(password, len, index->foldCase) & index->mask;
+
+    while (index->slots[slot] != EMPTY_SLOT) {
+        int position = index->slots[slot];
+        if (passwords_equal(get_password(list, position),
+                    list->lengths[position], password, len,
+                    index->foldCase)) {
+            return position;
+        }
+        slot = (slot + 1) & index->mask;
     }
+    return EMPTY_SLOT;
+}
 
-    return result;
+/* trie_add_node()
+ * ---------------
+ * Add a new node to trie as the first child of parent.
+ *
+ * trie: PasswordTrie to add node to
+ * parent: Node index of parent of the new node
+ * label: Character on the edge from parent to the new node
+ *
+ * Returns: Node index of the new node.
+ */
+int trie_add_node(PasswordTrie* trie, int parent, char label)
+{
+    if (trie->nodeCount == trie->capacity) {
+        trie->capacity *= 2;
+        trie->nodes = (TrieNode*)realloc(
+                trie->nodes, trie->capacity * sizeof(TrieNode));
+    }
+    int node = trie->nodeCount++;
+
+    trie->nodes[node].label = label;
+    trie->nodes[node].firstChild = TRIE_NONE;
+    trie->nodes[node].position = EMPTY_SLOT;
+    trie->nodes[node].nextSibling = trie->nodes[parent].firstChild;
+    trie->nodes[parent].firstChild = node;
+    return node;
 }
 
-/* leet_sub_count()
- * ----------------
- * Get the number of letters in word which have a LeetSpeak substitution
- * count of subCount.
+/* trie_child()
+ * ------------
+ * Find the child of a node in trie with the given edge label.
  *
- * word: Word to get count of
- * subCount: The number of LeetSpeak substitution characters the characters
- *            of word we wish to count.
+ * trie: PasswordTrie to search
+ * node: Node index of parent
+ * label: Edge label of child to find
  *
- * Returns: The number of characters in word which have subCount different
- *          substitutions according to LeetSpeak.
+ * Returns: Node index of child, or TRIE_NONE if node has no such child.
+ */
+int trie_child(PasswordTrie* trie, int node, char label)
+{
+    int child = trie->nodes[node].firstChild;
+
+    while ((child != TRIE_NONE) && (trie->nodes[child].label != label)) {
+        child = trie->nodes[child].nextSibling;
+    }
+    return child;
+}
+
+/* create_password_trie()
+ * ----------------------
+ * Build a PasswordTrie over all passwords in list. Each node records the
+ * first position in list of the password ending at that node.
  *
- * Errors: If an invalid is given for subCount (i.e. not 1 or 2), then NULL
- *         is returned and should be ignored.
+ * list: PasswordList to build trie of
+ *
+ * Returns: Pointer to newly allocated PasswordTrie.
  */
-int leet_sub_count(char* word, int subCount)
+PasswordTrie* create_password_trie(PasswordList* list)
 {
-    int len = strlen(word);
-    int count = 0;
+    PasswordTrie* trie = (PasswordTrie*)malloc(sizeof(PasswordTrie));
+    trie->capacity = INDEX_MIN_SLOTS;
+    trie->nodes = (TrieNode*)malloc(trie->capacity * sizeof(TrieNode));
+    trie->nodeCount = 1;
+    trie->nodes[TRIE_ROOT].label = '\0';
+    trie->nodes[TRIE_ROOT].firstChild = TRIE_NONE;
+    trie->nodes[TRIE_ROOT].nextSibling = TRIE_NONE;
+    trie->nodes[TRIE_ROOT].position = EMPTY_SLOT;
+
+    for (int j = 0; j < list->passCount; j++) {
+        const char* password = get_password(list, j);
+        int node = TRIE_ROOT;
+
+        for (int i = 0; i < list->lengths[j]; i++) {
+            int child = trie_child(trie, node, password[i]);
+            if (child == TRIE_NONE) {
+                child = trie_add_node(trie, node, password[i]);
+            }
+            node = child;
+        }
+        if (trie->nodes[node].position == EMPTY_SLOT) {
+            trie->nodes[node].position = j;
+        }
+    }
+    return trie;
+}
 
-    for (int i = 0; i < len; i++) {
-        char* subs = swap_char_leet(word[i]);
+/* build_password_indexes()
+ * ------------------------
+ * Build the exact and case folded indexes and the prefix trie for each list
+ * in set. Should be called once after read_in_passwords().
+ *
+ * set: PasswordSet to build indexes for
+ */
+void build_password_indexes(PasswordSet* set)
+{
+    for (int i = 0; i < set->listCount; i++) {
+        PasswordList* list = set->lists[i];
 
-        // both elements of subs are not null and we're looking for sub count
-        // of two
-        if ((subs[0] != '\0') && (subs[1] != '\0') && (subCount == 2)) {
-            count++;
-        } else if ((subs[0] != '\0') && (subs[1] == '\0') && (subCount == 1)) {
-            // subs only has one valid element and we're looking for sub count
-            // of one
-            count++;
+        // Compiled dictionaries already contain their indexes
+        if (list->compiled) {
+            continue;
         }
-        free(subs);
+        list->exactIndex = create_password_index(list, false);
+        list->caseIndex = create_password_index(list, true);
+        list->trie = create_password_trie(list);
     }
-    return count;
+}
+
+/* write_dict_section()
+ * --------------------
+ * Write a section of a compiled dictionary, padded with zeros to a multiple
+ * of DICT_ALIGNMENT bytes.
+ *
+ * out: File to write to
+ * data: Section contents
+ * size: Size of data in bytes
+ */
+void write_dict_section(FILE* out, const void* data, size_t size)
+{
+    static const char padding[DICT_ALIGNMENT] = {0};
+
+    fwrite(data, 1, size, out);
+    if (size % DICT_ALIGNMENT != 0) {
+        fwrite(padding, 1, DICT_ALIGNMENT - size % DICT_ALIGNMENT, out);
+    }
+}
+
+/* compile_dict()
+ * --------------
+ * Write list, its per password metadata, indexes and trie to a compiled
+ * dictionary file which can later be given in place of the password file.
+ * Passwords are written one per line into the DICT_PASSWORDS section and
+ * every other section is a copy of the corresponding array.
+ *
+ * list: PasswordList to write (with indexes built)
+ * outName: Name of compiled dictionary file to create
+ *
+ * Returns: true if the file was written successfully, false otherwise.
+ */
+bool compile_dict(PasswordList* list, char* outName)
+{
+    FILE* out = fopen(outName, "w");
+
+    if (out == NULL) {
+        fprintf(stderr,
+                "uqentropy: unable to write to dictionary file \"%s\"\n",
+                outName);
+        return false;
+    }
+    DictHeader header;
+    size_t sizes[DICT_SECTION_COUNT];
+    const void* sections[DICT_SECTION_COUNT];
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DICT_MAGIC, DICT_MAGIC_LENGTH);
+    header.version = DICT_VERSION;
+    header.byteOrder = DICT_BYTE_ORDER;
+    header.longSize = sizeof(unsigned long);
+    header.sizeSize = sizeof(size_t);
+    header.nodeSize = sizeof(TrieNode);
+    header.passCount = list->passCount;
+    header.indexSlots = list->exactIndex->mask + 1;
+    header.trieNodes = list->trie->nodeCount;
+    dict_section_sizes(
+            header.passCount, header.indexSlots, header.trieNodes, sizes);
+
+    // Passwords are written one per line, so offsets must be recalculated
+    size_t* offsets = (size_t*)malloc(list->passCount * sizeof(size_t));
+    sizes[DICT_PASSWORDS] = 0;
+    for (int j = 0; j < list->passCount; j++) {
+        sizes[DICT_PASSWORDS] += list->lengths[j] + 1;
+    }
+    sections[DICT_OFFSETS] = offsets;
+    sections[DICT_LENGTHS] = list->lengths;
+    sections[DICT_ALPHA_COUNTS] = list->alphaCounts;
+    sections[DICT_ONE_SUB_COUNTS] = list->oneSubCounts;
+    sections[DICT_TWO_SUB_COUNTS] = list->twoSubCounts;
+    sections[DICT_CASE_GUESSES] = list->caseGuesses;
+    sections[DICT_LEET_GUESSES] = list->leetGuesses;
+    sections[DICT_CASE_PREFIX] = list->casePrefix;
+    sections[DICT_LEET_PREFIX] = list->leetPrefix;
+    sections[DICT_APPENDABLE_PREFIX] = list->appendablePrefix;
+    sections[DICT_EXACT_INDEX] = list->exactIndex->slots;
+    sections[DICT_CASE_INDEX] = list->caseIndex->slots;
+    sections[DICT_TRIE] = list->trie->nodes;
+
+    // Lay out sections one after another following the header
+    uint64_t position = sizeof(DictHeader);
+    for (int i = 0; i < DICT_SECTION_COUNT; i++) {
+        position += (DICT_ALIGNMENT - position % DICT_ALIGNMENT)
+                % DICT_ALIGNMENT;
+        header.sectionOffsets[i] = position;
+        header.sectionSizes[i] = sizes[i];
+        position += sizes[i];
+    }
+    size_t offset = header.sectionOffsets[DICT_PASSWORDS];
+    for (int j = 0; j < list->passCount; j++) {
+        offsets[j] = offset;
+        offset += list->lengths[j] + 1;
+    }
+
+    write_dict_section(out, &header, sizeof(DictHeader));
+    for (int j = 0; j < list->passCount; j++) {
+        fwrite(get_password(list, j), 1, list->lengths[j], out);
+        fputc('\n', out);
+    }
+    // Pad DICT_PASSWORDS section
+    long written = ftell(out);
+    while (written % DICT_ALIGNMENT != 0) {
+        fputc('\0', out);
+        written++;
+    }
+    for (int i = DICT_PASSWORDS + 1; i < DICT_SECTION_COUNT; i++) {
+        write_dict_section(out, sections[i], sizes[i]);
+    }
+    free(offsets);
+
+    bool success = !ferror(out);
+    if (fclose(out) != 0) {
+        success = false;
+    }
+    if (!success) {
+        fprintf(stderr,
+                "uqentropy: unable to write to dictionary file \"%s\"\n",
+                outName);
+    }
+    return success;
 }
 
 /* check_leet()
  * ------------
- * Check if password can be converted to candidate by means of
- * LeetSpeak substitution.
+ * Check if a password in list can be converted to candidate by means of
+ * LeetSpeak substitution. Guess counts are added by search_list().
  *
  * candidate: Source password given by user
- * password: Password to check if it can be converted to candidate through
- *           LeetSpeak substitution.
+ * list: PasswordList containing password to check
+ * position: Position in list of password to check if it can be converted to
+ *           candidate through LeetSpeak substitution.
  *
  * Returns: true if password can be converted to candidate by means of
  *          LeetSpeak substitution, false otherwise.
  */
-bool check_leet(Password* candidate, char* password)
+bool check_leet(Password* candidate, PasswordList* list, int position)
 {
-    int passLen = strlen(password);
-    int candLen = strlen(candidate->password);
-    int oneSub = leet_sub_count(password, 1);
-    int twoSub = leet_sub_count(password, 2);
+    const char* password = get_password(list, position);
+    int passLen = list->lengths[position];
+
     // No leet-speak substitutable characters in password so return false
-    if ((oneSub == 0) && (twoSub == 0)) {
+    if ((list->oneSubCounts[position] == 0)
+            && (list->twoSubCounts[position] == 0)) {
         return false;
     }
-    // Add 2^(oneSub)3^(twoSub) - 1 to guess count
-    candidate->guessCount += (unsigned long)pow(LEET_COUNT_FIRST_BASE, oneSub)
-                    * pow(LEET_COUNT_SECOND_BASE, twoSub)
-            - 1;
-    if (passLen != candLen) {
+    if (passLen != candidate->length) {
         // Passowrds aren't the same length, no way to match them using
         // leet speak.
         return false;
@@ -1022,117 +2420,199 @@ bool check_leet(Password* candidate, char* password)
             if (!isalpha(password[i])) {
                 return false;
             }
-            char* leetSubs = swap_char_leet(password[i]);
+            const char* leetSubs = swap_char_leet(password[i]);
 
             // Check if neither substitute matches the candidate password
             // characters
             if (!((leetSubs[0] == candidate->password[i])
                         || (leetSubs[1] == candidate->password[i]))) {
-                free(leetSubs);
                 return false;
             }
-            free(leetSubs);
         }
     }
     return true;
 }
 
-/* check_dig_append()
- * ------------------
- * Check if password can append a number of digitCount to make it the
- * same string as candidate->password.
+/* find_exact()
+ * ------------
+ * Find the first password in list which exactly matches password.
  *
- * candidate: Password to try to match
- * digitCount: Maximum number of digits to try to append to password to make
- *              it match candidate->password
- * password: Password to see appending digits to will make it match the
- *           candidate password.
+ * password: Password string to try to match
+ * len: Length of password
+ * list: PasswordList to search
  *
- * Returns: True if there exists a number with at most digitCount digits
- *          that can be appended to password to make it match the candidate
- *          password string, false otherwise.
+ * Returns: Position of the match in list, or EMPTY_SLOT if there is none.
  */
-bool check_dig_append(Password* candidate, int digitCount, char* password)
+int find_exact(const char* password, int len, PasswordList* list)
 {
-    int candLen = strlen(candidate->password);
-    if (isdigit(password[strlen(password) - 1])) {
-        return false;
+    if (list->exactIndex != NULL) {
+        return index_lookup(list->exactIndex, list, password, len);
     }
-    // Remove trailing digits from candidate
-    for (int i = 1; i <= digitCount; i++) {
-        char* candPass = candidate->password;
-
-        if (!isdigit(candPass[strlen(candPass) - 1])) {
-            // Last char isn't digit, no point continuing just add to count
-            break;
+    for (int j = 0; j < list->passCount; j++) {
+        if (passwords_equal(password, len, get_password(list, j),
+                    list->lengths[j], false)) {
+            return j;
         }
-        char* candNoDigit = strdup(candPass);
-        // Remove i number of digits from candPass
-        candNoDigit[candLen - i] = '\0';
-        // Make candNum point to the number on the end of the candidate
-        // password.
-        char* candNum = candidate->password + candLen - i;
-
-        if (alpha_count(candNum) != 0) {
-            // Ending characters are not all digits, no point checking
-            free(candNoDigit);
-            break;
+    }
+    return EMPTY_SLOT;
+}
+
+/* find_case()
+ * -----------
+ * Find the first password in list which matches candidate when ignoring case.
+ *
+ * candidate: Password to try to match
+ * list: PasswordList to search
+ *
+ * Returns: Position of the match in list, or EMPTY_SLOT if there is none.
+ */
+int find_case(Password* candidate, PasswordList* list)
+{
+    // Passwords without alphabetic characters are never case checked
+    if (alpha_count(candidate->password, candidate->length) == 0) {
+        return EMPTY_SLOT;
+    }
+    if (list->caseIndex != NULL) {
+        return index_lookup(list->caseIndex, list, candidate->password,
+                candidate->length);
+    }
+    for (int j = 0; j < list->passCount; j++) {
+        if (passwords_equal(candidate->password, candidate->length,
+                    get_password(list, j), list->lengths[j], true)) {
+            return j;
         }
-        if (strcmp(password, candNoDigit) == 0) {
-            // Add to password guess count
-            candidate->guessCount += (unsigned long)atoi(candNum) + 1;
-            int candNumLen = strlen(candNum);
-
-            for (int i = 1; i < candNumLen; i++) {
-                candidate->guessCount
-                        += (unsigned long)pow(DIG_APPEND_COUNT_BASE, i);
-            }
-            free(candNoDigit);
-            return true;
+    }
+    return EMPTY_SLOT;
+}
+
+/* find_leet()
+ * -----------
+ * Find the first password in list which can be converted to candidate by
+ * means of LeetSpeak substitution.
+ *
+ * candidate: Password to try to match
+ * list: PasswordList to search
+ *
+ * Returns: Position of the match in list, or EMPTY_SLOT if there is none.
+ */
+int find_leet(Password* candidate, PasswordList* list)
+{
+    for (int j = 0; j < list->passCount; j++) {
+        if (check_leet(candidate, list, j)) {
+            return j;
         }
-        free(candNoDigit);
     }
-    // Didn't find a match so add 10+10^2+...+10^n (n is number of digits
-    // to append)
-    for (int i = 1; i <= digitCount; i++) {
-        candidate->guessCount += (unsigned long)pow(DIG_APPEND_COUNT_BASE, i);
+    return EMPTY_SLOT;
+}
+
+/* find_dig_append()
+ * -----------------
+ * Find the first password in list which can have at most digitCount digits
+ * appended to it to match candidate. Passwords ending in a digit are never
+ * appended to, so the only possible match is the candidate with its whole
+ * trailing run of digits removed, which is looked up in the exact index.
+ *
+ * candidate: Password to try to match
+ * list: PasswordList to search
+ * digitCount: Maximum number of digits to append
+ * matchGuesses: Set to the number of guesses made on the matched password
+ *               (only set if a match is found)
+ *
+ * Returns: Position of the match in list, or EMPTY_SLOT if there is none.
+ */
+int find_dig_append(Password* candidate, PasswordList* list, int digitCount,
+        unsigned long* matchGuesses)
+{
+    int digits = candidate->trailingDigits;
+
+    if ((digits == 0) || (digits > digitCount)
+            || (digits == candidate->length)) {
+        return EMPTY_SLOT;
+    }
+    int position
+            = find_exact(candidate->password, candidate->length - digits, list);
+
+    if (position != EMPTY_SLOT) {
+        // Every number with fewer digits was tried first, followed by every
+        // smaller number with the same number of digits
+        char* number = candidate->password + candidate->length - digits;
+        *matchGuesses = strtoul(number, NULL, DIG_APPEND_COUNT_BASE) + 1
+                + dig_append_guesses(digits - 1);
     }
-    return false;
+    return position;
 }
 
-/* get_all_passwords()
- * -------------------
- * Condense all passwords within a PasswordSet into a single array.
- * Helper function for check_double_up().
+/* find_in_set()
+ * -------------
+ * Find the first password in set (treating all lists as one concatenated
+ * list) which exactly matches password.
  *
- * set: PasswordSet to condense
- * count: Pointer to variable to keep track of total number of passwords
+ * password: Password string to try to match
+ * len: Length of password
+ * set: PasswordSet to search
  *
- * Returns: Pointer to array of password strings.
+ * Returns: Position of the match across all lists in set, or EMPTY_SLOT if
+ *          there is none.
  */
-char** get_all_passwords(PasswordSet* set, int* count)
+long find_in_set(const char* password, int len, PasswordSet* set)
 {
-    char** result = (char**)malloc(sizeof(char*));
-    *count = 0;
+    long offset = 0;
 
     for (int i = 0; i < set->listCount; i++) {
-        for (int j = 0; j < set->lists[i]->passCount; j++) {
-            PasswordList* list = set->lists[i];
-            int passLen = strlen(list->passwords[j]);
-            // Add password to result array
-            result = (char**)realloc(result, ((*count) + 1) * sizeof(char*));
-            result[*count] = (char*)malloc((passLen + 1) * sizeof(char));
-            strcpy(result[*count], list->passwords[j]);
-            (*count)++;
+        int position = find_exact(password, len, set->lists[i]);
+        if (position != EMPTY_SLOT) {
+            return offset + position;
         }
+        offset += set->lists[i]->passCount;
+    }
+    return EMPTY_SLOT;
+}
+
+/* find_prefix_positions()
+ * -----------------------
+ * For each length k, find the first password in set (treating all lists as
+ * one concatenated list) which is equal to the first k characters of
+ * candidate.
+ *
+ * candidate: Password to find prefixes of
+ * set: PasswordSet to search (tries must be built)
+ * positions: Array of candidate->length + 1 elements. positions[k] is set to
+ *            the position of the first password equal to the first k
+ *            characters of candidate, or EMPTY_SLOT if there is none.
+ */
+void find_prefix_positions(
+        Password* candidate, PasswordSet* set, long* positions)
+{
+    long offset = 0;
+
+    for (int k = 0; k <= candidate->length; k++) {
+        positions[k] = EMPTY_SLOT;
+    }
+    for (int i = 0; i < set->listCount; i++) {
+        PasswordTrie* trie = set->lists[i]->trie;
+        int node = TRIE_ROOT;
+
+        for (int k = 1; k <= candidate->length; k++) {
+            node = trie_child(trie, node, candidate->password[k - 1]);
+            if (node == TRIE_NONE) {
+                break;
+            }
+            // Earlier lists take precedence so only set if not yet found
+            if ((trie->nodes[node].position != EMPTY_SLOT)
+                    && (positions[k] == EMPTY_SLOT)) {
+                positions[k] = offset + trie->nodes[node].position;
+            }
+        }
+        offset += set->lists[i]->passCount;
     }
-    return result;
 }
 
 /* check_double_up()
  * -----------------
  * Check if any combination of two passwords from set can be
- * concatenated to match candidate->password.
+ * concatenated to match candidate->password. Passwords which are prefixes of
+ * the candidate are found using each list's trie and the remainder of the
+ * candidate is then looked up in the exact indexes.
  *
  * candidate: Password to try to match
  * set: Set of passwords read from password files
@@ -1143,51 +2623,118 @@ char** get_all_passwords(PasswordSet* set, int* count)
  */
 bool check_double_up(Password* candidate, PasswordSet* set)
 {
-    int passTotal = 0;
-    char** passwords = get_all_passwords(set, &passTotal);
+    unsigned long passTotal = 0;
+    long* prefixes = (long*)malloc((candidate->length + 1) * sizeof(long));
+    long first = EMPTY_SLOT;
+    long second = EMPTY_SLOT;
 
-    for (int i = 0; i < passTotal; i++) {
-        char* candPass = strdup(candidate->password);
-        char* subString = strstr(candPass, passwords[i]);
-        // Check if substring was not present
-        if (subString == NULL) {
-            free(candPass);
-            continue;
-        }
-        char* search = NULL;
+    for (int i = 0; i < set->listCount; i++) {
+        passTotal += set->lists[i]->passCount;
+    }
+    find_prefix_positions(candidate, set, prefixes);
 
-        if (strcmp(subString, candPass) == 0) {
-            // candPass begins with passwords[i] so make
-            // search point to rest of candPass
-            search = subString + strlen(passwords[i]);
-        } else {
-            // passwords[i] must've been at start or somewhere in
-            // the middle of candPass so don't search
-            free(candPass);
+    // The whole candidate can't be the first password as the second password
+    // would then have to be empty
+    for (int k = 1; k < candidate->length; k++) {
+        if ((prefixes[k] == EMPTY_SLOT)
+                || ((first != EMPTY_SLOT) && (prefixes[k] > first))) {
             continue;
         }
-
-        for (int j = 0; j < passTotal; j++) {
-            if (strcmp(passwords[j], search) == 0) {
-                // We found the search string in passwords. To get here we
-                // would've had to check passTotal * i many combinations before
-                // getting to passwords[i]. After getting to passwords[i] we
-                // then had to check j + 1 more combinations (+1 for the one
-                // that matches).
-                candidate->guessCount
-                        += (unsigned long)i * (unsigned long)passTotal
-                        + (unsigned long)j + 1;
-                free(candPass);
-                free_string_array(passwords, passTotal);
-                return true;
-            }
+        long suffix = find_in_set(
+                candidate->password + k, candidate->length - k, set);
+        if (suffix != EMPTY_SLOT) {
+            first = prefixes[k];
+            second = suffix;
         }
-        free(candPass);
     }
-    free_string_array(passwords, passTotal);
-    // Didn't find match so and passTotal^2 to guessCount.
-    candidate->guessCount += pow(passTotal, 2);
-    return false;
+    free(prefixes);
+
+    if (first == EMPTY_SLOT) {
+        // Didn't find match so and passTotal^2 to guessCount.
+        candidate->guessCount += passTotal * passTotal;
+        return false;
+    }
+    // To get here we would've had to check passTotal * first many
+    // combinations before getting to the first password. After getting to
+    // the first password we then had to check second + 1 more combinations
+    // (+1 for the one that matches).
+    candidate->guessCount
+            += (unsigned long)first * passTotal + (unsigned long)second + 1;
+    return true;
+}
+
+/* guesses_before()
+ * ----------------
+ * Get the number of guesses made by option on the passwords in list before
+ * the given position, using the prefix sums calculated on load.
+ *
+ * list: PasswordList being searched
+ * option: SearchOption being used (not DOUBLEUP)
+ * descriptor: SearchDescriptor containing the digit append count
+ * position: Position in list (may be list->passCount for the whole list)
+ *
+ * Returns: Number of guesses made on list[0] to list[position - 1].
+ */
+unsigned long guesses_before(PasswordList* list, SearchOption option,
+        SearchDescriptor* descriptor, int position)
+{
+    switch (option) {
+    case CASE_CHECK:
+        return list->casePrefix[position];
+    case LEET:
+        return list->leetPrefix[position];
+    case DIG_APPEND:
+        return (unsigned long)list->appendablePrefix[position]
+                * descriptor->appendGuesses;
+    default:
+        return (unsigned long)position;
+    }
+}
+
+/* search_list()
+ * -------------
+ * Search list for a match to candidate using option (not DOUBLEUP), adding
+ * the number of guesses made to candidate's guess count.
+ *
+ * candidate: Password to search for a match to
+ * list: PasswordList to search
+ * option: SearchOption to use
+ * descriptor: SearchDescriptor containing the digit append count
+ *
+ * Returns: true if a match to candidate was found in list, false otherwise.
+ */
+bool search_list(Password* candidate, PasswordList* list, SearchOption option,
+        SearchDescriptor* descriptor)
+{
+    int position = EMPTY_SLOT;
+    unsigned long matchGuesses = 0;
+
+    if (option == EXACT) {
+        position = find_exact(candidate->password, candidate->length, list);
+        matchGuesses = 1;
+    } else if (option == CASE_CHECK) {
+        position = find_case(candidate, list);
+    } else if (option == LEET) {
+        position = find_leet(candidate, list);
+    } else if (option == DIG_APPEND) {
+        position = find_dig_append(
+                candidate, list, descriptor->appendCount, &matchGuesses);
+    }
+
+    if (position == EMPTY_SLOT) {
+        candidate->guessCount
+                += guesses_before(list, option, descriptor, list->passCount);
+        return false;
+    }
+    if (option == CASE_CHECK) {
+        matchGuesses = list->caseGuesses[position];
+    } else if (option == LEET) {
+        matchGuesses = list->leetGuesses[position];
+    }
+    candidate->guessCount
+            += guesses_before(list, option, descriptor, position)
+            + matchGuesses;
+    return true;
 }
 
 /* search_for_match()
@@ -1212,43 +2759,38 @@ bool search_for_match(
             if (check_double_up(candidate, set)) {
                 return true;
             }
+            continue;
         }
         for (int i = 0; i < set->listCount; i++) {
-            // loop through each password in each list in set
-            for (int j = 0; j < set->lists[i]->passCount; j++) {
-                char* password = set->lists[i]->passwords[j];
-
-                if ((option == CASE_CHECK) && (alpha_count(password) > 0)) {
-                    // Add to guess count and use strcasecmp() to do case
-                    // insensitive comparison
-                    candidate->guessCount += pow(2, alpha_count(password)) - 1;
-                    if (strcasecmp(candidate->password, password) == 0) {
-                        return true;
-                    }
-                }
-                if (option == LEET) {
-                    if (check_leet(candidate, password)) {
-                        return true;
-                    }
-                }
-                if (option == DIG_APPEND) {
-                    if (check_dig_append(
-                                candidate, descriptor->appendCount, password)) {
-                        return true;
-                    }
-                }
-                if (option == EXACT) {
-                    candidate->guessCount++;
-                    if (strcmp(candidate->password, password) == 0) {
-                        return true;
-                    }
-                }
+            if (search_list(candidate, set->lists[i], option, descriptor)) {
+                return true;
             }
         }
     }
     return false;
 }
 
+/* evaluate_password()
+ * -------------------
+ * Search for a match to candidate (if password files were given) and
+ * calculate its entropy. Only reads from set and descriptor so may be called
+ * from multiple threads at once for different candidates.
+ *
+ * candidate: Password to evaluate
+ * set: PasswordSet to search, NULL if no password files were given
+ * desc: SearchDescriptor search options to use when searching for match
+ *
+ * Returns: Entropy of candidate.
+ */
+float evaluate_password(
+        Password* candidate, PasswordSet* set, SearchDescriptor* desc)
+{
+    if ((set != NULL) && search_for_match(candidate, set, desc)) {
+        candidate->matched = true;
+    }
+    return calc_entropy(candidate);
+}
+
 /* handle_user_input()
  * -------------------
  * Handles user input password to check for match can calculate entropy.
@@ -1268,9 +2810,10 @@ bool handle_user_input(PasswordSet* set, SearchDescriptor* desc,
     if (user == NULL) {
         return false;
     }
+    float entropy = evaluate_password(user, set, desc);
+
     if (fileCount > 0) {
-        if (search_for_match(user, set, desc)) {
-            user->matched = true;
+        if (user->matched) {
             printf("Candidate password matched on guess number %lu\n",
                     user->guessCount);
         } else {
@@ -1278,7 +2821,6 @@ bool handle_user_input(PasswordSet* set, SearchDescriptor* desc,
                     user->guessCount);
         }
     }
-    float entropy = calc_entropy(user);
     if (entropy > ENTROPY_STRONG) {
         // Set strongEntered flag
         *strongEntered = true;
@@ -1290,17 +2832,143 @@ bool handle_user_input(PasswordSet* set, SearchDescriptor* desc,
     return true;
 }
 
+/* batch_worker()
+ * --------------
+ * Thread start routine for batch mode workers. Repeatedly claims the next
+ * unevaluated candidate in job and evaluates it until none remain.
+ *
+ * arg: Pointer to the BatchJob to work on
+ *
+ * Returns: NULL
+ */
+void* batch_worker(void* arg)
+{
+    BatchJob* job = (BatchJob*)arg;
+
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        int next = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        if (next >= job->count) {
+            break;
+        }
+        job->entropies[next] = evaluate_password(
+                job->candidates[next], job->set, job->descriptor);
+    }
+    return NULL;
+}
+
+/* run_batch_job()
+ * ---------------
+ * Evaluate every candidate in job using threadCount worker threads, then
+ * print the results as tab separated values in input order.
+ *
+ * job: BatchJob to evaluate
+ * threadCount: Number of worker threads to use
+ * strongEntered: Flag to set if a strong password is evaluated
+ */
+void run_batch_job(BatchJob* job, int threadCount, bool* strongEntered)
+{
+    pthread_t* threads = (pthread_t*)malloc(threadCount * sizeof(pthread_t));
+
+    job->next = 0;
+    for (int i = 0; i < threadCount; i++) {
+        pthread_create(&threads[i], NULL, batch_worker, job);
+    }
+    for (int i = 0; i < threadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    for (int i = 0; i < job->count; i++) {
+        Password* candidate = job->candidates[i];
+        float entropy = job->entropies[i];
+
+        if (entropy > ENTROPY_STRONG) {
+            *strongEntered = true;
+        }
+        printf("%s\t%s\t%lu\t%.1f\t%s\n", candidate->password,
+                candidate->matched ? "yes" : "no", candidate->guessCount,
+                entropy, password_strength(entropy));
+        free(candidate->password);
+        free(candidate);
+    }
+}
+
+/* handle_batch_input()
+ * --------------------
+ * Evaluate every candidate password in the batch input file, BATCH_CHUNK_SIZE
+ * candidates at a time, printing one tab separated line per candidate:
+ * candidate, matched (yes/no), guess number, entropy and strength rating.
+ *
+ * batch: BatchDescriptor describing input file and number of threads
+ * set: PasswordSet to use for searching (NULL if no password files)
+ * desc: SearchDescriptor search options to use when searching for match
+ * strongEntered: Flag to set if a strong password is evaluated
+ *
+ * Returns: true if the input file could be read, false otherwise.
+ */
+bool handle_batch_input(BatchDescriptor* batch, PasswordSet* set,
+        SearchDescriptor* desc, bool* strongEntered)
+{
+    FILE* input = stdin;
+
+    if (strcmp(batch->inputName, "-") != 0) {
+        input = fopen(batch->inputName, "r");
+        if (input == NULL) {
+            fprintf(stderr,
+                    "uqentropy: unable to read from candidate file \"%s\"\n",
+                    batch->inputName);
+            return false;
+        }
+    }
+    BatchJob job;
+    job.candidates = (Password**)malloc(BATCH_CHUNK_SIZE * sizeof(Password*));
+    job.entropies = (float*)malloc(BATCH_CHUNK_SIZE * sizeof(float));
+    job.set = set;
+    job.descriptor = desc;
+    pthread_mutex_init(&job.lock, NULL);
+
+    printf("candidate\tmatched\tguesses\tentropy\tstrength\n");
+    bool inputOpen = true;
+
+    while (inputOpen) {
+        job.count = 0;
+        while (job.count < BATCH_CHUNK_SIZE) {
+            Password* candidate = read_password(input);
+            if (candidate == NULL) {
+                inputOpen = false;
+                break;
+            }
+            job.candidates[job.count++] = candidate;
+        }
+        run_batch_job(&job, batch->threadCount, strongEntered);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    free(job.candidates);
+    free(job.entropies);
+    if (input != stdin) {
+        fclose(input);
+    }
+    return true;
+}
+
 int main(int argc, char** argv)
 {
     // check cmdline argument validity
     if (!verify_cmdline_args(argc, argv)) {
         fprintf(stderr, "Usage: ./uqentropy [--leet] [--casecheck] ");
-        fprintf(stderr, "[--digit-append 1..6] [--doubleup] [filename ...]\n");
+        fprintf(stderr, "[--digit-append 1..6] [--doubleup] ");
+        fprintf(stderr, "[--batch candfile [--threads N]] [filename ...]\n");
+        fprintf(stderr, "   or: ./uqentropy --compile-dict out.uqd filename\n");
         exit(EXIT_INVALID_USAGE);
     }
 
     int fileCount = cmdline_file_count(argc, argv);
     SearchDescriptor* desc = parse_options(argv, argc - fileCount);
+    BatchDescriptor* batch = parse_batch_options(argv, argc - fileCount);
     PasswordSet* set = NULL;
     bool strongEntered = false;
 
@@ -1314,8 +2982,35 @@ int main(int argc, char** argv)
         if (set == NULL) {
             free(desc->options);
             free(desc);
+            free(batch);
+            exit(EXIT_FILE_ERROR);
+        }
+        build_password_indexes(set);
+    }
+
+    // verify_cmdline_args() ensures --compile-dict can only be the first
+    // argument, followed by its value and then a single password file
+    if ((fileCount == 1) && (strcmp(argv[1], "--compile-dict") == 0)) {
+        bool written = compile_dict(set->lists[0], argv[2]);
+        free_password_set(set);
+        free(desc->options);
+        free(desc);
+        free(batch);
+        exit(written ? EXIT_SUCCESS : EXIT_FILE_ERROR);
+    }
+
+    if (batch != NULL) {
+        bool inputRead = handle_batch_input(batch, set, desc, &strongEntered);
+        if (set != NULL) {
+            free_password_set(set);
+        }
+        free(desc->options);
+        free(desc);
+        free(batch);
+        if (!inputRead) {
             exit(EXIT_FILE_ERROR);
         }
+        exit(strongEntered ? EXIT_SUCCESS : EXIT_NO_STRONG_PASSWORD);
     }
     printf("Welcome to UQEntropy\n");
     printf("Written by s4834848.\n");
@@ -0,0 +1,525 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#ifdef USE_CSSE2310A1
+#include <csse2310a1.h>
+#endif
+
+// Exit codes
+#define EXIT_INVALID_USAGE 1
+#define EXIT_FILE_ERROR 2
+#define EXIT_RUN_ERROR 3
+
+// Default benchmark parameters
+#define DEFAULT_WORDS 100000
+#define DEFAULT_CANDIDATES 20000
+#define DEFAULT_HIT_RATE 0.5
+#define DEFAULT_SEED 1
+#define DEFAULT_DIGIT_APPEND 3
+#define DEFAULT_THREADS 1
+#define DEFAULT_UQENTROPY "./uqentropy"
+
+// Range of lengths of generated dictionary words
+#define WORD_MIN_LENGTH 4
+#define WORD_MAX_LENGTH 10
+
+// Length of generated candidates which should not match anything. These
+// contain characters which generated dictionary words never do.
+#define MISS_LENGTH 12
+
+// Maximum length of a generated candidate (two words plus a number)
+#define CANDIDATE_MAX_LENGTH 32
+
+// Maximum length of generated file names
+#define PATH_MAX_LENGTH 256
+
+// Number of benchmark cases (see BenchCase)
+#define BENCH_CASE_COUNT 6
+
+// Nanoseconds per second, used when converting timespecs
+#define NANOS_PER_SECOND 1e9
+
+/*
+ * Different ways candidates can be derived from dictionary words, one for
+ * each uqentropy search option (plus EXACT, which is always searched).
+ */
+typedef enum { GEN_EXACT, GEN_CASE, GEN_LEET, GEN_DIGITS, GEN_DOUBLE } GenType;
+
+/* BenchParams
+ *
+ * Stores parameters of a benchmark run given on the command line.
+ *
+ * words: Number of words in generated dictionary
+ * candidates: Number of candidates generated for each option
+ * hitRate: Fraction of candidates derived from dictionary words
+ * seed: Seed for random number generation
+ * digitAppend: Value given to --digit-append
+ * threads: Value given to --threads
+ * uqentropy: Path of uqentropy executable to benchmark
+ */
+typedef struct {
+    int words;
+    int candidates;
+    double hitRate;
+    unsigned int seed;
+    int digitAppend;
+    int threads;
+    char* uqentropy;
+} BenchParams;
+
+/* BenchCase
+ *
+ * A single benchmark case i.e. a set of uqentropy options to measure.
+ *
+ * name: Name printed in results table
+ * option: uqentropy search option (NULL for EXACT only)
+ * gen: How to derive hit candidates from dictionary words
+ * compiled: true if the compiled (.uqd) dictionary should be used
+ */
+typedef struct {
+    const char* name;
+    const char* option;
+    GenType gen;
+    bool compiled;
+} BenchCase;
+
+/* RunResult
+ *
+ * Measurements from a single run of uqentropy.
+ *
+ * seconds: Wall clock time taken
+ * maxRss: Peak resident set size in KiB
+ */
+typedef struct {
+    double seconds;
+    long maxRss;
+} RunResult;
+
+/* next_random()
+ * -------------
+ * Generate the next number from a xorshift pseudo random number generator.
+ *
+ * state: Generator state (must be non-zero)
+ *
+ * Returns: Next pseudo random number.
+ */
+unsigned int next_random(unsigned int* state)
+{
+    unsigned int x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* random_letters()
+ * ----------------
+ * Fill word with count random lower case letters. When built with
+ * USE_CSSE2310A1 these come from get_random_letters(), otherwise from
+ * next_random().
+ *
+ * word: Buffer of at least count + 1 characters to fill
+ * count: Number of letters to generate
+ * state: Generator state
+ */
+void random_letters(char* word, int count, unsigned int* state)
+{
+#ifdef USE_CSSE2310A1
+    (void)state;
+    const char* letters = get_random_letters(count);
+
+    for (int i = 0; i < count; i++) {
+        word[i] = tolower(letters[i]);
+    }
+#else
+    for (int i = 0; i < count; i++) {
+        word[i] = 'a' + next_random(state) % ('z' - 'a' + 1);
+    }
+#endif
+    word[count] = '\0';
+}
+
+/* generate_dictionary()
+ * ---------------------
+ * Generate a dictionary of random lower case words, writing it to fileName
+ * (one word per line) and returning it.
+ *
+ * fileName: Name of file to write dictionary to
+ * params: Benchmark parameters
+ * state: Generator state
+ *
+ * Returns: Array of params->words words, or NULL if the file couldn't be
+ *          written.
+ */
+char** generate_dictionary(
+        char* fileName, BenchParams* params, unsigned int* state)
+{
+    FILE* out = fopen(fileName, "w");
+
+    if (out == NULL) {
+        return NULL;
+    }
+    char** words = (char**)malloc(params->words * sizeof(char*));
+
+    for (int i = 0; i < params->words; i++) {
+        int len = WORD_MIN_LENGTH
+                + next_random(state) % (WORD_MAX_LENGTH - WORD_MIN_LENGTH + 1);
+        words[i] = (char*)malloc(len + 1);
+        random_letters(words[i], len, state);
+        fprintf(out, "%s\n", words[i]);
+    }
+    fclose(out);
+    return words;
+}
+
+/* leet_substitute()
+ * -----------------
+ * Replace the first character of word which has a LeetSpeak substitute
+ * with its first substitute.
+ *
+ * word: Word to modify
+ */
+void leet_substitute(char* word)
+{
+    const char* from = "abegilostxz";
+    const char* to = "@63610057%2";
+
+    for (int i = 0; word[i] != '\0'; i++) {
+        const char* found = strchr(from, word[i]);
+        if (found != NULL) {
+            word[i] = to[found - from];
+            return;
+        }
+    }
+}
+
+/* generate_candidate()
+ * --------------------
+ * Generate a single candidate. With probability params->hitRate the
+ * candidate is derived from dictionary words according to gen, otherwise
+ * it is a random string which can't match anything.
+ *
+ * candidate: Buffer of at least CANDIDATE_MAX_LENGTH characters
+ * words: Dictionary words
+ * gen: How to derive candidate from dictionary words
+ * params: Benchmark parameters
+ * state: Generator state
+ */
+void generate_candidate(char* candidate, char** words, GenType gen,
+        BenchParams* params, unsigned int* state)
+{
+    double roll = (double)(next_random(state) % 1000000) / 1000000;
+
+    if (roll >= params->hitRate) {
+        // Digits and upper case letters never appear in the dictionary
+        random_letters(candidate, MISS_LENGTH, state);
+        candidate[0] = toupper(candidate[0]);
+        candidate[MISS_LENGTH / 2] = '0' + next_random(state) % 10;
+        candidate[MISS_LENGTH - 1] = 'Q';
+        return;
+    }
+    char* word = words[next_random(state) % params->words];
+
+    strcpy(candidate, word);
+    if (gen == GEN_CASE) {
+        candidate[0] = toupper(candidate[0]);
+    } else if (gen == GEN_LEET) {
+        leet_substitute(candidate);
+    } else if (gen == GEN_DIGITS) {
+        int digits = 1 + next_random(state) % params->digitAppend;
+        for (int i = 0; i < digits; i++) {
+            char digit[2] = {'0' + next_random(state) % 10, '\0'};
+            strcat(candidate, digit);
+        }
+    } else if (gen == GEN_DOUBLE) {
+        strcat(candidate, words[next_random(state) % params->words]);
+    }
+}
+
+/* generate_candidates()
+ * ---------------------
+ * Generate a file of candidates for a benchmark case.
+ *
+ * fileName: Name of file to write candidates to
+ * count: Number of candidates to write
+ * words: Dictionary words
+ * gen: How to derive candidates from dictionary words
+ * params: Benchmark parameters
+ * state: Generator state
+ *
+ * Returns: true if file was written, false otherwise.
+ */
+bool generate_candidates(char* fileName, int count, char** words, GenType gen,
+        BenchParams* params, unsigned int* state)
+{
+    FILE* out = fopen(fileName, "w");
+    char candidate[CANDIDATE_MAX_LENGTH];
+
+    if (out == NULL) {
+        return false;
+    }
+    for (int i = 0; i < count; i++) {
+        generate_candidate(candidate, words, gen, params, state);
+        fprintf(out, "%s\n", candidate);
+    }
+    fclose(out);
+    return true;
+}
+
+/* elapsed_seconds()
+ * -----------------
+ * Calculate the number of seconds between two times.
+ *
+ * start: Start time
+ * end: End time
+ *
+ * Returns: end - start in seconds.
+ */
+double elapsed_seconds(struct timespec* start, struct timespec* end)
+{
+    return (end->tv_sec - start->tv_sec)
+            + (end->tv_nsec - start->tv_nsec) / NANOS_PER_SECOND;
+}
+
+/* run_uqentropy()
+ * ---------------
+ * Run uqentropy with the given arguments, discarding its output, and
+ * measure how long it takes and its peak memory usage.
+ *
+ * path: Path of uqentropy executable
+ * args: NULL terminated argument array (args[0] is the program name)
+ * result: RunResult to store measurements in
+ *
+ * Returns: true if uqentropy ran and exited with a status other than a
+ *          usage or file error, false otherwise.
+ */
+bool run_uqentropy(char* path, char** args, RunResult* result)
+{
+    struct timespec start;
+    struct timespec end;
+    struct rusage usage;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        close(devNull);
+        execv(path, args);
+        _exit(EXIT_RUN_ERROR);
+    }
+    if ((pid == -1) || (wait4(pid, &status, 0, &usage) == -1)) {
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    result->seconds = elapsed_seconds(&start, &end);
+    result->maxRss = usage.ru_maxrss;
+
+    // uqentropy exits with 0 or 8 (no strong password) on success
+    return WIFEXITED(status)
+            && ((WEXITSTATUS(status) == 0) || (WEXITSTATUS(status) == 8));
+}
+
+/* run_case()
+ * ----------
+ * Run a benchmark case with the given candidate file and dictionary.
+ *
+ * params: Benchmark parameters
+ * bench: Benchmark case to run
+ * candFile: Name of candidate file
+ * dictFile: Name of dictionary file
+ * result: RunResult to store measurements in
+ *
+ * Returns: true if the run succeeded, false otherwise.
+ */
+bool run_case(BenchParams* params, BenchCase* bench, char* candFile,
+        char* dictFile, RunResult* result)
+{
+    char threads[CANDIDATE_MAX_LENGTH];
+    char digits[CANDIDATE_MAX_LENGTH];
+    char* args[] = {params->uqentropy, "--batch", candFile, "--threads",
+            threads, NULL, NULL, NULL, NULL};
+    int argCount = 5;
+
+    snprintf(threads, sizeof(threads), "%d", params->threads);
+    snprintf(digits, sizeof(digits), "%d", params->digitAppend);
+    if (bench->option != NULL) {
+        args[argCount++] = (char*)bench->option;
+        if (strcmp(bench->option, "--digit-append") == 0) {
+            args[argCount++] = digits;
+        }
+    }
+    args[argCount] = dictFile;
+    return run_uqentropy(params->uqentropy, args, result);
+}
+
+/* parse_params()
+ * --------------
+ * Parse command line arguments into params.
+ *
+ * argc: Number of command line arguments
+ * argv: Array of command line arguments
+ * params: BenchParams to fill in (defaults are set first)
+ *
+ * Returns: true if arguments were valid, false otherwise.
+ */
+bool parse_params(int argc, char** argv, BenchParams* params)
+{
+    params->words = DEFAULT_WORDS;
+    params->candidates = DEFAULT_CANDIDATES;
+    params->hitRate = DEFAULT_HIT_RATE;
+    params->seed = DEFAULT_SEED;
+    params->digitAppend = DEFAULT_DIGIT_APPEND;
+    params->threads = DEFAULT_THREADS;
+    params->uqentropy = DEFAULT_UQENTROPY;
+
+    for (int i = 1; i < argc; i += 2) {
+        if (i == argc - 1) {
+            return false;
+        }
+        char* value = argv[i + 1];
+        if (strcmp(argv[i], "--words") == 0) {
+            params->words = atoi(value);
+        } else if (strcmp(argv[i], "--candidates") == 0) {
+            params->candidates = atoi(value);
+        } else if (strcmp(argv[i], "--hit-rate") == 0) {
+            params->hitRate = atof(value);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            params->seed = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--digit-append") == 0) {
+            params->digitAppend = atoi(value);
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            params->threads = atoi(value);
+        } else if (strcmp(argv[i], "--uqentropy") == 0) {
+            params->uqentropy = value;
+        } else {
+            return false;
+        }
+    }
+    return (params->words > 0) && (params->candidates > 0)
+            && (params->hitRate >= 0) && (params->hitRate <= 1)
+            && (params->seed != 0) && (params->digitAppend >= 1)
+            && (params->digitAppend <= 6) && (params->threads >= 1);
+}
+
+/* benchmark()
+ * -----------
+ * Generate the dictionary and candidate files in dir, then run and report
+ * on every benchmark case.
+ *
+ * params: Benchmark parameters
+ * dir: Directory to store generated files in
+ *
+ * Returns: Exit status for the program.
+ */
+int benchmark(BenchParams* params, char* dir)
+{
+    BenchCase cases[BENCH_CASE_COUNT] = {
+            {"exact", NULL, GEN_EXACT, false},
+            {"exact (.uqd)", NULL, GEN_EXACT, true},
+            {"--casecheck", "--casecheck", GEN_CASE, false},
+            {"--leet", "--leet", GEN_LEET, false},
+            {"--digit-append", "--digit-append", GEN_DIGITS, false},
+            {"--doubleup", "--doubleup", GEN_DOUBLE, false}};
+    char dictFile[PATH_MAX_LENGTH];
+    char compiledFile[PATH_MAX_LENGTH];
+    char emptyFile[PATH_MAX_LENGTH];
+    char candFile[PATH_MAX_LENGTH];
+    unsigned int state = params->seed;
+    RunResult result;
+
+    snprintf(dictFile, sizeof(dictFile), "%s/dict.txt", dir);
+    snprintf(compiledFile, sizeof(compiledFile), "%s/dict.uqd", dir);
+    snprintf(emptyFile, sizeof(emptyFile), "%s/empty.txt", dir);
+    snprintf(candFile, sizeof(candFile), "%s/candidates.txt", dir);
+
+    char** words = generate_dictionary(dictFile, params, &state);
+    if ((words == NULL)
+            || !generate_candidates(
+                    emptyFile, 0, words, GEN_EXACT, params, &state)) {
+        fprintf(stderr, "uqentropybench: unable to write to \"%s\"\n", dir);
+        return EXIT_FILE_ERROR;
+    }
+    char* compileArgs[] = {params->uqentropy, "--compile-dict", compiledFile,
+            dictFile, NULL};
+    if (!run_uqentropy(params->uqentropy, compileArgs, &result)) {
+        fprintf(stderr, "uqentropybench: unable to run \"%s\"\n",
+                params->uqentropy);
+        return EXIT_RUN_ERROR;
+    }
+    printf("uqentropy benchmark: %d words, %d candidates, hit rate %.2f, "
+           "seed %u, %d thread(s)\n",
+            params->words, params->candidates, params->hitRate, params->seed,
+            params->threads);
+    printf("compile: %.3f s, %ld KiB peak RSS\n", result.seconds,
+            result.maxRss);
+    printf("%-16s %10s %10s %14s %14s\n", "option", "load (s)", "total (s)",
+            "candidates/s", "peak RSS (KiB)");
+
+    int status = EXIT_SUCCESS;
+    for (int i = 0; i < BENCH_CASE_COUNT; i++) {
+        BenchCase* bench = &cases[i];
+        char* dict = bench->compiled ? compiledFile : dictFile;
+        RunResult load;
+
+        generate_candidates(candFile, params->candidates, words, bench->gen,
+                params, &state);
+        // Load time is measured by evaluating no candidates at all
+        if (!run_case(params, bench, emptyFile, dict, &load)
+                || !run_case(params, bench, candFile, dict, &result)) {
+            fprintf(stderr, "uqentropybench: \"%s\" failed\n", bench->name);
+            status = EXIT_RUN_ERROR;
+            continue;
+        }
+        double searchTime = result.seconds - load.seconds;
+        double rate = (searchTime > 0) ? params->candidates / searchTime : 0;
+        printf("%-16s %10.3f %10.3f %14.0f %14ld\n", bench->name,
+                load.seconds, result.seconds, rate, result.maxRss);
+    }
+
+    for (int i = 0; i < params->words; i++) {
+        free(words[i]);
+    }
+    free(words);
+    unlink(dictFile);
+    unlink(compiledFile);
+    unlink(emptyFile);
+    unlink(candFile);
+    return status;
+}
+
+int main(int argc, char** argv)
+{
+    BenchParams params;
+
+    if (!parse_params(argc, argv, &params)) {
+        fprintf(stderr, "Usage: ./uqentropybench [--words N] ");
+        fprintf(stderr, "[--candidates N] [--hit-rate 0..1] [--seed N] ");
+        fprintf(stderr, "[--digit-append 1..6] [--threads N] ");
+        fprintf(stderr, "[--uqentropy path]\n");
+        exit(EXIT_INVALID_USAGE);
+    }
+    char dir[] = "/tmp/uqentropybench.XXXXXX";
+
+    if (mkdtemp(dir) == NULL) {
+        fprintf(stderr, "uqentropybench: unable to create temporary "
+                        "directory\n");
+        exit(EXIT_FILE_ERROR);
+    }
+    int status = benchmark(&params, dir);
+    rmdir(dir);
+    exit(status);
+}
@@ -1,3 +1,5 @@
+// Needed for splice() and vmsplice()
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,14 +11,38 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <libgen.h>
+#include <errno.h>
+#include <ctype.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+#include <bzlib.h>
+#include <lzma.h>
 
 // Macro to make a number x divisible by 4
 #define MAKE_DIV_BY_FOUR(x) ((((x) + 3) / 4) * 4)
 
-// Size of chunks of data read from pipe at a time
-#define READ_BUFF_SIZE 1024
+// Maximum number of bytes moved from a pipe to the archive at a time
+#define STREAM_BUFF_SIZE 65536
+
+// Maximum number of bytes of a parallel worker's output held in memory
+// before the rest is spilled to a temporary file
+#define SPOOL_MEMORY_CAP (1024 * 1024)
+
+// zlib settings closest to "gzip -n --best": a gzip wrapper around a 32 KiB
+// window, and a 32 KiB literal buffer as gzip uses
+#define GZIP_WINDOW_BITS (15 + 16)
+#define GZIP_MEM_LEVEL 9
+
+// bzip2 and xz presets used by the bzip2 and xz commands by default
+#define BZIP2_BLOCK_SIZE 9
+#define XZ_PRESET 6
 
 // Number of children in a pair when executing parallel decompression
 #define PARALLEL_DECOMP_PAIR_SIZE 2
@@ -24,6 +50,42 @@
 // Byte number at which record offsets begin in UQZ header
 #define OFFSET_START 8
 
+// Flag set in the method byte of the UQZ header of archives in which every
+// record's data begins with a chunk table (version 2 of the format). Archives
+// without it are in the original format.
+#define UQZ_CHUNKED 0x80
+
+// Number of bytes of input compressed independently in each chunk of a file
+// in a chunked archive
+#define CHUNK_SIZE (4 * 1024 * 1024)
+
+// Size of the fixed part (chunk size and count) of a record's chunk table
+#define CHUNK_TABLE_START 8
+
+// Flag set in the method byte of the UQZ header of archives in which every
+// record's data begins with a hash of the original file and the offset of
+// the record holding its compressed data (see RECORD_HASH_SIZE)
+#define UQZ_HASHED 0x40
+
+// Size of the hash (uint64_t) and payload offset (uint32_t) at the start of
+// each record's data in a hashed archive. A payload offset of 0 means the
+// compressed data follows, otherwise it is that of the record at the offset.
+#define RECORD_HASH_SIZE 12
+
+// Primes used by the XXH64 hash
+#define XXH_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME3 0x165667B19E3779F9ULL
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME5 0x27D4EB2F165667C5ULL
+
+// Number of bytes XXH64 consumes at a time
+#define XXH_STRIPE_SIZE 32
+
+// Number of iovecs used to write the UQZ header and a file record
+#define HEADER_IOV_COUNT 4
+#define RECORD_IOV_COUNT 6
+
 // Constant to represent that a worker is running (compressing or
 // decompressing)
 #define WORKER_RUNNING 4
@@ -37,10 +99,57 @@
 #define USAGE_ERROR 9
 #define FORMAT_ERROR 2
 #define INTERRUPT_ERROR 5
+#define MISSING_ERROR 6
+#define CHECKSUM_ERROR 7
 
 // Global variable to show that SIGINT has been caught
 bool sigIntCaught = false;
 
+/* WorkerStats
+ *
+ * Time and bytes taken by one worker (or in-process codec unit).
+ *
+ * file: Name of file worked on
+ * start: Time the worker was started (see stats_now())
+ * wall: Seconds from start until the worker finished (-1 if it hasn't)
+ * bytesIn: Number of bytes given to the worker
+ * bytesOut: Number of bytes produced by the worker
+ */
+typedef struct {
+    char* file;
+    double start;
+    double wall;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+} WorkerStats;
+
+/* RunStats
+ *
+ * Statistics gathered for --stats.
+ *
+ * enabled: True if statistics are being gathered
+ * lock: Mutex protecting workers (added to by in-process codec threads)
+ * start: Time uqzip started
+ * workers: Entry for each worker started
+ * count: Number of entries in workers
+ * capacity: Number of entries workers has room for
+ * pipeTime: Seconds the parent spent blocked moving data through pipes
+ * waitTime: Seconds the parent spent blocked waiting for workers to finish
+ */
+typedef struct {
+    bool enabled;
+    pthread_mutex_t lock;
+    double start;
+    WorkerStats* workers;
+    int count;
+    int capacity;
+    double pipeTime;
+    double waitTime;
+} RunStats;
+
+// Global statistics of this run (only gathered with --stats)
+RunStats runStats = {.enabled = false, .lock = PTHREAD_MUTEX_INITIALIZER};
+
 /* Look up table for compressed and decompression commands to use in
  * conjunction with CompMethod constants. e.g. compCommandLUT[XZ] = 'xz' etc.
  */
@@ -71,14 +180,36 @@ typedef enum { EMPTY, NOCOMP, BZIP2, GZ, XZ, ZIP, DECOMP } CompMethod;
  * method: Compression/decompression method to use.
  * parallel: True if compression is to take place with parallel processes,
  *           false for sequential processes.
+ * jobs: Maximum number of workers (or worker pairs when decompressing) to
+ *       run at once when executing in parallel.
+ * inProcess: True if files are to be compressed by threads in this process
+ *            rather than by running compression commands (where possible)
+ * chunked: True if the archive splits files into chunks which are compressed
+ *          (and can be decompressed) independently
+ * hashed: True if the archive stores a hash of each file, and identical
+ *         files share one record's compressed data
+ * stats: True if a JSON summary of the time and bytes taken by each worker
+ *        is to be printed to stderr on exit
+ * list: True if the records of the archive are to be listed rather than
+ *       extracted
+ * extract: True if only the files named by inputFiles are to be extracted
+ *          from the archive
  * outName: Output file name (default is "out.uqz")
- * inputFiles: Array of input files to be compressed (NULL if decompressing)
+ * inputFiles: Array of input files to be compressed, or names of files to
+ *             extract when extracting (NULL if decompressing or listing)
  * inputCount: Number of input files.
  * archive: Name of archive file if decompressing (NULL if compressing)
  */
 typedef struct {
     CompMethod method;
     bool parallel;
+    int jobs;
+    bool inProcess;
+    bool chunked;
+    bool hashed;
+    bool stats;
+    bool list;
+    bool extract;
     bool decompress;
     char* outName;
     char** inputFiles;
@@ -94,13 +225,30 @@ typedef struct {
  *          name of file which is being extracted when decompressing.
  * data: Raw data (bytes) of compressed file
  * size: Number of bytes in data
+ * mapped: True if data points into a mapped archive (and so isn't freed)
+ * hash: Hash of the original file (only for records of hashed archives)
  */
 typedef struct {
     char* orgFile;
     uint8_t* data;
     uint32_t size;
+    bool mapped;
+    uint64_t hash;
 } Compressed;
 
+/* ArchiveMap
+ *
+ * A .uqz archive mapped into memory for decompression. Records are read
+ * straight from the mapping rather than being copied out of the file.
+ *
+ * data: Contents of the archive
+ * size: Number of bytes in data
+ */
+typedef struct {
+    uint8_t* data;
+    size_t size;
+} ArchiveMap;
+
 /* Worker
  *
  * Stores information about a uqzip child process for either compression
@@ -110,6 +258,10 @@ typedef struct {
  * parallel: True if worker is working on a parallel job, false if sequential
  * decompress: True if worker is decompressing, false if compressing
  * workingOn: String of file which worker is working on
+ * outOffset: Offset in workingOn at which a decompression worker writes its
+ *            output, or -1 if it truncates and writes the whole file
+ * outLength: Maximum number of bytes written at outOffset (if outOffset >= 0)
+ * stat: Index of the worker's entry in runStats (-1 if it has none)
  * state: Current state of the worker. Can be either WORKER_IDLE, WORKER_RUNNING
  * or, if it has exited, the reason for exiting e.g. EXIT_OK, SIGNAL_ERROR etc.
  */
@@ -118,9 +270,303 @@ typedef struct {
     bool parallel;
     bool decompress;
     char* workingOn;
+    off_t outOffset;
+    off_t outLength;
+    int stat;
     int state;
 } Worker;
 
+/* ChunkTable
+ *
+ * Table at the start of each record's data in a chunked (UQZ_CHUNKED)
+ * archive. It is stored as the chunk size, the chunk count and then the
+ * compressed size of each chunk (all uint32_t), and is followed by the
+ * compressed chunks in order. Every chunk but the last holds chunkSize bytes
+ * of the original file.
+ *
+ * chunkSize: Number of bytes of original file in each chunk
+ * count: Number of chunks
+ * sizes: Compressed size of each chunk (points into record data, which
+ *        needn't be aligned, so read with chunk_size())
+ * length: Number of bytes taken up by the table
+ */
+typedef struct {
+    uint32_t chunkSize;
+    uint32_t count;
+    uint8_t* sizes;
+    uint32_t length;
+} ChunkTable;
+
+/* Spool
+ *
+ * Holds the output of a parallel compression worker until its record can be
+ * committed to the archive. Records are committed in input order, so output
+ * of workers which finish early is kept here (in memory up to
+ * SPOOL_MEMORY_CAP bytes and in a temporary file beyond that).
+ *
+ * readfd: Read end of pipe from worker (-1 once all output has been read)
+ * data: Output held in memory
+ * size: Number of bytes in data
+ * capacity: Number of bytes allocated for data
+ * spill: Temporary file holding output beyond data (NULL if not needed)
+ * streaming: True if output is being written straight into the worker's
+ *            record in the archive, false if it is being spooled
+ * offset: Offset of the worker's record in the archive (if streaming)
+ * total: Total number of bytes of output read from worker
+ * stat: Index of the worker's entry in runStats (-1 if it has none)
+ * pool: CodecPool of the in-process codec writing to the spool (NULL if
+ *       the output is from a worker)
+ * unit: Index of the pool's unit which the output is for
+ */
+typedef struct {
+    int readfd;
+    uint8_t* data;
+    uint32_t size;
+    uint32_t capacity;
+    FILE* spill;
+    bool streaming;
+    uint32_t offset;
+    uint32_t total;
+    int stat;
+    struct CodecPool* pool;
+    int unit;
+} Spool;
+
+/* ArchiveWriter
+ *
+ * Holds a .uqz archive open for writing for the duration of a compression.
+ * Records are always appended to the end of the archive, and the header's
+ * file record offsets are kept in memory until every record is written.
+ *
+ * fd: File descriptor of archive
+ * offsets: File record offsets (one per input file)
+ * count: Number of entries in offsets
+ * end: Current length of archive
+ * hashes: Hash of each input file, written at the start of its record's data
+ *         (NULL unless the archive is hashed)
+ */
+typedef struct {
+    int fd;
+    uint32_t* offsets;
+    uint32_t count;
+    uint32_t end;
+    uint64_t* hashes;
+} ArchiveWriter;
+
+/* Hasher
+ *
+ * State of an XXH64 hash of data given a piece at a time.
+ *
+ * acc: Accumulators, each of which consumes 8 bytes of every stripe
+ * stripe: Data not yet consumed as it doesn't make up a whole stripe
+ * stripeSize: Number of bytes in stripe
+ * total: Number of bytes hashed
+ */
+typedef struct {
+    uint64_t acc[4];
+    uint8_t stripe[XXH_STRIPE_SIZE];
+    uint32_t stripeSize;
+    uint64_t total;
+} Hasher;
+
+/* stats_now()
+ * -----------
+ * Get the current time for statistics.
+ *
+ * Returns: Seconds since an arbitrary fixed point
+ */
+double stats_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* stats_begin()
+ * -------------
+ * Add an entry to runStats for a worker which is being started.
+ *
+ * file: Name of file the worker works on
+ * bytesIn: Number of bytes to be given to the worker
+ *
+ * Returns: Index of the entry, or -1 if statistics aren't being gathered
+ */
+int stats_begin(const char* file, uint64_t bytesIn)
+{
+    if (!runStats.enabled) {
+        return -1;
+    }
+    pthread_mutex_lock(&runStats.lock);
+    if (runStats.count == runStats.capacity) {
+        runStats.capacity = runStats.capacity ? 2 * runStats.capacity : 1;
+        runStats.workers = realloc(
+                runStats.workers, runStats.capacity * sizeof(WorkerStats));
+    }
+    int stat = runStats.count++;
+    WorkerStats* entry = &runStats.workers[stat];
+    entry->file = strdup(file);
+    entry->start = stats_now();
+    entry->wall = -1;
+    entry->bytesIn = bytesIn;
+    entry->bytesOut = 0;
+    pthread_mutex_unlock(&runStats.lock);
+    return stat;
+}
+
+/* stats_finish()
+ * --------------
+ * Record that a worker has finished producing output. Only the first call
+ * for an entry counts.
+ *
+ * stat: Index of worker's entry (-1 if it has none)
+ * bytesOut: Number of bytes the worker produced
+ */
+void stats_finish(int stat, uint64_t bytesOut)
+{
+    if (stat < 0) {
+        return;
+    }
+    pthread_mutex_lock(&runStats.lock);
+    WorkerStats* entry = &runStats.workers[stat];
+    if (entry->wall < 0) {
+        entry->wall = stats_now() - entry->start;
+        entry->bytesOut = bytesOut;
+    }
+    pthread_mutex_unlock(&runStats.lock);
+}
+
+/* stats_blocked()
+ * ---------------
+ * Add the time since the parent became blocked to a total in runStats.
+ *
+ * total: Total to add to (runStats.pipeTime or runStats.waitTime)
+ * since: Time the parent became blocked (see stats_now())
+ */
+void stats_blocked(double* total, double since)
+{
+    if (runStats.enabled) {
+        *total += stats_now() - since;
+    }
+}
+
+/* file_size()
+ * -----------
+ * Get the size of a file.
+ *
+ * fileName: Name of file
+ *
+ * Returns: Number of bytes in the file, or 0 if it can't be examined
+ */
+uint64_t file_size(const char* fileName)
+{
+    struct stat info;
+    return (stat(fileName, &info) == 0) ? (uint64_t)info.st_size : 0;
+}
+
+/* print_json_string()
+ * -------------------
+ * Print a string as a JSON string literal.
+ *
+ * out: Stream to print to
+ * string: String to print
+ */
+void print_json_string(FILE* out, const char* string)
+{
+    fputc('"', out);
+    for (const unsigned char* c = (const unsigned char*)string; *c; c++) {
+        if ((*c == '"') || (*c == '\\')) {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < ' ') {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* print_ratio()
+ * -------------
+ * Print a compression ratio (compressed size over original size) as JSON.
+ *
+ * out: Stream to print to
+ * compressed: Number of bytes of compressed data
+ * original: Number of bytes of original data
+ */
+void print_ratio(FILE* out, uint64_t compressed, uint64_t original)
+{
+    if (original) {
+        fprintf(out, "%.6f", (double)compressed / original);
+    } else {
+        fprintf(out, "null");
+    }
+}
+
+/* print_stats()
+ * -------------
+ * Print the statistics gathered for --stats to stderr as a JSON object and
+ * release them.
+ *
+ * param: Parameters passed through command line
+ * status: Exit status of uqzip
+ */
+void print_stats(Parameters* param, int status)
+{
+    double wall = stats_now() - runStats.start;
+    uint64_t totalIn = 0, totalOut = 0;
+
+    fprintf(stderr, "{\"mode\": \"%s\", \"method\": ",
+            param->decompress ? "decompress" : "compress");
+    if ((param->method >= NOCOMP) && (param->method <= ZIP)) {
+        print_json_string(stderr, compCommandLUT[param->method]);
+    } else {
+        fprintf(stderr, "null");
+    }
+    fprintf(stderr, ", \"parallel\": %s, \"jobs\": %d, \"status\": %d, "
+                    "\"wallSeconds\": %.6f, \"workers\": [",
+            param->parallel ? "true" : "false",
+            param->parallel ? param->jobs : 1, status, wall);
+    for (int i = 0; i < runStats.count; i++) {
+        WorkerStats* entry = &runStats.workers[i];
+        // a decompression worker's output is the original data
+        uint64_t compressed
+                = param->decompress ? entry->bytesIn : entry->bytesOut;
+        uint64_t original
+                = param->decompress ? entry->bytesOut : entry->bytesIn;
+
+        fprintf(stderr, "%s\n  {\"file\": ", i ? "," : "");
+        print_json_string(stderr, entry->file);
+        fprintf(stderr, ", \"wallSeconds\": ");
+        if (entry->wall < 0) {
+            fprintf(stderr, "null");
+        } else {
+            fprintf(stderr, "%.6f", entry->wall);
+        }
+        fprintf(stderr,
+                ", \"bytesIn\": %" PRIu64 ", \"bytesOut\": %" PRIu64
+                ", \"ratio\": ",
+                entry->bytesIn, entry->bytesOut);
+        print_ratio(stderr, compressed, original);
+        fprintf(stderr, "}");
+        totalIn += entry->bytesIn;
+        totalOut += entry->bytesOut;
+        free(entry->file);
+    }
+    fprintf(stderr,
+            "], \"parentPipeSeconds\": %.6f, \"parentWaitSeconds\": %.6f, "
+            "\"bytesIn\": %" PRIu64 ", \"bytesOut\": %" PRIu64
+            ", \"ratio\": ",
+            runStats.pipeTime, runStats.waitTime, totalIn, totalOut);
+    print_ratio(stderr, param->decompress ? totalIn : totalOut,
+            param->decompress ? totalOut : totalIn);
+    fprintf(stderr, ", \"bytesInPerSecond\": %.1f, "
+                    "\"bytesOutPerSecond\": %.1f}\n",
+            wall > 0 ? totalIn / wall : 0, wall > 0 ? totalOut / wall : 0);
+    free(runStats.workers);
+    runStats.workers = NULL;
+    runStats.count = runStats.capacity = 0;
+}
+
 /* free_parameters()
  * -----------------
  * Free a Parameters struct.
@@ -153,7 +599,7 @@ void free_compressed(Compressed* comp)
     if (comp->orgFile) {
         free(comp->orgFile);
     }
-    if (comp->data) {
+    if (comp->data && !comp->mapped) {
         free(comp->data);
     }
     free(comp);
@@ -191,8 +637,7 @@ void free_workers(Worker** workers, int size)
 /* free_worker_pairs()
  * -------------------
  * Free memory allocated to an array of worker pairs. Note this is used only
- * in decompress_parallel() and assumes workers has been statically allocated
- * and thus only the pointers within workers need to be freed via free_worker()
+ * in decompress_parallel().
  *
  * workers: Array of pointers to worker pairs
  * active: Number of pointers with workers which point to active (initialised)
@@ -204,6 +649,7 @@ void free_worker_pairs(Worker* (*workers)[2], int active)
         free_worker(workers[i][0]);
         free_worker(workers[i][1]);
     }
+    free(workers);
 }
 
 /* get_path()
@@ -277,6 +723,30 @@ bool get_method(char* arg, Parameters* param)
     return true;
 }
 
+/* parse_jobs()
+ * ------------
+ * Parse the value given with the --jobs option into param.
+ *
+ * arg: Argument following --jobs (NULL if there wasn't one)
+ * param: Parameters struct to set jobs of
+ *
+ * Returns: True if arg is a positive integer and jobs hadn't already been
+ *          given, false otherwise.
+ */
+bool parse_jobs(char* arg, Parameters* param)
+{
+    if ((arg == NULL) || (!arg[0]) || (param->jobs)) {
+        return false;
+    }
+    for (int i = 0; arg[i]; i++) {
+        if (!isdigit(arg[i])) {
+            return false;
+        }
+    }
+    param->jobs = atoi(arg);
+    return param->jobs > 0;
+}
+
 /* parse_option()
  * --------------
  * Parse an option argument into param.
@@ -299,9 +769,30 @@ bool parse_option(Parameters* param, int argc, char** argv, int* index)
         (*index)++;
     } else if ((!strcmp(argv[*index], "--parallel")) && (!param->parallel)) {
         param->parallel = true;
-    } else if (!strcmp(argv[*index], "--decompress")) {
+    } else if (!strcmp(argv[*index], "--jobs")) {
+        char* value = (*index == argc - 1) ? NULL : argv[*index + 1];
+        if (!parse_jobs(value, param)) {
+            return false; // missing, invalid or repeated job count
+        }
+        (*index)++;
+    } else if ((!strcmp(argv[*index], "--inprocess")) && (!param->inProcess)) {
+        param->inProcess = true;
+    } else if ((!strcmp(argv[*index], "--chunked")) && (!param->chunked)) {
+        param->chunked = true;
+    } else if ((!strcmp(argv[*index], "--dedup")) && (!param->hashed)) {
+        param->hashed = true;
+    } else if ((!strcmp(argv[*index], "--stats")) && (!param->stats)) {
+        param->stats = true;
+    } else if ((!strcmp(argv[*index], "--decompress"))
+            && (!param->list) && (!param->extract)) {
         param->decompress = true;
         param->method = DECOMP;
+    } else if ((!strcmp(argv[*index], "--list")) && (!param->decompress)) {
+        param->list = param->decompress = true;
+        param->method = DECOMP;
+    } else if ((!strcmp(argv[*index], "--extract")) && (!param->decompress)) {
+        param->extract = param->decompress = true;
+        param->method = DECOMP;
     } else if (!get_method(argv[*index], param)) {
         return false; // unknown or repeated option
     }
@@ -335,15 +826,14 @@ Parameters* process_cmdline_args(int argc, char** argv)
             }
         } else {
             // wasn't an option
-            if (param->method == DECOMP) {
-                if (param->archive != NULL) {
-                    free_parameters(param);
-                    return NULL; // multiple archive names given
-                }
+            if ((param->method == DECOMP) && (param->archive == NULL)) {
                 param->archive = strdup(argv[i]);
+            } else if ((param->method == DECOMP) && !param->extract) {
+                free_parameters(param);
+                return NULL; // multiple archive names given
             } else {
-                // argv[i] wasn't an option and we aren't decompressing so
-                // must be a filename so add to param->inputFiles
+                // argv[i] wasn't an option and isn't the archive so must be
+                // a file to compress or extract so add to param->inputFiles
                 int count = param->inputCount;
                 param->inputFiles = realloc(
                         param->inputFiles, (count + 1) * sizeof(char**));
@@ -354,12 +844,31 @@ Parameters* process_cmdline_args(int argc, char** argv)
     }
     if (((param->method == DECOMP)
                 && ((param->outName != NULL) || (param->archive == NULL)))
-            || ((param->method != DECOMP) && (param->inputCount == 0))) {
+            || ((param->method != DECOMP) && (param->inputCount == 0))
+            || (param->extract && (param->inputCount == 0))
+            || (param->list && param->parallel)
+            || (param->jobs && !param->parallel)
+            || ((param->method == DECOMP)
+                    && (param->inProcess || param->chunked || param->hashed))
+            || ((param->method == ZIP) && param->chunked)) {
         // Either --decompress was given with no archive name or with an output
-        // name OR no input file(s) were given for a compression
+        // name OR no input file(s) were given for a compression or an
+        // extraction OR --list was given with --parallel OR --jobs was
+        // given without --parallel OR --inprocess, --chunked or --dedup was
+        // given when decompressing OR --chunked was given with --zip (which
+        // can't be concatenated)
         free_parameters(param);
         return NULL;
     }
+    // chunks are compressed by in-process codecs
+    if (param->chunked) {
+        param->inProcess = true;
+    }
+    // no job count was given so run one worker per online processor
+    if (param->jobs == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        param->jobs = (cores > 0) ? cores : 1;
+    }
     // no decompression/compression option was given so set to default (NOCOMP)
     if (param->method == EMPTY) {
         param->method = NOCOMP;
@@ -367,44 +876,257 @@ Parameters* process_cmdline_args(int argc, char** argv)
     return param;
 }
 
-/* write_header_section()
+/* xxh_rotl()
+ * ----------
+ * Rotate a 64 bit value left.
+ *
+ * value: Value to rotate
+ * bits: Number of bits to rotate by (1 to 63)
+ *
+ * Returns: Rotated value
+ */
+uint64_t xxh_rotl(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+/* xxh_round()
+ * -----------
+ * Mix 8 bytes of input into an XXH64 accumulator.
+ *
+ * acc: Accumulator
+ * input: Input to mix in
+ *
+ * Returns: New value of accumulator
+ */
+uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME2;
+    return xxh_rotl(acc, 31) * XXH_PRIME1;
+}
+
+/* xxh_merge()
+ * -----------
+ * Merge an XXH64 accumulator into the final hash.
+ *
+ * hash: Hash so far
+ * acc: Accumulator to merge in
+ *
+ * Returns: New hash
+ */
+uint64_t xxh_merge(uint64_t hash, uint64_t acc)
+{
+    hash ^= xxh_round(0, acc);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/* init_hasher()
+ * -------------
+ * Start an XXH64 hash (with a seed of 0).
+ *
+ * hasher: Hasher to initialise
+ */
+void init_hasher(Hasher* hasher)
+{
+    memset(hasher, 0, sizeof(Hasher));
+    hasher->acc[0] = XXH_PRIME1 + XXH_PRIME2;
+    hasher->acc[1] = XXH_PRIME2;
+    hasher->acc[3] = -XXH_PRIME1;
+}
+
+/* consume_stripe()
+ * ----------------
+ * Mix a whole stripe of input into the accumulators of a hash.
+ *
+ * hasher: Hasher to mix stripe into
+ * stripe: XXH_STRIPE_SIZE bytes of input
+ */
+void consume_stripe(Hasher* hasher, const uint8_t* stripe)
+{
+    for (int i = 0; i < 4; i++) {
+        uint64_t lane;
+        memcpy(&lane, stripe + i * sizeof(uint64_t), sizeof(uint64_t));
+        hasher->acc[i] = xxh_round(hasher->acc[i], lane);
+    }
+}
+
+/* update_hasher()
+ * ---------------
+ * Add data to a hash.
+ *
+ * hasher: Hasher to add data to
+ * data: Data to add
+ * size: Number of bytes in data
+ */
+void update_hasher(Hasher* hasher, const uint8_t* data, size_t size)
+{
+    hasher->total += size;
+    if (hasher->stripeSize + size < XXH_STRIPE_SIZE) {
+        memcpy(hasher->stripe + hasher->stripeSize, data, size);
+        hasher->stripeSize += size;
+        return;
+    }
+    if (hasher->stripeSize) {
+        // complete the partial stripe held from last time
+        uint32_t fill = XXH_STRIPE_SIZE - hasher->stripeSize;
+        memcpy(hasher->stripe + hasher->stripeSize, data, fill);
+        consume_stripe(hasher, hasher->stripe);
+        data += fill;
+        size -= fill;
+    }
+    while (size >= XXH_STRIPE_SIZE) {
+        consume_stripe(hasher, data);
+        data += XXH_STRIPE_SIZE;
+        size -= XXH_STRIPE_SIZE;
+    }
+    memcpy(hasher->stripe, data, size);
+    hasher->stripeSize = size;
+}
+
+/* finish_hasher()
+ * ---------------
+ * Get the XXH64 hash of all data added to a hash.
+ *
+ * hasher: Hasher to finish
+ *
+ * Returns: The hash
+ */
+uint64_t finish_hasher(Hasher* hasher)
+{
+    uint64_t* acc = hasher->acc;
+    uint64_t hash = XXH_PRIME5;
+    uint32_t i = 0;
+
+    if (hasher->total >= XXH_STRIPE_SIZE) {
+        hash = xxh_rotl(acc[0], 1) + xxh_rotl(acc[1], 7)
+                + xxh_rotl(acc[2], 12) + xxh_rotl(acc[3], 18);
+        for (int j = 0; j < 4; j++) {
+            hash = xxh_merge(hash, acc[j]);
+        }
+    }
+    hash += hasher->total;
+    for (; i + sizeof(uint64_t) <= hasher->stripeSize; i += sizeof(uint64_t)) {
+        uint64_t lane;
+        memcpy(&lane, hasher->stripe + i, sizeof(uint64_t));
+        hash ^= xxh_round(0, lane);
+        hash = xxh_rotl(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (i + sizeof(uint32_t) <= hasher->stripeSize) {
+        uint32_t lane;
+        memcpy(&lane, hasher->stripe + i, sizeof(uint32_t));
+        hash ^= lane * XXH_PRIME1;
+        hash = xxh_rotl(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        i += sizeof(uint32_t);
+    }
+    for (; i < hasher->stripeSize; i++) {
+        hash ^= hasher->stripe[i] * XXH_PRIME5;
+        hash = xxh_rotl(hash, 11) * XXH_PRIME1;
+    }
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    return hash ^ (hash >> 32);
+}
+
+/* hash_file()
+ * -----------
+ * Find the XXH64 hash of the contents of a file.
+ *
+ * fileName: Name of file to hash
+ * hash: Set to the hash of the file
+ *
+ * Returns: true if the file was read, false if it couldn't be
+ */
+bool hash_file(const char* fileName, uint64_t* hash)
+{
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return false;
+    }
+    uint8_t* buffer = malloc(STREAM_BUFF_SIZE);
+    Hasher hasher;
+    ssize_t got;
+    init_hasher(&hasher);
+
+    while ((got = read(fd, buffer, STREAM_BUFF_SIZE)) > 0) {
+        update_hasher(&hasher, buffer, got);
+    }
+    *hash = finish_hasher(&hasher);
+    free(buffer);
+    close(fd);
+    return got == 0;
+}
+
+/* open_archive_writer()
  * ----------------------
- * Write the header section of a .uqz archive output.
+ * Create the output archive and write its header section, with every file
+ * record offset initially 0.
  *
  * param: Parameters struct containing relevant data from command line
  *        arguments.
  *
- * Returns: True if header section was successfully written to output archive,
- *          false if output archive could not be opened for writing.
+ * Returns: ArchiveWriter for the archive, or NULL if the output archive could
+ *          not be opened for writing.
  */
-bool write_header_section(Parameters* param)
+ArchiveWriter* open_archive_writer(Parameters* param)
 {
     // no output filename given so set to "out.uqz"
     if (param->outName == NULL) {
         param->outName = strdup("out.uqz");
     }
     // attempt to open output archive for reading and writing
-    int outfd = open(param->outName, O_RDWR | O_TRUNC | O_CREAT,
+    int outfd = open(param->outName, O_RDWR | O_TRUNC | O_CREAT | O_CLOEXEC,
             S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 
     if (outfd == -1) {
         fprintf(stderr, "uqzip: unable to open file \"%s\" for writing\n",
                 param->outName);
-        return false;
+        return NULL;
     }
-    uint32_t* placeHolders = malloc(sizeof(uint32_t) * param->inputCount);
-    memset(placeHolders, 0, sizeof(uint32_t) * param->inputCount);
-    char* uqz = "UQZ";
+    ArchiveWriter* writer = malloc(sizeof(ArchiveWriter));
+    writer->fd = outfd;
+    writer->count = param->inputCount;
+    writer->offsets = calloc(writer->count, sizeof(uint32_t));
+    writer->hashes = NULL;
+    uint8_t method = param->method | (param->chunked ? UQZ_CHUNKED : 0)
+            | (param->hashed ? UQZ_HASHED : 0);
 
     // write out header data in order of appearance e.g. "UQZ" tag first, then
     // method etc
-    write(outfd, uqz, strlen(uqz));
-    write(outfd, &param->method, 1);
-    write(outfd, &param->inputCount, sizeof(uint32_t));
-    write(outfd, placeHolders, sizeof(uint32_t) * param->inputCount);
-    free(placeHolders);
-    close(outfd);
-    return true;
+    struct iovec header[HEADER_IOV_COUNT] = {{"UQZ", strlen("UQZ")},
+            {&method, sizeof(uint8_t)}, {&writer->count, sizeof(uint32_t)},
+            {writer->offsets, sizeof(uint32_t) * writer->count}};
+    writer->end = writev(outfd, header, HEADER_IOV_COUNT);
+    return writer;
+}
+
+/* write_record_offsets()
+ * ----------------------
+ * Fill in the file record offsets of the archive's header section once all
+ * records have been written.
+ *
+ * writer: ArchiveWriter for archive
+ */
+void write_record_offsets(ArchiveWriter* writer)
+{
+    pwrite(writer->fd, writer->offsets, sizeof(uint32_t) * writer->count,
+            OFFSET_START);
+}
+
+/* free_archive_writer()
+ * ---------------------
+ * Close the archive and free an ArchiveWriter.
+ *
+ * writer: ArchiveWriter to free
+ */
+void free_archive_writer(ArchiveWriter* writer)
+{
+    close(writer->fd);
+    free(writer->offsets);
+    free(writer->hashes);
+    free(writer);
 }
 
 /* init_worker()
@@ -423,6 +1145,9 @@ Worker* init_worker(Parameters* param, char* workOn)
     work->pid = -1;
     work->parallel = param->parallel;
     work->workingOn = strdup(workOn);
+    work->outOffset = -1;
+    work->outLength = 0;
+    work->stat = -1;
     work->decompress = param->decompress;
     work->state = WORKER_RUNNING;
     return work;
@@ -485,124 +1210,387 @@ int exec_worker(Worker* work, CompMethod method)
     return -1;
 }
 
-/* empty_pipe()
- * ------------
- * Read all data from a given pipe used for relaying compressed file data.
+/* stream_pipe()
+ * -------------
+ * Copy all data from a pipe into a file at the file's current offset without
+ * buffering it in memory. splice() is used to move the data inside the kernel
+ * and read()/write() with a fixed size buffer is used if the file doesn't
+ * support it.
  *
- * readfd: Reading file descriptor for pipe.
+ * readfd: Reading file descriptor for pipe
+ * outfd: File descriptor to copy data to
  *
- * Returns: Pointer to Compressed struct which contains compressed file data.
+ * Returns: Number of bytes copied
  */
-Compressed* empty_pipe(int readfd)
+uint32_t stream_pipe(int readfd, int outfd)
 {
-    Compressed* result = calloc(1, sizeof(Compressed));
-    uint8_t* data = malloc(sizeof(uint8_t));
-    uint8_t buffer[READ_BUFF_SIZE];
-    int actualSize;
-    uint32_t totalRead = 0;
-
-    // Continously read at most READ_BUFF_SIZE from the pipe into a buffer
-    // and add to data array
-    while ((actualSize = read(readfd, buffer, READ_BUFF_SIZE)) > 0) {
-        data = realloc(data, (totalRead + actualSize) * sizeof(uint8_t));
-        memcpy(data + totalRead, buffer, actualSize);
-        totalRead += actualSize;
-    }
-    result->data = data;
-    result->size = totalRead;
-    return result;
+    uint32_t total = 0;
+    ssize_t moved;
+
+    while ((moved = splice(readfd, NULL, outfd, NULL, STREAM_BUFF_SIZE,
+                    SPLICE_F_MOVE | SPLICE_F_MORE))
+            > 0) {
+        total += moved;
+    }
+    if ((moved == -1) && (errno == EINVAL)) {
+        // splice() not supported for this file so copy through a buffer
+        uint8_t* buffer = malloc(STREAM_BUFF_SIZE);
+        while ((moved = read(readfd, buffer, STREAM_BUFF_SIZE)) > 0) {
+            write(outfd, buffer, moved);
+            total += moved;
+        }
+        free(buffer);
+    }
+    return total;
 }
 
-/* enter_record()
+/* pack_record_hash()
+ * ------------------
+ * Fill in the hash and payload offset which begin a record's data in a
+ * hashed archive.
+ *
+ * out: Buffer of RECORD_HASH_SIZE bytes
+ * hash: Hash of the original file
+ * payloadOffset: Offset of the record holding the compressed data, or 0 if
+ *                it follows
+ */
+void pack_record_hash(uint8_t* out, uint64_t hash, uint32_t payloadOffset)
+{
+    memcpy(out, &hash, sizeof(uint64_t));
+    memcpy(out + sizeof(uint64_t), &payloadOffset, sizeof(uint32_t));
+}
+
+/* write_record()
  * --------------
- * Enter a file record for a given Compressed item.
+ * Append a complete file record to the archive with a single writev(). In a
+ * hashed archive the record's data begins with the file's hash.
  *
- * comp: Compressed item to write record for.
- * param: Command line parameters:
+ * writer: ArchiveWriter for archive
+ * param: Command line parameters
  * inIndex: Index of param->inputFiles[] at which the file we wish to enter
  *        a record for is located.
+ * data: Compressed data of file
+ * dataSize: Number of bytes in data
  */
-void enter_record(Compressed* comp, Parameters* param, int inIndex)
+void write_record(ArchiveWriter* writer, Parameters* param, int inIndex,
+        uint8_t* data, uint32_t dataSize)
 {
-    // Use fd instead of FILE* so that we can use lseek to get file length
-    int outfd = open(param->outName, O_RDWR, 0);
-    uint32_t fileLen = lseek(outfd, 0, SEEK_END);
     char* baseFile = get_path(param->inputFiles[inIndex]);
     uint8_t inLength = strlen(baseFile);
+    uint8_t hash[RECORD_HASH_SIZE];
+    uint32_t hashSize = writer->hashes ? RECORD_HASH_SIZE : 0;
+    uint32_t fieldSize = hashSize + dataSize;
+    uint32_t recordSize
+            = sizeof(fieldSize) + sizeof(inLength) + inLength + fieldSize;
+    uint8_t padding[sizeof(uint32_t)] = {0};
+    struct iovec record[RECORD_IOV_COUNT] = {{&fieldSize, sizeof(uint32_t)},
+            {&inLength, sizeof(uint8_t)}, {baseFile, inLength},
+            {hash, hashSize}, {data, dataSize},
+            {padding, MAKE_DIV_BY_FOUR(recordSize) - recordSize}};
+
+    if (writer->hashes) {
+        pack_record_hash(hash, writer->hashes[inIndex], 0);
+    }
+
     // Offset of the new file is just the current file length before we add
     // the new file
-    uint32_t offset = fileLen;
-    uint32_t recordSize
-            = sizeof(comp->size) + sizeof(inLength) + inLength + comp->size;
-    int padCount = MAKE_DIV_BY_FOUR(recordSize) - recordSize;
-    uint8_t nullByte = 0;
-    // Enter file record data fields
-    write(outfd, &(comp->size), sizeof(uint32_t));
-    write(outfd, &inLength, sizeof(uint8_t));
-    write(outfd, baseFile, inLength);
-    write(outfd, comp->data, comp->size);
-
-    for (int i = 0; i < padCount; i++) {
-        write(outfd, &nullByte, sizeof(uint8_t)); // Add padding
-    }
-    // Fix offsets in header
-    lseek(outfd, OFFSET_START + sizeof(uint32_t) * inIndex, SEEK_SET);
-    write(outfd, &offset, sizeof(uint32_t));
+    writer->offsets[inIndex] = writer->end;
+    writer->end += writev(writer->fd, record, RECORD_IOV_COUNT);
     free(baseFile);
-    close(outfd);
 }
 
-/* read_record()
- * -------------
- * Read a file record from an archive file.
+/* begin_record()
+ * --------------
+ * Begin a file record at the end of an archive whose data size isn't known
+ * yet. The size field of the record is reserved and filled in by
+ * end_record() once the data has been written after the record's name (and
+ * hash, in a hashed archive).
  *
- * archive: Archive file to read record
- * header: Header of archive file
- * fileIndex: File number in archive file to read record of
+ * writer: ArchiveWriter for archive
+ * param: Command line parameters
+ * inIndex: Index of param->inputFiles[] at which the file we wish to enter
+ *        a record for is located.
  *
- * Returns: Pointer to Compressed type containing file record information
+ * Returns: Offset of the new record in the archive
  */
-Compressed* read_record(FILE* archive, UqzHeaderSection* header, int fileIndex)
+uint32_t begin_record(ArchiveWriter* writer, Parameters* param, int inIndex)
 {
-    Compressed* result = calloc(1, sizeof(Compressed));
-    uint32_t offset = header->fileRecordOffsets[fileIndex];
-    uint32_t dataSize;
-    uint8_t nameLen;
-
-    fseek(archive, offset, SEEK_SET);
-    if ((fread(&dataSize, sizeof(uint32_t), 1, archive) != 1)
-            || (fread(&nameLen, sizeof(uint8_t), 1, archive) != 1)) {
-        // We either didn't read a 4 byte data size field or didn't read
-        // a 1 byte name length field.
-        free_compressed(result);
-        return NULL;
-    }
-
-    result->orgFile = malloc((nameLen + 1) * sizeof(char));
-    if (fread(result->orgFile, sizeof(char), nameLen, archive) != nameLen) {
-        // Didn't read nameLen number of bytes from name field of file record
-        free_compressed(result);
-        return NULL;
-    }
-    result->orgFile[nameLen] = '\0'; // add terminator
-    result->data = malloc(dataSize * sizeof(uint8_t));
-    result->size = dataSize;
-
-    if (fread(result->data, sizeof(uint8_t), dataSize, archive) != dataSize) {
-        // Didn't read dataSize number of bytes from data field of file record
-        free_compressed(result);
-        return NULL;
+    char* baseFile = get_path(param->inputFiles[inIndex]);
+    uint8_t inLength = strlen(baseFile);
+    uint32_t dataSize = 0;
+    uint32_t offset = writer->end;
+    uint8_t hash[RECORD_HASH_SIZE];
+    struct iovec fields[] = {{&dataSize, sizeof(uint32_t)},
+            {&inLength, sizeof(uint8_t)}, {baseFile, inLength},
+            {hash, writer->hashes ? RECORD_HASH_SIZE : 0}};
+
+    if (writer->hashes) {
+        pack_record_hash(hash, writer->hashes[inIndex], 0);
     }
-    return result;
+    writer->offsets[inIndex] = offset;
+    writer->end += writev(writer->fd, fields, sizeof(fields) / sizeof(*fields));
+    free(baseFile);
+    return offset;
 }
 
-/* suppress_output()
- * -----------------
- * Suppress the output of a process such as stdout or stderr.
+/* end_record()
+ * ------------
+ * Finish a file record started by begin_record() by padding it and filling
+ * in its size field. The data must have been written directly to the
+ * archive's file descriptor after begin_record() was called.
  *
- * suppressfd: File descriptor of output to suppress
+ * writer: ArchiveWriter for archive
+ * offset: Offset of the record (as returned by begin_record())
+ * dataSize: Number of bytes of data written to the record
  */
-void suppress_output(int suppressfd)
+void end_record(ArchiveWriter* writer, uint32_t offset, uint32_t dataSize)
+{
+    uint8_t padding[sizeof(uint32_t)] = {0};
+    uint32_t fieldSize = dataSize + (writer->hashes ? RECORD_HASH_SIZE : 0);
+    writer->end += dataSize;
+    uint32_t recordSize = writer->end - offset;
+
+    writer->end += write(writer->fd, padding,
+            MAKE_DIV_BY_FOUR(recordSize) - recordSize);
+    pwrite(writer->fd, &fieldSize, sizeof(uint32_t), offset);
+}
+
+/* write_alias_record()
+ * --------------------
+ * Append a record to a hashed archive for a file identical to one already
+ * in the archive. The record holds no compressed data, but the offset of the
+ * record whose data it shares.
+ *
+ * writer: ArchiveWriter for archive
+ * param: Command line parameters
+ * inIndex: Index of param->inputFiles[] of the file
+ * hash: Hash of the file
+ * payloadOffset: Offset of the record holding the file's compressed data
+ *
+ * Returns: Offset of the new record in the archive
+ */
+uint32_t write_alias_record(ArchiveWriter* writer, Parameters* param,
+        int inIndex, uint64_t hash, uint32_t payloadOffset)
+{
+    char* baseFile = get_path(param->inputFiles[inIndex]);
+    uint8_t inLength = strlen(baseFile);
+    uint8_t fields[RECORD_HASH_SIZE];
+    uint32_t fieldSize = RECORD_HASH_SIZE;
+    uint32_t recordSize
+            = sizeof(fieldSize) + sizeof(inLength) + inLength + fieldSize;
+    uint8_t padding[sizeof(uint32_t)] = {0};
+    struct iovec record[] = {{&fieldSize, sizeof(uint32_t)},
+            {&inLength, sizeof(uint8_t)}, {baseFile, inLength},
+            {fields, fieldSize},
+            {padding, MAKE_DIV_BY_FOUR(recordSize) - recordSize}};
+    uint32_t offset = writer->end;
+
+    pack_record_hash(fields, hash, payloadOffset);
+    writer->end += writev(writer->fd, record, sizeof(record) / sizeof(*record));
+    free(baseFile);
+    return offset;
+}
+
+/* read_fully()
+ * ------------
+ * Read from a file descriptor until a buffer is full or end of file.
+ *
+ * readfd: File descriptor to read from
+ * buffer: Buffer to read into
+ * size: Number of bytes in buffer
+ *
+ * Returns: Number of bytes read
+ */
+uint32_t read_fully(int readfd, uint8_t* buffer, uint32_t size)
+{
+    uint32_t total = 0;
+    ssize_t got;
+
+    while ((total < size)
+            && ((got = read(readfd, buffer + total, size - total)) > 0)) {
+        total += got;
+    }
+    return total;
+}
+
+/* enter_record()
+ * --------------
+ * Enter a file record for the compressed data which a worker is sending
+ * over a pipe. Output which fits in STREAM_BUFF_SIZE bytes is written as a
+ * single record, larger output is streamed directly into the archive and the
+ * size field of the record is filled in once all data has been read.
+ *
+ * readfd: Reading file descriptor for pipe carrying compressed data
+ * writer: ArchiveWriter for archive
+ * param: Command line parameters:
+ * inIndex: Index of param->inputFiles[] at which the file we wish to enter
+ *        a record for is located.
+ *
+ * Returns: Number of bytes of compressed data read from the pipe
+ */
+uint32_t enter_record(
+        int readfd, ArchiveWriter* writer, Parameters* param, int inIndex)
+{
+    uint8_t* buffer = malloc(STREAM_BUFF_SIZE);
+    uint32_t size = read_fully(readfd, buffer, STREAM_BUFF_SIZE);
+
+    if (size < STREAM_BUFF_SIZE) {
+        write_record(writer, param, inIndex, buffer, size);
+    } else {
+        uint32_t offset = begin_record(writer, param, inIndex);
+        write(writer->fd, buffer, size);
+        size += stream_pipe(readfd, writer->fd);
+        end_record(writer, offset, size);
+    }
+    free(buffer);
+    return size;
+}
+
+/* map_record_at()
+ * ---------------
+ * Get the file record at an offset in a mapped archive. The record's data
+ * isn't copied, but points into the mapping.
+ *
+ * map: Mapped archive to read record from
+ * offset: Offset of the record in the archive
+ *
+ * Returns: Pointer to Compressed type containing file record information, or
+ *          NULL if the record doesn't fit within the archive.
+ */
+Compressed* map_record_at(ArchiveMap* map, uint64_t offset)
+{
+    uint32_t dataSize;
+    uint8_t nameLen;
+
+    if ((offset > map->size)
+            || (map->size - offset < sizeof(uint32_t) + sizeof(uint8_t))) {
+        // no room for a 4 byte data size field and a 1 byte name length
+        return NULL;
+    }
+    memcpy(&dataSize, map->data + offset, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+    nameLen = map->data[offset++];
+
+    if (map->size - offset < (uint64_t)nameLen + dataSize) {
+        // name field or data field runs past the end of the archive
+        return NULL;
+    }
+    Compressed* result = calloc(1, sizeof(Compressed));
+    result->orgFile = strndup((char*)map->data + offset, nameLen);
+    result->data = map->data + offset + nameLen;
+    result->size = dataSize;
+    result->mapped = true;
+    return result;
+}
+
+/* map_record()
+ * ------------
+ * Get a file record from a mapped archive (see map_record_at()).
+ *
+ * map: Mapped archive to read record from
+ * header: Header of archive file
+ * fileIndex: File number in archive file to read record of
+ *
+ * Returns: Pointer to Compressed type containing file record information, or
+ *          NULL if the record doesn't fit within the archive.
+ */
+Compressed* map_record(ArchiveMap* map, UqzHeaderSection* header,
+        int fileIndex)
+{
+    return map_record_at(map, header->fileRecordOffsets[fileIndex]);
+}
+
+/* resolve_hashed_record()
+ * -----------------------
+ * Take the hash from the start of the data of a record from a hashed
+ * archive, and point the record's data at its compressed data. That follows
+ * the hash, or, for a record of a file identical to an earlier one, is the
+ * data of the record the hash gives the offset of.
+ *
+ * map: Mapped archive
+ * comp: Record from archive
+ *
+ * Returns: true if the record and any record it shares data with are valid,
+ *          false otherwise.
+ */
+bool resolve_hashed_record(ArchiveMap* map, Compressed* comp)
+{
+    uint32_t payloadOffset;
+
+    if (comp->size < RECORD_HASH_SIZE) {
+        return false;
+    }
+    memcpy(&comp->hash, comp->data, sizeof(uint64_t));
+    memcpy(&payloadOffset, comp->data + sizeof(uint64_t), sizeof(uint32_t));
+    comp->data += RECORD_HASH_SIZE;
+    comp->size -= RECORD_HASH_SIZE;
+    if (payloadOffset == 0) {
+        return true;
+    }
+    Compressed* owner = map_record_at(map, payloadOffset);
+    uint64_t ownerHash;
+    uint32_t ownerPayload;
+    bool valid = (comp->size == 0) && (owner != NULL)
+            && (owner->size >= RECORD_HASH_SIZE);
+
+    if (valid) {
+        memcpy(&ownerHash, owner->data, sizeof(uint64_t));
+        memcpy(&ownerPayload, owner->data + sizeof(uint64_t),
+                sizeof(uint32_t));
+        // data is only ever shared with a record which holds its own
+        valid = (ownerHash == comp->hash) && (ownerPayload == 0);
+        comp->data = owner->data + RECORD_HASH_SIZE;
+        comp->size = owner->size - RECORD_HASH_SIZE;
+    }
+    if (owner != NULL) {
+        free_compressed(owner);
+    }
+    return valid;
+}
+
+/* write_mapped()
+ * --------------
+ * Write data from a mapped archive into a pipe. The pages are spliced into
+ * the pipe where possible so the data isn't copied, falling back to write().
+ *
+ * pipefd: Write end of pipe
+ * data: Data to write
+ * size: Number of bytes in data
+ */
+void write_mapped(int pipefd, uint8_t* data, uint32_t size)
+{
+    bool canSplice = true;
+
+    while (size > 0) {
+        ssize_t written;
+
+        if (canSplice) {
+            struct iovec iov = {data, size};
+            written = vmsplice(pipefd, &iov, 1, 0);
+        } else {
+            written = write(pipefd, data, size);
+        }
+        if ((written < 0) && (errno == EINTR)) {
+            continue;
+        } else if ((written < 0) && canSplice) {
+            // pipe doesn't support vmsplice()
+            canSplice = false;
+            continue;
+        } else if (written <= 0) {
+            break;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+/* suppress_output()
+ * -----------------
+ * Suppress the output of a process such as stdout or stderr.
+ *
+ * suppressfd: File descriptor of output to suppress
+ */
+void suppress_output(int suppressfd)
 {
     int fdnull = open("/dev/null", O_WRONLY, 0);
     dup2(fdnull, suppressfd);
@@ -630,8 +1618,13 @@ void redirect_worker(Worker* work, int pipefd[2])
         // close write end of pipe and suppress stderr
         close(pipefd[1]);
         suppress_output(STDERR_FILENO);
-        int outfd = open(work->workingOn, O_RDWR | O_TRUNC | O_CREAT,
+        // workers decompressing a chunk write only their part of the file
+        int flags = O_RDWR | O_CREAT | ((work->outOffset < 0) ? O_TRUNC : 0);
+        int outfd = open(work->workingOn, flags,
                 S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+        if (work->outOffset > 0) {
+            lseek(outfd, work->outOffset, SEEK_SET);
+        }
         // redirect stdout to out file descriptor and stdin to read end of pipe
         dup2(outfd, STDOUT_FILENO);
         dup2(pipefd[0], STDIN_FILENO);
@@ -640,6 +1633,28 @@ void redirect_worker(Worker* work, int pipefd[2])
     }
 }
 
+/* extracted_size()
+ * ----------------
+ * Get the number of bytes a decompression worker wrote to its output file.
+ *
+ * work: Decompression worker which has finished
+ *
+ * Returns: Number of bytes of output
+ */
+uint64_t extracted_size(Worker* work)
+{
+    uint64_t size = file_size(work->workingOn);
+
+    if (work->outOffset < 0) {
+        return size;
+    }
+    // chunks after this one may have been written already
+    uint64_t offset = work->outOffset;
+    uint64_t length = work->outLength;
+    size = (size > offset) ? size - offset : 0;
+    return (size < length) ? size : length;
+}
+
 /* get_exit_reason()
  * -----------------
  * Get the reason for a worker death for a given status. This function will set
@@ -659,6 +1674,10 @@ bool get_exit_reason(Worker* work, int status, CompMethod method)
     bool result = true;
     // set the worker's state initially to EXIT_OK (no longer WORKER_RUNNING)
     work->state = EXIT_OK;
+    // compression workers are finished when all of their output is read
+    if ((work->stat >= 0) && work->decompress) {
+        stats_finish(work->stat, extracted_size(work));
+    }
 
     if (work->decompress) {
         command = deCompCommandLUT[method];
@@ -683,43 +1702,144 @@ bool get_exit_reason(Worker* work, int status, CompMethod method)
     return result;
 }
 
+/* chunk_size()
+ * ------------
+ * Get the compressed size of a chunk from a chunk table.
+ *
+ * table: Chunk table of record
+ * chunk: Index of chunk
+ *
+ * Returns: Number of bytes of compressed data in the chunk
+ */
+uint32_t chunk_size(ChunkTable* table, uint32_t chunk)
+{
+    uint32_t size;
+    memcpy(&size, table->sizes + chunk * sizeof(uint32_t), sizeof(uint32_t));
+    return size;
+}
+
+/* parse_chunk_table()
+ * -------------------
+ * Parse and check the chunk table at the start of a record's data from a
+ * chunked archive.
+ *
+ * comp: Record read from archive
+ * table: ChunkTable to fill in
+ *
+ * Returns: true if the record begins with a chunk table whose chunks make up
+ *          the rest of the record's data, false otherwise.
+ */
+bool parse_chunk_table(Compressed* comp, ChunkTable* table)
+{
+    if (comp->size < CHUNK_TABLE_START) {
+        return false;
+    }
+    memcpy(&table->chunkSize, comp->data, sizeof(uint32_t));
+    memcpy(&table->count, comp->data + sizeof(uint32_t), sizeof(uint32_t));
+    if ((table->chunkSize == 0) || (table->count == 0)
+            || (table->count
+                    > (comp->size - CHUNK_TABLE_START) / sizeof(uint32_t))) {
+        return false;
+    }
+    table->sizes = comp->data + CHUNK_TABLE_START;
+    table->length = CHUNK_TABLE_START + table->count * sizeof(uint32_t);
+    uint64_t total = table->length;
+
+    for (uint32_t i = 0; i < table->count; i++) {
+        total += chunk_size(table, i);
+    }
+    return total == comp->size;
+}
+
+/* read_payload()
+ * --------------
+ * Get a record from a mapped archive with its data pointing at the data to
+ * be decompressed, checking the parts of the record which depend on the
+ * archive's format.
+ *
+ * param: Parameters passed through command line
+ * map: Mapped archive
+ * header: Header section of the archive
+ * record: Index of record
+ *
+ * Returns: The record, or NULL if it is not in the correct format
+ */
+Compressed* read_payload(Parameters* param, ArchiveMap* map,
+        UqzHeaderSection* header, int record)
+{
+    Compressed* comp = map_record(map, header, record);
+    ChunkTable table;
+
+    if ((comp != NULL)
+            && ((param->hashed && !resolve_hashed_record(map, comp))
+                    || (param->chunked && !parse_chunk_table(comp, &table)))) {
+        free_compressed(comp);
+        comp = NULL;
+    }
+    return comp;
+}
+
+/* verify_output()
+ * ---------------
+ * Check that a file extracted from a hashed archive has the hash stored in
+ * its record, removing it if it doesn't.
+ *
+ * extract: Record the file was extracted from
+ *
+ * Returns: EXIT_OK if the file has the right hash, otherwise CHECKSUM_ERROR
+ */
+int verify_output(Compressed* extract)
+{
+    uint64_t hash;
+
+    if (hash_file(extract->orgFile, &hash) && (hash == extract->hash)) {
+        return EXIT_OK;
+    }
+    fprintf(stderr, "uqzip: \"%s\" failed verification\n", extract->orgFile);
+    remove(extract->orgFile);
+    return CHECKSUM_ERROR;
+}
+
 /* verify_extractable()
  * --------------------
  * Verify that a record within a .uqz archive is extractable. This function
  * will ensure that the record is valid and that the filename from the record
  * can be opened for writing.
  *
- * archive: Name of .uqz archive to verify
+ * param: Parameters passed through command line (archive is the name of
+ *        the archive to verify)
+ * map: Mapped archive
  * header: Header section of the archive
  * record: Index of record to verify, 0 is first record, 1 is second etc
+ * extract: Set to the record if it is extractable
  *
  * Returns: EXIT_OK if record is extractable OR FORMAT_ERROR if the
  *          record is not in the correct format OR WRITE_ERROR if the filename
  *          in the record cannot be opened for writing.
  */
-int verify_extractable(char* archive, UqzHeaderSection* header, int record)
+int verify_extractable(Parameters* param, ArchiveMap* map,
+        UqzHeaderSection* header, int record, Compressed** extract)
 {
-    FILE* archiveFile = fopen(archive, "r");
-    Compressed* extract = read_record(archiveFile, header, record);
-    fclose(archiveFile);
+    char* archive = param->archive;
+    Compressed* comp = read_payload(param, map, header, record);
 
     // invalid record
-    if (extract == NULL) {
+    if (comp == NULL) {
         fprintf(stderr, "uqzip: File \"%s\" has invalid format\n", archive);
         return FORMAT_ERROR;
     }
 
-    FILE* output = fopen(extract->orgFile, "w");
+    FILE* output = fopen(comp->orgFile, "w");
 
     // couldn't be opened for writing
     if (output == NULL) {
         fprintf(stderr, "uqzip: unable to open file \"%s\" for writing\n",
-                extract->orgFile);
-        free_compressed(extract);
+                comp->orgFile);
+        free_compressed(comp);
         return WRITE_ERROR;
     }
-    free_compressed(extract);
     fclose(output);
+    *extract = comp;
     return 0;
 }
 
@@ -736,7 +1856,9 @@ int verify_extractable(char* archive, UqzHeaderSection* header, int record)
 bool reap_worker(Worker* work, CompMethod method)
 {
     int status;
+    double since = stats_now();
     waitpid(work->pid, &status, 0);
+    stats_blocked(&runStats.waitTime, since);
 
     return get_exit_reason(work, status, method);
 }
@@ -821,7 +1943,7 @@ void start_worker_pair(
     if (!pair[1]->pid) {
         // send data to decompression child (pair[0])
         close(pipefds[0]);
-        write(pipefds[1], comp->data, comp->size);
+        write_mapped(pipefds[1], comp->data, comp->size);
         close(pipefds[1]);
         exit(EXIT_OK);
 
@@ -852,7 +1974,7 @@ void create_empty_file(char* fileName)
  * currentWorker: Worker currently executing (SIGINT is only caught for
  *                sequential execution so we know there will only be one
  *                running at a time).
- * comp: Compressed object worker is working on.
+ * comp: Compressed object worker is working on (NULL if none).
  * output: Name of output file worker is writing to (archive file for
  *         compression or original file for decompression)
  */
@@ -861,8 +1983,11 @@ void sig_int_clean_up(Worker* currentWorker, Compressed* comp, char* output)
     wait(NULL);
     fprintf(stderr, "uqzip: Execution aborted\n");
     free_worker(currentWorker);
-    free_compressed(comp);
+    // output may be comp's file name so remove it first
     remove(output);
+    if (comp) {
+        free_compressed(comp);
+    }
 }
 
 /* compress_sequential()
@@ -870,33 +1995,40 @@ void sig_int_clean_up(Worker* currentWorker, Compressed* comp, char* output)
  * Compress a set of input files sequentially (Compress one file at a time).
  *
  * param: Command line parameters
+ * writer: ArchiveWriter for output archive
  *
  * Returns: 0 if compression was successfull, or the reason for child process
  *          death (SIGNAL_ERROR or COMMAND_ERROR) if child process does not
  *          exit successfully.
  */
-int compress_sequential(Parameters* param)
+int compress_sequential(Parameters* param, ArchiveWriter* writer)
 {
     for (int i = 0; i < param->inputCount; i++) {
         int pipefds[2];
         pipe(pipefds);
         // initialise and start a compression worker
         Worker* work = init_worker(param, param->inputFiles[i]);
+        if (runStats.enabled) {
+            work->stat = stats_begin(
+                    param->inputFiles[i], file_size(param->inputFiles[i]));
+        }
 
         if (!(work->pid = fork())) {
             start_worker(work, param->method, pipefds);
         }
-        // In parent so close the write end of pipe and empty the data which
-        // child process sent over pipe
+        // In parent so close the write end of pipe and stream the data which
+        // child process sent over pipe into the archive
         close(pipefds[1]);
-        Compressed* comp = empty_pipe(pipefds[0]);
+        double since = stats_now();
+        uint32_t size = enter_record(pipefds[0], writer, param, i);
+        stats_blocked(&runStats.pipeTime, since);
+        stats_finish(work->stat, size);
         close(pipefds[0]);
 
         if (!reap_worker(work, param->method)) {
             // worker didn't exit with exit status 0 so free memory and return
             // the worker's reason
             int reason = work->state;
-            free_compressed(comp);
             free_worker(work);
             remove(param->outName);
             return reason;
@@ -904,114 +2036,975 @@ int compress_sequential(Parameters* param)
         if (sigIntCaught && (i != param->inputCount - 1)) {
             // interrupted by SIGINT so free memory and wait for current worker
             // to finish what its doing
-            sig_int_clean_up(work, comp, param->outName);
+            sig_int_clean_up(work, NULL, param->outName);
             return INTERRUPT_ERROR;
         }
-        enter_record(comp, param, i);
         free_worker(work);
-        free_compressed(comp);
     }
     return 0;
 }
 
+/* init_spool()
+ * ------------
+ * Initialise a spool which isn't being used by any worker.
+ *
+ * spool: Spool to initialise
+ */
+void init_spool(Spool* spool)
+{
+    memset(spool, 0, sizeof(Spool));
+    spool->readfd = -1;
+    spool->stat = -1;
+}
+
+/* start_compress_worker()
+ * ------------------------
+ * Start a compression worker for an input file when compressing in parallel.
+ * Each running worker has a Spool, indexed by job slot.
+ *
+ * param: Command line parameters
+ * workers: Array of workers (one per input file)
+ * spools: Spools of running workers, indexed by job slot
+ * index: Index of input file to start worker for
+ */
+void start_compress_worker(
+        Parameters* param, Worker** workers, Spool* spools, int index)
+{
+    int slot = index % param->jobs;
+    int pipefds[2];
+
+    pipe(pipefds);
+    workers[index] = init_worker(param, param->inputFiles[index]);
+    if (runStats.enabled) {
+        workers[index]->stat = stats_begin(param->inputFiles[index],
+                file_size(param->inputFiles[index]));
+    }
+
+    if (!(workers[index]->pid = fork())) {
+        // close the file descriptors to other children inherited by this
+        // child
+        for (int j = 0; j < param->jobs; j++) {
+            if (spools[j].readfd != -1) {
+                close(spools[j].readfd);
+            }
+        }
+        start_worker(workers[index], param->method, pipefds);
+    }
+    // Still in parent so close the write end of pipe
+    close(pipefds[1]);
+    init_spool(&spools[slot]);
+    spools[slot].readfd = pipefds[0];
+    spools[slot].stat = workers[index]->stat;
+}
+
+/* spool_data()
+ * ------------
+ * Add output read from a worker to its spool, keeping it in memory up to
+ * SPOOL_MEMORY_CAP bytes and spilling to a temporary file after that.
+ *
+ * spool: Spool to add data to
+ * buffer: Data to add
+ * size: Number of bytes in buffer
+ */
+void spool_data(Spool* spool, uint8_t* buffer, uint32_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    if ((spool->spill == NULL) && (spool->size + size > SPOOL_MEMORY_CAP)) {
+        if ((spool->spill = tmpfile()) != NULL) {
+            // don't let workers started later inherit the file
+            fcntl(fileno(spool->spill), F_SETFD, FD_CLOEXEC);
+        }
+    }
+    if (spool->spill != NULL) {
+        fwrite(buffer, sizeof(uint8_t), size, spool->spill);
+        return;
+    }
+    if (spool->size + size > spool->capacity) {
+        // grow geometrically (beyond the cap only if tmpfile() failed)
+        while (spool->size + size > spool->capacity) {
+            spool->capacity = spool->capacity ? 2 * spool->capacity : size;
+        }
+        spool->data = realloc(spool->data, spool->capacity);
+    }
+    memcpy(spool->data + spool->size, buffer, size);
+    spool->size += size;
+}
+
+/* read_spool()
+ * ------------
+ * Read whatever output a worker has ready from its pipe. The output goes
+ * straight into the archive if the worker's record has been opened by
+ * open_spooled_record(), otherwise it is spooled.
+ *
+ * spool: Spool of worker to read from
+ * writer: ArchiveWriter for output archive
+ */
+void read_spool(Spool* spool, ArchiveWriter* writer)
+{
+    uint8_t buffer[STREAM_BUFF_SIZE];
+    ssize_t got = read(spool->readfd, buffer, STREAM_BUFF_SIZE);
+
+    if (got <= 0) {
+        // worker has finished sending output
+        close(spool->readfd);
+        spool->readfd = -1;
+        stats_finish(spool->stat, spool->total);
+        return;
+    }
+    spool->total += got;
+    if (spool->streaming) {
+        write(writer->fd, buffer, got);
+    } else {
+        spool_data(spool, buffer, got);
+    }
+}
+
+/* flush_spool()
+ * -------------
+ * Write all output held by a spool to the end of the archive (where the
+ * data of a record started by begin_record() goes) and release it.
+ *
+ * spool: Spool holding output
+ * writer: ArchiveWriter for output archive
+ */
+void flush_spool(Spool* spool, ArchiveWriter* writer)
+{
+    write(writer->fd, spool->data, spool->size);
+    free(spool->data);
+    spool->data = NULL;
+
+    if (spool->spill != NULL) {
+        uint8_t* buffer = malloc(STREAM_BUFF_SIZE);
+        size_t got;
+        rewind(spool->spill);
+        while ((got = fread(buffer, sizeof(uint8_t), STREAM_BUFF_SIZE,
+                        spool->spill))
+                > 0) {
+            write(writer->fd, buffer, got);
+        }
+        free(buffer);
+        fclose(spool->spill);
+        spool->spill = NULL;
+    }
+}
+
+/* open_spooled_record()
+ * ---------------------
+ * Begin the archive record of the oldest running worker, moving any output
+ * spooled so far into it. Any further output read from the worker is
+ * written straight into the record.
+ *
+ * spool: Spool of worker
+ * writer: ArchiveWriter for output archive
+ * param: Command line parameters
+ * inIndex: Index of param->inputFiles[] which the worker is compressing
+ */
+void open_spooled_record(Spool* spool, ArchiveWriter* writer,
+        Parameters* param, int inIndex)
+{
+    spool->streaming = true;
+    spool->offset = begin_record(writer, param, inIndex);
+    flush_spool(spool, writer);
+}
+
+/* free_spool()
+ * ------------
+ * Release everything held by a spool.
+ *
+ * spool: Spool to free the contents of
+ */
+void free_spool(Spool* spool)
+{
+    if (spool->readfd != -1) {
+        close(spool->readfd);
+    }
+    if (spool->spill != NULL) {
+        fclose(spool->spill);
+    }
+    free(spool->data);
+    init_spool(spool);
+}
+
+/* poll_spools()
+ * -------------
+ * Wait until at least one running worker has output ready (or has finished)
+ * and read from every worker that does, so no worker stalls on a full pipe
+ * while an earlier record is still being compressed.
+ *
+ * spools: Spools of running workers, indexed by job slot
+ * jobs: Number of job slots
+ * writer: ArchiveWriter for output archive
+ */
+void poll_spools(Spool* spools, int jobs, ArchiveWriter* writer)
+{
+    struct pollfd* fds = malloc(jobs * sizeof(struct pollfd));
+    int* slots = malloc(jobs * sizeof(int));
+    int count = 0;
+
+    for (int i = 0; i < jobs; i++) {
+        if (spools[i].readfd != -1) {
+            fds[count].fd = spools[i].readfd;
+            fds[count].events = POLLIN;
+            slots[count++] = i;
+        }
+    }
+    double since = stats_now();
+    int ready = poll(fds, count, -1);
+    stats_blocked(&runStats.pipeTime, since);
+
+    if (ready > 0) {
+        for (int i = 0; i < count; i++) {
+            if (fds[i].revents) {
+                read_spool(&spools[slots[i]], writer);
+            }
+        }
+    }
+    free(fds);
+    free(slots);
+}
+
 /* compress_parallel()
  * -------------------
  * Compress a set of input files in parallel (Files compressed simultaneously).
+ * At most param->jobs workers run at once. The output of every running worker
+ * is consumed as it arrives, but records are committed to the archive in
+ * input order. Output is spooled until its turn, except that the oldest
+ * worker's output is streamed straight into its record rather than spilled
+ * to a temporary file once it is too large to hold in memory.
  *
  * param: Command line parameters.
+ * writer: ArchiveWriter for output archive
  *
  * Returns: 0 if compression was successfull, or the reason for child process
  *          death (SIGNAL_ERROR or COMMAND_ERROR) if child process does not
  *          exit successfully.
  */
-int compress_parallel(Parameters* param)
+int compress_parallel(Parameters* param, ArchiveWriter* writer)
 {
     int inputCount = param->inputCount;
-    int pipefds[inputCount][2];
+    Spool* spools = malloc(param->jobs * sizeof(Spool));
     Worker** workers = malloc(inputCount * sizeof(Worker*));
+    int started = 0;
 
-    // executing in parallel so first create and start all compression workers
-    for (int i = 0; i < inputCount; i++) {
-        pipe(pipefds[i]);
-        workers[i] = init_worker(param, param->inputFiles[i]);
-
-        if (!(workers[i]->pid = fork())) {
-            // close the file descriptors to other children inherited by this
-            // child
-            for (int j = 0; j < i; j++) {
-                close(pipefds[j][0]);
-                close(pipefds[j][1]);
-            }
-            start_worker(workers[i], param->method, pipefds[i]);
-        }
-        // Still in parent so close the write end of pipe
-        close(pipefds[i][1]);
+    for (int i = 0; i < param->jobs; i++) {
+        init_spool(&spools[i]);
     }
-    for (int j = 0; j < inputCount; j++) {
-        Compressed* comp = empty_pipe(pipefds[j][0]);
-        close(pipefds[j][0]);
+    for (int j = 0; j < inputCount;) {
+        // top up the running workers so up to param->jobs are in flight
+        while ((started < inputCount) && (started < j + param->jobs)) {
+            start_compress_worker(param, workers, spools, started++);
+        }
+        Spool* head = &spools[j % param->jobs];
+
+        bool nearCap = head->size > SPOOL_MEMORY_CAP - STREAM_BUFF_SIZE;
+
+        // another read could take the oldest worker's output past what can
+        // be held in memory so write it straight to the archive instead
+        if (!head->streaming && ((head->spill != NULL) || nearCap)) {
+            open_spooled_record(head, writer, param, j);
+        }
+        if (head->readfd != -1) {
+            poll_spools(spools, param->jobs, writer);
+            continue;
+        }
+        // all output of the oldest worker has been read so commit its record
+        if (head->streaming) {
+            end_record(writer, head->offset, head->total);
+        } else {
+            write_record(writer, param, j, head->data, head->size);
+        }
+        free_spool(head);
 
         if (!reap_worker(workers[j], param->method)) {
             // one of the workers didn't exit correctly so send remaining
             // worker SIGTERM to terminate them
             int reason = workers[j]->state;
-            signal_workers(workers, j, inputCount, SIGTERM);
-            free_compressed(comp);
+            signal_workers(workers, j, started, SIGTERM);
+            for (int i = 0; i < param->jobs; i++) {
+                free_spool(&spools[i]);
+            }
             remove(param->outName);
-            free_workers(workers, inputCount);
+            free_workers(workers, started);
+            free(spools);
             return reason;
         }
-        enter_record(comp, param, j);
-        free_compressed(comp);
+        j++;
     }
     free_workers(workers, inputCount);
+    free(spools);
     return EXIT_OK;
 }
 
-/* decompress_sequential()
- * -----------------------
- * Decompress a .uqz archive sequentially (One file from the archive is
- * processed at a time).
+/* CodecUnit
  *
- * param: Parameters passed through command line
- * header: Header section of the archive file to be decompressed
+ * A unit of work for an in-process compression thread: a whole input file,
+ * or one chunk of it if the archive is chunked.
  *
- * Returns: EXIT_OK if successfull, FORMAT_ERROR if the archive file is not
- *          in a .uqz format or INTERRUPT_ERROR if a SIGINT is sent to uqzip
- *          whilst decompressing.
+ * file: Index of param->inputFiles[] which the unit is part of
+ * chunk: Index of chunk within the file (0 if not chunked)
+ * chunkCount: Number of chunks in the file (1 if not chunked)
  */
-int decompress_sequential(Parameters* param, UqzHeaderSection* header)
-{
-    for (uint32_t i = 0; i < header->numFiles; i++) {
-        int pipefd[2];
-        int verifyRecord;
-        pipe(pipefd);
+typedef struct {
+    int file;
+    uint32_t chunk;
+    uint32_t chunkCount;
+} CodecUnit;
+
+/* CodecPool
+ *
+ * State shared between the threads of an in-process compression. Threads
+ * claim units in order but never get more than jobs units ahead of the
+ * oldest unit not yet committed, so each running thread has its own slot.
+ *
+ * param: Command line parameters
+ * writer: ArchiveWriter for output archive
+ * jobs: Number of threads (and slots)
+ * units: Units of work in the order they are committed
+ * unitCount: Number of entries in units
+ * spools: Output of each thread, indexed by slot
+ * finished: True for each slot whose unit has been compressed
+ * failed: True for each slot whose unit couldn't be read or compressed
+ * next: Index of next unit to be claimed
+ * committed: Number of units which have been committed to the archive
+ * aborted: True if the compression has been abandoned
+ * lock: Mutex protecting all of the above
+ * changed: Signalled whenever a slot finishes or is freed
+ * recordOffset: Offset of the chunked record being committed
+ * tableOffset: Offset of the chunk table of the chunked record
+ * chunkSizes: Compressed sizes of the chunks of the chunked record
+ * recordSize: Number of bytes of data in the chunked record so far
+ */
+typedef struct CodecPool {
+    Parameters* param;
+    ArchiveWriter* writer;
+    int jobs;
+    CodecUnit* units;
+    int unitCount;
+    Spool* spools;
+    bool* finished;
+    bool* failed;
+    int next;
+    int committed;
+    bool aborted;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    uint32_t recordOffset;
+    uint32_t tableOffset;
+    uint32_t* chunkSizes;
+    uint32_t recordSize;
+} CodecPool;
+
+/* begin_chunk()
+ * -------------
+ * Start the record of a chunked file with its first chunk, writing the
+ * record's name and a chunk table with sizes of 0 (filled in at the end by
+ * commit_chunk()).
+ *
+ * pool: CodecPool of running threads
+ * writer: ArchiveWriter for output archive
+ * unit: First unit of the file
+ */
+void begin_chunk(CodecPool* pool, ArchiveWriter* writer, CodecUnit* unit)
+{
+    uint32_t tableLength
+            = CHUNK_TABLE_START + unit->chunkCount * sizeof(uint32_t);
+    uint32_t start[] = {CHUNK_SIZE, unit->chunkCount};
+
+    pool->recordOffset = begin_record(writer, pool->param, unit->file);
+    pool->tableOffset = writer->end;
+    pool->chunkSizes
+            = realloc(pool->chunkSizes, tableLength - CHUNK_TABLE_START);
+    memset(pool->chunkSizes, 0, tableLength - CHUNK_TABLE_START);
+    write(writer->fd, start, CHUNK_TABLE_START);
+    write(writer->fd, pool->chunkSizes, tableLength - CHUNK_TABLE_START);
+    pool->recordSize = tableLength;
+}
+
+/* stream_if_oldest()
+ * ------------------
+ * Switch a codec's spool to writing straight into the archive if its unit
+ * is the oldest one not yet committed, as compress_parallel() does for the
+ * oldest worker, so output too large to hold in memory isn't copied through
+ * a temporary file. The committing thread only writes to the archive once a
+ * unit is finished, so until then the archive belongs to the oldest unit's
+ * thread.
+ *
+ * spool: Spool of the codec
+ */
+void stream_if_oldest(Spool* spool)
+{
+    CodecPool* pool = spool->pool;
+    CodecUnit* unit = &pool->units[spool->unit];
+
+    pthread_mutex_lock(&pool->lock);
+    bool oldest = pool->committed == spool->unit;
+    pthread_mutex_unlock(&pool->lock);
+    if (!oldest) {
+        return;
+    }
+    if (!pool->param->chunked) {
+        open_spooled_record(spool, pool->writer, pool->param, unit->file);
+        return;
+    }
+    if (unit->chunk == 0) {
+        begin_chunk(pool, pool->writer, unit);
+    }
+    spool->streaming = true;
+    flush_spool(spool, pool->writer);
+}
+
+/* spool_output()
+ * --------------
+ * Add output produced by an in-process codec to a spool, or write it
+ * straight into the archive once the spool is streaming.
+ *
+ * spool: Spool to add output to
+ * data: Output to add
+ * size: Number of bytes in data
+ */
+void spool_output(Spool* spool, uint8_t* data, uint32_t size)
+{
+    spool->total += size;
+    if (!spool->streaming && (spool->pool != NULL)
+            && (spool->size + size > SPOOL_MEMORY_CAP)) {
+        stream_if_oldest(spool);
+    }
+    if (spool->streaming) {
+        write(spool->pool->writer->fd, data, size);
+    } else {
+        spool_data(spool, data, size);
+    }
+}
+
+/* read_limited()
+ * --------------
+ * Read the next block of input for an in-process codec, reading no more
+ * than a given number of bytes in total.
+ *
+ * infd: File descriptor to read from
+ * buffer: Buffer of STREAM_BUFF_SIZE bytes to read into
+ * limit: Number of bytes which may still be read (updated)
+ *
+ * Returns: Number of bytes read, 0 at end of input or -1 on error
+ */
+ssize_t read_limited(int infd, void* buffer, size_t* limit)
+{
+    size_t want = (*limit < STREAM_BUFF_SIZE) ? *limit : STREAM_BUFF_SIZE;
+    ssize_t got = want ? read(infd, buffer, want) : 0;
+
+    if (got > 0) {
+        *limit -= got;
+    }
+    return got;
+}
+
+/* copy_codec()
+ * ------------
+ * In-process equivalent of "cat": copy a file into a spool unchanged.
+ *
+ * infd: File descriptor of file to compress
+ * limit: Maximum number of bytes of the file to compress
+ * out: Spool to write output to
+ *
+ * Returns: true if the whole file was read, false otherwise
+ */
+bool copy_codec(int infd, size_t limit, Spool* out)
+{
+    uint8_t* buffer = malloc(STREAM_BUFF_SIZE);
+    ssize_t got;
+
+    while ((got = read_limited(infd, buffer, &limit)) > 0) {
+        spool_output(out, buffer, got);
+    }
+    free(buffer);
+    return got == 0;
+}
+
+/* gzip_codec()
+ * ------------
+ * In-process near-equivalent of "gzip -n --best --stdout" using zlib. zlib's
+ * deflate doesn't match GNU gzip's byte for byte, so this is only used for
+ * chunked archives whose chunks can't be compressed by the gzip command.
+ *
+ * infd: File descriptor of file to compress
+ * limit: Maximum number of bytes of the file to compress
+ * out: Spool to write output to
+ *
+ * Returns: true if the whole file was read and compressed, false otherwise
+ */
+bool gzip_codec(int infd, size_t limit, Spool* out)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED,
+                GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY)
+            != Z_OK) {
+        return false;
+    }
+    uint8_t* in = malloc(STREAM_BUFF_SIZE);
+    uint8_t* buffer = malloc(STREAM_BUFF_SIZE);
+    ssize_t got;
+
+    do {
+        if ((got = read_limited(infd, in, &limit)) < 0) {
+            break;
+        }
+        stream.next_in = in;
+        stream.avail_in = got;
+        // keep deflating until it stops filling the output buffer
+        do {
+            stream.next_out = buffer;
+            stream.avail_out = STREAM_BUFF_SIZE;
+            deflate(&stream, got ? Z_NO_FLUSH : Z_FINISH);
+            spool_output(out, buffer, STREAM_BUFF_SIZE - stream.avail_out);
+        } while (stream.avail_out == 0);
+    } while (got > 0);
+    deflateEnd(&stream);
+    free(in);
+    free(buffer);
+    return got == 0;
+}
+
+/* bzip2_codec()
+ * -------------
+ * In-process equivalent of "bzip2 --stdout" using libbz2.
+ *
+ * infd: File descriptor of file to compress
+ * limit: Maximum number of bytes of the file to compress
+ * out: Spool to write output to
+ *
+ * Returns: true if the whole file was read and compressed, false otherwise
+ */
+bool bzip2_codec(int infd, size_t limit, Spool* out)
+{
+    bz_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    if (BZ2_bzCompressInit(&stream, BZIP2_BLOCK_SIZE, 0, 0) != BZ_OK) {
+        return false;
+    }
+    char* in = malloc(STREAM_BUFF_SIZE);
+    char* buffer = malloc(STREAM_BUFF_SIZE);
+    ssize_t got;
+    int result = BZ_RUN_OK;
+
+    do {
+        if ((got = read_limited(infd, in, &limit)) < 0) {
+            break;
+        }
+        stream.next_in = in;
+        stream.avail_in = got;
+        // run until all input is consumed, or the stream ends once finishing
+        do {
+            stream.next_out = buffer;
+            stream.avail_out = STREAM_BUFF_SIZE;
+            result = BZ2_bzCompress(&stream, got ? BZ_RUN : BZ_FINISH);
+            spool_output(out, (uint8_t*)buffer,
+                    STREAM_BUFF_SIZE - stream.avail_out);
+        } while (got ? (stream.avail_in > 0)
+                     : (result == BZ_FINISH_OK));
+    } while (got > 0);
+    BZ2_bzCompressEnd(&stream);
+    free(in);
+    free(buffer);
+    return (got == 0) && (result == BZ_STREAM_END);
+}
+
+/* xz_codec()
+ * ----------
+ * In-process equivalent of "xz --stdout" using liblzma. The multi-threaded
+ * encoder is used (with one thread) since that is the output format of xz
+ * 5.4 onwards, which records block sizes in block headers.
+ *
+ * infd: File descriptor of file to compress
+ * limit: Maximum number of bytes of the file to compress
+ * out: Spool to write output to
+ *
+ * Returns: true if the whole file was read and compressed, false otherwise
+ */
+bool xz_codec(int infd, size_t limit, Spool* out)
+{
+    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_mt options;
+    memset(&options, 0, sizeof(options));
+    options.threads = 1;
+    options.preset = XZ_PRESET;
+    options.check = LZMA_CHECK_CRC64;
+
+    if (lzma_stream_encoder_mt(&stream, &options) != LZMA_OK) {
+        return false;
+    }
+    uint8_t* in = malloc(STREAM_BUFF_SIZE);
+    uint8_t* buffer = malloc(STREAM_BUFF_SIZE);
+    ssize_t got;
+    lzma_ret result = LZMA_OK;
+
+    do {
+        if ((got = read_limited(infd, in, &limit)) < 0) {
+            break;
+        }
+        stream.next_in = in;
+        stream.avail_in = got;
+        // run until all input is consumed, or the stream ends once finishing
+        do {
+            stream.next_out = buffer;
+            stream.avail_out = STREAM_BUFF_SIZE;
+            result = lzma_code(&stream, got ? LZMA_RUN : LZMA_FINISH);
+            spool_output(out, buffer, STREAM_BUFF_SIZE - stream.avail_out);
+        } while ((result == LZMA_OK)
+                && (got ? (stream.avail_in > 0) : true));
+    } while ((got > 0) && (result == LZMA_OK));
+    lzma_end(&stream);
+    free(in);
+    free(buffer);
+    return (got == 0) && (result == LZMA_STREAM_END);
+}
+
+/* In-process codecs to use in conjunction with CompMethod constants, e.g.
+ * codecLUT[XZ] = xz_codec. Methods without an in-process codec (zip) are
+ * NULL and always use the compression command. See use_codec() for gzip.
+ */
+bool (*const codecLUT[])(int, size_t, Spool*)
+        = {NULL, copy_codec, bzip2_codec, gzip_codec, xz_codec, NULL};
+
+/* codec_thread()
+ * --------------
+ * Thread function for in-process compression. Repeatedly claims the next
+ * unit and compresses it into its slot's spool.
+ *
+ * arg: CodecPool shared by all threads
+ *
+ * Returns: NULL
+ */
+void* codec_thread(void* arg)
+{
+    CodecPool* pool = arg;
+    Parameters* param = pool->param;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        // wait for this unit's slot to be freed by the committing thread
+        while (!pool->aborted && (pool->next < pool->unitCount)
+                && (pool->next >= pool->committed + pool->jobs)) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        if (pool->aborted || (pool->next >= pool->unitCount)) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        int index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        CodecUnit* unit = &pool->units[index];
+        int slot = index % pool->jobs;
+        pool->spools[slot].pool = pool;
+        pool->spools[slot].unit = index;
+        int infd = open(param->inputFiles[unit->file], O_RDONLY | O_CLOEXEC);
+        size_t limit = param->chunked ? CHUNK_SIZE : SIZE_MAX;
+        int stat = -1;
+        if (runStats.enabled) {
+            uint64_t size = file_size(param->inputFiles[unit->file]);
+            uint64_t skip = (uint64_t)unit->chunk * CHUNK_SIZE;
+            size = (size > skip) ? size - skip : 0;
+            stat = stats_begin(param->inputFiles[unit->file],
+                    (size < limit) ? size : limit);
+        }
+        bool ok = (infd != -1)
+                && ((unit->chunk == 0)
+                        || (lseek(infd, (off_t)unit->chunk * CHUNK_SIZE,
+                                    SEEK_SET)
+                                != -1))
+                && codecLUT[param->method](infd, limit, &pool->spools[slot]);
+        if (infd != -1) {
+            close(infd);
+        }
+        stats_finish(stat, pool->spools[slot].total);
+        pthread_mutex_lock(&pool->lock);
+        pool->failed[slot] = !ok;
+        pool->finished[slot] = true;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/* commit_spool()
+ * --------------
+ * Commit the complete output of an in-process codec to the archive.
+ *
+ * spool: Spool holding output
+ * writer: ArchiveWriter for output archive
+ * param: Command line parameters
+ * inIndex: Index of param->inputFiles[] which the output is for
+ */
+void commit_spool(
+        Spool* spool, ArchiveWriter* writer, Parameters* param, int inIndex)
+{
+    if (spool->streaming) {
+        end_record(writer, spool->offset, spool->total);
+    } else if (spool->spill == NULL) {
+        write_record(writer, param, inIndex, spool->data, spool->size);
+    } else {
+        open_spooled_record(spool, writer, param, inIndex);
+        end_record(writer, spool->offset, spool->total);
+    }
+}
+
+/* commit_chunk()
+ * --------------
+ * Commit the compressed output of one chunk of a file to a chunked archive.
+ * The file's record (and space for its chunk table) is started with its
+ * first chunk, and the record is finished with its last chunk.
+ *
+ * pool: CodecPool of running threads
+ * writer: ArchiveWriter for output archive
+ * unit: Unit which the output is for
+ * spool: Spool holding output
+ */
+void commit_chunk(CodecPool* pool, ArchiveWriter* writer, CodecUnit* unit,
+        Spool* spool)
+{
+    uint32_t tableLength
+            = CHUNK_TABLE_START + unit->chunkCount * sizeof(uint32_t);
+
+    // a streaming chunk has already been written by its thread
+    if (!spool->streaming) {
+        if (unit->chunk == 0) {
+            begin_chunk(pool, writer, unit);
+        }
+        flush_spool(spool, writer);
+    }
+    pool->chunkSizes[unit->chunk] = spool->total;
+    pool->recordSize += spool->total;
+
+    if (unit->chunk == unit->chunkCount - 1) {
+        pwrite(writer->fd, pool->chunkSizes, tableLength - CHUNK_TABLE_START,
+                pool->tableOffset + CHUNK_TABLE_START);
+        end_record(writer, pool->recordOffset, pool->recordSize);
+    }
+}
+
+/* commit_in_process()
+ * -------------------
+ * Commit records to the archive in input order as threads of an in-process
+ * compression finish them.
+ *
+ * pool: CodecPool of running threads
+ * writer: ArchiveWriter for output archive
+ *
+ * Returns: EXIT_OK if every file was compressed, COMMAND_ERROR if a file
+ *          couldn't be compressed or INTERRUPT_ERROR if a SIGINT was caught
+ *          while compressing sequentially.
+ */
+int commit_in_process(CodecPool* pool, ArchiveWriter* writer)
+{
+    Parameters* param = pool->param;
+
+    for (int u = 0; u < pool->unitCount; u++) {
+        int slot = u % pool->jobs;
+        int i = pool->units[u].file;
+
+        double since = stats_now();
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->finished[slot]) {
+            pthread_cond_wait(&pool->changed, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+        stats_blocked(&runStats.waitTime, since);
+
+        if (pool->failed[slot]) {
+            char* path = get_path(param->inputFiles[i]);
+            fprintf(stderr, "uqzip: \"%s\" command failed for filename "
+                            "\"%s\"\n",
+                    compCommandLUT[param->method], path);
+            free(path);
+            return COMMAND_ERROR;
+        }
+        if (!param->parallel && sigIntCaught && (pool->units[u].chunk == 0)
+                && (i != param->inputCount - 1)) {
+            fprintf(stderr, "uqzip: Execution aborted\n");
+            return INTERRUPT_ERROR;
+        }
+        if (param->chunked) {
+            commit_chunk(pool, writer, &pool->units[u], &pool->spools[slot]);
+        } else {
+            commit_spool(&pool->spools[slot], writer, param, i);
+        }
+        free_spool(&pool->spools[slot]);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->finished[slot] = false;
+        pool->committed++;
+        pthread_cond_broadcast(&pool->changed);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return EXIT_OK;
+}
+
+/* make_codec_units()
+ * ------------------
+ * Divide the input files into units of work for in-process compression. Each
+ * file is one unit, or if the archive is chunked, one unit for every
+ * CHUNK_SIZE bytes of the file (and at least one).
+ *
+ * param: Command line parameters
+ * count: Set to the number of units
+ *
+ * Returns: Allocated array of units in the order they are to be committed
+ */
+CodecUnit* make_codec_units(Parameters* param, int* count)
+{
+    CodecUnit* units = NULL;
+    *count = 0;
+
+    for (int i = 0; i < param->inputCount; i++) {
+        struct stat info;
+        uint32_t chunks = 1;
 
-        if ((verifyRecord = verify_extractable(param->archive, header, i))) {
+        // files which can't be examined get one unit, which will then fail
+        if (param->chunked && (stat(param->inputFiles[i], &info) == 0)
+                && (info.st_size > CHUNK_SIZE)) {
+            chunks = (info.st_size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        }
+        units = realloc(units, (*count + chunks) * sizeof(CodecUnit));
+        for (uint32_t j = 0; j < chunks; j++) {
+            units[*count].file = i;
+            units[*count].chunk = j;
+            units[*count].chunkCount = chunks;
+            (*count)++;
+        }
+    }
+    return units;
+}
+
+/* compress_in_process()
+ * ---------------------
+ * Compress a set of input files with in-process codecs instead of running
+ * a compression command for each file. Sequential compression uses one
+ * thread and parallel compression uses param->jobs threads. If the archive
+ * is chunked, the chunks of a file are compressed independently so even a
+ * single large file is compressed in parallel.
+ *
+ * param: Command line parameters
+ * writer: ArchiveWriter for output archive
+ *
+ * Returns: EXIT_OK if compression was successful, otherwise COMMAND_ERROR or
+ *          INTERRUPT_ERROR (see commit_in_process()).
+ */
+int compress_in_process(Parameters* param, ArchiveWriter* writer)
+{
+    CodecPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.param = param;
+    pool.writer = writer;
+    pool.units = make_codec_units(param, &pool.unitCount);
+    pool.jobs = param->parallel ? param->jobs : 1;
+    if (pool.jobs > pool.unitCount) {
+        pool.jobs = pool.unitCount;
+    }
+    pool.spools = malloc(pool.jobs * sizeof(Spool));
+    pool.finished = calloc(pool.jobs, sizeof(bool));
+    pool.failed = calloc(pool.jobs, sizeof(bool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.changed, NULL);
+    pthread_t* threads = malloc(pool.jobs * sizeof(pthread_t));
+
+    for (int i = 0; i < pool.jobs; i++) {
+        init_spool(&pool.spools[i]);
+    }
+    for (int i = 0; i < pool.jobs; i++) {
+        pthread_create(&threads[i], NULL, codec_thread, &pool);
+    }
+    int status = commit_in_process(&pool, writer);
+
+    // stop any threads still running (if a file failed) and clean up
+    pthread_mutex_lock(&pool.lock);
+    pool.aborted = true;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 0; i < pool.jobs; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < pool.jobs; i++) {
+        free_spool(&pool.spools[i]);
+    }
+    if (status != EXIT_OK) {
+        remove(param->outName);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.changed);
+    free(threads);
+    free(pool.spools);
+    free(pool.finished);
+    free(pool.failed);
+    free(pool.units);
+    free(pool.chunkSizes);
+    return status;
+}
+
+/* decompress_sequential()
+ * -----------------------
+ * Decompress a .uqz archive sequentially (One file from the archive is
+ * processed at a time).
+ *
+ * param: Parameters passed through command line
+ * map: Mapped archive file to be decompressed
+ * header: Header section of the archive file to be decompressed
+ * records: Indices of records to extract, in order
+ * count: Number of records
+ *
+ * Returns: EXIT_OK if successfull, FORMAT_ERROR if the archive file is not
+ *          in a .uqz format, CHECKSUM_ERROR if an extracted file doesn't
+ *          match its hash or INTERRUPT_ERROR if a SIGINT is sent to uqzip
+ *          whilst decompressing.
+ */
+int decompress_sequential(Parameters* param, ArchiveMap* map,
+        UqzHeaderSection* header, uint32_t* records, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        int pipefd[2];
+        int verifyRecord;
+        Compressed* extract;
+
+        if ((verifyRecord = verify_extractable(
+                     param, map, header, records[i], &extract))) {
             return verifyRecord;
         }
-        FILE* archive = fopen(param->archive, "r");
-        Compressed* extract = read_record(archive, header, i);
-        // close so children don't inherit
-        fclose(archive);
+        uint32_t skip = 0;
+        ChunkTable table;
 
-        if (extract->size == 0) {
+        // decompression commands accept concatenated chunks, so just skip
+        // over the chunk table
+        if (param->chunked && parse_chunk_table(extract, &table)) {
+            skip = table.length;
+        }
+        if (extract->size == skip) {
             // create empty output file if extracted size is 0
             create_empty_file(extract->orgFile);
+            verifyRecord = param->hashed ? verify_output(extract) : EXIT_OK;
             free_compressed(extract);
+            if (verifyRecord) {
+                return verifyRecord;
+            }
             continue;
         }
         Worker* work = init_worker(param, extract->orgFile);
+        work->stat = stats_begin(extract->orgFile, extract->size - skip);
+        pipe(pipefd);
 
         if (!(work->pid = fork())) {
-            start_worker(work, header->method, pipefd);
+            start_worker(work, param->method, pipefd);
         }
         // send compressed data to child through pipe
         close(pipefd[0]);
-        write(pipefd[1], extract->data, extract->size);
+        double since = stats_now();
+        write_mapped(pipefd[1], extract->data + skip, extract->size - skip);
+        stats_blocked(&runStats.pipeTime, since);
         close(pipefd[1]);
 
-        if (!reap_worker(work, header->method)) {
+        if (!reap_worker(work, param->method)) {
             // worker didn't exit correctly
             int reason = work->state;
             free_worker(work);
@@ -1019,10 +3012,15 @@ int decompress_sequential(Parameters* param, UqzHeaderSection* header)
             free_compressed(extract);
             return reason;
         }
-        if (sigIntCaught && (i != header->numFiles - 1)) {
+        if (sigIntCaught && (i != count - 1)) {
             sig_int_clean_up(work, extract, extract->orgFile);
             return INTERRUPT_ERROR;
         }
+        if (param->hashed && (verifyRecord = verify_output(extract))) {
+            free_worker(work);
+            free_compressed(extract);
+            return verifyRecord;
+        }
         printf("\"%s\" has been extracted\n", extract->orgFile);
         free_compressed(extract);
         free_worker(work);
@@ -1055,125 +3053,448 @@ int find_reaped(Worker* (*workers)[2], pid_t pid, int size)
     return index;
 }
 
-/* clean_up_worker_pairs()
- * -----------------------
- * Reap pairs of workers and signal remaining workers accordingly.
+/* reap_pair_member()
+ * ------------------
+ * Reap one worker from an array of worker pairs and, if it failed, signal
+ * remaining workers accordingly.
  *
- * workers: Array of worker pairs to clean up
+ * workers: Array of worker pairs
  * size: Number of pairs in workers array
  * method: CompMethod being used by workers
  *
- * Returns: EXIT_OK if all pairs exited with exit status 0, otherwise the
- *          reason for death of the worker which failed.
+ * Returns: EXIT_OK if the reaped worker exited with exit status 0, otherwise
+ *          the reason for death of the worker which failed.
  */
-int clean_up_worker_pairs(Worker* (*workers)[2], int size, CompMethod method)
+int reap_pair_member(Worker* (*workers)[2], int size, CompMethod method)
 {
-    // loop for 2 * size since size is number of worker pairs and therefore
-    // there are 2 * size children to be reaped
-    for (int i = 0; i < PARALLEL_DECOMP_PAIR_SIZE * size; i++) {
-        int status;
-        pid_t pid = wait(&status);
-        int failIndex = find_reaped(workers, pid, size);
-        Worker* reaped;
+    int status;
+    double since = stats_now();
+    pid_t pid = wait(&status);
+    stats_blocked(&runStats.waitTime, since);
+    int failIndex = find_reaped(workers, pid, size);
+    Worker* reaped;
+
+    if (workers[failIndex][0]->pid == pid) {
+        reaped = workers[failIndex][0];
+    } else {
+        reaped = workers[failIndex][1];
+    }
+    // only enter here for workers[x][0] since workers[x][1] will always
+    // exit with EXIT_OK
+    if (!get_exit_reason(reaped, status, method)) {
+        // check if partner to worker is also still running and needs to be
+        // terminated
+        if (workers[failIndex][1]->state == WORKER_RUNNING) {
+            kill(workers[failIndex][1]->pid, SIGTERM);
+            waitpid(workers[failIndex][1]->pid, NULL, 0);
+        }
+        remove(workers[failIndex][0]->workingOn);
 
-        if (workers[failIndex][0]->pid == pid) {
-            reaped = workers[failIndex][0];
-        } else {
-            reaped = workers[failIndex][1];
-        }
-        // only enter here for workers[x][0] since workers[x][1] will always
-        // exit with EXIT_OK
-        if (!get_exit_reason(reaped, status, method)) {
-            // check if partner to worker is also still running and needs to be
-            // terminated
-            if (workers[failIndex][1]->state == WORKER_RUNNING) {
-                kill(workers[failIndex][1]->pid, SIGTERM);
-                waitpid(workers[failIndex][1]->pid, NULL, 0);
-            }
-            remove(workers[failIndex][0]->workingOn);
+        // signal remaining running pairs with SIGTERM and remove the output
+        // file they were working on
+        signal_and_remove_worker_pairs(workers, size);
+        return workers[failIndex][0]->state;
+    }
+    return EXIT_OK;
+}
 
-            // signal remaining running pairs with SIGTERM and remove the output
-            // file they were working on
-            signal_and_remove_worker_pairs(workers, size);
-            return workers[failIndex][0]->state;
-        }
+/* PairPool
+ *
+ * Worker pairs of a parallel decompression.
+ *
+ * workers: Pairs started so far. workers[x][0] is the child with the read end
+ *          of the pair's pipe and workers[x][1] the child with the write end.
+ * activePairs: Number of pairs in workers
+ * capacity: Number of pairs which workers has room for
+ * running: Number of workers which haven't been reaped
+ */
+typedef struct {
+    Worker* (*workers)[PARALLEL_DECOMP_PAIR_SIZE];
+    int activePairs;
+    int capacity;
+    int running;
+} PairPool;
+
+/* start_decompress_pair()
+ * -----------------------
+ * Start a worker pair to decompress some compressed data, first waiting for
+ * a pair to finish if param->jobs pairs are already running.
+ *
+ * param: Parameters passed through command line
+ * pool: Pairs of workers of the decompression
+ * comp: Compressed data and name of file to decompress it into
+ * outOffset: Offset in file to write decompressed data at, or -1 to create
+ *            the file from the data
+ * outLength: Maximum number of bytes decompressed data at outOffset takes up
+ *            (if outOffset >= 0)
+ *
+ * Returns: EXIT_OK if the pair was started, otherwise the exit reason of a
+ *          worker which failed while waiting
+ */
+int start_decompress_pair(Parameters* param, PairPool* pool, Compressed* comp,
+        off_t outOffset, off_t outLength)
+{
+    int status = EXIT_OK;
+    int maxRunning = PARALLEL_DECOMP_PAIR_SIZE * (param->jobs - 1);
+
+    // wait for a pair to free up before starting another
+    while ((status == EXIT_OK) && (pool->running > maxRunning)) {
+        status = reap_pair_member(
+                pool->workers, pool->activePairs, param->method);
+        pool->running--;
+    }
+    if (status != EXIT_OK) {
+        return status;
     }
+    if (pool->activePairs == pool->capacity) {
+        pool->capacity = pool->capacity ? 2 * pool->capacity : 1;
+        pool->workers = realloc(
+                pool->workers, pool->capacity * sizeof(*pool->workers));
+    }
+    Worker** pair = pool->workers[pool->activePairs++];
+    int pipefds[PARALLEL_DECOMP_PAIR_SIZE];
+    pipe(pipefds);
+    // initialise and start worker pair
+    pair[0] = init_worker(param, comp->orgFile);
+    pair[1] = init_worker(param, comp->orgFile);
+    pair[0]->outOffset = outOffset;
+    pair[0]->outLength = outLength;
+    pair[0]->stat = stats_begin(comp->orgFile, comp->size);
+    start_worker_pair(pair, comp, param->method, pipefds);
+    pool->running += PARALLEL_DECOMP_PAIR_SIZE;
+
+    // still in parent so close both ends of pipe (parent wont communicate
+    // with children)
+    close(pipefds[0]);
+    close(pipefds[1]);
     return EXIT_OK;
 }
 
+/* start_chunk_pairs()
+ * -------------------
+ * Start a worker pair for each chunk of a record from a chunked archive,
+ * each writing its part of the output file.
+ *
+ * param: Parameters passed through command line
+ * pool: Pairs of workers of the decompression
+ * extract: Record read from archive
+ * table: Chunk table of record
+ *
+ * Returns: EXIT_OK if all pairs were started, otherwise the exit reason of a
+ *          worker which failed while waiting
+ */
+int start_chunk_pairs(Parameters* param, PairPool* pool, Compressed* extract,
+        ChunkTable* table)
+{
+    Compressed chunk = {
+            extract->orgFile, extract->data + table->length, 0, true, 0};
+    int status = EXIT_OK;
+
+    create_empty_file(extract->orgFile);
+    for (uint32_t i = 0; (i < table->count) && (status == EXIT_OK); i++) {
+        chunk.size = chunk_size(table, i);
+        status = start_decompress_pair(param, pool, &chunk,
+                (off_t)i * table->chunkSize, table->chunkSize);
+        chunk.data += chunk.size;
+    }
+    return status;
+}
+
 /* decompress_parallel()
  * ---------------------
- * Decompress a .uqz archive in parallel (One process for each file in the
- * archive).
+ * Decompress a .uqz archive in parallel (One pair of processes for each file
+ * in the archive, or for each chunk of each file in a chunked archive). At
+ * most param->jobs pairs run at once, and a new pair is started each time a
+ * worker is reaped.
  *
  * param: Parameters passed through command line
+ * map: Mapped archive file
  * header: Header section of the archive file
+ * records: Indices of records to extract
+ * count: Number of records
  *
  * Returns: EXIT_OK if archive was successfully decompressed, FORMAT_ERROR if
- *          the archive file is not in a .uqz format or, if a uqzip child
- *          process exits abnormally, the exit reason for that child process
+ *          the archive file is not in a .uqz format, CHECKSUM_ERROR if any
+ *          extracted file doesn't match its hash (every file is checked and
+ *          each which doesn't match is removed) or, if a uqzip child process
+ *          exits abnormally, the exit reason for that child process
  */
-int decompress_parallel(Parameters* param, UqzHeaderSection* header)
+int decompress_parallel(Parameters* param, ArchiveMap* map,
+        UqzHeaderSection* header, uint32_t* records, uint32_t count)
 {
-    // workers[x][0] will be child with read end of pipe and workers[x][1]
-    // will be child with write end of pipe
-    int inputCount = header->numFiles;
-    int pipefds[inputCount][PARALLEL_DECOMP_PAIR_SIZE];
-    int activePairs = 0;
-    Worker* workers[inputCount][PARALLEL_DECOMP_PAIR_SIZE];
+    // Only records with data get pairs so the number of pairs needn't match
+    // the number of records
+    int status = EXIT_OK;
+    bool failed = false;
+    PairPool pool;
+    memset(&pool, 0, sizeof(pool));
 
-    for (int i = 0; i < inputCount; i++) {
-        int verify;
+    for (uint32_t i = 0; (i < count) && (status == EXIT_OK); i++) {
+        Compressed* extract;
+        ChunkTable table;
 
-        if ((verify = verify_extractable(param->archive, header, i))) {
+        if ((status = verify_extractable(
+                     param, map, header, records[i], &extract))) {
             // can't extract record so signal active pairs
-            signal_and_remove_worker_pairs(workers, activePairs);
-            free_worker_pairs(workers, activePairs);
-            return verify;
+            signal_and_remove_worker_pairs(pool.workers, pool.activePairs);
+            break;
         }
-        FILE* archive = fopen(param->archive, "r");
-        Compressed* extract = read_record(archive, header, i);
-        // close so children dont inherit
-        fclose(archive);
 
-        if (extract->size == 0) {
-            free_compressed(extract);
+        if (param->chunked && parse_chunk_table(extract, &table)) {
+            status = start_chunk_pairs(param, &pool, extract, &table);
+        } else if (extract->size == 0) {
             create_empty_file(extract->orgFile);
-            continue;
+        } else {
+            status = start_decompress_pair(param, &pool, extract, -1, 0);
         }
-        pipe(pipefds[i]);
-        // initialise and start worker pair
-        workers[i][0] = init_worker(param, extract->orgFile);
-        workers[i][1] = init_worker(param, extract->orgFile);
-        start_worker_pair(workers[i], extract, param->method, pipefds[i]);
-        activePairs++;
-
-        if ((workers[i][0]->pid) && (workers[i][1]->pid)) {
-            // still in parent so close both ends of pipe (parent wont
-            // communicate with children)
-            close(pipefds[i][0]);
-            close(pipefds[i][1]);
+        free_compressed(extract);
+    }
+    while ((status == EXIT_OK) && (pool.running > 0)) {
+        status = reap_pair_member(
+                pool.workers, pool.activePairs, param->method);
+        pool.running--;
+    }
+    // every file is complete so check all of them against their hashes (each
+    // which doesn't match is removed)
+    for (uint32_t i = 0; param->hashed && (i < count) && (status == EXIT_OK);
+            i++) {
+        Compressed* extract = read_payload(param, map, header, records[i]);
+        if (verify_output(extract)) {
+            failed = true;
         }
         free_compressed(extract);
     }
-    int pairStatus = clean_up_worker_pairs(workers, inputCount, param->method);
-    free_worker_pairs(workers, activePairs);
+    if (failed) {
+        status = CHECKSUM_ERROR;
+    }
+    free_worker_pairs(pool.workers, pool.activePairs);
+    return status;
+}
+
+/* RecordName
+ *
+ * Entry of an index of the records of an archive by file name.
+ *
+ * name: Name of the file stored in the record
+ * record: Index of the record in the archive
+ */
+typedef struct {
+    char* name;
+    uint32_t record;
+} RecordName;
+
+/* compare_record_names()
+ * ----------------------
+ * Compare two RecordName entries for qsort() and bsearch(), by name and then
+ * record index.
+ *
+ * a: First RecordName
+ * b: Second RecordName
+ *
+ * Returns: Negative, zero or positive if a is before, equal to or after b
+ */
+int compare_record_names(const void* a, const void* b)
+{
+    const RecordName* first = a;
+    const RecordName* second = b;
+    int order = strcmp(first->name, second->name);
+
+    if (order) {
+        return order;
+    }
+    return (first->record > second->record) - (first->record < second->record);
+}
 
-    if (pairStatus != EXIT_OK) {
-        return pairStatus;
+/* compare_names()
+ * ---------------
+ * Compare a file name with a RecordName entry for bsearch().
+ *
+ * key: File name
+ * entry: RecordName
+ *
+ * Returns: Negative, zero or positive if key is before, equal to or after the
+ *          name of entry
+ */
+int compare_names(const void* key, const void* entry)
+{
+    return strcmp(key, ((const RecordName*)entry)->name);
+}
+
+/* free_name_index()
+ * -----------------
+ * Free an index of the records of an archive.
+ *
+ * index: Index to free
+ * count: Number of entries in index
+ */
+void free_name_index(RecordName* index, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        free(index[i].name);
+    }
+    free(index);
+}
+
+/* build_name_index()
+ * ------------------
+ * Build an index of the records of an archive sorted by file name. Only the
+ * header of each record is read.
+ *
+ * map: Mapped archive
+ * header: Header section of the archive
+ *
+ * Returns: Allocated array of header->numFiles entries, or NULL if a record
+ *          doesn't fit within the archive.
+ */
+RecordName* build_name_index(ArchiveMap* map, UqzHeaderSection* header)
+{
+    RecordName* index = calloc(header->numFiles, sizeof(RecordName));
+
+    for (uint32_t i = 0; i < header->numFiles; i++) {
+        Compressed* comp = map_record(map, header, i);
+
+        if (comp == NULL) {
+            free_name_index(index, i);
+            return NULL;
+        }
+        index[i].name = comp->orgFile;
+        index[i].record = i;
+        comp->orgFile = NULL;
+        free_compressed(comp);
+    }
+    qsort(index, header->numFiles, sizeof(RecordName), compare_record_names);
+    return index;
+}
+
+/* select_records()
+ * ----------------
+ * Find the records holding the files named in param->inputFiles. Where a
+ * name is stored more than once, the last record is used, as it would
+ * overwrite the others when extracting the whole archive.
+ *
+ * param: Parameters passed through command line
+ * map: Mapped archive
+ * header: Header section of the archive
+ * records: Set to the indices of the records, in the order the names were
+ *          given (and without repeats)
+ * count: Set to the number of records
+ *
+ * Returns: EXIT_OK if every name was found, FORMAT_ERROR if a record is not
+ *          in the correct format or MISSING_ERROR if a name isn't in the
+ *          archive.
+ */
+int select_records(Parameters* param, ArchiveMap* map,
+        UqzHeaderSection* header, uint32_t** records, uint32_t* count)
+{
+    RecordName* index = build_name_index(map, header);
+
+    if (index == NULL) {
+        fprintf(stderr, "uqzip: File \"%s\" has invalid format\n",
+                param->archive);
+        return FORMAT_ERROR;
+    }
+    bool* chosen = calloc(header->numFiles, sizeof(bool));
+    int status = EXIT_OK;
+    *records = malloc(param->inputCount * sizeof(uint32_t));
+    *count = 0;
+
+    for (int i = 0; (i < param->inputCount) && (status == EXIT_OK); i++) {
+        RecordName* found = bsearch(param->inputFiles[i], index,
+                header->numFiles, sizeof(RecordName), compare_names);
+
+        if (found == NULL) {
+            fprintf(stderr, "uqzip: \"%s\" is not in archive \"%s\"\n",
+                    param->inputFiles[i], param->archive);
+            status = MISSING_ERROR;
+            break;
+        }
+        // move to the last record with this name
+        while ((found + 1 < index + header->numFiles)
+                && !strcmp(found[1].name, found->name)) {
+            found++;
+        }
+        if (!chosen[found->record]) {
+            chosen[found->record] = true;
+            (*records)[(*count)++] = found->record;
+        }
+    }
+    free(chosen);
+    free_name_index(index, header->numFiles);
+    return status;
+}
+
+/* list_records()
+ * --------------
+ * Print the compressed size and file name (and hash, if the archive is
+ * hashed) of each record of an archive, without decompressing anything.
+ *
+ * param: Parameters passed through command line
+ * map: Mapped archive
+ * header: Header section of the archive
+ *
+ * Returns: EXIT_OK if every record was listed or FORMAT_ERROR if a record is
+ *          not in the correct format.
+ */
+int list_records(Parameters* param, ArchiveMap* map, UqzHeaderSection* header)
+{
+    for (uint32_t i = 0; i < header->numFiles; i++) {
+        Compressed* comp = read_payload(param, map, header, i);
+
+        if (comp == NULL) {
+            fprintf(stderr, "uqzip: File \"%s\" has invalid format\n",
+                    param->archive);
+            return FORMAT_ERROR;
+        }
+        if (param->hashed) {
+            printf("%" PRIu32 "\t%016" PRIx64 "\t%s\n", comp->size,
+                    comp->hash, comp->orgFile);
+        } else {
+            printf("%" PRIu32 "\t%s\n", comp->size, comp->orgFile);
+        }
+        free_compressed(comp);
     }
     return EXIT_OK;
 }
 
+/* map_archive()
+ * -------------
+ * Map an open archive file into memory.
+ *
+ * archivefd: File descriptor of archive
+ * map: ArchiveMap to fill in
+ *
+ * Returns: true if the archive was mapped, false if it isn't a regular file
+ *          or couldn't be mapped.
+ */
+bool map_archive(int archivefd, ArchiveMap* map)
+{
+    struct stat info;
+
+    if ((fstat(archivefd, &info) == -1) || !S_ISREG(info.st_mode)
+            || (info.st_size == 0)) {
+        return false;
+    }
+    map->size = info.st_size;
+    map->data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, archivefd, 0);
+    if (map->data == MAP_FAILED) {
+        return false;
+    }
+    // records are mostly read front to back
+    madvise(map->data, map->size, MADV_SEQUENTIAL);
+    return true;
+}
+
 /* decompress_archive()
  * --------------------
- * Decompress a .uqz archive file.
+ * Decompress a .uqz archive file, or with --extract just the named files
+ * from it, or with --list list its records.
  *
  * param: Parameters passed through command line
  *
- * Returns: READ_ERROR if archive file cannot be opened for reading,
- *          FORMAT_ERROR if the archive file does not contain a valid header
- *          section.
+ * Returns: READ_ERROR if archive file cannot be opened for reading (or
+ *          mapped), FORMAT_ERROR if the archive file does not contain a valid
+ *          header section, MISSING_ERROR if a file to extract isn't in the
+ *          archive, otherwise the status of listing or decompressing.
  */
 int decompress_archive(Parameters* param)
 {
@@ -1193,19 +3514,263 @@ int decompress_archive(Parameters* param)
         return FORMAT_ERROR;
     }
     // update param with method which was originally used to create archive
-    param->method = header->method;
+    param->method = header->method & ~(UQZ_CHUNKED | UQZ_HASHED);
+    param->chunked = header->method & UQZ_CHUNKED;
+    param->hashed = header->method & UQZ_HASHED;
+
+    if ((param->method < NOCOMP) || (param->method > ZIP)
+            || (param->chunked && (param->method == ZIP))) {
+        fprintf(stderr, "uqzip: File \"%s\" has invalid format\n",
+                param->archive);
+        free_uqz_header_section(header);
+        fclose(archive);
+        return FORMAT_ERROR;
+    }
+    ArchiveMap map;
+    bool mapped = map_archive(fileno(archive), &map);
+    // the mapping stays valid once the file is closed
     fclose(archive);
+
+    if (!mapped) {
+        fprintf(stderr, "uqzip: can't open file \"%s\" for reading\n",
+                param->archive);
+        free_uqz_header_section(header);
+        return READ_ERROR;
+    }
     int status = EXIT_OK;
+    uint32_t* records = NULL;
+    uint32_t count = header->numFiles;
 
-    if (param->parallel) {
-        status = decompress_parallel(param, header);
+    if (param->list) {
+        status = list_records(param, &map, header);
+    } else if (param->extract) {
+        status = select_records(param, &map, header, &records, &count);
     } else {
-        status = decompress_sequential(param, header);
+        records = malloc(count * sizeof(uint32_t));
+        for (uint32_t i = 0; i < count; i++) {
+            records[i] = i;
+        }
+    }
+    if ((status != EXIT_OK) || param->list) {
+        // nothing to extract
+    } else if (param->parallel) {
+        status = decompress_parallel(param, &map, header, records, count);
+    } else {
+        status = decompress_sequential(param, &map, header, records, count);
     }
+    free(records);
+    munmap(map.data, map.size);
     free_uqz_header_section(header);
     return status;
 }
 
+/* use_codec()
+ * -----------
+ * Check whether files are to be compressed by in-process codecs. gzip_codec()
+ * doesn't reproduce the gzip command's output, so --gz only uses it when
+ * chunking (which the command can't do).
+ *
+ * param: Command line parameters
+ *
+ * Returns: true if compressing with in-process codecs, false otherwise
+ */
+bool use_codec(Parameters* param)
+{
+    return param->inProcess && codecLUT[param->method]
+            && ((param->method != GZ) || param->chunked);
+}
+
+/* compress_records()
+ * ------------------
+ * Compress each of a set of input files into its own record.
+ *
+ * param: Command line parameters
+ * writer: ArchiveWriter for output archive
+ *
+ * Returns: the status of compress_in_process() if compressing with
+ *          in-process codecs, compress_parallel() if compressing in
+ *          parallel or compress_sequential() if compressing sequentially.
+ */
+int compress_records(Parameters* param, ArchiveWriter* writer)
+{
+    if (use_codec(param)) {
+        return compress_in_process(param, writer);
+    } else if (param->parallel) {
+        return compress_parallel(param, writer);
+    }
+    return compress_sequential(param, writer);
+}
+
+/* FileHash
+ *
+ * Hash of an input file, for finding identical input files.
+ *
+ * hash: Hash of the file's contents
+ * index: Index of param->inputFiles[] of the file
+ */
+typedef struct {
+    uint64_t hash;
+    int index;
+} FileHash;
+
+/* compare_file_hashes()
+ * ---------------------
+ * Compare two FileHash entries for qsort(), by hash and then input index.
+ *
+ * a: First FileHash
+ * b: Second FileHash
+ *
+ * Returns: Negative, zero or positive if a is before, equal to or after b
+ */
+int compare_file_hashes(const void* a, const void* b)
+{
+    const FileHash* first = a;
+    const FileHash* second = b;
+
+    if (first->hash != second->hash) {
+        return (first->hash > second->hash) ? 1 : -1;
+    }
+    return first->index - second->index;
+}
+
+/* files_identical()
+ * -----------------
+ * Compare the contents of two files byte for byte.
+ *
+ * first: Name of first file
+ * second: Name of second file
+ *
+ * Returns: true if both files could be read and are identical, false
+ *          otherwise
+ */
+bool files_identical(const char* first, const char* second)
+{
+    FILE* files[] = {fopen(first, "r"), fopen(second, "r")};
+    uint8_t* buffers[] = {malloc(STREAM_BUFF_SIZE), malloc(STREAM_BUFF_SIZE)};
+    bool identical = (files[0] != NULL) && (files[1] != NULL);
+
+    while (identical) {
+        size_t got = fread(buffers[0], 1, STREAM_BUFF_SIZE, files[0]);
+        identical = (fread(buffers[1], 1, STREAM_BUFF_SIZE, files[1]) == got)
+                && !memcmp(buffers[0], buffers[1], got)
+                && !ferror(files[0]) && !ferror(files[1]);
+        if (got < STREAM_BUFF_SIZE) {
+            break;
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (files[i] != NULL) {
+            fclose(files[i]);
+        }
+        free(buffers[i]);
+    }
+    return identical;
+}
+
+/* find_duplicates()
+ * -----------------
+ * Hash every input file and find which are identical to an earlier one.
+ * Files with the same hash are compared byte for byte, so a hash collision
+ * never makes a file share another's data.
+ *
+ * param: Command line parameters
+ * hashes: Set to the hash of each input file
+ * owners: Set to the index of the first input file identical to each input
+ *         file (its own index if there is no earlier one, or it can't be read)
+ */
+void find_duplicates(Parameters* param, uint64_t* hashes, int* owners)
+{
+    FileHash* sorted = malloc(param->inputCount * sizeof(FileHash));
+    int count = 0;
+
+    for (int i = 0; i < param->inputCount; i++) {
+        owners[i] = i;
+        hashes[i] = 0;
+        // files which can't be read are left to fail when compressed
+        if (hash_file(param->inputFiles[i], &hashes[i])) {
+            sorted[count].hash = hashes[i];
+            sorted[count++].index = i;
+        }
+    }
+    qsort(sorted, count, sizeof(FileHash), compare_file_hashes);
+    int run = 0;
+    for (int i = 1; i < count; i++) {
+        if (sorted[i].hash != sorted[i - 1].hash) {
+            run = i;
+            continue;
+        }
+        // share the data of the first earlier file with the same contents
+        // (the earlier files with this hash are in input order)
+        for (int j = run; j < i; j++) {
+            int owner = sorted[j].index;
+            if ((owners[owner] == owner)
+                    && files_identical(param->inputFiles[owner],
+                            param->inputFiles[sorted[i].index])) {
+                owners[sorted[i].index] = owner;
+                break;
+            }
+        }
+    }
+    free(sorted);
+}
+
+/* compress_deduplicated()
+ * -----------------------
+ * Compress a set of input files into a hashed archive. Only the first of a
+ * group of identical files is compressed, and the others get records which
+ * share its compressed data.
+ *
+ * param: Command line parameters
+ * writer: ArchiveWriter for output archive
+ *
+ * Returns: the status of compress_records() for the files compressed
+ */
+int compress_deduplicated(Parameters* param, ArchiveWriter* writer)
+{
+    int inputCount = param->inputCount;
+    uint64_t* hashes = malloc(inputCount * sizeof(uint64_t));
+    int* owners = malloc(inputCount * sizeof(int));
+    int* unique = malloc(inputCount * sizeof(int));
+    find_duplicates(param, hashes, owners);
+
+    // compress the files which have no earlier identical file as if they
+    // were the only input files
+    Parameters distinct = *param;
+    distinct.inputFiles = malloc(inputCount * sizeof(char*));
+    distinct.inputCount = 0;
+    writer->hashes = malloc(inputCount * sizeof(uint64_t));
+    for (int i = 0; i < inputCount; i++) {
+        if (owners[i] == i) {
+            unique[i] = distinct.inputCount;
+            writer->hashes[distinct.inputCount] = hashes[i];
+            distinct.inputFiles[distinct.inputCount++] = param->inputFiles[i];
+        }
+    }
+    int status = compress_records(&distinct, writer);
+
+    if (status == EXIT_OK) {
+        // the records of distinct files take up the start of offsets so
+        // move them to their files' places and add the other files' records
+        uint32_t* distinctOffsets
+                = malloc(distinct.inputCount * sizeof(uint32_t));
+        memcpy(distinctOffsets, writer->offsets,
+                distinct.inputCount * sizeof(uint32_t));
+        for (int i = 0; i < inputCount; i++) {
+            uint32_t payload = distinctOffsets[unique[owners[i]]];
+            writer->offsets[i] = (owners[i] == i)
+                    ? payload
+                    : write_alias_record(
+                            writer, param, i, hashes[i], payload);
+        }
+        free(distinctOffsets);
+    }
+    free(distinct.inputFiles);
+    free(hashes);
+    free(owners);
+    free(unique);
+    return status;
+}
+
 /* compress_files()
  * ----------------
  * Compress a set of files into a .uqz archive.
@@ -1213,23 +3778,28 @@ int decompress_archive(Parameters* param)
  * param: Parameters passed through command line
  *
  * Returns: WRITE_ERROR if output file cannot be opened for writing otherwise
- *          returns the status of compress_parallel() if compressing in
- *          parallel or compress_sequential() if compressing sequentially.
+ *          returns the status of compress_deduplicated() if the archive is
+ *          hashed or compress_records() if it isn't.
  */
 int compress_files(Parameters* param)
 {
     int status;
+    ArchiveWriter* writer = open_archive_writer(param);
 
-    if (!write_header_section(param)) {
+    if (writer == NULL) {
         // couldn't write the header
         return WRITE_ERROR;
     }
 
-    if (param->parallel) {
-        status = compress_parallel(param);
+    if (param->hashed) {
+        status = compress_deduplicated(param, writer);
     } else {
-        status = compress_sequential(param);
+        status = compress_records(param, writer);
+    }
+    if (status == EXIT_OK) {
+        write_record_offsets(writer);
     }
+    free_archive_writer(writer);
     return status;
 }
 
@@ -1257,22 +3827,29 @@ int main(int argc, char** argv)
 
     if (param == NULL) {
         fprintf(stderr,
-                "Usage: ./uqzip [--output outputFileName] [--parallel] "
-                "[--nocomp|--gz|--zip|--xz|--bzip2] filename ...\n");
+                "Usage: ./uqzip [--output outputFileName] "
+                "[--parallel [--jobs N]] [--inprocess] [--chunked] [--dedup] "
+                "[--stats] [--nocomp|--gz|--zip|--xz|--bzip2] filename ...\n");
+        fprintf(stderr,
+                "   Or: ./uqzip --decompress [--parallel [--jobs N]] "
+                "[--stats] archive-file\n");
         fprintf(stderr,
-                "   Or: ./uqzip --decompress [--parallel] archive-file\n");
+                "   Or: ./uqzip --extract [--parallel [--jobs N]] [--stats] "
+                "archive-file name ...\n");
+        fprintf(stderr, "   Or: ./uqzip --list archive-file\n");
         exit(USAGE_ERROR);
     }
+    runStats.enabled = param->stats;
+    runStats.start = stats_now();
+
     if (param->method != DECOMP) {
-        if (!write_header_section(param)) {
-            // couldn't write header section of archive
-            free_parameters(param);
-            exit(WRITE_ERROR);
-        }
         int compStatus = compress_files(param);
 
         if (compStatus) {
             // something went wrong with compression
+            if (param->stats) {
+                print_stats(param, compStatus);
+            }
             free_parameters(param);
             exit(compStatus);
         }
@@ -1281,10 +3858,16 @@ int main(int argc, char** argv)
 
         if (deCompStatus) {
             // something went wrong with decompression
+            if (param->stats) {
+                print_stats(param, deCompStatus);
+            }
             free_parameters(param);
             exit(deCompStatus);
         }
     }
+    if (param->stats) {
+        print_stats(param, EXIT_OK);
+    }
     free_parameters(param);
     exit(EXIT_OK);
 }
@@ -0,0 +1,164 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <csse2310a4.h>
+#include "chessprotocol.h"
+
+/* free_game_info()
+ * ----------------
+ * Free a GameInfo struct.
+ *
+ * info: GameInfo struct to free
+ */
+void free_game_info(GameInfo* info)
+{
+    sem_destroy(info->infoLock);
+    free(info->infoLock);
+    free(info->colour);
+    free(info->opponent);
+    free(info);
+}
+
+/* connect_to_server()
+ * -------------------
+ * Attempt to establish a connection with uqchessserver.
+ *
+ * port: Port uqchessserver is listening on
+ *
+ * Returns: File descriptor of socket connected to uqchessserver if the
+ *          connection was successful, otherwise -1.
+ */
+int connect_to_server(const char* port)
+{
+    // setup addrinfo structs to hold server address info and hints to use
+    // when searching for server.
+    struct addrinfo* ai = NULL;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo("localhost", port, &hints, &ai)) {
+        // couldn't find an address
+        freeaddrinfo(ai);
+        return -1;
+    }
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if ((sockfd >= 0)
+            && (connect(sockfd, ai->ai_addr, sizeof(struct addrinfo)))) {
+        // connect returned non-zero value (error)
+        close(sockfd);
+        sockfd = -1;
+    }
+    freeaddrinfo(ai);
+    return sockfd;
+}
+
+/* move_string_valid()
+ * -------------------
+ * Check if a move string e.g. "e2e4" is a valid move string or not. This
+ * does not consider any game position but rather the validity of the string
+ * itself.
+ *
+ * move: Move string to validate
+ *
+ * Returns: True if move is a valid move string, false otherwise
+ */
+bool move_string_valid(char* move)
+{
+    if ((move == NULL) || (move[0] == '\n') || (!move[0])) {
+        return false;
+    }
+    // -1 to ignore the '\n' character at end of move string
+    int moveLen = strlen(move) - 1;
+
+    if (moveLen < MIN_MOVE_STRING_LENGTH || moveLen > MAX_MOVE_STRING_LENGTH) {
+        return false;
+    }
+
+    // loop to len - 1 since character before null is newline
+    for (int i = 0; i < moveLen; i++) {
+        if (!isalnum(move[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* translate_command()
+ * -------------------
+ * Translate a command inputted by user into a command which uqchessserver can
+ * understand.
+ *
+ * info: GameInfo of current game being played
+ * userCommand: Command inputted by user to be translated
+ *
+ * Returns: Pointer to corresponding command to be sent to uqchessserver
+ */
+char* translate_command(GameInfo* info, char* userCommand)
+{
+    char* userDup = strdup(userCommand);
+    char** args = split_by_char(userDup, ' ', 0);
+    char* serverCmd = NULL;
+
+    if (!strcmp(args[0], "newgame\n")) {
+        // user wants to start new game so create string
+        // "start (opponent) (colour)"
+        serverCmd = (char*)malloc(strlen("start  ") + strlen(info->opponent)
+                + strlen(info->colour) + 1);
+        strcpy(serverCmd, "start ");
+        strcat(serverCmd, info->opponent);
+        strcat(serverCmd, " ");
+        strcat(serverCmd, info->colour);
+    } else if (!strcmp(args[0], "print\n")) {
+        serverCmd = strdup("board\n");
+    } else if (!strcmp(args[0], "hint\n")) {
+        serverCmd = strdup("hint best\n");
+    } else if (!strcmp(args[0], "possible\n")) {
+        serverCmd = strdup("hint all\n");
+    } else if (!strcmp(args[0], "move")) {
+        serverCmd = strdup(userCommand);
+    } else if (!strcmp(args[0], "resign\n")) {
+        serverCmd = strdup(args[0]);
+    }
+    free(userDup);
+    free(args);
+    return serverCmd;
+}
+
+/* update_info_from_response()
+ * ---------------------------
+ * Update GameInfo struct based on a server response string.
+ *
+ * info: GameInfo struct to update
+ * response: String of response from uqchessserver
+ */
+void update_info_from_response(GameInfo* info, char* response)
+{
+    // Take semaphore
+    sem_wait(info->infoLock);
+    // update info->turn and info->started accordingly
+    if (strstr(response, "started")) {
+        if (strstr(response, "white")) {
+            info->turn = true;
+        } else {
+            info->turn = false;
+        }
+        info->started = true;
+    }
+    if (!strcmp(response, "ok\n")) {
+        info->turn = false;
+    }
+    if (strstr(response, "error") || strstr(response, "moved")) {
+        info->turn = true;
+    }
+    if (strstr(response, "resign") || strstr(response, "gameover")) {
+        info->started = false;
+    }
+    sem_post(info->infoLock);
+}
@@ -0,0 +1,42 @@
+/*
+ * chessprotocol.h
+ */
+
+#ifndef CHESSPROTOCOL_H
+#define CHESSPROTOCOL_H
+
+#include <stdbool.h>
+#include <semaphore.h>
+
+// Maximum and minimum length of a move string e.g. "e2e4"
+#define MIN_MOVE_STRING_LENGTH 4
+#define MAX_MOVE_STRING_LENGTH 5
+
+/* GameInfo
+ *
+ * Stores information about the current game being played as well as other
+ * information needed by the worker threads.
+ *
+ * infoLock: Semaphore to use when updating values within struct
+ * turn: true if it is the clients turn to play, false otherwise
+ * started: true if the client is currently in a game, false otherwise
+ * sockfd: File descriptor of socket connected to server
+ * colour: Colour being played by client
+ * opponent: Opponent of client (human or computer)
+ */
+typedef struct {
+    sem_t* infoLock;
+    bool turn;
+    bool started;
+    int sockfd;
+    char* colour;
+    char* opponent;
+} GameInfo;
+
+void free_game_info(GameInfo* info);
+int connect_to_server(const char* port);
+bool move_string_valid(char* move);
+char* translate_command(GameInfo* info, char* userCommand);
+void update_info_from_response(GameInfo* info, char* response);
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "linereader.h"
+
+// Number of bytes a LineReader's buffer starts out holding
+#define INITIAL_CAPACITY 4096
+
+/* init_line_reader()
+ * ------------------
+ * Initialise a LineReader with an empty buffer.
+ *
+ * fd: File descriptor to read lines from (this is not closed by
+ *     free_line_reader())
+ *
+ * Returns: Pointer to initialised LineReader
+ */
+LineReader* init_line_reader(int fd)
+{
+    LineReader* reader = (LineReader*)malloc(sizeof(LineReader));
+    reader->fd = fd;
+    reader->capacity = INITIAL_CAPACITY;
+    reader->buffer = (char*)malloc(reader->capacity + 1);
+    reader->start = 0;
+    reader->length = 0;
+    reader->scanned = 0;
+    reader->savedAt = -1;
+    return reader;
+}
+
+/* free_line_reader()
+ * ------------------
+ * Free a LineReader (any lines it returned are no longer valid).
+ *
+ * reader: LineReader to free
+ */
+void free_line_reader(LineReader* reader)
+{
+    free(reader->buffer);
+    free(reader);
+}
+
+/* restore_saved()
+ * ---------------
+ * Put back the byte overwritten by the null terminator of the last line
+ * returned.
+ *
+ * reader: LineReader to restore byte of
+ */
+void restore_saved(LineReader* reader)
+{
+    if (reader->savedAt >= 0) {
+        reader->buffer[reader->savedAt] = reader->saved;
+        reader->savedAt = -1;
+    }
+}
+
+/* fill_line_reader()
+ * ------------------
+ * Read once from a LineReader's file descriptor into its buffer. Data
+ * already returned in lines is discarded and the buffer is grown if it is
+ * full.
+ *
+ * reader: LineReader to fill
+ *
+ * Returns: Number of bytes read, 0 at end of file or -1 if read() failed
+ *          (errno is set by read())
+ */
+ssize_t fill_line_reader(LineReader* reader)
+{
+    restore_saved(reader);
+    if (reader->start > 0) {
+        // move unreturned data to the front of the buffer
+        reader->length -= reader->start;
+        memmove(reader->buffer, reader->buffer + reader->start,
+                reader->length);
+        reader->start = 0;
+    }
+    if (reader->length == reader->capacity) {
+        reader->capacity *= 2;
+        reader->buffer
+                = (char*)realloc(reader->buffer, reader->capacity + 1);
+    }
+    ssize_t got = read(reader->fd, reader->buffer + reader->length,
+            reader->capacity - reader->length);
+    if (got > 0) {
+        reader->length += got;
+    }
+    return got;
+}
+
+/* peek_buffered_line()
+ * --------------------
+ * Get the next complete line in a LineReader's buffer without removing it
+ * (nothing is read from the file descriptor).
+ *
+ * reader: LineReader to get line from
+ * length: Pointer to store length of the line in (may be NULL)
+ *
+ * Returns: Pointer to the null terminated line, including its trailing '\n',
+ *          in the reader's buffer or NULL if no complete line is buffered
+ */
+char* peek_buffered_line(LineReader* reader, size_t* length)
+{
+    restore_saved(reader);
+    char* line = reader->buffer + reader->start;
+    size_t unscanned = reader->length - reader->start - reader->scanned;
+    char* end = memchr(line + reader->scanned, '\n', unscanned);
+
+    if (end == NULL) {
+        // remember where to continue searching once more data is read
+        reader->scanned += unscanned;
+        return NULL;
+    }
+    reader->savedAt = end + 1 - reader->buffer;
+    reader->saved = end[1];
+    end[1] = '\0';
+    reader->scanned = end - line;
+    if (length != NULL) {
+        *length = end + 1 - line;
+    }
+    return line;
+}
+
+/* next_buffered_line()
+ * --------------------
+ * Remove and return the next complete line in a LineReader's buffer
+ * (nothing is read from the file descriptor).
+ *
+ * reader: LineReader to get line from
+ * length: Pointer to store length of the line in (may be NULL)
+ *
+ * Returns: Pointer to the null terminated line, including its trailing '\n',
+ *          in the reader's buffer or NULL if no complete line is buffered
+ */
+char* next_buffered_line(LineReader* reader, size_t* length)
+{
+    char* line = peek_buffered_line(reader, length);
+
+    if (line != NULL) {
+        reader->start = reader->savedAt;
+        reader->scanned = 0;
+    }
+    return line;
+}
+
+/* read_buffered_line()
+ * --------------------
+ * Get the next line from a LineReader, reading from its file descriptor
+ * until a complete line is available. A partial line at end of file is
+ * discarded.
+ *
+ * reader: LineReader to get line from
+ * length: Pointer to store length of the line in (may be NULL)
+ *
+ * Returns: Pointer to the null terminated line, including its trailing '\n',
+ *          in the reader's buffer or NULL at end of file or on error
+ */
+char* read_buffered_line(LineReader* reader, size_t* length)
+{
+    while (true) {
+        char* line = next_buffered_line(reader, length);
+        if (line != NULL) {
+            return line;
+        }
+        ssize_t got = fill_line_reader(reader);
+        if ((got < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (got <= 0) {
+            return NULL;
+        }
+    }
+}
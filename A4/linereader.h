@@ -0,0 +1,46 @@
+/*
+ * linereader.h
+ */
+
+#ifndef LINEREADER_H
+#define LINEREADER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* LineReader
+ *
+ * Stores data read from a file descriptor which hasn't been returned as a
+ * line yet. Lines are returned as views into the buffer, which stay valid
+ * until the reader is next used.
+ *
+ * fd: File descriptor to read from
+ * buffer: Data read from fd (one byte more than capacity is allocated so the
+ *         last line in the buffer can always be null terminated)
+ * capacity: Number of bytes of data buffer can hold
+ * start: Index in buffer of the first byte not yet returned in a line
+ * length: Index in buffer one past the last byte of data
+ * scanned: Number of bytes after start already searched for a newline
+ * saved: Byte overwritten by the null terminator of the last line returned
+ * savedAt: Index in buffer of the byte in saved (-1 if none)
+ */
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t capacity;
+    size_t start;
+    size_t length;
+    size_t scanned;
+    char saved;
+    ssize_t savedAt;
+} LineReader;
+
+LineReader* init_line_reader(int fd);
+void free_line_reader(LineReader* reader);
+ssize_t fill_line_reader(LineReader* reader);
+char* peek_buffered_line(LineReader* reader, size_t* length);
+char* next_buffered_line(LineReader* reader, size_t* length);
+char* read_buffered_line(LineReader* reader, size_t* length);
+
+#endif
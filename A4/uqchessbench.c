@@ -0,0 +1,848 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <csse2310a4.h>
+#include "linereader.h"
+#include "chessprotocol.h"
+
+// Error/status codes
+#define STATUS_OK 0
+#define USAGE_ERROR 4
+#define SERVER_ERROR 5
+#define SCRIPT_ERROR 6
+#define PORT_ERROR 18
+
+// Values of options which aren't given on the command line
+#define DEFAULT_CLIENTS 100
+#define DEFAULT_GAMES 1
+#define DEFAULT_MOVES 40
+#define DEFAULT_SEED 2310
+
+// Every HINT_INTERVAL turns a client also asks for the board and the best
+// move before moving
+#define HINT_INTERVAL 4
+
+// Max number of socket events handled per wait
+#define MAX_EVENTS 64
+
+// Max length (including the null terminator) of a command sent to the server
+#define MAX_COMMAND_LENGTH 64
+
+// Microseconds in a second and in a millisecond
+#define USEC_PER_SEC 1000000.0
+#define USEC_PER_MSEC 1000.0
+
+// Types of request whose latency is measured (in the same order as
+// requestNames). REPLY_REQUEST is the wait for the computer's move after a
+// move is accepted.
+typedef enum {
+    START_REQUEST,
+    BOARD_REQUEST,
+    HINT_BEST_REQUEST,
+    HINT_ALL_REQUEST,
+    MOVE_REQUEST,
+    RESIGN_REQUEST,
+    REPLY_REQUEST,
+    NO_REQUEST
+} RequestType;
+
+// Names of the request types used in the report
+const char* const requestNames[] = {"start", "board", "hint best", "hint all",
+        "move", "resign", "computer reply"};
+
+/* Parameters
+ *
+ * Stores the options given to the benchmark on the command line.
+ *
+ * port: Port uqchessserver is listening on
+ * clients: Number of clients to connect to the server at once
+ * humans: Number of the clients which play each other rather than the
+ *         computer
+ * games: Number of games each client plays
+ * moves: Number of moves each client makes in a game before resigning
+ * script: Name of file of commands each client plays at the start of every
+ *         game (NULL if none)
+ * seed: Seed of the random moves chosen by clients
+ */
+typedef struct {
+    char* port;
+    int clients;
+    int humans;
+    int games;
+    int moves;
+    char* script;
+    unsigned int seed;
+} Parameters;
+
+/* Samples
+ *
+ * Stores the latencies measured for one type of request.
+ *
+ * values: Latencies in microseconds
+ * count: Number of latencies in values
+ * capacity: Number of latencies which fit in values
+ */
+typedef struct {
+    uint64_t* values;
+    size_t count;
+    size_t capacity;
+} Samples;
+
+/* Bot
+ *
+ * Stores the state of one simulated client. Each bot has at most one
+ * request to the server waiting for a response.
+ *
+ * info: Game state tracked from the server's responses
+ * input: Reader buffering responses from the server
+ * seed: State of the random number generator used to choose moves
+ * human: True if the bot plays other bots, false if it plays the computer
+ * open: True if the bot is still connected to the server
+ * gamesLeft: Number of games the bot is yet to start
+ * movesMade: Number of moves the bot has made in its current game
+ * turns: Number of turns the bot has finished in its current game
+ * scriptLine: Index of the next line of the script to play
+ * pending: Type of the request waiting for a response (NO_REQUEST if none)
+ * sentAt: Time at which the pending request was sent
+ * awaitingReply: True if waiting for the computer to reply to a move
+ * acceptedAt: Time at which the bot's last move was accepted
+ * inBoard: True if between the "startboard" and "endboard" lines of a board
+ * askedBoard: True if the bot has asked for the board this turn
+ * askedHint: True if the bot has asked for the best move this turn
+ * movesLine: Copy of the last "moves" line listing the legal moves this turn
+ *            (NULL if they aren't known)
+ * moves: Legal moves this turn (split from movesLine)
+ * moveCount: Number of moves in moves
+ */
+typedef struct {
+    GameInfo* info;
+    LineReader* input;
+    unsigned int seed;
+    bool human;
+    bool open;
+    int gamesLeft;
+    int movesMade;
+    int turns;
+    int scriptLine;
+    RequestType pending;
+    uint64_t sentAt;
+    bool awaitingReply;
+    uint64_t acceptedAt;
+    bool inBoard;
+    bool askedBoard;
+    bool askedHint;
+    char* movesLine;
+    char** moves;
+    int moveCount;
+} Bot;
+
+/* Bench
+ *
+ * Stores the state of the whole benchmark.
+ *
+ * param: Options given on the command line
+ * epollfd: File descriptor of the epoll instance watching all sockets
+ * bots: Array of param->clients bots
+ * live: Number of bots still connected
+ * liveHumans: Number of bots playing each other still connected
+ * script: Commands (as typed into uqchessclient) played at the start of
+ *         each game
+ * scriptLength: Number of commands in script
+ * samples: Latencies measured, indexed by RequestType
+ * movesMade: Number of moves accepted by the server
+ * gamesPlayed: Number of games finished (a game between two bots counts
+ *              once for each of them)
+ * errors: Number of error responses received during a game
+ */
+typedef struct {
+    Parameters* param;
+    int epollfd;
+    Bot* bots;
+    int live;
+    int liveHumans;
+    char** script;
+    int scriptLength;
+    Samples samples[NO_REQUEST];
+    unsigned long movesMade;
+    unsigned long gamesPlayed;
+    unsigned long errors;
+} Bench;
+
+/* parse_count()
+ * -------------
+ * Parse the argument of an option taking a count.
+ *
+ * arg: Argument to parse
+ *
+ * Returns: Number given by arg OR -1 if arg isn't a non-negative integer
+ */
+int parse_count(char* arg)
+{
+    char* end;
+    long count = strtol(arg, &end, 10);
+
+    if (!isdigit(arg[0]) || *end || (count > INT_MAX)) {
+        return -1;
+    }
+    return (int)count;
+}
+
+/* parse_option()
+ * --------------
+ * Parse an option and its value into a Parameters struct.
+ *
+ * param: Parameters struct to parse option into
+ * option: Option e.g. "--clients"
+ * value: Argument following option
+ *
+ * Returns: true if option was valid and could be parsed into param, false
+ *          otherwise.
+ */
+bool parse_option(Parameters* param, char* option, char* value)
+{
+    int count = parse_count(value);
+
+    if (!strcmp(option, "--clients") && !param->clients && (count > 0)) {
+        param->clients = count;
+    } else if (!strcmp(option, "--humans") && (param->humans < 0)
+            && (count >= 0)) {
+        param->humans = count;
+    } else if (!strcmp(option, "--games") && !param->games && (count > 0)) {
+        param->games = count;
+    } else if (!strcmp(option, "--moves") && !param->moves && (count > 0)) {
+        param->moves = count;
+    } else if (!strcmp(option, "--script") && (param->script == NULL)) {
+        param->script = value;
+    } else if (!strcmp(option, "--seed") && !param->seed && (count > 0)) {
+        param->seed = count;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* process_cmdline_args()
+ * ----------------------
+ * Process the command line arguments passed to program into a Parameters
+ * struct.
+ *
+ * argc: Number of command line arguments
+ * argv: Array of command line arguments
+ * param: Parameters struct to store options in
+ *
+ * Returns: True if the command line arguments are valid, false otherwise
+ */
+bool process_cmdline_args(int argc, char** argv, Parameters* param)
+{
+    memset(param, 0, sizeof(Parameters));
+    param->humans = -1;
+
+    // the port must come first
+    if ((argc < 2) || !argv[1][0] || !strncmp(argv[1], "--", 2)) {
+        return false;
+    }
+    param->port = argv[1];
+    for (int i = 2; i < argc; i += 2) {
+        if ((i == argc - 1) || !argv[i + 1][0]
+                || !parse_option(param, argv[i], argv[i + 1])) {
+            return false;
+        }
+    }
+    if (!param->clients) {
+        param->clients = DEFAULT_CLIENTS;
+    }
+    if (param->humans < 0) {
+        param->humans = 0;
+    }
+    if (!param->games) {
+        param->games = DEFAULT_GAMES;
+    }
+    if (!param->moves) {
+        param->moves = DEFAULT_MOVES;
+    }
+    if (!param->seed) {
+        param->seed = DEFAULT_SEED;
+    }
+    // every bot playing a human needs a bot to play against
+    return param->humans <= param->clients;
+}
+
+/* monotonic_usec()
+ * ----------------
+ * Get the current time of the monotonic clock.
+ *
+ * Returns: Microseconds since an arbitrary fixed point in the past
+ */
+uint64_t monotonic_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* add_sample()
+ * ------------
+ * Record the time since start as a latency.
+ *
+ * samples: Samples to add latency to
+ * start: Time (from monotonic_usec()) at which the request was sent
+ */
+void add_sample(Samples* samples, uint64_t start)
+{
+    if (samples->count == samples->capacity) {
+        samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+        samples->values = (uint64_t*)realloc(
+                samples->values, samples->capacity * sizeof(uint64_t));
+    }
+    samples->values[samples->count++] = monotonic_usec() - start;
+}
+
+/* compare_samples()
+ * -----------------
+ * Compare two latencies for qsort().
+ *
+ * a: Pointer to first latency
+ * b: Pointer to second latency
+ *
+ * Returns: Negative, zero or positive if a is less than, equal to or greater
+ *          than b
+ */
+int compare_samples(const void* a, const void* b)
+{
+    uint64_t first = *(const uint64_t*)a;
+    uint64_t second = *(const uint64_t*)b;
+
+    return (first > second) - (first < second);
+}
+
+/* percentile_msec()
+ * -----------------
+ * Get a percentile of a set of sorted latencies.
+ *
+ * samples: Sorted latencies
+ * fraction: Fraction of latencies which are no larger than the percentile
+ *           (e.g. 0.99 for the 99th percentile)
+ *
+ * Returns: Percentile in milliseconds (0 if there are no latencies)
+ */
+double percentile_msec(Samples* samples, double fraction)
+{
+    if (!samples->count) {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * samples->count);
+    if (index >= samples->count) {
+        index = samples->count - 1;
+    }
+    return samples->values[index] / USEC_PER_MSEC;
+}
+
+/* script_line_valid()
+ * -------------------
+ * Check if a line of a script is a command a bot can play during a game.
+ *
+ * line: Line of script (including the trailing '\n')
+ *
+ * Returns: True if line is a "print", "hint", "possible", "move" or "resign"
+ *          command, false otherwise
+ */
+bool script_line_valid(char* line)
+{
+    return !strcmp(line, "print\n") || !strcmp(line, "hint\n")
+            || !strcmp(line, "possible\n") || !strcmp(line, "resign\n")
+            || (!strncmp(line, "move ", strlen("move "))
+                    && move_string_valid(line + strlen("move ")));
+}
+
+/* load_script()
+ * -------------
+ * Read the commands bots play at the start of each game from a file. Lines
+ * which aren't valid commands are skipped.
+ *
+ * bench: Bench to store script in
+ * filename: Name of script file
+ *
+ * Returns: True if file could be read, false otherwise
+ */
+bool load_script(Bench* bench, char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        return false;
+    }
+    LineReader* reader = init_line_reader(fd);
+    char* line;
+    while ((line = read_buffered_line(reader, NULL)) != NULL) {
+        if (!script_line_valid(line)) {
+            continue;
+        }
+        bench->script = (char**)realloc(
+                bench->script, (bench->scriptLength + 1) * sizeof(char*));
+        bench->script[bench->scriptLength++] = strdup(line);
+    }
+    free_line_reader(reader);
+    close(fd);
+    return true;
+}
+
+/* request_type()
+ * --------------
+ * Get the type of a command sent to the server.
+ *
+ * serverCmd: Command sent to the server
+ *
+ * Returns: RequestType of serverCmd
+ */
+RequestType request_type(char* serverCmd)
+{
+    if (!strncmp(serverCmd, "start ", strlen("start "))) {
+        return START_REQUEST;
+    } else if (!strcmp(serverCmd, "board\n")) {
+        return BOARD_REQUEST;
+    } else if (!strcmp(serverCmd, "hint best\n")) {
+        return HINT_BEST_REQUEST;
+    } else if (!strcmp(serverCmd, "hint all\n")) {
+        return HINT_ALL_REQUEST;
+    } else if (!strncmp(serverCmd, "move ", strlen("move "))) {
+        return MOVE_REQUEST;
+    }
+    return RESIGN_REQUEST;
+}
+
+/* server_gone()
+ * -------------
+ * Exit because the connection to the server was lost.
+ */
+void server_gone(void)
+{
+    fprintf(stderr, "uqchessbench: server has gone away\n");
+    exit(SERVER_ERROR);
+}
+
+/* send_command()
+ * --------------
+ * Translate a command (as typed into uqchessclient) and send it to the
+ * server, starting the timer of its response.
+ *
+ * bot: Bot sending command
+ * userCommand: Command to send e.g. "possible\n"
+ */
+void send_command(Bot* bot, char* userCommand)
+{
+    char* serverCmd = translate_command(bot->info, userCommand);
+    size_t length = strlen(serverCmd);
+    size_t sent = 0;
+
+    bot->pending = request_type(serverCmd);
+    bot->sentAt = monotonic_usec();
+    while (sent < length) {
+        ssize_t wrote = send(bot->info->sockfd, serverCmd + sent,
+                length - sent, MSG_NOSIGNAL);
+        if (wrote <= 0) {
+            server_gone();
+        }
+        sent += wrote;
+    }
+    free(serverCmd);
+}
+
+/* forget_moves()
+ * --------------
+ * Forget the legal moves a bot was told about.
+ *
+ * bot: Bot to forget moves of
+ */
+void forget_moves(Bot* bot)
+{
+    free(bot->moves);
+    free(bot->movesLine);
+    bot->moves = NULL;
+    bot->movesLine = NULL;
+    bot->moveCount = 0;
+}
+
+/* remember_moves()
+ * ----------------
+ * Remember the legal moves listed in a response to "hint all".
+ *
+ * bot: Bot which asked for the moves
+ * line: "moves" line received from the server
+ */
+void remember_moves(Bot* bot, char* line)
+{
+    forget_moves(bot);
+    bot->movesLine = strdup(line);
+    bot->movesLine[strcspn(bot->movesLine, "\n")] = '\0';
+    bot->moves = split_by_char(bot->movesLine, ' ', 0);
+    while (bot->moves[bot->moveCount + 1] != NULL) {
+        bot->moveCount++;
+    }
+}
+
+/* finish_bot()
+ * ------------
+ * Disconnect a bot from the server.
+ *
+ * bench: Bench bot belongs to
+ * bot: Bot to disconnect
+ */
+void finish_bot(Bench* bench, Bot* bot)
+{
+    bot->open = false;
+    bench->live--;
+    if (bot->human) {
+        bench->liveHumans--;
+    }
+    close(bot->info->sockfd);
+    free_line_reader(bot->input);
+    forget_moves(bot);
+    free_game_info(bot->info);
+
+    if (bench->liveHumans == 1) {
+        // a bot left waiting for an opponent on its own would wait forever
+        for (int i = 0; i < bench->param->clients; i++) {
+            Bot* other = &bench->bots[i];
+            if (other->open && other->human
+                    && (other->pending == START_REQUEST)) {
+                finish_bot(bench, other);
+                break;
+            }
+        }
+    }
+}
+
+/* take_turn()
+ * -----------
+ * Send the next command of a bot whose turn it is. Bots play their script
+ * first, then ask for the legal moves and make a random one, also asking for
+ * the board and best move every HINT_INTERVAL turns. Once a bot has made
+ * enough moves it resigns.
+ *
+ * bench: Bench bot belongs to
+ * bot: Bot whose turn it is
+ */
+void take_turn(Bench* bench, Bot* bot)
+{
+    bool extras = !(bot->turns % HINT_INTERVAL);
+
+    if (bot->scriptLine < bench->scriptLength) {
+        send_command(bot, bench->script[bot->scriptLine++]);
+    } else if (bot->movesMade >= bench->param->moves) {
+        send_command(bot, "resign\n");
+    } else if (extras && !bot->askedBoard) {
+        bot->askedBoard = true;
+        send_command(bot, "print\n");
+    } else if (extras && !bot->askedHint) {
+        bot->askedHint = true;
+        send_command(bot, "hint\n");
+    } else if (bot->movesLine == NULL) {
+        send_command(bot, "possible\n");
+    } else if (!bot->moveCount) {
+        send_command(bot, "resign\n");
+    } else {
+        char command[MAX_COMMAND_LENGTH];
+        char* move = bot->moves[1 + rand_r(&bot->seed) % bot->moveCount];
+        snprintf(command, sizeof(command), "move %s\n", move);
+        send_command(bot, command);
+    }
+}
+
+/* next_action()
+ * -------------
+ * Send a bot's next command if it isn't waiting for a response. A bot starts
+ * a new game once its last one is over (or disconnects once it has played
+ * all of its games) and otherwise only acts on its turn.
+ *
+ * bench: Bench bot belongs to
+ * bot: Bot to act
+ */
+void next_action(Bench* bench, Bot* bot)
+{
+    if (!bot->open || (bot->pending != NO_REQUEST)) {
+        return;
+    }
+    if (!bot->info->started) {
+        if (!bot->gamesLeft || (bot->human && (bench->liveHumans == 1))) {
+            finish_bot(bench, bot);
+        } else {
+            bot->gamesLeft--;
+            send_command(bot, "newgame\n");
+        }
+    } else if (bot->info->turn) {
+        take_turn(bench, bot);
+    }
+}
+
+/* complete_request()
+ * ------------------
+ * Mark a bot's pending request as answered.
+ *
+ * bench: Bench bot belongs to
+ * bot: Bot whose request was answered
+ * succeeded: True if the response wasn't an error (only their latencies are
+ *            recorded)
+ */
+void complete_request(Bench* bench, Bot* bot, bool succeeded)
+{
+    if (succeeded) {
+        add_sample(&bench->samples[bot->pending], bot->sentAt);
+    }
+    bot->pending = NO_REQUEST;
+}
+
+/* handle_response()
+ * -----------------
+ * Update a bot with a line received from the server.
+ *
+ * bench: Bench bot belongs to
+ * bot: Bot which received line
+ * line: Line received (including the trailing '\n')
+ */
+void handle_response(Bench* bench, Bot* bot, char* line)
+{
+    if (bot->inBoard || !strcmp(line, "startboard\n")) {
+        // the lines of a board are only finished by "endboard"
+        bot->inBoard = strcmp(line, "endboard\n");
+        if (!bot->inBoard && (bot->pending == BOARD_REQUEST)) {
+            complete_request(bench, bot, true);
+        }
+        return;
+    }
+    bool wasStarted = bot->info->started;
+    update_info_from_response(bot->info, line);
+
+    if (!strncmp(line, "started ", strlen("started "))) {
+        bot->movesMade = 0;
+        bot->turns = 0;
+        bot->scriptLine = 0;
+        bot->askedBoard = false;
+        bot->askedHint = false;
+        forget_moves(bot);
+        complete_request(bench, bot, true);
+    } else if (!strncmp(line, "moves", strlen("moves"))) {
+        if (bot->pending == HINT_ALL_REQUEST) {
+            remember_moves(bot, line);
+        }
+        complete_request(bench, bot, true);
+    } else if (!strcmp(line, "ok\n")) {
+        bench->movesMade++;
+        bot->movesMade++;
+        bot->turns++;
+        bot->askedBoard = false;
+        bot->askedHint = false;
+        forget_moves(bot);
+        complete_request(bench, bot, true);
+        if (!bot->human) {
+            bot->awaitingReply = true;
+            bot->acceptedAt = monotonic_usec();
+        }
+    } else if (!strncmp(line, "moved ", strlen("moved "))) {
+        if (bot->awaitingReply) {
+            add_sample(&bench->samples[REPLY_REQUEST], bot->acceptedAt);
+            bot->awaitingReply = false;
+        }
+    } else if (!strncmp(line, "gameover", strlen("gameover"))) {
+        bench->gamesPlayed++;
+        bot->awaitingReply = false;
+        if (bot->pending == RESIGN_REQUEST) {
+            complete_request(bench, bot, true);
+        }
+    } else if (!strncmp(line, "error", strlen("error"))) {
+        // errors for commands sent just before the opponent ended the game
+        // are expected
+        if (wasStarted) {
+            bench->errors++;
+        }
+        forget_moves(bot);
+        if (bot->pending != NO_REQUEST) {
+            complete_request(bench, bot, false);
+        }
+    }
+}
+
+/* read_responses()
+ * ----------------
+ * Read the data available from a bot's socket and handle every complete
+ * line received, then let the bot act.
+ *
+ * bench: Bench bot belongs to
+ * bot: Bot whose socket is readable
+ */
+void read_responses(Bench* bench, Bot* bot)
+{
+    if (fill_line_reader(bot->input) <= 0) {
+        server_gone();
+    }
+    char* line;
+    while (bot->open && (line = next_buffered_line(bot->input, NULL))) {
+        handle_response(bench, bot, line);
+        next_action(bench, bot);
+    }
+}
+
+/* init_bot()
+ * ----------
+ * Connect a bot to the server.
+ *
+ * bench: Bench bot belongs to
+ * bot: Bot to initialise
+ * index: Index of bot in bench->bots (the first param->humans bots play
+ *        each other, the others alternate playing white and black against
+ *        the computer)
+ */
+void init_bot(Bench* bench, Bot* bot, int index)
+{
+    Parameters* param = bench->param;
+    int sockfd = connect_to_server(param->port);
+
+    if (sockfd < 0) {
+        fprintf(stderr,
+                "uqchessbench: can't make connection to port \"%s\"\n",
+                param->port);
+        exit(PORT_ERROR);
+    }
+    memset(bot, 0, sizeof(Bot));
+    bot->info = (GameInfo*)malloc(sizeof(GameInfo));
+    bot->info->infoLock = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(bot->info->infoLock, 0, 1);
+    bot->info->turn = false;
+    bot->info->started = false;
+    bot->info->sockfd = sockfd;
+    bot->human = index < param->humans;
+    if (bot->human) {
+        bot->info->opponent = strdup("human");
+        bot->info->colour = strdup("either\n");
+    } else {
+        bot->info->opponent = strdup("computer");
+        bot->info->colour = strdup((index % 2) ? "black\n" : "white\n");
+    }
+    bot->input = init_line_reader(sockfd);
+    bot->seed = param->seed + index;
+    bot->open = true;
+    bot->gamesLeft = param->games;
+    bot->pending = NO_REQUEST;
+
+    bench->live++;
+    if (bot->human) {
+        bench->liveHumans++;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = bot};
+    epoll_ctl(bench->epollfd, EPOLL_CTL_ADD, sockfd, &event);
+}
+
+/* raise_file_limit()
+ * ------------------
+ * Raise the limit on open file descriptors as far as allowed so that
+ * thousands of clients can connect.
+ */
+void raise_file_limit(void)
+{
+    struct rlimit limit;
+
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+/* report()
+ * --------
+ * Print the throughput and the latency percentiles of each type of request.
+ *
+ * bench: Finished bench to report on
+ * elapsed: Microseconds the games took
+ */
+void report(Bench* bench, uint64_t elapsed)
+{
+    double seconds = elapsed / USEC_PER_SEC;
+
+    printf("clients %d (%d playing each other), %lu games, %lu moves in "
+           "%.2fs\n",
+            bench->param->clients, bench->param->humans, bench->gamesPlayed,
+            bench->movesMade, seconds);
+    printf("throughput %.1f moves/sec, %lu errors\n",
+            seconds > 0 ? bench->movesMade / seconds : 0, bench->errors);
+    printf("%-15s %8s %10s %10s %10s %10s\n", "command", "count", "p50(ms)",
+            "p99(ms)", "p999(ms)", "max(ms)");
+    for (int i = START_REQUEST; i < NO_REQUEST; i++) {
+        Samples* samples = &bench->samples[i];
+        if (!samples->count) {
+            continue;
+        }
+        qsort(samples->values, samples->count, sizeof(uint64_t),
+                compare_samples);
+        printf("%-15s %8zu %10.3f %10.3f %10.3f %10.3f\n", requestNames[i],
+                samples->count, percentile_msec(samples, 0.5),
+                percentile_msec(samples, 0.99), percentile_msec(samples, 0.999),
+                percentile_msec(samples, 1));
+    }
+    fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+    Parameters param;
+
+    // invalid command line arguments
+    if (!process_cmdline_args(argc, argv, &param)) {
+        fprintf(stderr,
+                "Usage: uqchessbench portno [--clients n] [--humans n] "
+                "[--games n] [--moves n] [--script file] [--seed n]\n");
+        exit(USAGE_ERROR);
+    }
+    Bench bench;
+    memset(&bench, 0, sizeof(Bench));
+    bench.param = &param;
+
+    // couldn't read the script
+    if ((param.script != NULL) && !load_script(&bench, param.script)) {
+        fprintf(stderr, "uqchessbench: unable to read script \"%s\"\n",
+                param.script);
+        exit(SCRIPT_ERROR);
+    }
+    // use sigaction to ignore SIGPIPE
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(struct sigaction));
+    sa.sa_handler = SIG_IGN;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGPIPE, &sa, 0);
+    raise_file_limit();
+    bench.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    bench.bots = (Bot*)malloc(param.clients * sizeof(Bot));
+    for (int i = 0; i < param.clients; i++) {
+        init_bot(&bench, &bench.bots[i], i);
+    }
+
+    // start every bot's first game once all of them are connected
+    uint64_t start = monotonic_usec();
+    for (int i = 0; i < param.clients; i++) {
+        next_action(&bench, &bench.bots[i]);
+    }
+    while (bench.live > 0) {
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(bench.epollfd, events, MAX_EVENTS, -1);
+
+        for (int i = 0; i < count; i++) {
+            Bot* bot = (Bot*)events[i].data.ptr;
+            if (bot->open) {
+                read_responses(&bench, bot);
+            }
+        }
+    }
+    report(&bench, monotonic_usec() - start);
+    exit(STATUS_OK);
+}
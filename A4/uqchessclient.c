@@ -5,20 +5,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <pthread.h>
-#include <netdb.h>
 #include <unistd.h>
 #include <semaphore.h>
-#include <ctype.h>
 #include <signal.h>
 #include <csse2310a4.h>
+#include "linereader.h"
+#include "chessprotocol.h"
 
 // Minimum number of args to program including program name itself
 #define MIN_CMDLINE_ARG_COUNT 2
 
-// Maximum and minimum length of a move string e.g. "e2e4"
-#define MIN_MOVE_STRING_LENGTH 4
-#define MAX_MOVE_STRING_LENGTH 5
-
 // Error/status codes
 #define STATUS_OK 0
 #define USAGE_ERROR 4
@@ -45,27 +41,6 @@ typedef struct {
     char* colour;
 } Parameters;
 
-/* GameInfo
- *
- * Stores information about the current game being played as well as other
- * information needed by the worker threads.
- *
- * infoLock: Semaphore to use when updating values within struct
- * turn: true if it is the clients turn to play, false otherwise
- * started: true if the client is currently in a game, false otherwise
- * sockfd: File descriptor of socket connected to server
- * colour: Colour being played by client
- * opponent: Opponent of client (human or computer)
- */
-typedef struct {
-    sem_t* infoLock;
-    bool turn;
-    bool started;
-    int sockfd;
-    char* colour;
-    char* opponent;
-} GameInfo;
-
 /* free_parameters()
  * -----------------
  * Free a Paramters type.
@@ -86,20 +61,6 @@ void free_parameters(Parameters* param)
     free(param);
 }
 
-/* free_game_info()
- * ----------------
- * Free a GameInfo struct.
- *
- * info: GameInfo struct to free
- */
-void free_game_info(GameInfo* info)
-{
-    sem_destroy(info->infoLock);
-    free(info->colour);
-    free(info->opponent);
-    free(info);
-}
-
 /* arg_is_option()
  * ---------------
  * Check if a command line string is an option (begins with "--").
@@ -252,79 +213,6 @@ void command_error(const char* const cmdErrString)
     fflush(stderr);
 }
 
-/* read_line()
- * -----------
- * Read a line from a FILE*. Will read up until newline or EOF. Note that the
- * newline character will be included in the line as commands being sent to
- * server require a terminating newline character.
- *
- * read: File to read line from
- *
- * Returns: Pointer to line read from file.
- */
-char* read_line(FILE* read)
-{
-    char* result = (char*)calloc(1, sizeof(char));
-    int index = 0;
-
-    if (feof(read)) {
-        free(result);
-        return NULL;
-    }
-    while (true) {
-        char next = fgetc(read);
-        // got EOF so exit with whatever has been built up in result up
-        // until now
-        if (next == EOF) {
-            return NULL;
-        }
-
-        // add next to result string
-        result[index] = next;
-        index++;
-        result = (char*)realloc(result, (index + 1) * sizeof(char));
-
-        // next was a newline so break here
-        if (next == '\n') {
-            break;
-        }
-    }
-    // terminate result string
-    result[index] = '\0';
-    return result;
-}
-
-/* move_string_valid()
- * -------------------
- * Check if a move string e.g. "e2e4" is a valid move string or not. This
- * does not consider any game position but rather the validity of the string
- * itself.
- *
- * move: Move string to validate
- *
- * Returns: True if move is a valid move string, false otherwise
- */
-bool move_string_valid(char* move)
-{
-    if ((move == NULL) || (move[0] == '\n') || (!move[0])) {
-        return false;
-    }
-    // -1 to ignore the '\n' character at end of move string
-    int moveLen = strlen(move) - 1;
-
-    if (moveLen < MIN_MOVE_STRING_LENGTH || moveLen > MAX_MOVE_STRING_LENGTH) {
-        return false;
-    }
-
-    // loop to len - 1 since character before null is newline
-    for (int i = 0; i < moveLen; i++) {
-        if (!isalnum(move[i])) {
-            return false;
-        }
-    }
-    return true;
-}
-
 /* command_is_valid()
  * ------------------
  * Check if a command is valid based on current game state.
@@ -370,45 +258,6 @@ bool command_is_valid(GameInfo* info, char* command)
     return false;
 }
 
-/* translate_command()
- * -------------------
- * Translate a command inputted by user into a command which uqchessserver can
- * understand.
- *
- * info: GameInfo of current game being played
- * userCommand: Command inputted by user to be translated
- *
- * Returns: Pointer to corresponding command to be sent to uqchessserver
- */
-char* translate_command(GameInfo* info, char* userCommand)
-{
-    char* userDup = strdup(userCommand);
-    char** args = split_by_char(userDup, ' ', 0);
-    char* serverCmd = NULL;
-
-    if (!strcmp(args[0], "newgame\n")) {
-        // user wants to start new game so create string
-        // "start (opponent) (colour)"
-        serverCmd = strdup("start ");
-        strcat(serverCmd, info->opponent);
-        strcat(serverCmd, " ");
-        strcat(serverCmd, info->colour);
-    } else if (!strcmp(args[0], "print\n")) {
-        serverCmd = strdup("board\n");
-    } else if (!strcmp(args[0], "hint\n")) {
-        serverCmd = strdup("hint best\n");
-    } else if (!strcmp(args[0], "possible\n")) {
-        serverCmd = strdup("hint all\n");
-    } else if (!strcmp(args[0], "move")) {
-        serverCmd = strdup(userCommand);
-    } else if (!strcmp(args[0], "resign\n")) {
-        serverCmd = strdup(args[0]);
-    }
-    free(userDup);
-    free(args);
-    return serverCmd;
-}
-
 /* execute_command()
  * -----------------
  * Execute a command from user by sending to server.
@@ -448,11 +297,12 @@ bool execute_command(GameInfo* info, char* command)
 void* handle_user_input(void* read)
 {
     GameInfo* info = (GameInfo*)read;
+    LineReader* input = init_line_reader(STDIN_FILENO);
     // immediately start new game upon thread starting
     execute_command(info, "newgame\n");
     // repeatedly read from stdin for user commands
     while (true) {
-        char* line = read_line(stdin);
+        char* line = read_buffered_line(input, NULL);
 
         if (line == NULL) {
             exit(STATUS_OK);
@@ -464,43 +314,10 @@ void* handle_user_input(void* read)
         if (!execute_command(info, line)) {
             exit(STATUS_OK);
         }
-        free(line);
     }
     return NULL;
 }
 
-/* update_info_from_response()
- * ---------------------------
- * Update GameInfo struct based on a server response string.
- *
- * info: GameInfo struct to update
- * response: String of response from uqchessserver
- */
-void update_info_from_response(GameInfo* info, char* response)
-{
-    // Take semaphore
-    sem_wait(info->infoLock);
-    // update info->turn and info->started accordingly
-    if (strstr(response, "started")) {
-        if (strstr(response, "white")) {
-            info->turn = true;
-        } else {
-            info->turn = false;
-        }
-        info->started = true;
-    }
-    if (!strcmp(response, "ok\n")) {
-        info->turn = false;
-    }
-    if (strstr(response, "error") || strstr(response, "moved")) {
-        info->turn = true;
-    }
-    if (strstr(response, "resign") || strstr(response, "gameover")) {
-        info->started = false;
-    }
-    sem_post(info->infoLock);
-}
-
 /* handle_server_response()
  * ------------------------
  * Thread function to handle server responses and print them to stdout.
@@ -512,11 +329,11 @@ void update_info_from_response(GameInfo* info, char* response)
 void* handle_server_response(void* read)
 {
     GameInfo* info = (GameInfo*)read;
-    FILE* readFile = fdopen(info->sockfd, "r");
+    LineReader* readFile = init_line_reader(info->sockfd);
 
     // repeatedly read server response and print to stdout
     while (true) {
-        char* response = read_line(readFile);
+        char* response = read_buffered_line(readFile, NULL);
         if (response == NULL) {
             // no need to free memory so just exit with status 5 (server error)
             fprintf(stderr, "uqchessclient: server has gone away\n");
@@ -525,15 +342,13 @@ void* handle_server_response(void* read)
         // check to see if reponse contained the "startboard" or "endboard"
         // strings that come with response to "board" command
         if (strstr(response, "startboard") || strstr(response, "endboard")) {
-            free(response);
             continue;
         }
         printf("%s", response);
         fflush(stdout);
         update_info_from_response(info, response);
-        free(response);
     }
-    fclose(readFile);
+    free_line_reader(readFile);
     return NULL;
 }
 
@@ -549,30 +364,13 @@ void* handle_server_response(void* read)
  */
 int init_game(Parameters* param)
 {
-    // setup addrinfo structs to hold server address info and hints to use
-    // when searching for server.
-    struct addrinfo* ai = NULL;
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    int status;
-
-    if ((status = getaddrinfo("localhost", param->port, &hints, &ai))) {
-        // couldn't find an address
-        freeaddrinfo(ai);
-        connection_error(param->port);
-        return PORT_ERROR;
-    }
-    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    int sockfd = connect_to_server(param->port);
 
-    if ((sockfd < 0)
-            || (connect(sockfd, ai->ai_addr, sizeof(struct addrinfo)))) {
-        // connect returned non-zero value (error)
+    if (sockfd < 0) {
+        // couldn't find an address or connect to it
         connection_error(param->port);
         return PORT_ERROR;
     }
-    freeaddrinfo(ai);
     return sockfd;
 }
 
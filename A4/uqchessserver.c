@@ -6,11 +6,20 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
 #include <csse2310a4.h>
+#include "linereader.h"
 
 // Error/Status codes
 #define ERROR_USAGE 14
@@ -18,16 +27,116 @@
 #define ERROR_LISTEN 7
 #define ERROR_STOCKFISH_START 11
 #define ERROR_STOCKFISH_UNEXPECTED_EXIT 5
+#define ERROR_BOOK 13
 #define STATUS_OK 0
 
+// Number of chess engines to run when --engines isn't given
+#define DEFAULT_ENGINES 1
+
+// Number of engines a computer move is attempted on before giving up
+#define ENGINE_ATTEMPTS 2
+
+// Number of best moves to cache when --cache isn't given
+#define DEFAULT_CACHE_SIZE 4096
+
+// Search time (in milliseconds) and depth of a best move search when
+// --movetime and --depth aren't given
+#define DEFAULT_MOVETIME 500
+#define DEFAULT_DEPTH 15
+
+// Search time (in milliseconds) and number of nodes below which a best move
+// search isn't cut however deep the queue for engines is
+#define MIN_MOVETIME 20
+#define MIN_NODES 1000
+
+// Stockfish's "Skill Level" at full strength (which new engines start at)
+#define MAX_SKILL 20
+
+// Number of finite buckets in each latency histogram and microseconds in a
+// second
+#define LATENCY_BUCKETS 15
+#define USEC_PER_SEC 1000000.0
+
 // Max and min lengths of a move string
 #define MIN_MOVE_STRING_LENGTH 4
 #define MAX_MOVE_STRING_LENGTH 5
 
+// Max length (including the null terminator) of a single line message, other
+// than a list of moves, sent to a client
+#define MAX_MESSAGE_LENGTH 64
+
+// Max number of socket events handled per wait and number of worker threads
+// handling commands which don't need a chess engine
+#define MAX_EVENTS 64
+#define COMMAND_WORKERS 4
+
+// Number of bytes of responses which may be waiting to be written to a
+// client (which isn't reading them) before the client is disconnected
+#define MAX_PENDING_OUTPUT (256 * 1024)
+
+// Dimensions of the chess board
+#define BOARD_WIDTH 8
+#define BOARD_SQUARES 64
+
+// Max number of moves possible in a position (including illegal moves which
+// leave the king in check)
+#define MAX_MOVES 256
+
+// Max lengths (including the null terminator) of a FEN string and of a
+// drawing of the board
+#define MAX_FEN_LENGTH 128
+#define MAX_BOARD_LENGTH 1024
+
+// Bitboards of the edge files and ranks of the board
+#define FILE_A 0x0101010101010101ULL
+#define FILE_H 0x8080808080808080ULL
+#define RANK_1 0xFFULL
+#define RANK_8 0xFF00000000000000ULL
+
+// Castling rights (black's rights are white's shifted left by 2)
+#define WHITE_KINGSIDE 1
+#define WHITE_QUEENSIDE 2
+#define BLACK_KINGSIDE 4
+#define BLACK_QUEENSIDE 8
+
+// Squares the kings start on (e1 and e8)
+#define WHITE_KING_START 4
+#define BLACK_KING_START 60
+
+// Sizes of the magic bitboard tables holding the attacks of all squares and
+// the max number of sets of blockers of a single square
+#define ROOK_TABLE_SIZE 102400
+#define BISHOP_TABLE_SIZE 5248
+#define MAX_BLOCKER_SETS 4096
+
+// Seeds of the random numbers tried when searching for magic numbers and of
+// the Zobrist hash keys
+#define MAGIC_SEED 0x2310C0FFEEULL
+#define ZOBRIST_SEED 0x5EEDF00DULL
+
 // Fen string for initial (startpos) position
 const char* const initialFen
         = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
+// Characters representing each PieceType (in lower case) and castling right
+const char* const pieceChars = "pnbrqk";
+const char* const castlingChars = "KQkq";
+
+// (file, rank) directions rooks and bishops slide in
+const int rookDirections[4][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}};
+const int bishopDirections[4][2] = {{1, 1}, {1, -1}, {-1, 1}, {-1, -1}};
+
+// ID given to the most recently created GameState
+unsigned long lastGameId = 0;
+
+// Upper bounds (in microseconds) of the latency histogram buckets
+const uint64_t latencyBuckets[LATENCY_BUCKETS] = {100, 250, 500, 1000, 2500,
+        5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+        5000000};
+
+// Names of the colour preferences (in the order of Preference)
+const char* const preferenceNames[] = {"white", "black", "either"};
+
 // Constants to represent results of different moves
 typedef enum {
     OK,
@@ -42,6 +151,148 @@ typedef enum {
     MOVE
 } MoveStatus;
 
+// Colours of the two players
+typedef enum { WHITE, BLACK } Colour;
+
+// Colour preferences of clients waiting for a human opponent (in the same
+// order as MatchQueues.queues)
+typedef enum { WANTS_WHITE, WANTS_BLACK, WANTS_EITHER } Preference;
+
+// Strengths the computer can play at (in the same order as difficultyNames)
+typedef enum { EASY, MEDIUM, HARD } Difficulty;
+
+// Names of the difficulties as given in "start" commands, and the Stockfish
+// "Skill Level" and percentage of the full search budget used at each
+const char* const difficultyNames[] = {"easy", "medium", "hard"};
+const int difficultySkill[] = {0, 10, MAX_SKILL};
+const int difficultyPercent[] = {20, 50, 100};
+
+// Commands whose latency is recorded separately (in the same order as
+// commandNames)
+typedef enum {
+    BOARD_COMMAND,
+    MOVE_COMMAND,
+    HINT_BEST_COMMAND,
+    HINT_ALL_COMMAND,
+    RESIGN_COMMAND,
+    START_COMMAND,
+    OTHER_COMMAND
+} CommandType;
+
+// Names of the commands as they are labelled in metrics
+const char* const commandNames[] = {
+        "board", "move", "hint best", "hint all", "resign", "start", "other"};
+
+// Types of chess pieces (in the same order as pieceChars)
+typedef enum { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING, NO_PIECE } PieceType;
+
+/* Position
+ *
+ * Stores a chess position as bitboards (bit n is set if square n, counting
+ * a1, b1, ... h8, is occupied).
+ *
+ * pieces: Bitboards of the squares holding each type of piece
+ * colours: Bitboards of the squares holding each colour's pieces
+ * toMove: Colour of the player whose turn it is
+ * castling: Castling rights still available (WHITE_KINGSIDE etc.)
+ * enPassant: Square a pawn can capture en passant on or -1 if none
+ * halfmoves: Number of halfmoves since the last capture or pawn move
+ * fullmoves: Number of the current move (starting at 1)
+ */
+typedef struct {
+    uint64_t pieces[NO_PIECE];
+    uint64_t colours[2];
+    Colour toMove;
+    int castling;
+    int enPassant;
+    int halfmoves;
+    int fullmoves;
+} Position;
+
+/* Move
+ *
+ * Stores a single chess move.
+ *
+ * from: Square the piece moves from
+ * to: Square the piece moves to
+ * promotion: PieceType a pawn promotes to (NO_PIECE if not a promotion)
+ */
+typedef struct {
+    unsigned char from;
+    unsigned char to;
+    unsigned char promotion;
+} Move;
+
+/* Magic
+ *
+ * Stores the magic bitboard entry of a sliding piece on a single square.
+ * Multiplying the relevant blockers by the magic number gives (in the top
+ * bits) the index of the piece's attacks in the table.
+ *
+ * mask: Bitboard of the squares whose occupancy affects the attacks
+ * magic: Magic number to multiply the blockers by
+ * attacks: Table of attacks (indexed by magic_index())
+ * shift: Number of bits to shift the product right by
+ */
+typedef struct {
+    uint64_t mask;
+    uint64_t magic;
+    uint64_t* attacks;
+    int shift;
+} Magic;
+
+// Attack tables of pieces on each square (set up by init_attack_tables())
+uint64_t knightAttacks[BOARD_SQUARES];
+uint64_t kingAttacks[BOARD_SQUARES];
+uint64_t pawnAttacks[2][BOARD_SQUARES];
+Magic rookMagics[BOARD_SQUARES];
+Magic bishopMagics[BOARD_SQUARES];
+uint64_t rookAttackTable[ROOK_TABLE_SIZE];
+uint64_t bishopAttackTable[BISHOP_TABLE_SIZE];
+
+// Random keys combined to give the Zobrist hash of a position (set up by
+// init_attack_tables())
+uint64_t zobristPieces[2][NO_PIECE][BOARD_SQUARES];
+uint64_t zobristCastling[1 << 4];
+uint64_t zobristEnPassant[BOARD_WIDTH];
+uint64_t zobristBlack;
+uint64_t zobristDifficulty[HARD + 1];
+
+/* SearchBudget
+ *
+ * Stores the limits of a best move search.
+ *
+ * movetime: Milliseconds the engine may search for
+ * depth: Max depth (in plies) the engine may search to
+ * nodes: Max number of nodes the engine may search (0 if unlimited)
+ */
+typedef struct {
+    int movetime;
+    int depth;
+    int nodes;
+} SearchBudget;
+
+/* Parameters
+ *
+ * Stores the options given to the server on the command line.
+ *
+ * port: Port to listen on ("0" if an ephemeral port should be used)
+ * metricsPort: Port to serve metrics on (NULL if metrics aren't served)
+ * engines: Number of chess engine (Stockfish) processes to run
+ * cacheSize: Number of best moves to cache
+ * book: Name of opening book file to preload cache from (NULL if none)
+ * budget: Limits of a best move search at full strength when engines aren't
+ *         in demand
+ */
+typedef struct {
+    char* port;
+    char* metricsPort;
+    int engines;
+    int cacheSize;
+    char* book;
+    SearchBudget budget;
+} Parameters;
+
 /* GameState
  *
  * Stores information about a current game being played between either two
@@ -53,6 +304,8 @@ typedef enum {
  * started: true if game is currently in progress, false if game is over or
  *          hasn't started
  * fenString: FEN string representing most recent game state.
+ * id: Number uniquely identifying the game (used by engines to tell whether
+ *     they're being asked about the game they were last set up for)
  */
 typedef struct {
     sem_t* lock;
@@ -60,6 +313,7 @@ typedef struct {
     struct Client* blackClient;
     bool started;
     char* fenString;
+    unsigned long id;
 } GameState;
 
 /* ClientList
@@ -78,59 +332,377 @@ typedef struct {
 
 /* Engine
  *
- * Stores information about a chess engine (Stockfish).
+ * Stores information about a chess engine (Stockfish). An engine is only used
+ * by the thread which has checked it out of an EnginePool.
  *
  * toEngine: FILE* to use to send data to engine
- * fromEngine: FILE* to use to read data from engine
- * notifyOnError: List of currently connected clients whom need to be notified
- *                in the case that the engine exits
- * lock: Semaphore to use when accessing engine
+ * fromEngine: LineReader to use to read data from engine
+ * pid: Process ID of the engine
+ * failed: True if communication with the engine has broken down (it must be
+ *         restarted before it can be used again)
+ * gameId: ID of the game the engine was last set up for (0 if none)
+ * awaitingReady: True if an "isready" has been queued whose "readyok"
+ *                response hasn't been read yet
+ * skill: "Skill Level" the engine is set to
  */
 typedef struct {
     FILE* toEngine;
-    FILE* fromEngine;
+    LineReader* fromEngine;
+    pid_t pid;
+    bool failed;
+    unsigned long gameId;
+    bool awaitingReady;
+    int skill;
+} Engine;
+
+/* CacheEntry
+ *
+ * Stores a best move found for a position in a MoveCache.
+ *
+ * key: Zobrist hash of the position (see position_hash())
+ * move: Best move in the position e.g. "g1f3"
+ * next: Index of the next entry in the same hash bucket (-1 if none)
+ * used: True if entry is in use
+ * referenced: True if entry has been looked up since the clock hand last
+ *             passed it
+ * movetime: Search time (in milliseconds) move was found with (INT_MAX for
+ *           opening book moves)
+ */
+typedef struct {
+    uint64_t key;
+    char move[MAX_MOVE_STRING_LENGTH + 1];
+    int next;
+    bool used;
+    bool referenced;
+    int movetime;
+} CacheEntry;
+
+/* MoveCache
+ *
+ * Stores a bounded cache of the best moves found by the chess engines. When
+ * the cache is full entries are evicted with the clock algorithm (entries
+ * looked up since the hand last passed them get a second chance).
+ *
+ * entries: Array of capacity entries
+ * buckets: Array of capacity indices of the first entry in each hash bucket
+ *          (-1 if empty)
+ * capacity: Number of entries the cache can hold
+ * hand: Index of the next entry to consider evicting
+ * hits: Number of lookups which found a move
+ * misses: Number of lookups which didn't find a move
+ * lock: Semaphore to use when accessing cache
+ */
+typedef struct {
+    CacheEntry* entries;
+    int* buckets;
+    int capacity;
+    int hand;
+    unsigned long hits;
+    unsigned long misses;
+    sem_t* lock;
+} MoveCache;
+
+/* EnginePool
+ *
+ * Stores the chess engines (Stockfish processes) shared between all clients.
+ * Engines which aren't checked out by a client are kept on the idle stack.
+ *
+ * idle: Array of pointers to engines not currently in use
+ * idleCount: Number of engines in idle
+ * count: Total number of engines in the pool
+ * available: Semaphore counting the engines in idle
+ * lock: Semaphore to use when accessing idle
+ * notifyOnError: List of currently connected clients whom need to be notified
+ *                in the case that an engine can't be restarted
+ * cache: Cache of best moves found by the engines
+ * budget: Limits of a best move search at full strength when engines aren't
+ *         in demand
+ * backlog: Queue of clients waiting for a worker which can use an engine
+ */
+typedef struct {
+    Engine** idle;
+    int idleCount;
+    int count;
+    sem_t* available;
+    sem_t* lock;
     ClientList* notifyOnError;
+    MoveCache* cache;
+    SearchBudget budget;
+    struct WorkQueue* backlog;
+} EnginePool;
+
+/* WorkQueue
+ *
+ * Stores a queue of clients with a command (or disconnection) waiting to be
+ * handled by a worker thread.
+ *
+ * clients: Circular array of pointers to the clients in the queue
+ * head: Index in clients of the client at the front of the queue
+ * count: Number of clients in the queue
+ * capacity: Number of clients which fit in clients
+ * available: Semaphore counting the clients in the queue
+ * lock: Semaphore to use when accessing queue
+ */
+typedef struct WorkQueue {
+    struct Client** clients;
+    int head;
+    int count;
+    int capacity;
+    sem_t* available;
     sem_t* lock;
-} Engine;
+} WorkQueue;
+
+/* WaitQueue
+ *
+ * Stores a FIFO queue of clients with the same colour preference who are
+ * waiting for a human opponent. Clients are linked through their queueNext
+ * and queuePrev fields so they can be added and removed in constant time.
+ *
+ * head: Client which has waited longest (NULL if queue is empty)
+ * tail: Client which joined the queue most recently (NULL if queue is empty)
+ * depth: Number of clients in the queue
+ * peakDepth: Largest number of clients which have been in the queue at once
+ * joined: Number of clients which have ever joined the queue
+ */
+typedef struct {
+    struct Client* head;
+    struct Client* tail;
+    int depth;
+    int peakDepth;
+    unsigned long joined;
+} WaitQueue;
+
+/* MatchQueues
+ *
+ * Stores the clients waiting for a human opponent, queued by colour
+ * preference. Every pairing decision looks at all three queues so they share
+ * one lock, which is only held for a constant amount of work.
+ *
+ * queues: Queues of waiting clients, indexed by Preference
+ * nextTicket: Ticket to give the next client to join a queue (tickets record
+ *             the order clients joined in across all queues)
+ * matches: Number of pairs of clients which have been matched
+ * lock: Semaphore to use when accessing queues
+ */
+typedef struct {
+    WaitQueue queues[WANTS_EITHER + 1];
+    unsigned long nextTicket;
+    unsigned long matches;
+    sem_t* lock;
+} MatchQueues;
+
+/* Histogram
+ *
+ * Stores the distribution of a latency (updated with atomic operations so it
+ * can be shared by all threads without a lock).
+ *
+ * buckets: Number of observations no larger than the matching bound in
+ *          latencyBuckets (and larger than the bound before it)
+ * count: Total number of observations
+ * sumUsec: Sum of all observations in microseconds
+ */
+typedef struct {
+    unsigned long buckets[LATENCY_BUCKETS];
+    unsigned long count;
+    uint64_t sumUsec;
+} Histogram;
+
+/* ServerMetrics
+ *
+ * Stores counters describing the load on the server which aren't kept by
+ * any other structure (updated with atomic operations).
+ *
+ * connections: Number of clients which have ever connected
+ * gamesInProgress: Number of games which have started and not finished
+ * engineRestarts: Number of engines which have been restarted after failing
+ * commandLatency: Time taken to handle each type of command, indexed by
+ *                 CommandType
+ * engineWait: Time spent waiting to check out an engine
+ * engineSearch: Time from sending a position to an engine until its best
+ *               move is received
+ * searchMovetime: Search time (in milliseconds) of the last full strength
+ *                 best move search budget
+ */
+typedef struct {
+    unsigned long connections;
+    long gamesInProgress;
+    unsigned long engineRestarts;
+    Histogram commandLatency[OTHER_COMMAND + 1];
+    Histogram engineWait;
+    Histogram engineSearch;
+    int searchMovetime;
+} ServerMetrics;
+
+// Load counters shared by all threads
+ServerMetrics metrics;
 
 /* Client
  *
- * Stores information about a Client to be passed to a thread function.
+ * Stores information about a connected client. Commands from a client are
+ * handled by one worker thread at a time, in the order they were received.
  *
- * toClient: FILE* to use when writing data to client
- * fromClient: FILE* to use when reading data from client
+ * fd: File descriptor of the (non-blocking) socket connected to client
+ * epollfd: File descriptor of the epoll instance watching client's socket
+ * writeLock: Semaphore to use when accessing output, outputStart,
+ *            outputLength, outputCapacity and dropped
+ * output: Responses which couldn't be written to client's socket yet, which
+ *         the event loop writes once the socket is writable
+ * outputStart: Index in output of the first byte not yet written
+ * outputLength: Number of bytes in output (including those written)
+ * outputCapacity: Number of bytes allocated for output
+ * dropped: True if client's connection has been shut down as it stopped
+ *          reading responses (or writing to it failed)
+ * input: Reader buffering data received from client which hasn't been
+ *        handled yet
+ * inputLock: Semaphore to use when accessing input, scheduled and closed
+ * scheduled: True if client is on a WorkQueue or being handled by a worker
+ * closed: True if client has disconnected
+ * engineWork: Queue for commands which may need a chess engine
+ * commandWork: Queue for all other commands
+ * matched: True if client's first "start" command has been handled
  * game: Game which client is currently playing (this may be shared between two
  *       client structs if two clients are playing against each other)
- * waitList: List of clients who are currently waiting for a human opponent
- *           with a compatible colour
- * engine: Chess engine for client to use while playing
+ * matchQueues: Queues of clients who are currently waiting for a human
+ *              opponent
+ * queued: True if client is in one of matchQueues' queues
+ * queueNext: Client which joined client's queue after client
+ * queuePrev: Client which joined client's queue before client
+ * ticket: Ticket client was given when it last joined a queue
+ * engines: Pool of chess engines for client to use while playing
  * hasPlayed: True if the client has played a game previously, false if not
  * white: True if client wants to play as white, false if black
  * either: True if client wishes to play with either colour (no preferences),
  *         false if client has a preferences.
  * human: True if client wants to play a human, false if wants to play the
  *        computer.
+ * difficulty: Strength the computer plays against client at
  */
 typedef struct Client {
-    FILE* toClient;
-    FILE* fromClient;
+    int fd;
+    int epollfd;
+    sem_t* writeLock;
+    char* output;
+    size_t outputStart;
+    size_t outputLength;
+    size_t outputCapacity;
+    bool dropped;
+    LineReader* input;
+    sem_t* inputLock;
+    bool scheduled;
+    bool closed;
+    WorkQueue* engineWork;
+    WorkQueue* commandWork;
+    bool matched;
     GameState* game;
-    ClientList* waitList;
-    Engine* engine;
+    MatchQueues* matchQueues;
+    bool queued;
+    struct Client* queueNext;
+    struct Client* queuePrev;
+    unsigned long ticket;
+    EnginePool* engines;
     bool hasPlayed;
     bool white;
     bool either;
     bool human;
+    Difficulty difficulty;
 } Client;
 
+/* Server
+ *
+ * Stores the state shared by the event loop accepting and reading from
+ * clients.
+ *
+ * epollfd: File descriptor of the epoll instance watching all sockets
+ * metricsfd: File descriptor of socket to serve metrics on (-1 if metrics
+ *            aren't served)
+ * connected: List of currently connected clients
+ * matchQueues: Queues of clients waiting for a human opponent
+ * engines: Pool of chess engines shared by all clients
+ * engineWork: Queue for commands which may need a chess engine
+ * commandWork: Queue for all other commands
+ */
+typedef struct {
+    int epollfd;
+    int metricsfd;
+    ClientList* connected;
+    MatchQueues* matchQueues;
+    EnginePool* engines;
+    WorkQueue* engineWork;
+    WorkQueue* commandWork;
+} Server;
+
+/* MetricsConnection
+ *
+ * Stores information about a connection made to the metrics port.
+ *
+ * fd: File descriptor of the socket connected to the scraper
+ * server: Server whose metrics are served
+ */
+typedef struct {
+    int fd;
+    Server* server;
+} MetricsConnection;
+
+/* monotonic_usec()
+ * ----------------
+ * Get the current time of the monotonic clock.
+ *
+ * Returns: Microseconds since an arbitrary fixed point in the past
+ */
+uint64_t monotonic_usec(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* observe_latency()
+ * -----------------
+ * Record the time since start in a latency histogram.
+ *
+ * histogram: Histogram to record latency in
+ * start: Time (from monotonic_usec()) at which the timed operation started
+ */
+void observe_latency(Histogram* histogram, uint64_t start)
+{
+    uint64_t latency = monotonic_usec() - start;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (latency <= latencyBuckets[i]) {
+            __sync_add_and_fetch(&histogram->buckets[i], 1);
+            break;
+        }
+    }
+    __sync_add_and_fetch(&histogram->count, 1);
+    __sync_add_and_fetch(&histogram->sumUsec, latency);
+}
+
+/* set_game_started()
+ * ------------------
+ * Mark a game as in progress or over, keeping count of the games in
+ * progress. The caller must hold the game's lock (unless no other thread
+ * can refer to the game yet).
+ *
+ * game: Game to update
+ * started: True if game is now in progress, false if it is over
+ */
+void set_game_started(GameState* game, bool started)
+{
+    if (game->started != started) {
+        __sync_add_and_fetch(&metrics.gamesInProgress, started ? 1 : -1);
+    }
+    game->started = started;
+}
+
 /* free_game_state()
  * -----------------
- * Free a GameState struct.
+ * Free a GameState struct (ending it if it is still in progress).
  *
  * state: Pointer to GameState struct to free
  */
 void free_game_state(GameState* state)
 {
+    set_game_started(state, false);
     free(state->fenString);
     sem_destroy(state->lock);
     free(state);
@@ -152,41 +724,112 @@ void free_client_list(ClientList* list)
     free(list->clients);
 }
 
+/* parse_count()
+ * -------------
+ * Parse the argument of the --engines, --cache, --movetime, --depth or
+ * --nodes option.
+ *
+ * arg: Argument to parse
+ *
+ * Returns: Number given by arg OR 0 if arg isn't a positive integer
+ */
+int parse_count(char* arg)
+{
+    char* end;
+    long count = strtol(arg, &end, 10);
+
+    if (!isdigit(arg[0]) || *end || (count < 1) || (count > INT_MAX)) {
+        return 0;
+    }
+    return (int)count;
+}
+
 /* process_cmdline_args()
  * ----------------------
  * Process command line arguments passed to program to verfiy validity
- * and extract port that user wants server to listen on.
+ * and extract port that user wants server to listen on, the port to serve
+ * metrics on, the number of chess engines to run, the size and opening
+ * book of the move cache and the limits of a full strength best move search.
  *
  * argc: Number of command line arguments
  * argv: Array of command line arguments
+ * param: Parameters struct to store options in
  *
- * Returns: Pointer to string of port to listen on ("0" if user wishes to use
- *          ephemeral port) OR NULL if the command line arguments are invalid
+ * Returns: True if the command line arguments are valid, false otherwise
  */
-char* process_cmdline_args(int argc, char** argv)
+bool process_cmdline_args(int argc, char** argv, Parameters* param)
 {
-    if (argc == 1) {
-        return strdup("0");
-    }
-    char* port = NULL;
+    param->port = NULL;
+    param->metricsPort = NULL;
+    param->engines = 0;
+    param->cacheSize = 0;
+    param->book = NULL;
+    param->budget.movetime = 0;
+    param->budget.depth = 0;
+    param->budget.nodes = 0;
 
     for (int i = 1; i < argc; i++) {
-        if (!(argv[i][0])) {
-            // empty string argument
-            return NULL;
+        if (!(argv[i][0]) || (i == argc - 1) || !(argv[i + 1][0])) {
+            // empty string argument or option missing its value
+            return false;
         }
 
-        if ((!strcmp(argv[i], "--listen") && (i != argc - 1) && (argv[i + 1][0])
-                    && (port == NULL))) {
-            port = strdup(argv[i + 1]);
-            i += 1;
+        if (!strcmp(argv[i], "--listen") && (param->port == NULL)) {
+            param->port = argv[i + 1];
+        } else if (!strcmp(argv[i], "--metrics")
+                && (param->metricsPort == NULL)) {
+            param->metricsPort = argv[i + 1];
+        } else if (!strcmp(argv[i], "--engines") && !param->engines) {
+            param->engines = parse_count(argv[i + 1]);
+            if (!param->engines) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--cache") && !param->cacheSize) {
+            param->cacheSize = parse_count(argv[i + 1]);
+            if (!param->cacheSize) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--book") && (param->book == NULL)) {
+            param->book = argv[i + 1];
+        } else if (!strcmp(argv[i], "--movetime")
+                && !param->budget.movetime) {
+            param->budget.movetime = parse_count(argv[i + 1]);
+            if (!param->budget.movetime) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--depth") && !param->budget.depth) {
+            param->budget.depth = parse_count(argv[i + 1]);
+            if (!param->budget.depth) {
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--nodes") && !param->budget.nodes) {
+            param->budget.nodes = parse_count(argv[i + 1]);
+            if (!param->budget.nodes) {
+                return false;
+            }
         } else {
-            return NULL;
+            return false;
         }
+        i += 1;
     }
     // args were valid but no port was specified so set port to "0" to be used
     // later when using ephermal port.
-    return port;
+    if (param->port == NULL) {
+        param->port = "0";
+    }
+    if (!param->engines) {
+        param->engines = DEFAULT_ENGINES;
+    }
+    if (!param->cacheSize) {
+        param->cacheSize = DEFAULT_CACHE_SIZE;
+    }
+    if (!param->budget.movetime) {
+        param->budget.movetime = DEFAULT_MOVETIME;
+    }
+    if (!param->budget.depth) {
+        param->budget.depth = DEFAULT_DEPTH;
+    }
+    return true;
 }
 
 /* move_string_valid()
@@ -220,124 +863,1290 @@ bool move_string_valid(char* move)
     return true;
 }
 
-/* read_line()
- * -----------
- * Read a line from a FILE* (until '\n' is read).
+/* square_bit()
+ * ------------
+ * Get the bitboard with only a given square set.
  *
- * read: FILE* to read line from
+ * square: Square to set (0 is a1, 1 is b1, ... 63 is h8)
  *
- * Returns: Pointer to line read or NULL if error occured whilst trying
- *          to read from FILE*.
+ * Returns: Bitboard containing only square
  */
-char* read_line(FILE* read)
+uint64_t square_bit(int square)
 {
-    char* result = (char*)malloc(sizeof(char));
-    int index = 0;
+    return 1ULL << square;
+}
 
-    if (feof(read)) {
-        free(result);
-        return NULL;
+/* pop_lsb()
+ * ---------
+ * Remove the lowest square from a non-empty bitboard.
+ *
+ * bits: Pointer to bitboard to remove square from
+ *
+ * Returns: Square which was removed
+ */
+int pop_lsb(uint64_t* bits)
+{
+    int square = __builtin_ctzll(*bits);
+    *bits &= *bits - 1;
+    return square;
+}
+
+/* shift_bits()
+ * ------------
+ * Move every square in a bitboard one step in a direction, dropping squares
+ * which would wrap around the edge of the board.
+ *
+ * bits: Bitboard to shift
+ * direction: Change in square number of one step (-9, -8, -7, 7, 8 or 9)
+ *
+ * Returns: Shifted bitboard
+ */
+uint64_t shift_bits(uint64_t bits, int direction)
+{
+    switch (direction) {
+    case 8:
+        return bits << 8;
+    case -8:
+        return bits >> 8;
+    case 9:
+        return (bits & ~FILE_H) << 9;
+    case 7:
+        return (bits & ~FILE_A) << 7;
+    case -7:
+        return (bits & ~FILE_H) >> 7;
+    default:
+        return (bits & ~FILE_A) >> 9;
     }
+}
 
-    while (true) {
-        char next = fgetc(read);
-        // got EOF so exit with whatever has been built up in result up
-        // until now
-        if (next == EOF) {
-            if (result != NULL) {
-                free(result);
-            }
-            return NULL;
-        }
-        // add next to result string
-        result[index] = next;
-        index++;
-        result = (char*)realloc(result, (index + 1) * sizeof(char));
+/* step_attacks()
+ * --------------
+ * Get the squares reachable from a square by single (file, rank) steps.
+ *
+ * square: Square to step from
+ * steps: Array of (file, rank) steps
+ * count: Number of steps in steps
+ *
+ * Returns: Bitboard of squares reached which are on the board
+ */
+uint64_t step_attacks(int square, const int steps[][2], int count)
+{
+    uint64_t attacks = 0;
 
-        // next was a newline so break here
-        if (next == '\n') {
-            break;
+    for (int i = 0; i < count; i++) {
+        int file = square % BOARD_WIDTH + steps[i][0];
+        int rank = square / BOARD_WIDTH + steps[i][1];
+        if ((file >= 0) && (file < BOARD_WIDTH) && (rank >= 0)
+                && (rank < BOARD_WIDTH)) {
+            attacks |= square_bit(rank * BOARD_WIDTH + file);
         }
     }
-    // terminate result string
-    result[index] = '\0';
-    return result;
+    return attacks;
 }
 
-/* confirm_stockfish_response()
- * ----------------------------
- * Confirm Stockfish's response to a command to match an expected response.
+/* sliding_attacks()
+ * -----------------
+ * Get the squares attacked by a sliding piece by walking along each of its
+ * directions until the edge of the board or an occupied square (this is
+ * only used to build the magic bitboard tables).
  *
- * command: Command to issue to Stockfish
- * expected: Expected reponse from Stockfish to command
- * writeFile: FILE* to use to write data to Stockfish
- * readFile: FILE* to use to read data from Stockfish
+ * square: Square the piece is on
+ * occupied: Bitboard of occupied squares
+ * directions: Array of four (file, rank) directions the piece slides in
  *
- * Returns: True if read response from stockfish matched the expected string,
- *          false otherwise.
+ * Returns: Bitboard of attacked squares
  */
-bool confirm_stockfish_response(
-        char* command, char* expected, FILE* writeFile, FILE* readFile)
+uint64_t sliding_attacks(
+        int square, uint64_t occupied, const int directions[4][2])
 {
-    // send command to stockfish
-    if (fputs(command, writeFile) == EOF) {
-        return false;
-    }
-    fflush(writeFile);
-    // read response from stockfish
-    char* line = read_line(readFile);
-    bool flag = false;
+    uint64_t attacks = 0;
 
-    while (line != NULL) {
-        // loop until we find the match (we can assume that response is
-        // forthcoming)
-        if (!strcmp(line, expected)) {
-            flag = true;
-            free(line);
-            break;
+    for (int i = 0; i < 4; i++) {
+        int file = square % BOARD_WIDTH + directions[i][0];
+        int rank = square / BOARD_WIDTH + directions[i][1];
+        while ((file >= 0) && (file < BOARD_WIDTH) && (rank >= 0)
+                && (rank < BOARD_WIDTH)) {
+            uint64_t bit = square_bit(rank * BOARD_WIDTH + file);
+            attacks |= bit;
+            if (occupied & bit) {
+                break;
+            }
+            file += directions[i][0];
+            rank += directions[i][1];
         }
-        free(line);
-        line = read_line(readFile);
     }
-    return flag;
+    return attacks;
 }
 
-/* init_stockfish()
- * ----------------
- * Initialise the Stockfish chess engine.
+/* next_random()
+ * -------------
+ * Generate the next number from a xorshift64* pseudo random sequence.
  *
- * writeFile: FILE* to use when sending data to Stockfish
- * readFile: FILE* to use when reading data from Stockfish
+ * state: Pointer to the (non-zero) state of the sequence
  *
- * Returns: Pointer to Engine struct or NULL if Stockfish couldn't be
- *          successfully initialised (isready or uci commands failed)
+ * Returns: Next number in the sequence
  */
-Engine* init_stockfish(FILE* writeFile, FILE* readFile)
+uint64_t next_random(uint64_t* state)
 {
-    if (feof(readFile) || feof(writeFile)) {
-        return NULL;
-    }
-    // send "isready" and wait for "readyok"
-    if (!confirm_stockfish_response(
-                "isready\n", "readyok\n", writeFile, readFile)) {
-        return NULL;
-    }
-    // send "uci" and wait for "uciok"
-    if (!confirm_stockfish_response("uci\n", "uciok\n", writeFile, readFile)) {
-        return NULL;
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/* magic_index()
+ * -------------
+ * Get the index of the attacks for a set of occupied squares in a square's
+ * magic bitboard table.
+ *
+ * magic: Magic bitboard entry for the square
+ * occupied: Bitboard of occupied squares
+ *
+ * Returns: Index into magic->attacks
+ */
+unsigned magic_index(const Magic* magic, uint64_t occupied)
+{
+    return (unsigned)(((occupied & magic->mask) * magic->magic)
+            >> magic->shift);
+}
+
+/* init_magics()
+ * -------------
+ * Build the magic bitboard tables for a sliding piece. For each square every
+ * subset of the relevant blockers is enumerated and random sparse numbers are
+ * tried until one maps every subset to a slot holding its attacks.
+ *
+ * magics: Array of Magic entries to fill in (one per square)
+ * table: Table to store the attacks of all squares in
+ * directions: Array of four (file, rank) directions the piece slides in
+ */
+void init_magics(Magic magics[], uint64_t* table, const int directions[4][2])
+{
+    static uint64_t occupancy[MAX_BLOCKER_SETS];
+    static uint64_t reference[MAX_BLOCKER_SETS];
+    static int epoch[MAX_BLOCKER_SETS];
+    int attempt = 0;
+    uint64_t seed = MAGIC_SEED;
+
+    memset(epoch, 0, sizeof(epoch));
+    for (int square = 0; square < BOARD_SQUARES; square++) {
+        Magic* magic = &magics[square];
+        // squares on the edge of the board never block anything beyond them
+        uint64_t edges = ((RANK_1 | RANK_8)
+                                 & ~(RANK_1 << (8 * (square / BOARD_WIDTH))))
+                | ((FILE_A | FILE_H) & ~(FILE_A << (square % BOARD_WIDTH)));
+        magic->mask = sliding_attacks(square, 0, directions) & ~edges;
+        magic->shift = 64 - __builtin_popcountll(magic->mask);
+        magic->attacks = table;
+
+        int size = 0;
+        uint64_t subset = 0;
+        do {
+            occupancy[size] = subset;
+            reference[size] = sliding_attacks(square, subset, directions);
+            size++;
+            subset = (subset - magic->mask) & magic->mask;
+        } while (subset);
+        table += size;
+
+        for (int i = 0; i < size;) {
+            do {
+                magic->magic = next_random(&seed) & next_random(&seed)
+                        & next_random(&seed);
+            } while (__builtin_popcountll((magic->magic * magic->mask) >> 56)
+                    < 6);
+            attempt++;
+            for (i = 0; i < size; i++) {
+                unsigned index = magic_index(magic, occupancy[i]);
+                if (epoch[index] < attempt) {
+                    epoch[index] = attempt;
+                    magic->attacks[index] = reference[i];
+                } else if (magic->attacks[index] != reference[i]) {
+                    break;
+                }
+            }
+        }
     }
-    // initialise Engine struct and semaphore
-    Engine* result = (Engine*)malloc(sizeof(Engine));
-    sem_t* stockfishLock = (sem_t*)malloc(sizeof(sem_t));
-    sem_init(stockfishLock, 0, 1);
+}
 
-    result->lock = stockfishLock;
-    result->toEngine = writeFile;
-    result->fromEngine = readFile;
+/* init_attack_tables()
+ * --------------------
+ * Initialise the attack tables used for move generation and the keys used
+ * for hashing positions. This must be called once before any positions are
+ * analysed.
+ */
+void init_attack_tables(void)
+{
+    const int knightSteps[8][2] = {{1, 2}, {2, 1}, {2, -1}, {1, -2},
+            {-1, -2}, {-2, -1}, {-2, 1}, {-1, 2}};
+    const int kingSteps[8][2] = {{1, 0}, {1, 1}, {0, 1}, {-1, 1}, {-1, 0},
+            {-1, -1}, {0, -1}, {1, -1}};
+    const int whitePawnSteps[2][2] = {{-1, 1}, {1, 1}};
+    const int blackPawnSteps[2][2] = {{-1, -1}, {1, -1}};
+
+    for (int square = 0; square < BOARD_SQUARES; square++) {
+        knightAttacks[square] = step_attacks(square, knightSteps, 8);
+        kingAttacks[square] = step_attacks(square, kingSteps, 8);
+        pawnAttacks[WHITE][square] = step_attacks(square, whitePawnSteps, 2);
+        pawnAttacks[BLACK][square] = step_attacks(square, blackPawnSteps, 2);
+    }
+    init_magics(rookMagics, rookAttackTable, rookDirections);
+    init_magics(bishopMagics, bishopAttackTable, bishopDirections);
+
+    uint64_t seed = ZOBRIST_SEED;
+    for (int colour = WHITE; colour <= BLACK; colour++) {
+        for (int type = PAWN; type < NO_PIECE; type++) {
+            for (int square = 0; square < BOARD_SQUARES; square++) {
+                zobristPieces[colour][type][square] = next_random(&seed);
+            }
+        }
+    }
+    for (int rights = 0; rights < (1 << 4); rights++) {
+        zobristCastling[rights] = next_random(&seed);
+    }
+    for (int file = 0; file < BOARD_WIDTH; file++) {
+        zobristEnPassant[file] = next_random(&seed);
+    }
+    zobristBlack = next_random(&seed);
+    // hard searches share the keys of the opening book (0)
+    for (int difficulty = EASY; difficulty < HARD; difficulty++) {
+        zobristDifficulty[difficulty] = next_random(&seed);
+    }
+}
+
+/* piece_attacks()
+ * ---------------
+ * Get the squares attacked by a (non-pawn) piece.
+ *
+ * type: Type of the piece
+ * square: Square the piece is on
+ * occupied: Bitboard of occupied squares
+ *
+ * Returns: Bitboard of squares attacked by the piece
+ */
+uint64_t piece_attacks(PieceType type, int square, uint64_t occupied)
+{
+    const Magic* rook = &rookMagics[square];
+    const Magic* bishop = &bishopMagics[square];
+
+    switch (type) {
+    case KNIGHT:
+        return knightAttacks[square];
+    case BISHOP:
+        return bishop->attacks[magic_index(bishop, occupied)];
+    case ROOK:
+        return rook->attacks[magic_index(rook, occupied)];
+    case QUEEN:
+        return bishop->attacks[magic_index(bishop, occupied)]
+                | rook->attacks[magic_index(rook, occupied)];
+    case KING:
+        return kingAttacks[square];
+    default:
+        return 0;
+    }
+}
+
+/* attackers_to()
+ * --------------
+ * Get the pieces (of either colour) attacking a square.
+ *
+ * pos: Position to look at
+ * square: Square to find attackers of
+ * occupied: Bitboard of occupied squares
+ *
+ * Returns: Bitboard of the squares of pieces attacking square
+ */
+uint64_t attackers_to(const Position* pos, int square, uint64_t occupied)
+{
+    return (pawnAttacks[WHITE][square] & pos->colours[BLACK]
+                   & pos->pieces[PAWN])
+            | (pawnAttacks[BLACK][square] & pos->colours[WHITE]
+                    & pos->pieces[PAWN])
+            | (knightAttacks[square] & pos->pieces[KNIGHT])
+            | (kingAttacks[square] & pos->pieces[KING])
+            | (piece_attacks(ROOK, square, occupied)
+                    & (pos->pieces[ROOK] | pos->pieces[QUEEN]))
+            | (piece_attacks(BISHOP, square, occupied)
+                    & (pos->pieces[BISHOP] | pos->pieces[QUEEN]));
+}
+
+/* squares_between()
+ * -----------------
+ * Get the squares strictly between two squares on the same rank, file or
+ * diagonal.
+ *
+ * from: First square
+ * to: Second square
+ *
+ * Returns: Bitboard of the squares between from and to (empty if they don't
+ *          share a line)
+ */
+uint64_t squares_between(int from, int to)
+{
+    uint64_t fromBit = square_bit(from);
+    uint64_t toBit = square_bit(to);
+
+    if (piece_attacks(ROOK, from, 0) & toBit) {
+        return piece_attacks(ROOK, from, toBit)
+                & piece_attacks(ROOK, to, fromBit);
+    }
+    if (piece_attacks(BISHOP, from, 0) & toBit) {
+        return piece_attacks(BISHOP, from, toBit)
+                & piece_attacks(BISHOP, to, fromBit);
+    }
+    return 0;
+}
+
+/* piece_on()
+ * ----------
+ * Get the type of the piece on a square.
+ *
+ * pos: Position to look at
+ * square: Square to look at
+ *
+ * Returns: Type of piece on square or NO_PIECE if it is empty
+ */
+PieceType piece_on(const Position* pos, int square)
+{
+    uint64_t bit = square_bit(square);
+
+    for (int type = PAWN; type < NO_PIECE; type++) {
+        if (pos->pieces[type] & bit) {
+            return type;
+        }
+    }
+    return NO_PIECE;
+}
+
+/* king_square()
+ * -------------
+ * Get the square of a player's king.
+ *
+ * pos: Position to look at
+ * colour: Colour of the king to find
+ *
+ * Returns: Square the king is on
+ */
+int king_square(const Position* pos, Colour colour)
+{
+    return __builtin_ctzll(pos->pieces[KING] & pos->colours[colour]);
+}
+
+/* checkers_of()
+ * -------------
+ * Get the pieces giving check to the player whose turn it is.
+ *
+ * pos: Position to look at
+ *
+ * Returns: Bitboard of the squares of the checking pieces
+ */
+uint64_t checkers_of(const Position* pos)
+{
+    uint64_t occupied = pos->colours[WHITE] | pos->colours[BLACK];
+
+    return attackers_to(pos, king_square(pos, pos->toMove), occupied)
+            & pos->colours[!pos->toMove];
+}
+
+/* add_move()
+ * ----------
+ * Append a move to an array of moves.
+ *
+ * moves: Array of moves to append to
+ * count: Pointer to number of moves in moves
+ * from: Square the move starts on
+ * to: Square the move ends on
+ * promotion: Type of piece the pawn promotes to or NO_PIECE
+ */
+void add_move(Move* moves, int* count, int from, int to, PieceType promotion)
+{
+    moves[*count].from = from;
+    moves[*count].to = to;
+    moves[*count].promotion = promotion;
+    (*count)++;
+}
+
+/* add_promotions()
+ * ----------------
+ * Append all four promotions of a pawn move to an array of moves.
+ *
+ * moves: Array of moves to append to
+ * count: Pointer to number of moves in moves
+ * from: Square the pawn moves from
+ * to: Square the pawn promotes on
+ */
+void add_promotions(Move* moves, int* count, int from, int to)
+{
+    add_move(moves, count, from, to, QUEEN);
+    add_move(moves, count, from, to, ROOK);
+    add_move(moves, count, from, to, BISHOP);
+    add_move(moves, count, from, to, KNIGHT);
+}
+
+/* generate_pawn_moves()
+ * ---------------------
+ * Append the pseudo-legal pawn moves of the player whose turn it is.
+ *
+ * pos: Position to generate moves for
+ * moves: Array of moves to append to
+ * count: Pointer to number of moves in moves
+ * target: Squares which moves may end on
+ * checkers: Bitboard of pieces giving check (only these may be captured when
+ *           non-empty)
+ */
+void generate_pawn_moves(const Position* pos, Move* moves, int* count,
+        uint64_t target, uint64_t checkers)
+{
+    Colour us = pos->toMove;
+    int up = (us == WHITE) ? 8 : -8;
+    int upRight = (us == WHITE) ? 9 : -9;
+    int upLeft = (us == WHITE) ? 7 : -7;
+    uint64_t seventh = (us == WHITE) ? (RANK_1 << 48) : (RANK_1 << 8);
+    uint64_t third = (us == WHITE) ? (RANK_1 << 16) : (RANK_1 << 40);
+    uint64_t empty = ~(pos->colours[WHITE] | pos->colours[BLACK]);
+    uint64_t enemies = checkers ? checkers : pos->colours[!us];
+    uint64_t pawns = pos->pieces[PAWN] & pos->colours[us];
+    uint64_t promoting = pawns & seventh;
+    pawns &= ~seventh;
+
+    // single and double pushes
+    uint64_t single = shift_bits(pawns, up) & empty;
+    uint64_t twice = shift_bits(single & third, up) & empty & target;
+    single &= target;
+    while (single) {
+        int to = pop_lsb(&single);
+        add_move(moves, count, to - up, to, NO_PIECE);
+    }
+    while (twice) {
+        int to = pop_lsb(&twice);
+        add_move(moves, count, to - up - up, to, NO_PIECE);
+    }
+    // promotions by capturing and by pushing
+    uint64_t right = shift_bits(promoting, upRight) & enemies;
+    uint64_t left = shift_bits(promoting, upLeft) & enemies;
+    uint64_t forward = shift_bits(promoting, up) & empty & target;
+    while (right) {
+        int to = pop_lsb(&right);
+        add_promotions(moves, count, to - upRight, to);
+    }
+    while (left) {
+        int to = pop_lsb(&left);
+        add_promotions(moves, count, to - upLeft, to);
+    }
+    while (forward) {
+        int to = pop_lsb(&forward);
+        add_promotions(moves, count, to - up, to);
+    }
+    // captures
+    right = shift_bits(pawns, upRight) & enemies;
+    left = shift_bits(pawns, upLeft) & enemies;
+    while (right) {
+        int to = pop_lsb(&right);
+        add_move(moves, count, to - upRight, to, NO_PIECE);
+    }
+    while (left) {
+        int to = pop_lsb(&left);
+        add_move(moves, count, to - upLeft, to, NO_PIECE);
+    }
+    if (pos->enPassant >= 0) {
+        // an en passant capture can't resolve a check discovered by the
+        // pawn's double move
+        if (checkers && (target & square_bit(pos->enPassant + up))) {
+            return;
+        }
+        uint64_t capturers = pawns & pawnAttacks[!us][pos->enPassant];
+        while (capturers) {
+            add_move(moves, count, pop_lsb(&capturers), pos->enPassant,
+                    NO_PIECE);
+        }
+    }
+}
+
+/* generate_castling()
+ * -------------------
+ * Append the castling moves available to the player whose turn it is (the
+ * squares the king crosses are checked by move_is_legal()).
+ *
+ * pos: Position to generate moves for
+ * moves: Array of moves to append to
+ * count: Pointer to number of moves in moves
+ */
+void generate_castling(const Position* pos, Move* moves, int* count)
+{
+    Colour us = pos->toMove;
+    int king = (us == WHITE) ? WHITE_KING_START : BLACK_KING_START;
+    int rights = (us == WHITE) ? pos->castling : (pos->castling >> 2);
+    uint64_t occupied = pos->colours[WHITE] | pos->colours[BLACK];
+    uint64_t rooks = pos->pieces[ROOK] & pos->colours[us];
+
+    if (!(pos->pieces[KING] & pos->colours[us] & square_bit(king))) {
+        return;
+    }
+    if ((rights & WHITE_KINGSIDE) && (rooks & square_bit(king + 3))
+            && !(occupied & (square_bit(king + 1) | square_bit(king + 2)))) {
+        add_move(moves, count, king, king + 2, NO_PIECE);
+    }
+    if ((rights & WHITE_QUEENSIDE) && (rooks & square_bit(king - 4))
+            && !(occupied
+                    & (square_bit(king - 1) | square_bit(king - 2)
+                            | square_bit(king - 3)))) {
+        add_move(moves, count, king, king - 2, NO_PIECE);
+    }
+}
+
+/* generate_pseudo_moves()
+ * -----------------------
+ * Generate the pseudo-legal moves of the player whose turn it is. When in
+ * check only moves which might get out of check are generated. Moves are
+ * generated in the same order as Stockfish (pawns, knights, bishops, rooks,
+ * queens then the king) so that hints list moves in Stockfish's order.
+ *
+ * pos: Position to generate moves for
+ * moves: Array (of at least MAX_MOVES) to store moves in
+ *
+ * Returns: Number of moves generated
+ */
+int generate_pseudo_moves(const Position* pos, Move* moves)
+{
+    Colour us = pos->toMove;
+    uint64_t own = pos->colours[us];
+    uint64_t occupied = pos->colours[WHITE] | pos->colours[BLACK];
+    int king = king_square(pos, us);
+    uint64_t checkers = checkers_of(pos);
+    int count = 0;
+
+    // only the king can move out of a double check
+    if (!(checkers & (checkers - 1))) {
+        uint64_t target = ~own;
+        if (checkers) {
+            // block or capture the checking piece
+            target = squares_between(king, __builtin_ctzll(checkers))
+                    | checkers;
+        }
+        generate_pawn_moves(pos, moves, &count, target, checkers);
+        for (int type = KNIGHT; type < KING; type++) {
+            uint64_t pieces = pos->pieces[type] & own;
+            while (pieces) {
+                int from = pop_lsb(&pieces);
+                uint64_t attacks = piece_attacks(type, from, occupied) & target;
+                while (attacks) {
+                    add_move(moves, &count, from, pop_lsb(&attacks), NO_PIECE);
+                }
+            }
+        }
+    }
+    uint64_t attacks = kingAttacks[king] & ~own;
+    while (attacks) {
+        add_move(moves, &count, king, pop_lsb(&attacks), NO_PIECE);
+    }
+    if (!checkers) {
+        generate_castling(pos, moves, &count);
+    }
+    return count;
+}
+
+/* castling_kept()
+ * ---------------
+ * Get the castling rights which survive a piece moving to or from a square.
+ *
+ * square: Square moved to or from
+ *
+ * Returns: Mask of the castling rights kept
+ */
+int castling_kept(int square)
+{
+    switch (square) {
+    case WHITE_KING_START:
+        return ~(WHITE_KINGSIDE | WHITE_QUEENSIDE);
+    case WHITE_KING_START - 4:
+        return ~WHITE_QUEENSIDE;
+    case WHITE_KING_START + 3:
+        return ~WHITE_KINGSIDE;
+    case BLACK_KING_START:
+        return ~(BLACK_KINGSIDE | BLACK_QUEENSIDE);
+    case BLACK_KING_START - 4:
+        return ~BLACK_QUEENSIDE;
+    case BLACK_KING_START + 3:
+        return ~BLACK_KINGSIDE;
+    default:
+        return ~0;
+    }
+}
+
+/* make_move()
+ * -----------
+ * Play a (pseudo-legal) move in a position.
+ *
+ * pos: Position to play move in (this is updated)
+ * move: Move to play
+ */
+void make_move(Position* pos, Move move)
+{
+    Colour us = pos->toMove;
+    Colour them = !us;
+    int up = (us == WHITE) ? 8 : -8;
+    uint64_t fromTo = square_bit(move.from) | square_bit(move.to);
+    PieceType moving = piece_on(pos, move.from);
+    PieceType captured = piece_on(pos, move.to);
+
+    if (captured != NO_PIECE) {
+        pos->pieces[captured] &= ~square_bit(move.to);
+        pos->colours[them] &= ~square_bit(move.to);
+    } else if ((moving == PAWN) && (move.to == pos->enPassant)) {
+        // en passant so remove the pawn behind the destination square
+        pos->pieces[PAWN] &= ~square_bit(move.to - up);
+        pos->colours[them] &= ~square_bit(move.to - up);
+        captured = PAWN;
+    }
+    pos->pieces[moving] ^= fromTo;
+    pos->colours[us] ^= fromTo;
+    if (move.promotion != NO_PIECE) {
+        pos->pieces[PAWN] &= ~square_bit(move.to);
+        pos->pieces[move.promotion] |= square_bit(move.to);
+    }
+    if ((moving == KING) && (abs(move.to - move.from) == 2)) {
+        // castling so move the rook across the king too
+        int rookFrom = (move.to > move.from) ? move.from + 3 : move.from - 4;
+        int rookTo = (move.from + move.to) / 2;
+        uint64_t rookMove = square_bit(rookFrom) | square_bit(rookTo);
+        pos->pieces[ROOK] ^= rookMove;
+        pos->colours[us] ^= rookMove;
+    }
+    pos->castling &= castling_kept(move.from) & castling_kept(move.to);
+
+    // like Stockfish, only record an en passant square if a pawn could
+    // capture on it
+    pos->enPassant = -1;
+    if ((moving == PAWN) && (abs(move.to - move.from) == 16)
+            && (pawnAttacks[us][move.from + up] & pos->pieces[PAWN]
+                    & pos->colours[them])) {
+        pos->enPassant = move.from + up;
+    }
+    if ((moving == PAWN) || (captured != NO_PIECE)) {
+        pos->halfmoves = 0;
+    } else {
+        pos->halfmoves++;
+    }
+    if (us == BLACK) {
+        pos->fullmoves++;
+    }
+    pos->toMove = them;
+}
+
+/* move_is_legal()
+ * ---------------
+ * Check whether a pseudo-legal move leaves the moving player's king safe.
+ *
+ * pos: Position the move is played in
+ * move: Move to check
+ *
+ * Returns: True if move is legal, false otherwise
+ */
+bool move_is_legal(const Position* pos, Move move)
+{
+    Colour us = pos->toMove;
+
+    if ((square_bit(move.from) & pos->pieces[KING])
+            && (abs(move.to - move.from) == 2)) {
+        // castling, so the squares the king crosses can't be attacked
+        uint64_t occupied = pos->colours[WHITE] | pos->colours[BLACK];
+        int step = (move.to > move.from) ? 1 : -1;
+        for (int square = move.from + step; square != move.to + step;
+                square += step) {
+            if (attackers_to(pos, square, occupied) & pos->colours[!us]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    Position after = *pos;
+    make_move(&after, move);
+    uint64_t occupied = after.colours[WHITE] | after.colours[BLACK];
+    return !(attackers_to(&after, king_square(&after, us), occupied)
+            & after.colours[!us]);
+}
+
+/* generate_legal_moves()
+ * ----------------------
+ * Generate the legal moves of the player whose turn it is. Illegal moves are
+ * replaced by the last move generated, as Stockfish does.
+ *
+ * pos: Position to generate moves for
+ * moves: Array (of at least MAX_MOVES) to store moves in
+ *
+ * Returns: Number of legal moves
+ */
+int generate_legal_moves(const Position* pos, Move* moves)
+{
+    int count = generate_pseudo_moves(pos, moves);
+
+    for (int i = 0; i < count;) {
+        if (move_is_legal(pos, moves[i])) {
+            i++;
+        } else {
+            moves[i] = moves[--count];
+        }
+    }
+    return count;
+}
+
+/* move_to_string()
+ * ----------------
+ * Convert a move to its string representation e.g. "e7e8q".
+ *
+ * move: Move to convert
+ * buffer: Buffer (of at least MAX_MOVE_STRING_LENGTH + 1) to store string in
+ */
+void move_to_string(Move move, char* buffer)
+{
+    buffer[0] = 'a' + move.from % BOARD_WIDTH;
+    buffer[1] = '1' + move.from / BOARD_WIDTH;
+    buffer[2] = 'a' + move.to % BOARD_WIDTH;
+    buffer[3] = '1' + move.to / BOARD_WIDTH;
+    buffer[4] = '\0';
+    if (move.promotion != NO_PIECE) {
+        buffer[4] = pieceChars[move.promotion];
+        buffer[5] = '\0';
+    }
+}
+
+/* find_legal_move()
+ * -----------------
+ * Look up a move string among the legal moves of a position.
+ *
+ * pos: Position the move is played in
+ * moveString: String representation of the move e.g. "g1f3"
+ * move: Pointer to store the matching move in
+ *
+ * Returns: True if moveString is a legal move, false otherwise
+ */
+bool find_legal_move(const Position* pos, char* moveString, Move* move)
+{
+    Move moves[MAX_MOVES];
+    int count = generate_legal_moves(pos, moves);
+    char buffer[MAX_MOVE_STRING_LENGTH + 1];
+    char wanted[MAX_MOVE_STRING_LENGTH + 1];
+
+    // like Stockfish, accept the promotion piece in either case
+    snprintf(wanted, sizeof(wanted), "%s", moveString);
+    wanted[MAX_MOVE_STRING_LENGTH - 1] = tolower(
+            wanted[MAX_MOVE_STRING_LENGTH - 1]);
+    for (int i = 0; i < count; i++) {
+        move_to_string(moves[i], buffer);
+        if (!strcmp(buffer, wanted)) {
+            *move = moves[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/* parse_fen()
+ * -----------
+ * Read a position from a FEN string. As in Stockfish, an en passant square
+ * is ignored unless a pawn could capture on it.
+ *
+ * fen: FEN string to read
+ * pos: Position to store result in
+ *
+ * Returns: True if fen was a valid position, false otherwise
+ */
+bool parse_fen(const char* fen, Position* pos)
+{
+    memset(pos, 0, sizeof(Position));
+    int square = BOARD_SQUARES - BOARD_WIDTH;
+
+    for (; *fen && (*fen != ' '); fen++) {
+        const char* type = strchr(pieceChars, tolower(*fen));
+        if (*fen == '/') {
+            square -= 2 * BOARD_WIDTH;
+        } else if ((*fen >= '1') && (*fen <= '8')) {
+            square += *fen - '0';
+        } else if ((type != NULL) && (square >= 0)
+                && (square < BOARD_SQUARES)) {
+            pos->pieces[type - pieceChars] |= square_bit(square);
+            pos->colours[isupper(*fen) ? WHITE : BLACK] |= square_bit(square);
+            square++;
+        } else {
+            return false;
+        }
+    }
+    char side = 'w';
+    char castling[5] = "-";
+    char enPassant[3] = "-";
+    pos->fullmoves = 1;
+    sscanf(fen, " %c %4s %2s %d %d", &side, castling, enPassant,
+            &pos->halfmoves, &pos->fullmoves);
+    pos->toMove = (side == 'b') ? BLACK : WHITE;
+    for (char* c = castling; *c; c++) {
+        const char* right = strchr(castlingChars, *c);
+        if (right != NULL) {
+            pos->castling |= 1 << (right - castlingChars);
+        }
+    }
+    pos->enPassant = -1;
+    if ((enPassant[0] >= 'a') && (enPassant[0] <= 'h')
+            && (enPassant[1] == ((side == 'b') ? '3' : '6'))) {
+        int up = (pos->toMove == WHITE) ? 8 : -8;
+        int ep = (enPassant[1] - '1') * BOARD_WIDTH + enPassant[0] - 'a';
+        uint64_t occupied = pos->colours[WHITE] | pos->colours[BLACK];
+        if ((pawnAttacks[!pos->toMove][ep] & pos->pieces[PAWN]
+                    & pos->colours[pos->toMove])
+                && (pos->pieces[PAWN] & pos->colours[!pos->toMove]
+                        & square_bit(ep - up))
+                && !(occupied & (square_bit(ep) | square_bit(ep + up)))) {
+            pos->enPassant = ep;
+        }
+    }
+    if (pos->fullmoves < 1) {
+        pos->fullmoves = 1;
+    }
+    // each side needs exactly one king
+    return (__builtin_popcountll(pos->pieces[KING] & pos->colours[WHITE]) == 1)
+            && (__builtin_popcountll(pos->pieces[KING] & pos->colours[BLACK])
+                    == 1);
+}
+
+/* piece_char()
+ * ------------
+ * Get the character representing the piece on a square (upper case for
+ * white pieces, lower case for black).
+ *
+ * pos: Position to look at
+ * square: Square to look at
+ *
+ * Returns: Character for the piece or ' ' if square is empty
+ */
+char piece_char(const Position* pos, int square)
+{
+    PieceType type = piece_on(pos, square);
+
+    if (type == NO_PIECE) {
+        return ' ';
+    }
+    if (pos->colours[WHITE] & square_bit(square)) {
+        return toupper(pieceChars[type]);
+    }
+    return pieceChars[type];
+}
+
+/* position_to_fen()
+ * -----------------
+ * Convert a position to a FEN string.
+ *
+ * pos: Position to convert
+ *
+ * Returns: Pointer to (malloc'd) FEN string
+ */
+char* position_to_fen(const Position* pos)
+{
+    char* fen = (char*)malloc(MAX_FEN_LENGTH * sizeof(char));
+    int length = 0;
+
+    for (int rank = BOARD_WIDTH - 1; rank >= 0; rank--) {
+        int empty = 0;
+        for (int file = 0; file < BOARD_WIDTH; file++) {
+            char piece = piece_char(pos, rank * BOARD_WIDTH + file);
+            if (piece == ' ') {
+                empty++;
+                continue;
+            }
+            if (empty) {
+                fen[length++] = '0' + empty;
+                empty = 0;
+            }
+            fen[length++] = piece;
+        }
+        if (empty) {
+            fen[length++] = '0' + empty;
+        }
+        fen[length++] = rank ? '/' : ' ';
+    }
+    fen[length++] = (pos->toMove == WHITE) ? 'w' : 'b';
+    fen[length++] = ' ';
+    if (!pos->castling) {
+        fen[length++] = '-';
+    }
+    for (int i = 0; castlingChars[i]; i++) {
+        if (pos->castling & (1 << i)) {
+            fen[length++] = castlingChars[i];
+        }
+    }
+    if (pos->enPassant < 0) {
+        sprintf(fen + length, " - %d %d", pos->halfmoves, pos->fullmoves);
+    } else {
+        sprintf(fen + length, " %c%c %d %d",
+                'a' + pos->enPassant % BOARD_WIDTH,
+                '1' + pos->enPassant / BOARD_WIDTH, pos->halfmoves,
+                pos->fullmoves);
+    }
+    return fen;
+}
+
+/* position_to_board()
+ * -------------------
+ * Draw a position as a board, in the same layout as Stockfish's "d" command.
+ *
+ * pos: Position to draw
+ *
+ * Returns: Pointer to (malloc'd) string holding the board
+ */
+char* position_to_board(const Position* pos)
+{
+    const char* const separator = " +---+---+---+---+---+---+---+---+\n";
+    char* board = (char*)malloc(MAX_BOARD_LENGTH * sizeof(char));
+    int length = sprintf(board, "\n%s", separator);
+
+    for (int rank = BOARD_WIDTH - 1; rank >= 0; rank--) {
+        for (int file = 0; file < BOARD_WIDTH; file++) {
+            length += sprintf(board + length, " | %c",
+                    piece_char(pos, rank * BOARD_WIDTH + file));
+        }
+        length += sprintf(board + length, " | %d\n%s", rank + 1, separator);
+    }
+    sprintf(board + length, "   a   b   c   d   e   f   g   h\n\n");
+    return board;
+}
+
+/* analyse_position()
+ * ------------------
+ * Analyse current position for a check, checkmate or stalemate.
+ *
+ * pos: Position to analyse
+ *
+ * Returns: OK if current position not has a check, checkmate or stalemate,
+ *          otherwise CHECK, CHECKMATE or STALEMATE if current position
+ *          contains a check, checkmate or stalemate respectively.
+ */
+MoveStatus analyse_position(const Position* pos)
+{
+    Move moves[MAX_MOVES];
+    int count = generate_legal_moves(pos, moves);
+
+    if (checkers_of(pos)) {
+        // there was a check and there are no possible moves (checkmate) or
+        // there are possible moves (check)
+        return count ? CHECK : CHECKMATE;
+    }
+    // there was no check but there a no possible moves (stalemate)
+    return count ? OK : STALEMATE;
+}
+
+
+/* position_hash()
+ * ---------------
+ * Get the Zobrist hash of a position. The move counters aren't included so
+ * the same position reached by different move orders has the same hash.
+ *
+ * pos: Position to hash
+ *
+ * Returns: 64 bit hash of pos
+ */
+uint64_t position_hash(const Position* pos)
+{
+    uint64_t hash = zobristCastling[pos->castling];
+
+    for (int colour = WHITE; colour <= BLACK; colour++) {
+        for (int type = PAWN; type < NO_PIECE; type++) {
+            uint64_t pieces = pos->pieces[type] & pos->colours[colour];
+            while (pieces) {
+                hash ^= zobristPieces[colour][type][pop_lsb(&pieces)];
+            }
+        }
+    }
+    if (pos->enPassant >= 0) {
+        hash ^= zobristEnPassant[pos->enPassant % BOARD_WIDTH];
+    }
+    if (pos->toMove == BLACK) {
+        hash ^= zobristBlack;
+    }
+    return hash;
+}
+
+/* init_move_cache()
+ * -----------------
+ * Initialise an empty MoveCache.
+ *
+ * capacity: Number of best moves the cache can hold
+ *
+ * Returns: Pointer to initialised MoveCache
+ */
+MoveCache* init_move_cache(int capacity)
+{
+    MoveCache* cache = (MoveCache*)malloc(sizeof(MoveCache));
+    cache->entries = (CacheEntry*)calloc(capacity, sizeof(CacheEntry));
+    cache->buckets = (int*)malloc(capacity * sizeof(int));
+    for (int i = 0; i < capacity; i++) {
+        cache->buckets[i] = -1;
+    }
+    cache->capacity = capacity;
+    cache->hand = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->lock = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(cache->lock, 0, 1);
+    return cache;
+}
+
+/* cache_find()
+ * ------------
+ * Find the entry holding a position in a MoveCache. The caller must hold
+ * the cache's lock.
+ *
+ * cache: Cache to search
+ * key: Hash of the position to find
+ *
+ * Returns: Index of the entry or -1 if the position isn't cached
+ */
+int cache_find(MoveCache* cache, uint64_t key)
+{
+    int index = cache->buckets[key % cache->capacity];
+
+    while ((index >= 0) && (cache->entries[index].key != key)) {
+        index = cache->entries[index].next;
+    }
+    return index;
+}
+
+/* cache_lookup()
+ * --------------
+ * Look up the best move of a position in a MoveCache.
+ *
+ * cache: Cache to look in
+ * key: Hash of the position
+ * movetime: Least search time (in milliseconds) the move must have been
+ *           found with
+ * move: Buffer (of at least MAX_MOVE_STRING_LENGTH + 1) to store move in
+ *
+ * Returns: True if the move was found, false otherwise
+ */
+bool cache_lookup(MoveCache* cache, uint64_t key, int movetime, char* move)
+{
+    sem_wait(cache->lock);
+    int index = cache_find(cache, key);
+
+    if ((index >= 0) && (cache->entries[index].movetime < movetime)) {
+        // the move was found by a search cut short under load
+        index = -1;
+    }
+    if (index < 0) {
+        cache->misses++;
+    } else {
+        cache->hits++;
+        cache->entries[index].referenced = true;
+        strcpy(move, cache->entries[index].move);
+    }
+    sem_post(cache->lock);
+    return index >= 0;
+}
+
+/* cache_evict()
+ * -------------
+ * Free up an entry of a MoveCache, evicting the first entry found by the
+ * clock hand which hasn't been looked up since the hand last passed it. The
+ * caller must hold the cache's lock.
+ *
+ * cache: Cache to evict from
+ *
+ * Returns: Index of the entry freed
+ */
+int cache_evict(MoveCache* cache)
+{
+    while (true) {
+        int index = cache->hand;
+        CacheEntry* entry = &cache->entries[index];
+        cache->hand = (cache->hand + 1) % cache->capacity;
+
+        if (!entry->used) {
+            return index;
+        }
+        if (entry->referenced) {
+            // give entry a second chance
+            entry->referenced = false;
+            continue;
+        }
+        // unlink entry from its bucket
+        int* link = &cache->buckets[entry->key % cache->capacity];
+        while (*link != index) {
+            link = &cache->entries[*link].next;
+        }
+        *link = entry->next;
+        entry->used = false;
+        return index;
+    }
+}
+
+/* cache_store()
+ * -------------
+ * Store the best move of a position in a MoveCache. A move already stored
+ * for the position is only replaced if it was found with no more search time,
+ * so moves found under load never displace better ones.
+ *
+ * cache: Cache to store move in
+ * key: Hash of the position
+ * move: Best move in the position e.g. "g1f3"
+ * movetime: Search time (in milliseconds) move was found with
+ */
+void cache_store(MoveCache* cache, uint64_t key, char* move, int movetime)
+{
+    sem_wait(cache->lock);
+    int index = cache_find(cache, key);
+
+    if (index < 0) {
+        index = cache_evict(cache);
+        int* bucket = &cache->buckets[key % cache->capacity];
+        cache->entries[index].key = key;
+        cache->entries[index].next = *bucket;
+        cache->entries[index].used = true;
+        *bucket = index;
+    } else if (cache->entries[index].movetime > movetime) {
+        // keep the move found with the longer search
+        sem_post(cache->lock);
+        return;
+    }
+    cache->entries[index].referenced = false;
+    cache->entries[index].movetime = movetime;
+    snprintf(cache->entries[index].move, MAX_MOVE_STRING_LENGTH + 1, "%s",
+            move);
+    sem_post(cache->lock);
+}
+
+/* load_opening_book()
+ * -------------------
+ * Preload a MoveCache with the moves in an opening book. Each line of the
+ * book is a FEN string followed by the move to play in that position e.g.
+ * "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1 e2e4". Blank
+ * lines, lines starting with '#' and lines whose move isn't legal are
+ * ignored.
+ *
+ * cache: Cache to load moves into
+ * filename: Name of the opening book file
+ *
+ * Returns: True if the book could be read, false otherwise
+ */
+bool load_opening_book(MoveCache* cache, char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    LineReader* book = init_line_reader(fd);
+    char* line;
+
+    while ((line = read_buffered_line(book, NULL)) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char* move = strrchr(line, ' ');
+        Position pos;
+        Move legal;
+        if ((line[0] != '#') && (move != NULL)) {
+            *move++ = '\0';
+            if (move_string_valid(move) && parse_fen(line, &pos)
+                    && find_legal_move(&pos, move, &legal)) {
+                move_to_string(legal, move);
+                cache_store(cache, position_hash(&pos), move, INT_MAX);
+            }
+        }
+    }
+    free_line_reader(book);
+    close(fd);
+    return true;
+}
+
+/* await_stockfish_response()
+ * --------------------------
+ * Read lines from Stockfish until an expected response is read.
+ *
+ * expected: Expected response from Stockfish
+ * readFile: LineReader to use to read data from Stockfish
+ *
+ * Returns: True if the expected response was read, false if EOF was reached
+ *          first.
+ */
+bool await_stockfish_response(char* expected, LineReader* readFile)
+{
+    char* line;
+
+    // loop until we find the match (we can assume that response is
+    // forthcoming)
+    while ((line = read_buffered_line(readFile, NULL)) != NULL) {
+        if (!strcmp(line, expected)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* confirm_stockfish_response()
+ * ----------------------------
+ * Confirm Stockfish's response to a command to match an expected response.
+ *
+ * command: Command to issue to Stockfish
+ * expected: Expected reponse from Stockfish to command
+ * writeFile: FILE* to use to write data to Stockfish
+ * readFile: LineReader to use to read data from Stockfish
+ *
+ * Returns: True if read response from stockfish matched the expected string,
+ *          false otherwise.
+ */
+bool confirm_stockfish_response(
+        char* command, char* expected, FILE* writeFile, LineReader* readFile)
+{
+    // send command to stockfish
+    if (fputs(command, writeFile) == EOF) {
+        return false;
+    }
+    fflush(writeFile);
+    return await_stockfish_response(expected, readFile);
+}
+
+/* init_stockfish()
+ * ----------------
+ * Initialise the Stockfish chess engine.
+ *
+ * writeFile: FILE* to use when sending data to Stockfish
+ * readFile: LineReader to use when reading data from Stockfish
+ *
+ * Returns: Pointer to Engine struct or NULL if Stockfish couldn't be
+ *          successfully initialised (isready or uci commands failed)
+ */
+Engine* init_stockfish(FILE* writeFile, LineReader* readFile)
+{
+    if (feof(writeFile)) {
+        return NULL;
+    }
+    // send "isready" and wait for "readyok"
+    if (!confirm_stockfish_response(
+                "isready\n", "readyok\n", writeFile, readFile)) {
+        return NULL;
+    }
+    // send "uci" and wait for "uciok"
+    if (!confirm_stockfish_response("uci\n", "uciok\n", writeFile, readFile)) {
+        return NULL;
+    }
+    // initialise Engine struct
+    Engine* result = (Engine*)malloc(sizeof(Engine));
+    result->toEngine = writeFile;
+    result->fromEngine = readFile;
+    result->failed = false;
+    result->gameId = 0;
+    result->awaitingReady = false;
+    result->skill = MAX_SKILL;
 
     return result;
 }
 
+/* close_on_exec()
+ * ---------------
+ * Mark a file descriptor to be closed when a child process exec()s, so
+ * that engines started later don't hold open pipes or client connections.
+ *
+ * fd: File descriptor to mark
+ */
+void close_on_exec(int fd)
+{
+    fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
 /* start_stockfish()
  * -----------------
  * Create a child process to run the Stockfish engine.
@@ -347,15 +2156,17 @@ Engine* init_stockfish(FILE* writeFile, FILE* readFile)
  * pipeFromFish: File descriptors of pipe which will be used to get data from
  *               Stockfish.
  *
- * Returns: STATUS_OK if Stockfish child was successfully exec()'d otherwise
- *          ERROR_STOCKFISH_START
+ * Returns: Process ID of the Stockfish child
  */
-int start_stockfish(int pipeToFish[2], int pipeFromFish[2])
+pid_t start_stockfish(int pipeToFish[2], int pipeFromFish[2])
 {
     pipe(pipeToFish);
     pipe(pipeFromFish);
+    close_on_exec(pipeToFish[1]);
+    close_on_exec(pipeFromFish[0]);
+    pid_t pid = fork();
 
-    if (!fork()) {
+    if (!pid) {
         // redirect stdout and stdin before starting stockfish
         close(pipeToFish[1]);
         close(pipeFromFish[0]);
@@ -365,12 +2176,99 @@ int start_stockfish(int pipeToFish[2], int pipeFromFish[2])
         close(pipeToFish[0]);
 
         execlp("stockfish", "stockfish", NULL);
+        _exit(ERROR_STOCKFISH_START);
     }
     // in parent so closed read end of pipe to Stockfish and close
     // write end of pipe from Stockfish
     close(pipeToFish[0]);
     close(pipeFromFish[1]);
-    return STATUS_OK;
+    return pid;
+}
+
+/* free_engine()
+ * -------------
+ * Stop an engine's Stockfish process, reap it and free the Engine struct.
+ *
+ * engine: Engine to free
+ */
+void free_engine(Engine* engine)
+{
+    fclose(engine->toEngine);
+    close(engine->fromEngine->fd);
+    free_line_reader(engine->fromEngine);
+    kill(engine->pid, SIGKILL);
+    waitpid(engine->pid, NULL, 0);
+    free(engine);
+}
+
+/* spawn_engine()
+ * --------------
+ * Start a Stockfish process and establish communication with it.
+ *
+ * Returns: Pointer to Engine struct or NULL if Stockfish couldn't be
+ *          successfully initialised
+ */
+Engine* spawn_engine(void)
+{
+    int pipeToFish[2], pipeFromFish[2];
+
+    // fork and redirect stockfish stdout and stdin
+    pid_t pid = start_stockfish(pipeToFish, pipeFromFish);
+
+    // Create an engine struct with writeFile and readFile going to and from
+    // stockfish respectively
+    FILE* writeFile = fdopen(pipeToFish[1], "w");
+    LineReader* readFile = init_line_reader(pipeFromFish[0]);
+    Engine* engine = init_stockfish(writeFile, readFile);
+
+    if (engine == NULL) {
+        close(readFile->fd);
+        free_line_reader(readFile);
+        fclose(writeFile);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return NULL;
+    }
+    engine->pid = pid;
+    return engine;
+}
+
+/* init_engine_pool()
+ * ------------------
+ * Start the chess engines to be shared by all clients.
+ *
+ * count: Number of engines to start
+ *
+ * Returns: Pointer to EnginePool with all engines idle or NULL if any engine
+ *          couldn't be started
+ */
+EnginePool* init_engine_pool(int count)
+{
+    EnginePool* pool = (EnginePool*)malloc(sizeof(EnginePool));
+    pool->idle = (Engine**)malloc(count * sizeof(Engine*));
+    pool->idleCount = 0;
+    pool->count = count;
+    pool->notifyOnError = NULL;
+    pool->cache = NULL;
+    pool->backlog = NULL;
+
+    for (int i = 0; i < count; i++) {
+        Engine* engine = spawn_engine();
+        if (engine == NULL) {
+            for (int j = 0; j < pool->idleCount; j++) {
+                free_engine(pool->idle[j]);
+            }
+            free(pool->idle);
+            free(pool);
+            return NULL;
+        }
+        pool->idle[pool->idleCount++] = engine;
+    }
+    pool->available = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(pool->available, 0, count);
+    pool->lock = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(pool->lock, 0, 1);
+    return pool;
 }
 
 /* init_socket()
@@ -412,24 +2310,172 @@ int init_socket(char* port, int* sockfd)
     socklen_t len = sizeof(struct sockaddr_in);
     getsockname(*sockfd, (struct sockaddr*)&ad, &len);
 
-    if (listen(*sockfd, 0)) {
+    // allow plenty of connections to queue up as they are accepted in batches
+    if (listen(*sockfd, SOMAXCONN)) {
         freeaddrinfo(ai);
         return ERROR_PORT;
     }
     return ntohs(ad.sin_port);
 }
 
+/* watch_output()
+ * --------------
+ * Set whether the event loop waits for a client's socket to become writable
+ * (as well as readable). The caller must hold the client's write lock.
+ *
+ * client: Client to watch
+ * writable: True to wait for the socket to become writable, false to only
+ *           wait for it to become readable
+ */
+void watch_output(Client* client, bool writable)
+{
+    struct epoll_event event = {.events = EPOLLIN | (writable ? EPOLLOUT : 0),
+            .data.ptr = client};
+    epoll_ctl(client->epollfd, EPOLL_CTL_MOD, client->fd, &event);
+}
+
+/* drop_client()
+ * -------------
+ * Shut down the connection to a client which isn't reading its responses
+ * (or whose socket has failed), discarding any responses not yet written.
+ * The event loop then sees the client disconnect as usual. The caller must
+ * hold the client's write lock.
+ *
+ * client: Client to drop
+ */
+void drop_client(Client* client)
+{
+    client->dropped = true;
+    free(client->output);
+    client->output = NULL;
+    client->outputStart = client->outputLength = client->outputCapacity = 0;
+    shutdown(client->fd, SHUT_RDWR);
+}
+
+/* write_available()
+ * -----------------
+ * Write as much of some data to a client's socket as it can take without
+ * blocking. The client is dropped if writing fails. The caller must hold the
+ * client's write lock.
+ *
+ * client: Client to write to
+ * data: Data to write
+ * length: Number of bytes in data
+ *
+ * Returns: Number of bytes written
+ */
+size_t write_available(Client* client, char* data, size_t length)
+{
+    size_t sent = 0;
+
+    while (sent < length) {
+        ssize_t wrote
+                = send(client->fd, data + sent, length - sent, MSG_NOSIGNAL);
+        if (wrote >= 0) {
+            sent += wrote;
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+            // socket buffer is full
+            break;
+        } else if (errno != EINTR) {
+            // client has gone
+            drop_client(client);
+            break;
+        }
+    }
+    return sent;
+}
+
+/* grow_output()
+ * -------------
+ * Make room for more output waiting to be written to a client by moving the
+ * output not yet written to the front of the buffer, then growing the buffer
+ * if it is still too small. The caller must hold the client's write lock.
+ *
+ * client: Client whose output to make room in
+ * needed: Number of bytes the buffer must be able to hold
+ */
+void grow_output(Client* client, size_t needed)
+{
+    size_t pending = client->outputLength - client->outputStart;
+
+    if (pending) {
+        memmove(client->output, client->output + client->outputStart,
+                pending);
+    }
+    client->outputStart = 0;
+    client->outputLength = pending;
+    if (needed > client->outputCapacity) {
+        while (needed > client->outputCapacity) {
+            client->outputCapacity = client->outputCapacity
+                    ? 2 * client->outputCapacity
+                    : MAX_MESSAGE_LENGTH;
+        }
+        client->output = (char*)realloc(client->output, client->outputCapacity);
+    }
+}
+
 /* send_to_client()
  * ----------------
- * Send message to a client connected to serve.
+ * Send message to a client connected to serve. This never blocks: whatever
+ * the client's socket can't take now is kept in their output and written by
+ * the event loop once the socket is writable. A client with more than
+ * MAX_PENDING_OUTPUT bytes waiting is too slow to keep up and is dropped, so
+ * it can't hold up any other client (or the game lock of its opponent).
  *
  * message: Message to send to client
  * client: Client to send message to
  */
 void send_to_client(char* message, Client* client)
 {
-    fputs(message, client->toClient);
-    fflush(client->toClient);
+    size_t length = strlen(message);
+
+    sem_wait(client->writeLock);
+    if (!client->dropped && (client->outputLength == 0)) {
+        // nothing is waiting to be written so the message can go straight to
+        // the socket
+        size_t sent = write_available(client, message, length);
+        message += sent;
+        length -= sent;
+        if (length) {
+            watch_output(client, true);
+        }
+    }
+    if (!client->dropped && length) {
+        size_t pending = client->outputLength - client->outputStart;
+        if (pending + length > MAX_PENDING_OUTPUT) {
+            drop_client(client);
+        } else {
+            if (client->outputLength + length > client->outputCapacity) {
+                grow_output(client, pending + length);
+            }
+            memcpy(client->output + client->outputLength, message, length);
+            client->outputLength += length;
+        }
+    }
+    sem_post(client->writeLock);
+}
+
+/* write_client_output()
+ * ---------------------
+ * Write as much of a client's waiting output as its (writable) socket can
+ * take, and stop waiting for the socket to become writable once it has all
+ * been written.
+ *
+ * client: Client whose socket is writable
+ */
+void write_client_output(Client* client)
+{
+    sem_wait(client->writeLock);
+    if (!client->dropped) {
+        client->outputStart += write_available(client,
+                client->output + client->outputStart,
+                client->outputLength - client->outputStart);
+    }
+    if (!client->dropped && (client->outputStart == client->outputLength)) {
+        client->outputStart = client->outputLength = 0;
+        watch_output(client, false);
+    }
+    sem_post(client->writeLock);
 }
 
 /* get_opponent()
@@ -485,26 +2531,69 @@ void send_error(Client* client, MoveStatus error)
 
 /* handle_stockfish_exit()
  * -----------------------
- * Clean up after the chess engine (Stockfish) exits unexpectedly. The child
- * process will be reaped and all connected clients will be notified with
- * "error engine" before the program exits.
+ * Clean up after a chess engine (Stockfish) exits unexpectedly and can't be
+ * restarted. All connected clients will be notified with "error engine"
+ * before the program exits.
  *
- * Engine: Pointer to engine which failed (Stockfish)
+ * pool: Pool which the failed engine belonged to
  */
-void handle_stockfish_exit(Engine* engine)
+void handle_stockfish_exit(EnginePool* pool)
 {
-    // reap stockfish process
-    wait(NULL);
-    sem_wait(engine->notifyOnError->lock);
-    for (int i = 0; i < engine->notifyOnError->count; i++) {
+    sem_wait(pool->notifyOnError->lock);
+    for (int i = 0; i < pool->notifyOnError->count; i++) {
         // send "error engine" to all connected clients
-        send_error(engine->notifyOnError->clients[i], ENGINE);
+        send_error(pool->notifyOnError->clients[i], ENGINE);
     }
-    sem_post(engine->notifyOnError->lock);
+    sem_post(pool->notifyOnError->lock);
     fprintf(stderr, "uqchessserver: chess engine exited unexpectedly\n");
     exit(ERROR_STOCKFISH_UNEXPECTED_EXIT);
 }
 
+/* checkout_engine()
+ * -----------------
+ * Take an idle engine from a pool for exclusive use, waiting until one is
+ * available if all engines are in use.
+ *
+ * pool: Pool to take engine from
+ *
+ * Returns: Pointer to engine which must be returned with checkin_engine()
+ */
+Engine* checkout_engine(EnginePool* pool)
+{
+    uint64_t start = monotonic_usec();
+    sem_wait(pool->available);
+    sem_wait(pool->lock);
+    Engine* engine = pool->idle[--pool->idleCount];
+    sem_post(pool->lock);
+    observe_latency(&metrics.engineWait, start);
+    return engine;
+}
+
+/* checkin_engine()
+ * ----------------
+ * Return an engine to its pool once finished with it. If communication with
+ * the engine failed it is replaced by a newly started engine.
+ *
+ * pool: Pool which engine was checked out from
+ * engine: Engine to return
+ */
+void checkin_engine(EnginePool* pool, Engine* engine)
+{
+    if (engine->failed) {
+        fprintf(stderr, "uqchessserver: restarting chess engine\n");
+        __sync_add_and_fetch(&metrics.engineRestarts, 1);
+        free_engine(engine);
+        engine = spawn_engine();
+        if (engine == NULL) {
+            handle_stockfish_exit(pool);
+        }
+    }
+    sem_wait(pool->lock);
+    pool->idle[pool->idleCount++] = engine;
+    sem_post(pool->lock);
+    sem_post(pool->available);
+}
+
 /* remove_from_list()
  * ------------------
  * Remove an entry from a ClientList at position index.
@@ -534,20 +2623,22 @@ void remove_from_list(ClientList* list, Client* remove)
 /* flush_stockfish()
  * -----------------
  * Flush data to stockfish. Function will check if fflush() fails and
- * call handle_stockfish_exit() accordingly.
+ * mark the engine as failed accordingly.
  *
  * engine: Pointer to engine to flush data to
  */
 void flush_stockfish(Engine* engine)
 {
     if (fflush(engine->toEngine) == EOF) {
-        handle_stockfish_exit(engine);
+        engine->failed = true;
     }
 }
 
 /* send_to_stockfish()
  * -------------------
- * Send a constant string to the Stockfish engine.
+ * Send a constant string to the Stockfish engine, along with any commands
+ * already queued by set_position(). If an "isready" was queued its "readyok"
+ * response is read so that the next line read is a response to command.
  *
  * engine: Engine to send command to
  */
@@ -555,6 +2646,13 @@ void send_to_stockfish(char* command, Engine* engine)
 {
     fputs(command, engine->toEngine);
     flush_stockfish(engine);
+
+    if (engine->awaitingReady) {
+        engine->awaitingReady = false;
+        if (!await_stockfish_response("readyok\n", engine->fromEngine)) {
+            engine->failed = true;
+        }
+    }
 }
 
 /* send_started()
@@ -621,15 +2719,18 @@ void send_gameover(Client* client, MoveStatus reason)
     } else {
         winner = "white";
     }
+    char message[MAX_MESSAGE_LENGTH];
+
     // send gameover message for corresponding gameover reason
     if (reason == CHECKMATE) {
-        fprintf(client->toClient, "gameover checkmate %s\n", winner);
+        sprintf(message, "gameover checkmate %s\n", winner);
+        send_to_client(message, client);
     } else if (reason == STALEMATE) {
         send_to_client("gameover stalemate\n", client);
     } else if (reason == RESIGN) {
-        fprintf(client->toClient, "gameover resignation %s\n", winner);
+        sprintf(message, "gameover resignation %s\n", winner);
+        send_to_client(message, client);
     }
-    fflush(client->toClient);
 }
 
 /* notify_client()
@@ -667,81 +2768,212 @@ void notify_client(Client* client, MoveStatus status)
     }
 }
 
+/* preference_of()
+ * ---------------
+ * Get the colour preference of a client looking for a human opponent.
+ *
+ * client: Client to get preference of
+ *
+ * Returns: Preference matching client's either and white attributes
+ */
+Preference preference_of(Client* client)
+{
+    if (client->either) {
+        return WANTS_EITHER;
+    }
+    return client->white ? WANTS_WHITE : WANTS_BLACK;
+}
+
+/* join_match_queue()
+ * ------------------
+ * Add a client to the back of the queue for its colour preference. The
+ * caller must hold matchQueues->lock.
+ *
+ * matchQueues: Queues to add client to
+ * client: Client which isn't already queued
+ */
+void join_match_queue(MatchQueues* matchQueues, Client* client)
+{
+    WaitQueue* queue = &matchQueues->queues[preference_of(client)];
+
+    client->queued = true;
+    client->ticket = matchQueues->nextTicket++;
+    client->queueNext = NULL;
+    client->queuePrev = queue->tail;
+    if (queue->tail != NULL) {
+        queue->tail->queueNext = client;
+    } else {
+        queue->head = client;
+    }
+    queue->tail = client;
+    queue->joined++;
+    if (++queue->depth > queue->peakDepth) {
+        queue->peakDepth = queue->depth;
+    }
+}
+
+/* unlink_waiting()
+ * ----------------
+ * Remove a queued client from its queue. The caller must hold
+ * matchQueues->lock.
+ *
+ * matchQueues: Queues client is in
+ * client: Client to remove
+ */
+void unlink_waiting(MatchQueues* matchQueues, Client* client)
+{
+    WaitQueue* queue = &matchQueues->queues[preference_of(client)];
+
+    if (client->queuePrev != NULL) {
+        client->queuePrev->queueNext = client->queueNext;
+    } else {
+        queue->head = client->queueNext;
+    }
+    if (client->queueNext != NULL) {
+        client->queueNext->queuePrev = client->queuePrev;
+    } else {
+        queue->tail = client->queuePrev;
+    }
+    client->queueNext = NULL;
+    client->queuePrev = NULL;
+    client->queued = false;
+    queue->depth--;
+}
+
+/* leave_match_queue()
+ * -------------------
+ * Remove a client from its match queue if it is waiting for an opponent.
+ *
+ * client: Client to remove
+ *
+ * Returns: True if client was queued, false otherwise
+ */
+bool leave_match_queue(Client* client)
+{
+    MatchQueues* matchQueues = client->matchQueues;
+
+    sem_wait(matchQueues->lock);
+    bool queued = client->queued;
+    if (queued) {
+        unlink_waiting(matchQueues, client);
+    }
+    sem_post(matchQueues->lock);
+    return queued;
+}
+
+/* leave_game()
+ * ------------
+ * Take a client out of the game it last played (which has been matched up),
+ * resigning it if it is still in progress. A human opponent keeps the game
+ * but no longer refers to the client, otherwise the game is freed.
+ *
+ * leaving: Client leaving its game
+ */
+void leave_game(Client* leaving)
+{
+    GameState* game = leaving->game;
+    sem_wait(game->lock);
+    notify_client(leaving, RESIGN);
+    set_game_started(game, false);
+    Client* opponent = leaving->human ? get_opponent(leaving) : NULL;
+    if (opponent != NULL) {
+        // opponent keeps the game but no longer refers to this client
+        if (leaving->white) {
+            game->whiteClient = NULL;
+        } else {
+            game->blackClient = NULL;
+        }
+    }
+    sem_post(game->lock);
+
+    if (opponent == NULL) {
+        // the client was playing against the computer OR its opponent has
+        // already left so we can safely free it's GameState as no other
+        // clients rely on it
+        free_game_state(game);
+    }
+}
+
 /* clean_up_client()
  * -----------------
  * Handle a client which has recently disconnected from the server. Their
- * opponent will be notified of a win by resignation. If the client never
- * played a game they will also be removed from the wait list.
+ * opponent will be notified of a win by resignation. If the client was still
+ * waiting for an opponent they will be removed from their match queue. Once
+ * this returns no other client refers to leaving.
  *
  * leaving: Client which disconnected from the server.
  */
 void clean_up_client(Client* leaving)
 {
-    notify_client(leaving, RESIGN);
     // remove client from connected client list
-    sem_wait(leaving->engine->notifyOnError->lock);
-    remove_from_list(leaving->engine->notifyOnError, leaving);
-    sem_post(leaving->engine->notifyOnError->lock);
-
-    if (leaving->human) {
-        // client was playing a human so we will check if their opponent
-        // is NULL meaning they were not in a game when they left (so on the
-        // wait list)
-        sem_wait(leaving->waitList->lock);
-        Client* opponent = get_opponent(leaving);
-        if (opponent == NULL) {
-            // remove from the wait list
-            remove_from_list(leaving->waitList, leaving);
-        }
-        sem_post(leaving->waitList->lock);
+    sem_wait(leaving->engines->notifyOnError->lock);
+    remove_from_list(leaving->engines->notifyOnError, leaving);
+    sem_post(leaving->engines->notifyOnError->lock);
+
+    if (leaving->human && leave_match_queue(leaving)) {
+        // client was still waiting for an opponent so no other client refers
+        // to its game (which hasn't started)
+        free_game_state(leaving->game);
+        return;
     }
     if (leaving->hasPlayed) {
-        if (!leaving->human || (get_opponent(leaving) == NULL)) {
-            // the exiting client was playing against the computer OR was not
-            // matched up against a human opponent so we can safely free it's
-            // GameState as no other clients rely on it
-            free_game_state(leaving->game);
-        } else if (get_opponent(leaving) != NULL) {
-            if (leaving->white) {
-                leaving->game->whiteClient = NULL;
-            } else {
-                leaving->game->blackClient = NULL;
-            }
+        leave_game(leaving);
+    }
+}
+
+/* parse_difficulty()
+ * ------------------
+ * Parse the optional difficulty given at the end of a "start" command.
+ *
+ * arg: Argument to parse (NULL if none was given)
+ * difficulty: Pointer to store difficulty in (HARD if none was given)
+ *
+ * Returns: True if arg is NULL or the name of a difficulty, false otherwise
+ */
+bool parse_difficulty(char* arg, Difficulty* difficulty)
+{
+    *difficulty = HARD;
+    if (arg == NULL) {
+        return true;
+    }
+    for (int i = EASY; i <= HARD; i++) {
+        if (!strcmp(arg, difficultyNames[i])) {
+            *difficulty = (Difficulty)i;
+            return true;
         }
     }
-    pthread_exit(STATUS_OK);
+    return false;
 }
 
 /* get_client_info()
  * -----------------
- * Get information about a newly connected client (desired colour and opponent
- * type).
+ * Get information about a newly connected client (desired colour, opponent
+ * type and optionally the difficulty of the computer) from the first line
+ * they sent e.g. "start computer white easy".
  *
  * store: Client struct to store information in
+ * line: Line received from client (including the trailing '\n')
+ *
+ * Returns: True if line was a "start" command, false otherwise
  */
-bool get_client_info(Client* store)
+bool get_client_info(Client* store, char* line)
 {
     store->human = false;
     store->white = false;
     store->either = false;
     store->hasPlayed = false;
-    char* line = read_line(store->fromClient);
-
-    if (line == NULL) {
-        // client disconnected
-        clean_up_client(store);
-    }
+    line[strcspn(line, "\n")] = '\0';
     char** parts = split_by_char(line, ' ', 0);
 
-    if (strcmp(parts[0], "start")) {
-        if (!strcmp(parts[0], "board\n") || !strcmp(parts[0], "move")
-                || !strcmp(parts[0], "hint") || !strcmp(parts[0], "resign\n")) {
+    if (strcmp(parts[0], "start") || (parts[1] == NULL) || (parts[2] == NULL)
+            || !parse_difficulty(parts[3], &store->difficulty)) {
+        if (!strcmp(parts[0], "board") || !strcmp(parts[0], "move")
+                || !strcmp(parts[0], "hint") || !strcmp(parts[0], "resign")) {
             send_error(store, GAME);
         } else {
             send_error(store, COMMAND);
         }
         free(parts);
-        free(line);
         return false;
     }
     // set Client struct human and white attributes according to client
@@ -749,11 +2981,11 @@ bool get_client_info(Client* store)
     if (!strcmp(parts[1], "human")) {
         store->human = true;
     }
-    if (!strcmp(parts[2], "white\n")) {
+    if (!strcmp(parts[2], "white")) {
         store->white = true;
-    } else if (!strcmp(parts[2], "black\n")) {
+    } else if (!strcmp(parts[2], "black")) {
         store->white = false;
-    } else if (!strcmp(parts[2], "either\n")) {
+    } else if (!strcmp(parts[2], "either")) {
         if (store->human) {
             store->either = true;
         } else {
@@ -761,164 +2993,266 @@ bool get_client_info(Client* store)
         }
     }
     free(parts);
-    free(line);
     return true;
 }
 
-/* clients_are_compatible()
- * ------------------------
- * Check if two clients are compatible based on their colour preferences
- * (white, black or either).
- *
- * waiting: Client from the wait list who is waiting for a compatible opponent
- * looking: Newly connected client looking for an opponent
- *
- * Returns: True if waiting and looking clients are compatible based on their
- *          colour preferences, otherwise false.
- */
-bool clients_are_compatible(Client* waiting, Client* looking)
-{
-    sem_wait(waiting->game->lock);
-    bool compatible = false;
-
-    if (waiting->either && looking->either) {
-        waiting->white = true;
-        looking->white = false;
-        waiting->game->blackClient = looking;
-        compatible = true;
-    }
-    if (waiting->either && !looking->white) {
-        waiting->game->blackClient = looking;
-        waiting->white = true;
-        compatible = true;
-    }
-    if (waiting->either && looking->white) {
-        waiting->game->whiteClient = looking;
-        waiting->game->blackClient = waiting;
-        compatible = true;
-    }
-    if (looking->either && !waiting->white) {
-        looking->white = true;
-        waiting->game->blackClient = waiting;
-        waiting->game->whiteClient = looking;
-        compatible = true;
-    }
-    if (looking->either && waiting->white) {
-        looking->white = false;
-        waiting->game->whiteClient = waiting;
-        waiting->game->blackClient = looking;
-        compatible = true;
-    }
-    if (looking->white == !waiting->white) {
-        if (waiting->white) {
-            waiting->game->whiteClient = waiting;
-            waiting->game->blackClient = looking;
-        } else {
-            waiting->game->blackClient = waiting;
-            waiting->game->whiteClient = looking;
+/* oldest_compatible()
+ * -------------------
+ * Find the client which has waited longest out of those whose colour
+ * preference is compatible with looking's. The caller must hold
+ * matchQueues->lock.
+ *
+ * matchQueues: Queues of waiting clients
+ * looking: Client which is looking for an opponent
+ *
+ * Returns: Compatible client with the lowest ticket or NULL if there isn't
+ *          one
+ */
+Client* oldest_compatible(MatchQueues* matchQueues, Client* looking)
+{
+    Preference wanted = preference_of(looking);
+    Client* oldest = NULL;
+
+    for (int i = WANTS_WHITE; i <= WANTS_EITHER; i++) {
+        if ((wanted != WANTS_EITHER) && (i == (int)wanted)) {
+            // clients wanting the same colour can't play each other
+            continue;
+        }
+        Client* head = matchQueues->queues[i].head;
+        if ((head != NULL)
+                && ((oldest == NULL) || (head->ticket < oldest->ticket))) {
+            oldest = head;
         }
-        compatible = true;
     }
-    sem_post(waiting->game->lock);
-    return compatible;
+    return oldest;
 }
 
-/* find_opponent()
- * ---------------
- * Attempt to find looking a colour compatible opponent from waitList. If no
- * such client can be found then looking client will be added to waitList.
- *
- * waitList: List of clients currently waiting to play a human vs human game
- * looking: Client which is not in the waitList who is looking for an opponent
+/* pair_clients()
+ * --------------
+ * Assign colours to a waiting client and the client it was matched with, and
+ * make the waiting client's game theirs. If both clients wished to play
+ * either colour the waiting client plays white.
  *
- * Returns: True if a colour compatible opponent for looking is found in
- *          waitList, false otherwise.
+ * waiting: Client which was waiting for an opponent
+ * looking: Client which was matched with waiting
  */
-bool find_opponent(ClientList* waitList, Client* looking)
+void pair_clients(Client* waiting, Client* looking)
 {
-    for (int i = 0; i < waitList->count; i++) {
-        sem_wait(waitList->lock);
-        Client* waiting = waitList->clients[i];
+    GameState* game = waiting->game;
 
-        if ((waiting->white == !looking->white) || (waiting->either)
-                || (looking->either)) {
-            // waiting client and new client have compatible colours
-            // so update the GameState client attributes
-
-            if (!clients_are_compatible(waiting, looking)) {
-                continue;
-            }
-            // update the looking client with the same game as the waiting
-            // client and free the looking client's temporary GameState
-            free_game_state(looking->game);
-            looking->game = waiting->game;
-            waiting->game->started = true;
-            // remove the waiting client from the wait list
-            remove_from_list(waitList, waiting);
-            // send "started" messages to clients
-            send_started(waiting);
-            send_started(looking);
-            sem_post(waitList->lock);
-            return true;
-        }
-        sem_post(waitList->lock);
+    sem_wait(game->lock);
+    if (waiting->either) {
+        waiting->white = looking->either || !looking->white;
     }
-    return false;
+    if (looking->either) {
+        looking->white = !waiting->white;
+    }
+    game->whiteClient = waiting->white ? waiting : looking;
+    game->blackClient = waiting->white ? looking : waiting;
+    set_game_started(game, true);
+    // set now so that clean_up_client() of either client sees the game
+    waiting->hasPlayed = true;
+    looking->hasPlayed = true;
+    sem_post(game->lock);
 }
 
-/* add_to_waitlist()
- * -----------------
- * Add a client to the wait list of clients looking for opponents.
+/* find_opponent()
+ * ---------------
+ * Attempt to find looking a colour compatible opponent from the match
+ * queues, preferring whichever compatible client has waited longest. If no
+ * such client can be found then looking client will be added to the queue
+ * for its colour preference.
+ *
+ * matchQueues: Queues of clients waiting to play a human vs human game
+ * looking: Client which isn't queued who is looking for an opponent
  *
- * waitList: List of clients who are waiting to find an opponent
- * add: Client to add to waitList
+ * Returns: True if a colour compatible opponent for looking is found,
+ *          false otherwise.
  */
-void add_to_waitlist(ClientList* waitList, Client* add)
+bool find_opponent(MatchQueues* matchQueues, Client* looking)
 {
-    // take semaphore and update waitList with new client
-    sem_wait(waitList->lock);
-    waitList->clients = (Client**)realloc(
-            waitList->clients, (waitList->count + 1) * sizeof(Client*));
-    waitList->clients[waitList->count] = add;
-    waitList->count++;
-    sem_post(waitList->lock);
+    sem_wait(matchQueues->lock);
+    Client* waiting = oldest_compatible(matchQueues, looking);
+    if (waiting == NULL) {
+        join_match_queue(matchQueues, looking);
+        sem_post(matchQueues->lock);
+        return false;
+    }
+    unlink_waiting(matchQueues, waiting);
+    matchQueues->matches++;
+    pair_clients(waiting, looking);
+
+    // update the looking client with the same game as the waiting client and
+    // free the looking client's temporary GameState. This is done before the
+    // lock is released so a disconnecting waiting client can't be cleaned up
+    // until both clients have been told the game has started
+    free_game_state(looking->game);
+    looking->game = waiting->game;
+    // send "started" messages to clients
+    send_started(waiting);
+    send_started(looking);
+    sem_post(matchQueues->lock);
+    return true;
 }
 
 /* set_position()
  * --------------
- * Set the position of the Stockfish engine to the position contained in
- * fenString.
+ * Queue commands to set the position of the Stockfish engine to the current
+ * position of a game. "ucinewgame" and "isready" are only queued if the
+ * engine was last set up for a different game. Nothing is sent until
+ * send_to_stockfish() is next called, so the position shares a round trip
+ * with the command after it.
  *
- * fenString: FEN string of position to set Stockfish to
+ * game: Game whose position Stockfish should be set to
  * engine: Pointer to engine to use
  */
-void set_position(char* fenString, Engine* engine)
+void set_position(GameState* game, Engine* engine)
 {
-    send_to_stockfish("ucinewgame\n", engine);
-    confirm_stockfish_response(
-            "isready\n", "readyok\n", engine->toEngine, engine->fromEngine);
-    fprintf(engine->toEngine, "position fen %s\n", fenString);
-    flush_stockfish(engine);
+    if (engine->gameId != game->id) {
+        fputs("ucinewgame\nisready\n", engine->toEngine);
+        engine->gameId = game->id;
+        engine->awaitingReady = true;
+    }
+    fprintf(engine->toEngine, "position fen %s\n", game->fenString);
 }
 
-/* get_best_move()
+/* search_budget()
  * ---------------
- * Get the best move for a current position.
+ * Work out the limits of a best move search. The pool's budget is scaled
+ * down to the percentage used at the difficulty, then by the share of the
+ * engines each client waiting for one would get if the searches queued
+ * behind it were spread over all engines. This keeps the time a client
+ * waits in the queue for an engine to about one full search however many
+ * games are in progress, and restores the full budget once the queue has
+ * drained.
+ *
+ * pool: Pool of engines the search will be run on
+ * difficulty: Strength the search is for
+ *
+ * Returns: Limits of the search
+ */
+SearchBudget search_budget(EnginePool* pool, Difficulty difficulty)
+{
+    SearchBudget budget = pool->budget;
+    int queued = 0;
+    if (pool->backlog != NULL) {
+        sem_wait(pool->backlog->lock);
+        queued = pool->backlog->count;
+        sem_post(pool->backlog->lock);
+    }
+    // do the arithmetic in long long since the options may be up to INT_MAX
+    long long scale = (long long)difficultyPercent[difficulty] * pool->count;
+    long long divisor = 100LL * (pool->count + queued);
+
+    budget.movetime = (int)(budget.movetime * scale / divisor);
+    if (budget.movetime < MIN_MOVETIME) {
+        budget.movetime = MIN_MOVETIME;
+    }
+    if (budget.nodes) {
+        budget.nodes = (int)(budget.nodes * scale / divisor);
+        if (budget.nodes < MIN_NODES) {
+            budget.nodes = MIN_NODES;
+        }
+    }
+    if (difficulty == HARD) {
+        __sync_lock_test_and_set(&metrics.searchMovetime, budget.movetime);
+    }
+    return budget;
+}
+
+/* search_best_move()
+ * ------------------
+ * Ask an engine for the best move in a game's current position.
  *
- * fenString: FEN string of position to get best move for
+ * game: Game whose current position to get best move for
  * engine: Engine to use to evaluate best move
+ * budget: Limits of the search
+ * skill: "Skill Level" the engine should play at
  *
- * Returns: String representation of best move e.g. "g1f3"
+ * Returns: String representation of best move e.g. "g1f3" or NULL if the
+ *          engine failed
  */
-char* get_best_move(char* fenString, Engine* engine)
+char* search_best_move(GameState* game, Engine* engine, SearchBudget* budget,
+        int skill)
 {
-    set_position(fenString, engine);
+    uint64_t start = monotonic_usec();
+    set_position(game, engine);
+    if (engine->skill != skill) {
+        fprintf(engine->toEngine, "setoption name Skill Level value %d\n",
+                skill);
+        engine->skill = skill;
+    }
     // send command to stockfish to analyse position and read response
-    send_to_stockfish("go movetime 500 depth 15\n", engine);
-    ChessMoves* best = read_stockfish_bestmove_output(engine->fromEngine);
-    char* bestMove = strdup(best->moves[0]);
-    free_chess_moves(best);
-    return bestMove;
+    char command[MAX_MESSAGE_LENGTH];
+    int length = sprintf(command, "go movetime %d depth %d", budget->movetime,
+            budget->depth);
+    if (budget->nodes) {
+        length += sprintf(command + length, " nodes %d", budget->nodes);
+    }
+    strcpy(command + length, "\n");
+    send_to_stockfish(command, engine);
+    char* line;
+    while ((line = read_buffered_line(engine->fromEngine, NULL)) != NULL) {
+        // skip "info" lines until the "bestmove" line
+        if (!strncmp(line, "bestmove ", strlen("bestmove "))) {
+            observe_latency(&metrics.engineSearch, start);
+            char* move = line + strlen("bestmove ");
+            return strndup(move, strcspn(move, " \n"));
+        }
+    }
+    engine->failed = true;
+    return NULL;
+}
+
+/* get_best_move()
+ * ---------------
+ * Get the best move for a current position. Positions whose best move has
+ * been found before (with at least the search time a search would be given
+ * now) are answered from the move cache, otherwise an engine is asked (and
+ * the move is retried on its replacement if the engine fails or picks a move
+ * which isn't legal). The caller must hold the game's lock.
+ *
+ * game: Game whose current position to get best move for
+ * pool: Pool of engines (and the move cache) to use
+ * difficulty: Strength to play the move at
+ *
+ * Returns: String representation of a legal best move e.g. "g1f3" or NULL if
+ *          the engines failed
+ */
+char* get_best_move(GameState* game, EnginePool* pool, Difficulty difficulty)
+{
+    Position pos;
+    char move[MAX_MOVE_STRING_LENGTH + 1];
+    parse_fen(game->fenString, &pos);
+    // moves found at each difficulty are cached separately
+    uint64_t key = position_hash(&pos) ^ zobristDifficulty[difficulty];
+    // a cached move is as good as one a search could find now
+    int movetime = search_budget(pool, difficulty).movetime;
+
+    if (cache_lookup(pool->cache, key, movetime, move)) {
+        return strdup(move);
+    }
+    for (int i = 0; i < ENGINE_ATTEMPTS; i++) {
+        Engine* engine = checkout_engine(pool);
+        SearchBudget budget = search_budget(pool, difficulty);
+        char* best = search_best_move(
+                game, engine, &budget, difficultySkill[difficulty]);
+        Move legal;
+
+        if ((best != NULL) && (!move_string_valid(best)
+                || !find_legal_move(&pos, best, &legal))) {
+            // the engine picked a move which isn't legal so can't be trusted
+            engine->failed = true;
+            free(best);
+            best = NULL;
+        }
+        checkin_engine(pool, engine);
+        if (best != NULL) {
+            cache_store(pool->cache, key, best, budget.movetime);
+            return best;
+        }
+    }
+    return NULL;
 }
 
 /* is_clients_turn()
@@ -943,28 +3277,38 @@ bool is_clients_turn(Client* client)
     return result;
 }
 
-/* get_possible_moves()
- * --------------------
- * Get all possible moves for a given position.
- *
- * fenString: FEN string of position to get all possible moves of
- * engine: Engine to use to get all possible moves
+/* send_all_moves()
+ * ----------------
+ * Send a client all the legal moves in their game's current position (in the
+ * same order Stockfish lists them). The caller must hold the game's lock.
  *
- * Returns: Pointer to ChessMoves struct whos "moves" attribute contains
- *          all the possible moves in their string representation
+ * client: Client to send moves to
  */
-ChessMoves* get_possible_moves(char* fenString, Engine* engine)
+void send_all_moves(Client* client)
 {
-    set_position(fenString, engine);
-    send_to_stockfish("go perft 1\n", engine);
-    ChessMoves* possible = read_stockfish_go_perft_1_output(engine->fromEngine);
-    return possible;
+    Position pos;
+    Move moves[MAX_MOVES];
+    char* message = (char*)malloc(sizeof("moves") + MAX_MOVES
+            * (MAX_MOVE_STRING_LENGTH + 1) + 1);
+    int length = sprintf(message, "moves");
+
+    parse_fen(client->game->fenString, &pos);
+    int count = generate_legal_moves(&pos, moves);
+    for (int i = 0; i < count; i++) {
+        message[length++] = ' ';
+        move_to_string(moves[i], message + length);
+        length += strlen(message + length);
+    }
+    sprintf(message + length, "\n");
+    send_to_client(message, client);
+    free(message);
 }
 
 /* send_hints()
  * ------------
  * Send response to a "hint" command from client (either "hint all" or
- * "hint best".
+ * "hint best". Only "hint best" needs a chess engine (unless its move is
+ * cached).
  *
  * client: Client to send hints to
  * option: Either "all" if client wants hints of all possible moves or "best"
@@ -972,45 +3316,36 @@ ChessMoves* get_possible_moves(char* fenString, Engine* engine)
  */
 void send_hints(Client* client, char* option)
 {
-    sem_wait(client->engine->lock);
     sem_wait(client->game->lock);
     // clients game has not started so ignore request
     if (!client->game->started) {
         sem_post(client->game->lock);
-        sem_post(client->engine->lock);
         send_error(client, GAME);
-        return;
-    }
-    // not clients turn so ignore request
-    if (!is_clients_turn(client)) {
+    } else if (!is_clients_turn(client)) {
+        // not clients turn so ignore request
         sem_post(client->game->lock);
-        sem_post(client->engine->lock);
         send_error(client, TURN);
-        return;
-    }
-    if (!strcmp(option, "best\n")) {
-        // client wants best move so ask stockfish and send result
-        char* best = get_best_move(client->game->fenString, client->engine);
-        fprintf(client->toClient, "moves %s\n", best);
-        fflush(client->toClient);
-        free(best);
+    } else if (!strcmp(option, "best\n")) {
+        // client wants best move so look it up or ask stockfish and send
+        // result
+        char* best = get_best_move(client->game, client->engines, HARD);
+        sem_post(client->game->lock);
+        if (best == NULL) {
+            send_error(client, ENGINE);
+        } else {
+            char message[MAX_MESSAGE_LENGTH];
+            sprintf(message, "moves %s\n", best);
+            send_to_client(message, client);
+            free(best);
+        }
     } else if (!strcmp(option, "all\n")) {
-        // client wants all possible moves for current position so ask
-        // Stockfish and send all elements of possible->moves
-        ChessMoves* possible
-                = get_possible_moves(client->game->fenString, client->engine);
-        send_to_client("moves", client);
-        for (int i = 0; i < possible->numMoves; i++) {
-            send_to_client(" ", client);
-            send_to_client(possible->moves[i], client);
-        }
-        send_to_client("\n", client);
-        free_chess_moves(possible);
+        // client wants all possible moves for current position
+        send_all_moves(client);
+        sem_post(client->game->lock);
     } else {
+        sem_post(client->game->lock);
         send_error(client, COMMAND);
     }
-    sem_post(client->game->lock);
-    sem_post(client->engine->lock);
 }
 
 /* init_new_game()
@@ -1040,142 +3375,66 @@ GameState* init_new_game(Client* client)
         result->blackClient = client;
         result->whiteClient = NULL;
     }
-    if (client->human) {
-        result->started = false;
-    } else {
-        result->started = true;
+    result->started = false;
+    if (!client->human) {
+        set_game_started(result, true);
         send_started(client);
     }
     // setup initial fen string
     result->fenString = strdup(initialFen);
+    result->id = __sync_add_and_fetch(&lastGameId, 1);
     return result;
 }
 
-/* get_stockfish_state()
- * ---------------------
- * Get current state of game from Stockfish (used to get board layout of game)
- * (Note that the current position of Stockfish must be configured before
- * calling this function to ensure correct position is read).
- *
- * engine: Engine to get state from
- *
- * Returns: Pointer to StockfishGameState struct which holds information about
- *          current game state
- */
-StockfishGameState* get_stockfish_state(Engine* engine)
-{
-    send_to_stockfish("d\n", engine);
-    StockfishGameState* state = read_stockfish_d_output(engine->fromEngine);
-    return state;
-}
-
 /* send_board()
  * ------------
  * Send current board state to client.
  *
- * engine: Engine to use to get board state
  * client: Client to send board state to
  */
-void send_board(Engine* engine, Client* client)
+void send_board(Client* client)
 {
     // client's game hasn't started to ignore request
     if (!client->hasPlayed) {
         send_error(client, GAME);
         return;
     }
-    // set position of Stockfish and send state->boardString to client
-    StockfishGameState* state = get_stockfish_state(engine);
+    Position pos;
+    sem_wait(client->game->lock);
+    parse_fen(client->game->fenString, &pos);
+    sem_post(client->game->lock);
+
+    char* board = position_to_board(&pos);
     send_to_client("startboard\n", client);
-    send_to_client(state->boardString, client);
+    send_to_client(board, client);
     send_to_client("endboard\n", client);
-    free_stockfish_game_state(state);
-}
-
-/* get_fen_string()
- * ----------------
- * Get FEN string of a current position from Stockfish (Used to get new
- * FEN string after a move has been made by client/computer)
- *
- * engine: Engine to use to get FEN string from
- *
- * Returns: FEN string of current Stockfish position
- */
-char* get_fen_string(Engine* engine)
-{
-    StockfishGameState* state = get_stockfish_state(engine);
-    char* fen = strdup(state->fenString);
-    free_stockfish_game_state(state);
-    return fen;
-}
-
-/* send_move_to_stockfish()
- * ------------------------
- * Send a move to Stockfish for curren position and make sure it was accepted
- * as valid by Stockfish.
- *
- * move: String representation of move to make
- * game: Current state of game (before move is played)
- * engine: Engine to use to make move
- *
- * Returns: OK if move was valid, TURN if it's not players turn OR MOVE if the
- *          move is invalid and not accepted by Stockfish
- */
-StockfishGameState* send_move_to_stockfish(
-        char* move, GameState* game, Engine* engine)
-{
-    // send move to Stockfish get updated position
-    send_to_stockfish("ucinewgame\n", engine);
-    confirm_stockfish_response(
-            "isready\n", "readyok\n", engine->toEngine, engine->fromEngine);
-    fprintf(engine->toEngine, "position fen %s moves %s\n", game->fenString,
-            move);
-    flush_stockfish(engine);
-    StockfishGameState* result = get_stockfish_state(engine);
-
-    // FEN string did not change meaning move was invalid
-    if (!strcmp(game->fenString, result->fenString)) {
-        result = NULL;
-    } else {
-        // update game with new FEN string
-        game->fenString = result->fenString;
-    }
-    return result;
+    free(board);
 }
 
-/* analyse_position()
- * ------------------
- * Get engine to analyse current position for a check, checkmate or stalemate.
+/* play_move()
+ * -----------
+ * Play a move in a game if it is legal, updating the game's FEN string. The
+ * caller must hold the game's lock.
  *
- * game: Game to get engine to analyse.
- * engine: Engine to use to analyse position
+ * game: Game to play move in
+ * moveString: String representation of move to play e.g. "e2e4"
  *
- * Returns: OK if current position not has a check, checkmate or stalemate,
- *          otherwise CHECK, CHECKMATE or STALEMATE if current position
- *          contains a check, checkmate or stalemate respectively.
+ * Returns: MOVE if the move isn't legal, otherwise the result of
+ *          analyse_position() on the position after the move
  */
-MoveStatus analyse_position(StockfishGameState* game, Engine* engine)
+MoveStatus play_move(GameState* game, char* moveString)
 {
-    ChessMoves* lastMoves;
-    MoveStatus result = OK;
-    // Get a ChessMoves struct for current position to use to check for
-    // check, checkmate or stalemate
-    send_to_stockfish("go perft 1\n", engine);
-    lastMoves = read_stockfish_go_perft_1_output(engine->fromEngine);
+    Position pos;
+    Move move;
 
-    if (game->checkers != NULL) {
-        if (lastMoves->moves == NULL) {
-            // there was a check and there are no possible moves (checkmate)
-            result = CHECKMATE;
-        } else {
-            // there was a check and there are possible moves (check)
-            result = CHECK;
-        }
-    } else if ((game->checkers == NULL) && (lastMoves->moves == NULL)) {
-        // there was no check but there a no possible moves (stalemate)
-        result = STALEMATE;
+    if (!parse_fen(game->fenString, &pos)
+            || !find_legal_move(&pos, moveString, &move)) {
+        return MOVE;
     }
-    free_chess_moves(lastMoves);
-    return result;
+    make_move(&pos, move);
+    free(game->fenString);
+    game->fenString = position_to_fen(&pos);
+    return analyse_position(&pos);
 }
 
 /* client_made_valid_move()
@@ -1231,79 +3490,77 @@ MoveStatus client_move_valid(Client* client, char* move)
  */
 MoveStatus client_move(Client* client, char* move)
 {
-    sem_wait(client->engine->lock);
     sem_wait(client->game->lock);
     MoveStatus moveValid = client_move_valid(client, move);
 
-    // move which client wants to make is invalid so release semaphores and
+    // move which client wants to make is invalid so release semaphore and
     // send and error
     if (moveValid != OK) {
         sem_post(client->game->lock);
-        sem_post(client->engine->lock);
         send_error(client, moveValid);
         return moveValid;
     }
-    StockfishGameState* state
-            = send_move_to_stockfish(move, client->game, client->engine);
+    MoveStatus clientMoveStatus = play_move(client->game, move);
 
-    // move wasn't valid according to Stockfish so send an error just to client
-    // which is trying to make a move
-    if (state == NULL) {
+    // move wasn't legal so send an error just to client which is trying to
+    // make a move
+    if (clientMoveStatus == MOVE) {
         send_error(client, MOVE);
         sem_post(client->game->lock);
-        sem_post(client->engine->lock);
         return MOVE;
     }
     send_ok(client);
     if (client->human) {
         // if client's opponent is human let opponent know the move which was
         // played
-        Client* opp = get_opponent(client);
-        fprintf(opp->toClient, "moved %s\n", move);
-        fflush(opp->toClient);
+        char message[MAX_MESSAGE_LENGTH];
+        sprintf(message, "moved %s\n", move);
+        send_to_client(message, get_opponent(client));
     }
-    // Analyse position for gameover, check or stalemate
-    MoveStatus clientMoveStatus = analyse_position(state, client->engine);
+    // Notify of gameover, check or stalemate
     notify_client(client, clientMoveStatus);
 
     // change game->started if the move just made resulted in the game ending
     if (is_game_over(clientMoveStatus)) {
-        client->game->started = false;
+        set_game_started(client->game, false);
     }
     sem_post(client->game->lock);
-    sem_post(client->engine->lock);
     return clientMoveStatus;
 }
 
 /* computer_move()
  * ---------------
- * Let computer make move against client.
+ * Let computer make move against client. The client is sent "error engine"
+ * (and the game left unchanged) if no engine could pick a move.
  *
  * opponent: Computer's opponent client
  *
- * Returns: MoveStatus of computers move
+ * Returns: MoveStatus of computers move (ENGINE if the engines failed)
  */
 MoveStatus computer_move(Client* opponent)
 {
-    sem_wait(opponent->engine->lock);
     sem_wait(opponent->game->lock);
-    // get best move from stockfish and play it
-    char* best = get_best_move(opponent->game->fenString, opponent->engine);
-    StockfishGameState* state
-            = send_move_to_stockfish(best, opponent->game, opponent->engine);
-    fprintf(opponent->toClient, "moved %s\n", best);
-    fflush(opponent->toClient);
+    // get best move and play it
+    char* best = get_best_move(
+            opponent->game, opponent->engines, opponent->difficulty);
+    if (best == NULL) {
+        sem_post(opponent->game->lock);
+        send_error(opponent, ENGINE);
+        return ENGINE;
+    }
+    MoveStatus status = play_move(opponent->game, best);
+    char message[MAX_MESSAGE_LENGTH];
+    sprintf(message, "moved %s\n", best);
+    send_to_client(message, opponent);
     free(best);
 
-    // analyse position for checks, checkmate or stalemate
-    MoveStatus status = analyse_position(state, opponent->engine);
+    // notify of checks, checkmate or stalemate
     notify_client(opponent, status);
     // change game->started if move made resulted in the game ending
     if (is_game_over(status)) {
-        opponent->game->started = false;
+        set_game_started(opponent->game, false);
     }
     sem_post(opponent->game->lock);
-    sem_post(opponent->engine->lock);
     return status;
 }
 
@@ -1312,32 +3569,33 @@ MoveStatus computer_move(Client* opponent)
  * Attempt to match up a client with an opponent based on client preferences.
  * If looking is wanting to verse the computer it is given a new GameState and
  * can begin playing. If looking wants a human opponent we will try to find one
- * from the waitList and if that fails they will be given a new GameState and
- * placed on the waitList.
+ * from the match queues and if that fails they will be given a new GameState
+ * and placed in the queue for their colour preference.
  *
  * looking: Client which is looking for an opponent.
  */
 void match_up_client(Client* looking)
 {
     if (looking->human) {
-        ClientList* waitList = looking->waitList;
+        if (leave_match_queue(looking)) {
+            // client was already waiting so only it refers to its old game
+            free_game_state(looking->game);
+        } else if (looking->hasPlayed) {
+            // resign the old game so the opponent stops referring to client
+            leave_game(looking);
+        }
         // we will give the looking client a temporary GameState, note that if
-        // find_opponent() does indeed find an opponent from the wait list then
-        // looking->game will point to the waiting client's GameState and this
-        // temporary state will be freed.
+        // find_opponent() does indeed find an opponent from the match queues
+        // then looking->game will point to the waiting client's GameState and
+        // this temporary state will be freed. If no opponent is found the
+        // client is queued until one arrives.
         looking->game = init_new_game(looking);
-        // if client wants to play another human we will look for a match
-        // from the waitList
-        if (!find_opponent(waitList, looking)) {
-            // couldn't find a compatible opponent for client so add them to
-            // the waitList
-            add_to_waitlist(waitList, looking);
-        }
+        find_opponent(looking->matchQueues, looking);
     } else {
         // client wants to play computer to just give them a new GameState. If
-        // client has previously played we need to free the old GameState.
+        // client has previously played we need to resign and free the old one.
         if (looking->hasPlayed) {
-            free_game_state(looking->game);
+            leave_game(looking);
         }
         looking->game = init_new_game(looking);
 
@@ -1364,7 +3622,7 @@ void handle_resign(Client* client)
     } else {
         // notify opponent and change game->started
         notify_client(client, RESIGN);
-        client->game->started = false;
+        set_game_started(client->game, false);
     }
     sem_post(client->game->lock);
 }
@@ -1374,30 +3632,21 @@ void handle_resign(Client* client)
  * Handle input commands from a client.
  *
  * client: Client to handle commands of
+ * clientInput: Line received from client (including the trailing '\n')
  */
-void handle_client_input(Client* client)
+void handle_client_input(Client* client, char* clientInput)
 {
-    char* clientInput = read_line(client->fromClient);
-    // client has disconnected so end thread and notify opponent of resignation
-    if (clientInput == NULL) {
-        clean_up_client(client);
-    }
-    Engine* engine = client->engine;
     char* inputDup = strdup(clientInput);
     char** parts = split_by_char(inputDup, ' ', 0);
 
     if (!strcmp(clientInput, "board\n")) {
-        if (client->game->started) {
-            set_position(client->game->fenString, engine);
-        }
-        send_board(engine, client);
+        send_board(client);
     } else if (!strcmp(parts[0], "move")) {
         parts[1][strlen(parts[1]) - 1] = '\0';
         MoveStatus clientMove = client_move(client, parts[1]);
         if (is_game_over(clientMove)) {
             free(parts);
             free(inputDup);
-            free(clientInput);
             return;
         }
         // if client is playing computer and just made a valid move we let the
@@ -1406,7 +3655,6 @@ void handle_client_input(Client* client)
             if (is_game_over(computer_move(client))) {
                 free(parts);
                 free(inputDup);
-                free(clientInput);
                 return;
             }
         }
@@ -1423,36 +3671,253 @@ void handle_client_input(Client* client)
     }
     free(parts);
     free(inputDup);
-    free(clientInput);
 }
 
-/* handle_connection()
- * -------------------
- * Thread function to handle a newly connected client. Thread will continuously
- * loop handling client commands until client disconnects and thread exits.
+/* command_type()
+ * --------------
+ * Get the type of command a line received from a client holds.
  *
- * inputClient: Pointer to client which just connected.
+ * line: Line received from client (including the trailing '\n')
  *
- * Returns: NULL
+ * Returns: CommandType to record the latency of line under
+ */
+CommandType command_type(char* line)
+{
+    if (!strcmp(line, "board\n")) {
+        return BOARD_COMMAND;
+    } else if (!strncmp(line, "move ", strlen("move "))) {
+        return MOVE_COMMAND;
+    } else if (!strcmp(line, "hint best\n")) {
+        return HINT_BEST_COMMAND;
+    } else if (!strcmp(line, "hint all\n")) {
+        return HINT_ALL_COMMAND;
+    } else if (!strcmp(line, "resign\n")) {
+        return RESIGN_COMMAND;
+    } else if (!strncmp(line, "start ", strlen("start "))) {
+        return START_COMMAND;
+    }
+    return OTHER_COMMAND;
+}
+
+/* handle_line()
+ * -------------
+ * Handle a line received from a client, recording how long it took. Until a
+ * client's first "start" command is received every other command is answered
+ * with an error.
+ *
+ * client: Client which sent line
+ * line: Line received from client (including the trailing '\n')
+ */
+void handle_line(Client* client, char* line)
+{
+    uint64_t start = monotonic_usec();
+    // find the type first as get_client_info() splits line up
+    CommandType type = command_type(line);
+
+    if (client->matched) {
+        handle_client_input(client, line);
+    } else if (get_client_info(client, line)) {
+        // got info about client (colour and opponent type)
+        client->matched = true;
+        match_up_client(client);
+    }
+    observe_latency(&metrics.commandLatency[type], start);
+}
+
+/* init_work_queue()
+ * -----------------
+ * Initialise an empty WorkQueue.
+ *
+ * Returns: Pointer to initialised WorkQueue
+ */
+WorkQueue* init_work_queue(void)
+{
+    WorkQueue* queue = (WorkQueue*)malloc(sizeof(WorkQueue));
+    queue->capacity = 1;
+    queue->clients = (Client**)malloc(queue->capacity * sizeof(Client*));
+    queue->head = 0;
+    queue->count = 0;
+    queue->available = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(queue->available, 0, 0);
+    queue->lock = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(queue->lock, 0, 1);
+    return queue;
+}
+
+/* push_work()
+ * -----------
+ * Add a client to the back of a WorkQueue.
+ *
+ * queue: Queue to add client to
+ * client: Client with a command waiting to be handled
+ */
+void push_work(WorkQueue* queue, Client* client)
+{
+    sem_wait(queue->lock);
+    if (queue->count == queue->capacity) {
+        // queue is full so double its size, unwrapping the clients which
+        // wrapped around to the start of the array
+        queue->clients = (Client**)realloc(
+                queue->clients, 2 * queue->capacity * sizeof(Client*));
+        memcpy(queue->clients + queue->capacity, queue->clients,
+                queue->head * sizeof(Client*));
+        queue->capacity *= 2;
+    }
+    queue->clients[(queue->head + queue->count) % queue->capacity] = client;
+    queue->count++;
+    sem_post(queue->lock);
+    sem_post(queue->available);
+}
+
+/* pop_work()
+ * ----------
+ * Remove the client at the front of a WorkQueue, waiting until one is added
+ * if the queue is empty.
+ *
+ * queue: Queue to take client from
+ *
+ * Returns: Pointer to client removed
+ */
+Client* pop_work(WorkQueue* queue)
+{
+    sem_wait(queue->available);
+    sem_wait(queue->lock);
+    Client* client = queue->clients[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    sem_post(queue->lock);
+    return client;
+}
+
+/* needs_engine()
+ * --------------
+ * Check if a command from a client may need a chess engine ("hint best", a
+ * move against the computer or starting a game against the computer).
+ *
+ * client: Client who sent the command
+ * line: Line received from client (including the trailing '\n')
+ *
+ * Returns: True if the command may need an engine, false otherwise
+ */
+bool needs_engine(Client* client, char* line)
+{
+    return !strcmp(line, "hint best\n")
+            || !strncmp(line, "start computer ", strlen("start computer "))
+            || (!client->human && !strncmp(line, "move ", strlen("move ")));
+}
+
+/* schedule_client()
+ * -----------------
+ * Put a client on the work queue for its next command (or its disconnection
+ * if it has left and all its commands have been handled). The client is
+ * marked as not scheduled if it has nothing to do. The caller must hold the
+ * client's input lock.
+ *
+ * client: Client to schedule
  */
-void* handle_connection(void* inputClient)
+void schedule_client(Client* client)
 {
-    Client* client = (Client*)inputClient;
-    // get info about client (colour and opponent type)
-    bool gotClientInfo = get_client_info(client);
+    char* line = peek_buffered_line(client->input, NULL);
 
-    // wait here until we get a "start" message from client
-    while (!gotClientInfo) {
-        gotClientInfo = get_client_info(client);
+    client->scheduled = true;
+    if (line != NULL) {
+        push_work(needs_engine(client, line) ? client->engineWork
+                                             : client->commandWork,
+                client);
+    } else if (client->closed) {
+        push_work(client->commandWork, client);
+    } else {
+        client->scheduled = false;
     }
-    match_up_client(client);
+}
+
+/* take_line()
+ * -----------
+ * Remove the first complete line from a client's input. The line is copied
+ * as more input may be read into the client's buffer while it is handled.
+ * The caller must hold the client's input lock.
+ *
+ * client: Client to take line from
+ *
+ * Returns: Pointer to (malloc'd) line including the trailing '\n' or NULL if
+ *          there is no complete line
+ */
+char* take_line(Client* client)
+{
+    size_t length;
+    char* line = next_buffered_line(client->input, &length);
+
+    return (line == NULL) ? NULL : strndup(line, length);
+}
+
+/* free_client()
+ * -------------
+ * Close the connection to a client which has been cleaned up and free it.
+ *
+ * client: Client to free
+ */
+void free_client(Client* client)
+{
+    close(client->fd);
+    sem_destroy(client->writeLock);
+    sem_destroy(client->inputLock);
+    free(client->writeLock);
+    free(client->inputLock);
+    free_line_reader(client->input);
+    free(client->output);
+    free(client);
+}
+
+/* handle_work()
+ * -------------
+ * Thread function for a worker which handles one command (or disconnection)
+ * at a time from clients on a WorkQueue.
+ *
+ * inputQueue: Pointer to WorkQueue to take clients from
+ *
+ * Returns: NULL (this never returns)
+ */
+void* handle_work(void* inputQueue)
+{
+    WorkQueue* queue = (WorkQueue*)inputQueue;
 
     while (true) {
-        handle_client_input(client);
+        Client* client = pop_work(queue);
+        sem_wait(client->inputLock);
+        char* line = take_line(client);
+        sem_post(client->inputLock);
+
+        if (line == NULL) {
+            // client has disconnected and all their commands were handled
+            clean_up_client(client);
+            free_client(client);
+            continue;
+        }
+        handle_line(client, line);
+        free(line);
+        sem_wait(client->inputLock);
+        schedule_client(client);
+        sem_post(client->inputLock);
     }
     return NULL;
 }
 
+/* start_workers()
+ * ---------------
+ * Start worker threads handling clients from a WorkQueue.
+ *
+ * queue: Queue for workers to take clients from
+ * count: Number of workers to start
+ */
+void start_workers(WorkQueue* queue, int count)
+{
+    for (int i = 0; i < count; i++) {
+        pthread_t tid;
+        pthread_create(&tid, 0, handle_work, queue);
+        pthread_detach(tid);
+    }
+}
+
 /* init_sigaction()
  * ----------------
  * Initialise signal handler (SIG_IGN) for SIGPIPE using sigaction
@@ -1483,94 +3948,508 @@ ClientList* init_list(void)
     return list;
 }
 
+/* init_match_queues()
+ * -------------------
+ * Initialise empty MatchQueues.
+ *
+ * Returns: Pointer to initialised MatchQueues
+ */
+MatchQueues* init_match_queues(void)
+{
+    MatchQueues* matchQueues = (MatchQueues*)malloc(sizeof(MatchQueues));
+    memset(matchQueues, 0, sizeof(MatchQueues));
+    matchQueues->lock = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(matchQueues->lock, 0, 1);
+    return matchQueues;
+}
+
+/* add_client()
+ * ------------
+ * Initialise a Client struct for a newly accepted connection and start
+ * watching it for input.
+ *
+ * server: Server the client connected to
+ * connfd: File descriptor of the (non-blocking) socket connected to client
+ */
+void add_client(Server* server, int connfd)
+{
+    Client* client = (Client*)malloc(sizeof(Client));
+    memset(client, 0, sizeof(Client));
+    client->fd = connfd;
+    client->epollfd = server->epollfd;
+    client->input = init_line_reader(connfd);
+    client->writeLock = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(client->writeLock, 0, 1);
+    client->inputLock = (sem_t*)malloc(sizeof(sem_t));
+    sem_init(client->inputLock, 0, 1);
+    client->engineWork = server->engineWork;
+    client->commandWork = server->commandWork;
+    client->matchQueues = server->matchQueues;
+    client->engines = server->engines;
+
+    ClientList* connected = server->connected;
+    sem_wait(connected->lock);
+    connected->clients = (Client**)realloc(
+            connected->clients, (connected->count + 1) * sizeof(Client*));
+    connected->clients[connected->count++] = client;
+    sem_post(connected->lock);
+    __sync_add_and_fetch(&metrics.connections, 1);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+    epoll_ctl(server->epollfd, EPOLL_CTL_ADD, connfd, &event);
+}
+
+/* accept_clients()
+ * ----------------
+ * Accept all connections waiting on the listening socket.
+ *
+ * server: Server to add clients to
+ * sockfd: File descriptor of (non-blocking) socket to accept connections on
+ */
+void accept_clients(Server* server, int sockfd)
+{
+    int connfd;
+    int noDelay = 1;
+
+    while ((connfd = accept(sockfd, 0, 0)) >= 0) {
+        close_on_exec(connfd);
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+        // responses are written in pieces (e.g. "ok" then "moved") so don't
+        // let them wait for the client to acknowledge the previous piece
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+        add_client(server, connfd);
+    }
+}
+
+/* read_client_input()
+ * -------------------
+ * Read all data available from a client's socket into their input, and
+ * schedule the client if a complete line (or their disconnection) is now
+ * waiting to be handled.
+ *
+ * server: Server the client is connected to
+ * client: Client whose socket is readable
+ */
+void read_client_input(Server* server, Client* client)
+{
+    while (true) {
+        sem_wait(client->inputLock);
+        ssize_t got = fill_line_reader(client->input);
+        int error = errno;
+        if ((got < 0) && (error == EINTR)) {
+            sem_post(client->inputLock);
+            continue;
+        }
+        if ((got < 0) && ((error == EAGAIN) || (error == EWOULDBLOCK))) {
+            // all available data has been read
+            sem_post(client->inputLock);
+            return;
+        }
+        if (got <= 0) {
+            // client disconnected so stop watching it (the worker handling
+            // the disconnection frees it)
+            epoll_ctl(server->epollfd, EPOLL_CTL_DEL, client->fd, NULL);
+            client->closed = true;
+        }
+        bool closed = client->closed;
+        if (!client->scheduled) {
+            schedule_client(client);
+        }
+        sem_post(client->inputLock);
+        if (closed) {
+            return;
+        }
+    }
+}
+
+/* write_metric_header()
+ * ---------------------
+ * Write the HELP and TYPE lines describing a metric.
+ *
+ * out: Stream to write to
+ * name: Name of the metric
+ * type: Prometheus type of the metric (e.g. "counter")
+ * help: Description of the metric
+ */
+void write_metric_header(
+        FILE* out, const char* name, const char* type, const char* help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* write_histogram()
+ * -----------------
+ * Write the samples of a latency histogram (in seconds).
+ *
+ * out: Stream to write to
+ * name: Name of the metric
+ * labels: Labels identifying the histogram e.g. "command=\"move\"" (NULL if
+ *         none)
+ * histogram: Histogram to write
+ */
+void write_histogram(
+        FILE* out, const char* name, const char* labels, Histogram* histogram)
+{
+    // labels of the buckets (which also have an "le" label) and the totals
+    char bucketLabels[MAX_MESSAGE_LENGTH] = "";
+    char totalLabels[MAX_MESSAGE_LENGTH] = "";
+    if (labels != NULL) {
+        sprintf(bucketLabels, "%s,", labels);
+        sprintf(totalLabels, "{%s}", labels);
+    }
+    unsigned long count = histogram->count;
+    unsigned long cumulative = 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        cumulative += histogram->buckets[i];
+        fprintf(out, "%s_bucket{%sle=\"%g\"} %lu\n", name, bucketLabels,
+                latencyBuckets[i] / USEC_PER_SEC, cumulative);
+    }
+    fprintf(out, "%s_bucket{%sle=\"+Inf\"} %lu\n", name, bucketLabels, count);
+    fprintf(out, "%s_sum%s %g\n", name, totalLabels,
+            histogram->sumUsec / USEC_PER_SEC);
+    fprintf(out, "%s_count%s %lu\n", name, totalLabels, count);
+}
+
+/* write_metrics()
+ * ---------------
+ * Write the current metrics of the server in the Prometheus text format.
+ *
+ * out: Stream to write to
+ * server: Server to write metrics of
+ */
+void write_metrics(FILE* out, Server* server)
+{
+    sem_wait(server->connected->lock);
+    int connected = server->connected->count;
+    sem_post(server->connected->lock);
+    write_metric_header(out, "uqchess_connected_clients", "gauge",
+            "Clients currently connected.");
+    fprintf(out, "uqchess_connected_clients %d\n", connected);
+    write_metric_header(out, "uqchess_connections_total", "counter",
+            "Clients which have connected.");
+    fprintf(out, "uqchess_connections_total %lu\n", metrics.connections);
+    write_metric_header(out, "uqchess_games_in_progress", "gauge",
+            "Games which have started and not finished.");
+    fprintf(out, "uqchess_games_in_progress %ld\n", metrics.gamesInProgress);
+
+    // copy the queue statistics so the lock is only held briefly
+    MatchQueues* matchQueues = server->matchQueues;
+    sem_wait(matchQueues->lock);
+    WaitQueue queues[WANTS_EITHER + 1];
+    memcpy(queues, matchQueues->queues, sizeof(queues));
+    unsigned long matches = matchQueues->matches;
+    sem_post(matchQueues->lock);
+    write_metric_header(out, "uqchess_waiting_clients", "gauge",
+            "Clients waiting for a human opponent.");
+    for (int i = WANTS_WHITE; i <= WANTS_EITHER; i++) {
+        fprintf(out, "uqchess_waiting_clients{colour=\"%s\"} %d\n",
+                preferenceNames[i], queues[i].depth);
+    }
+    write_metric_header(out, "uqchess_waiting_clients_peak", "gauge",
+            "Most clients which have waited for a human opponent at once.");
+    for (int i = WANTS_WHITE; i <= WANTS_EITHER; i++) {
+        fprintf(out, "uqchess_waiting_clients_peak{colour=\"%s\"} %d\n",
+                preferenceNames[i], queues[i].peakDepth);
+    }
+    write_metric_header(out, "uqchess_match_queue_joins_total", "counter",
+            "Clients which have waited for a human opponent.");
+    for (int i = WANTS_WHITE; i <= WANTS_EITHER; i++) {
+        fprintf(out, "uqchess_match_queue_joins_total{colour=\"%s\"} %lu\n",
+                preferenceNames[i], queues[i].joined);
+    }
+    write_metric_header(out, "uqchess_matches_total", "counter",
+            "Pairs of clients matched to play each other.");
+    fprintf(out, "uqchess_matches_total %lu\n", matches);
+
+    EnginePool* engines = server->engines;
+    sem_wait(engines->lock);
+    int idle = engines->idleCount;
+    sem_post(engines->lock);
+    write_metric_header(out, "uqchess_engines", "gauge", "Chess engines run.");
+    fprintf(out, "uqchess_engines %d\n", engines->count);
+    write_metric_header(out, "uqchess_engines_idle", "gauge",
+            "Chess engines not checked out.");
+    fprintf(out, "uqchess_engines_idle %d\n", idle);
+    write_metric_header(out, "uqchess_engine_restarts_total", "counter",
+            "Chess engines restarted after failing.");
+    fprintf(out, "uqchess_engine_restarts_total %lu\n",
+            metrics.engineRestarts);
+
+    sem_wait(server->engineWork->lock);
+    int engineQueued = server->engineWork->count;
+    sem_post(server->engineWork->lock);
+    sem_wait(server->commandWork->lock);
+    int commandQueued = server->commandWork->count;
+    sem_post(server->commandWork->lock);
+    write_metric_header(out, "uqchess_queued_clients", "gauge",
+            "Clients with a command waiting for a worker thread.");
+    fprintf(out, "uqchess_queued_clients{queue=\"engine\"} %d\n",
+            engineQueued);
+    fprintf(out, "uqchess_queued_clients{queue=\"command\"} %d\n",
+            commandQueued);
+
+    MoveCache* cache = engines->cache;
+    sem_wait(cache->lock);
+    unsigned long hits = cache->hits;
+    unsigned long misses = cache->misses;
+    sem_post(cache->lock);
+    write_metric_header(out, "uqchess_move_cache_hits_total", "counter",
+            "Best move lookups answered from the cache.");
+    fprintf(out, "uqchess_move_cache_hits_total %lu\n", hits);
+    write_metric_header(out, "uqchess_move_cache_misses_total", "counter",
+            "Best move lookups not answered from the cache.");
+    fprintf(out, "uqchess_move_cache_misses_total %lu\n", misses);
+
+    write_metric_header(out, "uqchess_command_duration_seconds", "histogram",
+            "Time taken to handle client commands.");
+    for (int i = BOARD_COMMAND; i <= OTHER_COMMAND; i++) {
+        char labels[MAX_MESSAGE_LENGTH];
+        sprintf(labels, "command=\"%s\"", commandNames[i]);
+        write_histogram(out, "uqchess_command_duration_seconds", labels,
+                &metrics.commandLatency[i]);
+    }
+    write_metric_header(out, "uqchess_engine_wait_seconds", "histogram",
+            "Time spent waiting for an idle chess engine.");
+    write_histogram(
+            out, "uqchess_engine_wait_seconds", NULL, &metrics.engineWait);
+    write_metric_header(out, "uqchess_engine_search_seconds", "histogram",
+            "Round trip time of asking a chess engine for a best move.");
+    write_histogram(
+            out, "uqchess_engine_search_seconds", NULL, &metrics.engineSearch);
+    write_metric_header(out, "uqchess_search_budget_seconds", "gauge",
+            "Search time of the last full strength best move search.");
+    fprintf(out, "uqchess_search_budget_seconds %.3f\n",
+            metrics.searchMovetime / 1000.0);
+}
+
+/* send_metrics_response()
+ * -----------------------
+ * Send the response to a request made to the metrics port. "GET /metrics" is
+ * answered with the server's metrics, other requests with an error.
+ *
+ * out: Stream connected to the scraper
+ * server: Server whose metrics are served
+ * method: Method of the request
+ * address: Address requested
+ */
+void send_metrics_response(
+        FILE* out, Server* server, char* method, char* address)
+{
+    int status = 200;
+    const char* explanation = "OK";
+    char* body = NULL;
+    size_t bodySize = 0;
+
+    if (strcmp(method, "GET")) {
+        status = 405;
+        explanation = "Method Not Allowed";
+    } else if (strcmp(address, "/metrics")) {
+        status = 404;
+        explanation = "Not Found";
+    } else {
+        FILE* bodyStream = open_memstream(&body, &bodySize);
+        write_metrics(bodyStream, server);
+        fclose(bodyStream);
+    }
+    HttpHeader contentType
+            = {"Content-Type", "text/plain; version=0.0.4; charset=utf-8"};
+    HttpHeader* headers[] = {&contentType, NULL};
+    unsigned long length;
+    unsigned char* response = construct_HTTP_response(status, explanation,
+            headers, (unsigned char*)body, bodySize, &length);
+    fwrite(response, 1, length, out);
+    fflush(out);
+    free(response);
+    free(body);
+}
+
+/* serve_metrics_connection()
+ * --------------------------
+ * Thread function answering all the HTTP requests made on one connection to
+ * the metrics port until it is closed.
+ *
+ * arg: Pointer to the MetricsConnection (which is freed)
+ *
+ * Returns: NULL
+ */
+void* serve_metrics_connection(void* arg)
+{
+    MetricsConnection* connection = (MetricsConnection*)arg;
+    FILE* in = fdopen(connection->fd, "r");
+    FILE* out = fdopen(dup(connection->fd), "w");
+    char* method;
+    char* address;
+    HttpHeader** headers;
+    unsigned char* body;
+    unsigned long bodySize;
+
+    while (get_HTTP_request(in, &method, &address, &headers, &body,
+            &bodySize)) {
+        send_metrics_response(out, connection->server, method, address);
+        free(method);
+        free(address);
+        free_array_of_headers(headers);
+        free(body);
+    }
+    fclose(in);
+    fclose(out);
+    free(connection);
+    return NULL;
+}
+
+/* metrics_loop()
+ * --------------
+ * Thread function accepting connections to the metrics port, each of which
+ * is served by its own thread. This function never returns.
+ *
+ * arg: Pointer to the Server whose metrics are served
+ *
+ * Returns: Never returns
+ */
+void* metrics_loop(void* arg)
+{
+    Server* server = (Server*)arg;
+
+    while (true) {
+        int connfd = accept(server->metricsfd, 0, 0);
+        if (connfd < 0) {
+            continue;
+        }
+        close_on_exec(connfd);
+        MetricsConnection* connection
+                = (MetricsConnection*)malloc(sizeof(MetricsConnection));
+        connection->fd = connfd;
+        connection->server = server;
+
+        pthread_t tid;
+        pthread_create(&tid, 0, serve_metrics_connection, connection);
+        pthread_detach(tid);
+    }
+}
+
 /* client_loop()
  * -------------
- * Loop to continually accept and initialise new clients connecting to the
- * server. This function should never return.
+ * Event loop which accepts new clients and reads commands from connected
+ * clients, passing complete commands to worker threads. This function should
+ * never return.
  *
  * sockfd: File descriptor of socket to accept connections on
- * Engine: Engine struct to use for all chess computations
+ * metricsfd: File descriptor of socket to serve metrics on (-1 if metrics
+ *            aren't served)
+ * engines: Pool of engines to use for all chess computations
  */
-void client_loop(int sockfd, Engine* engine)
+void client_loop(int sockfd, int metricsfd, EnginePool* engines)
 {
     // Initialise necessary server data structures
-    ClientList* connected = init_list();
-    connected->clients = (Client**)malloc(sizeof(Client*));
-    ClientList* waitList = init_list();
-    // update engine->notifyOnError to point at array of connected clients
-    engine->notifyOnError = connected;
+    Server server;
+    server.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    server.metricsfd = metricsfd;
+    server.connected = init_list();
+    server.matchQueues = init_match_queues();
+    server.engines = engines;
+    server.engineWork = init_work_queue();
+    server.commandWork = init_work_queue();
+    // update engines->notifyOnError to point at array of connected clients
+    engines->notifyOnError = server.connected;
+    engines->backlog = server.engineWork;
 
-    while (true) {
-        int connfd;
+    // each engine worker uses at most one engine at a time
+    start_workers(server.engineWork, engines->count);
+    start_workers(server.commandWork, COMMAND_WORKERS);
+    if (metricsfd >= 0) {
         pthread_t tid;
+        pthread_create(&tid, 0, metrics_loop, &server);
+        pthread_detach(tid);
+    }
+
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event listen = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(server.epollfd, EPOLL_CTL_ADD, sockfd, &listen);
 
-        if ((connfd = accept(sockfd, 0, 0))) {
-            // new client was accepted so initialise their corresponding
-            // Client struct to be passed to thread function
-            // handle_connnection().
-            sem_wait(connected->lock);
-            int threadCount = connected->count;
-            connected->clients = (Client**)realloc(
-                    connected->clients, (threadCount + 1) * sizeof(Client*));
-            connected->clients[threadCount] = (Client*)malloc(sizeof(Client));
-            connected->clients[threadCount]->toClient = fdopen(connfd, "r+");
-            connected->clients[threadCount]->fromClient
-                    = fdopen(dup(connfd), "r+");
-            connected->clients[threadCount]->waitList = waitList;
-            connected->clients[threadCount]->engine = engine;
-            connected->count++;
-            sem_post(connected->lock);
-            pthread_create(&tid, 0, handle_connection,
-                    connected->clients[threadCount]);
-            pthread_detach(tid);
+    while (true) {
+        struct epoll_event events[MAX_EVENTS];
+        int count = epoll_wait(server.epollfd, events, MAX_EVENTS, -1);
+
+        for (int i = 0; i < count; i++) {
+            Client* client = (Client*)events[i].data.ptr;
+            if (client == NULL) {
+                accept_clients(&server, sockfd);
+                continue;
+            }
+            // write before reading since reading may find the client has
+            // disconnected and hand it over to be freed
+            if (events[i].events & EPOLLOUT) {
+                write_client_output(client);
+            }
+            if (events[i].events & ~EPOLLOUT) {
+                read_client_input(&server, client);
+            }
         }
     }
 }
 
 int main(int argc, char** argv)
 {
-    char* port = process_cmdline_args(argc, argv);
+    Parameters param;
 
-    // invalid port
-    if (port == NULL) {
-        fprintf(stderr, "Usage: ./uqchessserver [--listen portnum]\n");
-        free(port);
+    // invalid command line arguments
+    if (!process_cmdline_args(argc, argv, &param)) {
+        fprintf(stderr,
+                "Usage: ./uqchessserver [--listen portnum] "
+                "[--metrics portnum] [--engines n] [--cache n] "
+                "[--book file] [--movetime ms] [--depth n] [--nodes n]\n");
         exit(ERROR_USAGE);
     }
     int sockfd;
-    int portListen = init_socket(port, &sockfd);
+    int portListen = init_socket(param.port, &sockfd);
     init_sigaction();
 
     // couldn't listen on given port
     if (portListen == ERROR_PORT) {
-        fprintf(stderr, "uqchessserver: can't listen on port \"%s\"\n", port);
-        free(port);
+        fprintf(stderr, "uqchessserver: can't listen on port \"%s\"\n",
+                param.port);
         exit(ERROR_LISTEN);
     }
-    int pipeToFish[2], pipeFromFish[2];
-
-    // fork and redirect stockfish stdout and stdin
-    start_stockfish(pipeToFish, pipeFromFish);
+    close_on_exec(sockfd);
+    int metricsfd = -1;
+    int metricsPort = 0;
+    if (param.metricsPort != NULL) {
+        metricsPort = init_socket(param.metricsPort, &metricsfd);
+        // couldn't listen on given metrics port
+        if (metricsPort == ERROR_PORT) {
+            fprintf(stderr, "uqchessserver: can't listen on port \"%s\"\n",
+                    param.metricsPort);
+            exit(ERROR_LISTEN);
+        }
+        close_on_exec(metricsfd);
+    }
+    init_attack_tables();
+    MoveCache* cache = init_move_cache(param.cacheSize);
 
-    // Create an engine struct with writeFile and readFile going to and from
-    // stockfish respectively
-    FILE* writeFile = fdopen(pipeToFish[1], "w");
-    FILE* readFile = fdopen(pipeFromFish[0], "r");
-    Engine* engine = init_stockfish(writeFile, readFile);
+    // couldn't read the opening book to preload the cache from
+    if ((param.book != NULL) && !load_opening_book(cache, param.book)) {
+        fprintf(stderr, "uqchessserver: unable to read opening book \"%s\"\n",
+                param.book);
+        exit(ERROR_BOOK);
+    }
+    EnginePool* engines = init_engine_pool(param.engines);
 
     // couldn't establish communication with stockfish
-    if (engine == NULL) {
-        fclose(readFile);
-        fclose(writeFile);
+    if (engines == NULL) {
         fprintf(stderr,
                 "uqchessserver: unable to start communication with chess "
                 "engine\n");
-        free(port);
         exit(ERROR_STOCKFISH_START);
     }
+    engines->cache = cache;
+    engines->budget = param.budget;
     fprintf(stderr, "%u\n", portListen);
+    if (metricsfd >= 0) {
+        fprintf(stderr, "%u\n", metricsPort);
+    }
     fflush(stderr);
     // call client_loop() which should never return
-    client_loop(sockfd, engine);
+    client_loop(sockfd, metricsfd, engines);
     exit(STATUS_OK);
 }